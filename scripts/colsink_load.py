@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+# Loads a columnar metadata file written by receive -o, see src/colsink.h.
+#
+# Usage: colsink_load.py <file>           prints the columns and row count
+#        from colsink_load import load     load(path) returns a dict of
+#                                          numpy arrays, load_frame(path)
+#                                          a pandas DataFrame
+#
+# Numeric columns of a block are read straight into arrays, including the
+# -K name:int and name:double columns, with NULL_INT64 or NaN for missing
+# values; a DataFrame holds int columns with missing values as nullable
+# Int64. String columns become numpy object arrays, or pandas categoricals
+# in a DataFrame, with None for missing values.
+
+import struct
+import sys
+
+import numpy as np
+
+MAGIC = b"AMQPCOL1"
+BLOCK_MAGIC = b"BLK1"
+INT64, UINT32, STRING, DOUBLE = 1, 2, 3, 4
+NULL = 0xFFFFFFFF
+NULL_INT64 = -(1 << 63)
+DTYPES = {INT64: np.dtype("<i8"), UINT32: np.dtype("<u4"), DOUBLE: np.dtype("<f8")}
+
+
+def _read_header(buf):
+    if buf[:8] != MAGIC:
+        raise ValueError("not a colsink file")
+    (count,) = struct.unpack_from("<I", buf, 8)
+    pos = 12
+    columns = []
+    for _ in range(count):
+        kind, length = buf[pos], buf[pos + 1]
+        name = bytes(buf[pos + 2:pos + 2 + length]).decode("utf-8", "replace")
+        columns.append((name, kind))
+        pos += 2 + length
+    return columns, pos
+
+
+def load(path):
+    """Returns {column name: numpy array} with the rows of every block"""
+    with open(path, "rb") as f:
+        buf = memoryview(f.read())
+    columns, pos = _read_header(buf)
+    parts = {name: [] for name, _ in columns}
+    while pos < len(buf):
+        if buf[pos:pos + 4] != BLOCK_MAGIC:
+            raise ValueError("corrupt block at offset %d" % pos)
+        (rows,) = struct.unpack_from("<I", buf, pos + 4)
+        pos += 8
+        for name, kind in columns:
+            if kind == STRING:
+                (entries,) = struct.unpack_from("<I", buf, pos)
+                pos += 4
+                words = []
+                for _ in range(entries):
+                    (length,) = struct.unpack_from("<H", buf, pos)
+                    words.append(bytes(buf[pos + 2:pos + 2 + length]).decode("utf-8", "replace"))
+                    pos += 2 + length
+                index = np.frombuffer(buf, dtype="<u4", count=rows, offset=pos)
+                pos += 4 * rows
+                # the last dictionary slot stands for missing values
+                dictionary = np.array(words + [None], dtype=object)
+                parts[name].append(dictionary[np.where(index == NULL, len(words), index)])
+            else:
+                dtype = DTYPES[kind]
+                parts[name].append(np.frombuffer(buf, dtype=dtype, count=rows, offset=pos))
+                pos += dtype.itemsize * rows
+    return {name: np.concatenate(parts[name]) if parts[name] else np.array([])
+            for name, _ in columns}
+
+
+def load_frame(path):
+    """Returns a pandas DataFrame, string columns as categoricals"""
+    import pandas as pd
+    frame = pd.DataFrame(load(path))
+    for column in frame.columns:
+        if frame[column].dtype == object:
+            frame[column] = frame[column].astype("category")
+        elif frame[column].dtype == np.int64:
+            missing = frame[column].to_numpy() == NULL_INT64
+            if missing.any():
+                frame[column] = pd.arrays.IntegerArray(frame[column].to_numpy(), missing)
+    return frame
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print("Usage: colsink_load.py <file>")
+        sys.exit(1)
+    data = load(sys.argv[1])
+    rows = len(next(iter(data.values()))) if data else 0
+    print("%d rows" % rows)
+    for name, values in data.items():
+        print("%-16s %s" % (name, values.dtype))
@@ -0,0 +1,116 @@
+#!/usr/bin/env bash
+# Runs the samples through src/bin/faultproxy to measure recovery and
+# tuning over a bad network against a broker.
+#
+# Usage: fault_bench.sh [broker host] [broker port] [# of messages]
+#
+# Scenarios:
+#   baseline   send and receive through the proxy without faults, the bytes
+#              sent up are the reference for the resend volume
+#   reset      every connection is reset after 2s, send is started again
+#              until it completes, reports the reconnect time and the bytes
+#              sent up relative to the baseline
+#   rtt        receive with 1 and 4 consumers, dte_consumer with and without
+#              the bulk profile, at 0, 25 and 100ms of added latency each
+#              way, reports the message rates
+#
+# The samples do not reconnect by themselves, the reconnect time includes
+# starting the sample again.
+
+BROKER_HOST=${1:-localhost}
+BROKER_PORT=${2:-5672}
+COUNT=${3:-10000}
+PROXY_PORT=5673
+BIN=`dirname $0`/../src/bin
+OUT_DIR=${OUT_DIR:-fault_bench}
+
+for app in faultproxy send receive producer dte_consumer ; do
+    if ! [ -x $BIN/$app ]; then
+        echo "Missing $BIN/$app. Please build the samples with make -f src/makefile."
+        exit 1
+    fi
+done
+mkdir -p $OUT_DIR || exit 1
+
+# start_proxy <log name> <proxy options...>
+start_proxy(){
+    local NAME=$1
+    shift
+    $BIN/faultproxy -l $PROXY_PORT -a $BROKER_HOST -p $BROKER_PORT "$@" > $OUT_DIR/$NAME.proxy.log &
+    PROXY_PID=$!
+    sleep 0.5
+}
+
+stop_proxy(){
+    kill -INT $PROXY_PID
+    wait $PROXY_PID 2>/dev/null
+}
+
+# proxied <log name> <sample> <args...> runs a sample through the proxy
+proxied(){
+    local NAME=$1
+    shift
+    local APP=$1
+    shift
+    $BIN/$APP -a localhost -p $PROXY_PORT "$@" > $OUT_DIR/$NAME.log 2>&1
+}
+
+# bytes_up <log name> prints the bytes the proxy forwarded to the broker
+bytes_up(){
+    grep -o '[0-9]* bytes up, [0-9]* bytes down, [0-9]* bytes dropped' $OUT_DIR/$1.proxy.log | cut -d' ' -f1
+}
+
+rate(){
+    grep -o '([0-9]* msg/s)' $OUT_DIR/$1.log | tail -1
+}
+
+echo "== baseline: $COUNT messages"
+start_proxy baseline
+proxied baseline_send send -c $COUNT -t fault_bench
+proxied baseline_receive receive -c $COUNT -t fault_bench
+stop_proxy
+BASELINE=`bytes_up baseline`
+echo "send `rate baseline_send`, receive `rate baseline_receive`, $BASELINE bytes up"
+
+echo "== reset: every connection reset after 2s"
+printf "2000 reset\n" > $OUT_DIR/reset.script
+start_proxy reset -f $OUT_DIR/reset.script
+ATTEMPTS=0
+until proxied reset_send send -c $COUNT -t fault_bench ; do
+    ATTEMPTS=$((ATTEMPTS + 1))
+    [ $ATTEMPTS -lt 5 ] || break
+done
+# started directly so $! is receive itself, a background job ignores SIGINT
+$BIN/receive -a localhost -p $PROXY_PORT -c 0 -t fault_bench > $OUT_DIR/reset_receive.log 2>&1 &
+RECEIVE_PID=$!
+sleep 5
+kill -TERM $RECEIVE_PID 2>/dev/null
+wait $RECEIVE_PID 2>/dev/null
+stop_proxy
+grep 'reconnect' $OUT_DIR/reset.proxy.log
+RESET=`bytes_up reset`
+echo "$RESET bytes up after $ATTEMPTS restarts, `awk "BEGIN { printf \"%.2f\", $RESET / ($BASELINE > 0 ? $BASELINE : 1) }"`x the baseline"
+
+echo "== rtt: credit and window tuning over added latency"
+for LATENCY in 0 25 100 ; do
+    start_proxy rtt_$LATENCY -d $LATENCY
+    proxied rtt_${LATENCY}_send send -c $COUNT -t fault_bench
+    proxied rtt_${LATENCY}_receive1 receive -c $COUNT -t fault_bench -M 1
+    proxied rtt_${LATENCY}_send send -c $COUNT -t fault_bench
+    proxied rtt_${LATENCY}_receive4 receive -c $COUNT -t fault_bench -M 4
+    proxied rtt_${LATENCY}_live dte_consumer -c $COUNT -n fault_bench_live &
+    CONSUMER_PID=$!
+    sleep 1
+    proxied rtt_${LATENCY}_producer producer -c $COUNT
+    wait $CONSUMER_PID
+    proxied rtt_${LATENCY}_bulk dte_consumer -c $COUNT -n fault_bench_bulk -B &
+    CONSUMER_PID=$!
+    sleep 1
+    proxied rtt_${LATENCY}_producer producer -c $COUNT
+    wait $CONSUMER_PID
+    stop_proxy
+    echo "latency ${LATENCY}ms: receive `rate rtt_${LATENCY}_receive1`, receive -M 4 `rate rtt_${LATENCY}_receive4`," \
+         "dte_consumer `rate rtt_${LATENCY}_live`, dte_consumer -B `rate rtt_${LATENCY}_bulk`"
+done
+
+echo "Logs written to $OUT_DIR"
@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+# Generates a self-signed CA and a server certificate for 'localhost' so the
+# samples can be run with SSL (-s/-C) against a local broker.
+#
+# Usage: gen_certs.sh [output directory]
+#
+# Output:
+#   ca.pem           trusted CA database, pass to the samples with -C
+#   server-cert.pem  server certificate for localhost signed by ca.pem
+#   server-key.pem   server private key
+#   server.pem       server certificate and key combined, the format
+#                    expected by the Solace PubSub+ server certificate config
+
+OUT_DIR=${1:-certs}
+DAYS=365
+
+if ! command -v openssl >/dev/null 2>&1 ; then
+    echo "Missing command openssl. Please install openssl and make available."
+    exit 1
+fi
+
+mkdir -p $OUT_DIR || exit 1
+cd $OUT_DIR
+
+openssl req -x509 -newkey rsa:2048 -nodes -days $DAYS \
+    -subj "/CN=samples-test-ca" \
+    -keyout ca-key.pem -out ca.pem || exit 1
+
+openssl req -newkey rsa:2048 -nodes \
+    -subj "/CN=localhost" \
+    -keyout server-key.pem -out server.csr || exit 1
+
+printf "subjectAltName=DNS:localhost,IP:127.0.0.1\n" > server.ext
+openssl x509 -req -in server.csr -days $DAYS \
+    -CA ca.pem -CAkey ca-key.pem -CAcreateserial \
+    -extfile server.ext -out server-cert.pem || exit 1
+
+cat server-cert.pem server-key.pem > server.pem
+rm -f server.csr server.ext ca.srl
+
+echo "Certificates written to $(pwd)"
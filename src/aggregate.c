@@ -0,0 +1,288 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "aggregate.h"
+#include "util.h"
+
+#include <proton/codec.h>
+#include <proton/message.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AGG_KEY_MAX 64
+#define AGG_INITIAL_CAPACITY 16 /* power of two */
+
+/* Aggregates of one key, stored in an open addressing table */
+typedef struct agg_entry_t {
+    bool used;
+    uint32_t hash;
+    char key[AGG_KEY_MAX];
+    uint64_t count;
+    double sum, min, max;
+} agg_entry_t;
+
+typedef struct agg_table_t {
+    agg_entry_t *entries;
+    size_t capacity;
+    size_t size;
+} agg_table_t;
+
+/* Partial aggregates owned by one consumer thread */
+typedef struct agg_slot_t {
+    pthread_mutex_t lock;
+    agg_table_t *panes;         /* ring of pane_ring tables */
+} agg_slot_t;
+
+struct aggregator_t {
+    agg_config_t config;
+    uint64_t pane_count;        /* panes per window */
+    uint64_t pane_ring;         /* pane_count + 1, the open pane never aliases a window pane */
+    uint64_t open_pane;         /* oldest pane not closed yet, wall clock ms / slide_ms */
+    agg_slot_t *slots;
+    agg_table_t merged;
+};
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void table_init(agg_table_t *t) {
+    t->capacity = AGG_INITIAL_CAPACITY;
+    t->size = 0;
+    t->entries = (agg_entry_t*)calloc(t->capacity, sizeof(agg_entry_t));
+}
+
+static void table_clear(agg_table_t *t) {
+    if (t->size > 0) {
+        memset(t->entries, 0, t->capacity * sizeof(agg_entry_t));
+        t->size = 0;
+    }
+}
+
+static agg_entry_t* table_find(agg_table_t *t, const char *key, uint32_t hash);
+
+static void table_grow(agg_table_t *t) {
+    agg_table_t old = *t;
+    t->capacity *= 2;
+    t->size = 0;
+    t->entries = (agg_entry_t*)calloc(t->capacity, sizeof(agg_entry_t));
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.entries[i].used) {
+            agg_entry_t *e = table_find(t, old.entries[i].key, old.entries[i].hash);
+            *e = old.entries[i];
+        }
+    }
+    free(old.entries);
+}
+
+/* Returns the entry for key, inserting an empty entry on miss */
+static agg_entry_t* table_find(agg_table_t *t, const char *key, uint32_t hash) {
+    if ((t->size + 1) * 4 > t->capacity * 3) {
+        table_grow(t);
+    }
+    size_t mask = t->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        agg_entry_t *e = &t->entries[i];
+        if (!e->used) {
+            e->used = true;
+            e->hash = hash;
+            strncpy(e->key, key, AGG_KEY_MAX - 1);
+            ++t->size;
+            return e;
+        }
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+}
+
+static void entry_add(agg_entry_t *e, uint64_t count, double sum, double min, double max) {
+    if (e->count == 0) {
+        e->min = min;
+        e->max = max;
+    } else {
+        if (min < e->min) e->min = min;
+        if (max > e->max) e->max = max;
+    }
+    e->count += count;
+    e->sum += sum;
+}
+
+aggregator_t* aggregator(const agg_config_t *config) {
+    if (!config || !config->field || config->window_ms == 0 || config->slide_ms == 0
+        || config->window_ms % config->slide_ms != 0 || config->slots < 1) {
+        return NULL;
+    }
+    aggregator_t *agg = (aggregator_t*)calloc(1, sizeof(aggregator_t));
+    agg->config = *config;
+    if (!agg->config.sink) agg->config.sink = stdout;
+    agg->pane_count = config->window_ms / config->slide_ms;
+    agg->pane_ring = agg->pane_count + 1;
+    agg->open_pane = clock_wall_ms() / config->slide_ms;
+    agg->slots = (agg_slot_t*)calloc(config->slots, sizeof(agg_slot_t));
+    for (int i = 0; i < config->slots; ++i) {
+        agg_slot_t *s = &agg->slots[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->panes = (agg_table_t*)calloc(agg->pane_ring, sizeof(agg_table_t));
+        for (uint64_t p = 0; p < agg->pane_ring; ++p) {
+            table_init(&s->panes[p]);
+        }
+    }
+    table_init(&agg->merged);
+    return agg;
+}
+
+void aggregator_free(aggregator_t *agg) {
+    if (!agg) return;
+    for (int i = 0; i < agg->config.slots; ++i) {
+        agg_slot_t *s = &agg->slots[i];
+        for (uint64_t p = 0; p < agg->pane_ring; ++p) {
+            free(s->panes[p].entries);
+        }
+        free(s->panes);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(agg->slots);
+    free(agg->merged.entries);
+    free(agg);
+}
+
+/* Formats the current node of data as a grouping key, returns false for unsupported types */
+static bool data_key(pn_data_t *data, char *key) {
+    double number;
+    pn_bytes_t bytes;
+    switch (pn_data_type(data)) {
+    case PN_STRING: bytes = pn_data_get_string(data); break;
+    case PN_SYMBOL: bytes = pn_data_get_symbol(data); break;
+    default:
+        if (!data_get_number(data, &number)) return false;
+        snprintf(key, AGG_KEY_MAX, "%.17g", number);
+        return true;
+    }
+    size_t len = bytes.size < AGG_KEY_MAX - 1 ? bytes.size : AGG_KEY_MAX - 1;
+    memcpy(key, bytes.start, len);
+    key[len] = '\0';
+    return true;
+}
+
+int aggregator_add(aggregator_t *agg, int slot, pn_message_t *message, uint64_t now_ms) {
+    double value;
+    char key[AGG_KEY_MAX] = "*";
+    pn_data_t *properties = pn_message_properties(message);
+
+    /* extract the value and grouping key */
+    if (strcmp(agg->config.field, "body") == 0) {
+        pn_data_t *body = pn_message_body(message);
+        pn_data_rewind(body);
+        if (!pn_data_next(body) || !data_get_number(body, &value)) return 0;
+    } else if (!data_map_find(properties, agg->config.field) || !data_get_number(properties, &value)) {
+        return 0;
+    }
+    if (agg->config.key && !(data_map_find(properties, agg->config.key) && data_key(properties, key))) {
+        return 0;
+    }
+
+    agg_slot_t *s = &agg->slots[slot];
+    pthread_mutex_lock(&s->lock);
+    {
+    /* late messages go to the open pane, early ones to the pane after it until the next tick */
+    uint64_t pane = now_ms / agg->config.slide_ms;
+    if (pane < agg->open_pane) pane = agg->open_pane;
+    if (pane > agg->open_pane + 1) pane = agg->open_pane + 1;
+    agg_entry_t *e = table_find(&s->panes[pane % agg->pane_ring], key, key_hash(key, strlen(key)));
+    entry_add(e, 1, value, value, value);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+/* Merges the window ending with pane 'last' across all slots and writes it to the sink */
+static void close_window(aggregator_t *agg, uint64_t last) {
+    uint64_t first = last + 1 >= agg->pane_count ? last + 1 - agg->pane_count : 0;
+    agg_table_t *merged = &agg->merged;
+    for (int i = 0; i < agg->config.slots; ++i) {
+        for (uint64_t p = first; p <= last; ++p) {
+            agg_table_t *pane = &agg->slots[i].panes[p % agg->pane_ring];
+            for (size_t j = 0; j < pane->capacity; ++j) {
+                agg_entry_t *e = &pane->entries[j];
+                if (e->used) {
+                    entry_add(table_find(merged, e->key, e->hash), e->count, e->sum, e->min, e->max);
+                }
+            }
+        }
+    }
+    for (size_t j = 0; j < merged->capacity; ++j) {
+        agg_entry_t *e = &merged->entries[j];
+        if (e->used) {
+            fprintf(agg->config.sink, "window %llu-%llu key=%s count=%llu sum=%g min=%g max=%g avg=%g\n",
+                    (unsigned long long)(first * agg->config.slide_ms),
+                    (unsigned long long)((last + 1) * agg->config.slide_ms),
+                    e->key, (unsigned long long)e->count, e->sum, e->min, e->max, e->sum / e->count);
+        }
+    }
+    table_clear(merged);
+    /* the oldest pane is not part of any later window */
+    for (int i = 0; i < agg->config.slots; ++i) {
+        table_clear(&agg->slots[i].panes[first % agg->pane_ring]);
+    }
+}
+
+void aggregator_tick(aggregator_t *agg, uint64_t now_ms) {
+    uint64_t now_pane = now_ms / agg->config.slide_ms;
+    /* unlocked fast path, checked again under the locks */
+    if (now_pane <= agg->open_pane) {
+        return;
+    }
+    for (int i = 0; i < agg->config.slots; ++i) {
+        pthread_mutex_lock(&agg->slots[i].lock);
+    }
+    /* another thread closed the panes since */
+    if (now_pane <= agg->open_pane) {
+        for (int i = agg->config.slots - 1; i >= 0; --i) {
+            pthread_mutex_unlock(&agg->slots[i].lock);
+        }
+        return;
+    }
+    /* after a full ring of panes every pane is empty, skip ahead */
+    if (now_pane - agg->open_pane > agg->pane_ring) {
+        for (uint64_t n = 0; n < agg->pane_ring; ++n) {
+            close_window(agg, agg->open_pane++);
+        }
+        agg->open_pane = now_pane;
+    }
+    while (agg->open_pane < now_pane) {
+        close_window(agg, agg->open_pane++);
+    }
+    fflush(agg->config.sink);
+    for (int i = agg->config.slots - 1; i >= 0; --i) {
+        pthread_mutex_unlock(&agg->slots[i].lock);
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H 1
+
+#include <proton/message.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Windowed in-stream aggregation for consumers.
+ *
+ * Messages are reduced to count, sum, min and max of a numeric field per
+ * grouping key and only the aggregates are written to the sink when a
+ * window closes. Windows are aligned to the wall clock and built from
+ * panes of 'slide_ms': a tumbling window has one pane, a sliding window
+ * of 'window_ms' merges the last window_ms/slide_ms panes.
+ *
+ * Each consumer thread adds to its own slot of partial aggregates, the
+ * slots are merged when a window closes.
+ */
+
+typedef struct agg_config_t {
+    const char *field;      /* numeric application property, or "body" for a numeric body */
+    const char *key;        /* application property to group by, NULL for a single group */
+    uint64_t window_ms;     /* window length */
+    uint64_t slide_ms;      /* window slide, equal to window_ms for tumbling windows */
+    int slots;              /* # of threads adding messages */
+    FILE *sink;             /* aggregates output */
+} agg_config_t;
+
+typedef struct aggregator_t aggregator_t;
+
+/*
+ * Creates an aggregator.
+ * @param[in]: config, the aggregation settings, slide_ms must divide window_ms
+ * @returns: the aggregator or NULL for an invalid configuration
+ * */
+aggregator_t* aggregator(const agg_config_t *config);
+
+/* Frees the aggregator, open windows are discarded */
+void aggregator_free(aggregator_t *agg);
+
+/*
+ * Adds a decoded message to the partial aggregates of a slot. Messages
+ * without a numeric value for the configured field are ignored.
+ * @param[in]: slot, the calling thread's slot, 0 to slots-1
+ * @param[in]: now_ms, the wall clock time of the message in ms
+ * @returns: 1 if the message was aggregated, 0 if ignored
+ * */
+int aggregator_add(aggregator_t *agg, int slot, pn_message_t *message, uint64_t now_ms);
+
+/*
+ * Closes every window that ended at or before now_ms, merging the slot
+ * partials and writing one line per key to the sink. Call periodically,
+ * at least once per slide, so windows close while no messages arrive.
+ * */
+void aggregator_tick(aggregator_t *agg, uint64_t now_ms);
+
+#endif /* aggregate.h */
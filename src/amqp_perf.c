@@ -0,0 +1,224 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * amqp-perf
+ *
+ * Runs any of the samples as a subcommand of one binary:
+ *
+ *     amqp-perf [--config <file>] <role> [options]
+ *
+ * Options are the short options of the sample or the long names shared
+ * by every role, and a config file can hold both common settings and a
+ * section per role, see perfopt.h. For example with perf.conf:
+ *
+ *     host = broker1
+ *     count = 100000
+ *     [receive]
+ *     consumers = 2:8
+ *     credit = 2000
+ *     latency
+ *
+ *     amqp-perf --config perf.conf receive --capture run1.col
+ *
+ * The samples are built into amqp-perf with AMQP_PERF defined, which
+ * leaves out their own main() and keeps their <sample>_main().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perfopt.h"
+
+int send_main(int argc, char **argv);
+int receive_main(int argc, char **argv);
+int producer_main(int argc, char **argv);
+int dte_consumer_main(int argc, char **argv);
+int dte_solconsumer_main(int argc, char **argv);
+int merge_consumer_main(int argc, char **argv);
+int router_main(int argc, char **argv);
+int sub_churn_main(int argc, char **argv);
+int analyze_main(int argc, char **argv);
+int faultproxy_main(int argc, char **argv);
+
+/* Options of every role that connects to a broker */
+#define CONNECTION_OPTIONS \
+    {"host", 'a', true}, {"port", 'p', true}, {"container", 'i', true}, \
+    {"username", 'u', true}, {"password", 'P', true}, \
+    {"ssl", 's', false}, {"ca", 'C', true}, {"help", 'h', false}
+
+static const perfopt_t send_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true}, {"connections", 'r', true},
+    {"link", 'T', true}, {"quantum", 'q', true}, {"strict", 'S', false},
+    {"ttl", 'e', true}, {"size", 'z', true}, {"settle", 'd', true},
+    {"latency-sample", 'l', true}, {"stages", 'L', false},
+    {"conflate-key", 'k', true}, {"keys", 'K', true}, {"rate", 'g', true},
+    {"shard-key", 'H', true}, {"vnodes", 'V', true},
+    {"delta", 'D', true}, {"snapshot-size", 'Z', true},
+    {"probe", 'N', true}, {"clock", 'Y', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t receive_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true},
+    {"link", 'R', true}, {"strict", 'S', false},
+    {"credit", 'f', true}, {"settle", 'd', true},
+    {"consumers", 'M', true}, {"scale-interval", 'I', true}, {"scale-lag", 'A', true},
+    {"lag-report", 'm', true}, {"shed-expired", 'x', true},
+    {"capture", 'o', true}, {"capture-property", 'K', true},
+    {"aggregate", 'g', true}, {"group-by", 'k', true}, {"window", 'w', true}, {"slide", 'W', true},
+    {"latency", 'l', false}, {"stages", 'L', false},
+    {"probe", 'N', true}, {"clock", 'Y', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t produce_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true},
+    {"broker", 'b', true}, {"quorum", 'm', true},
+    {"ttl", 'e', true}, {"size", 'z', true}, {"settle", 'd', true},
+    {"latency-sample", 'l', true},
+    {"probe", 'N', true}, {"clock", 'Y', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t dte_consume_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true}, {"subscription", 'n', true},
+    {"aggregate", 'g', true}, {"group-by", 'k', true}, {"window", 'w', true}, {"slide", 'W', true},
+    {"latency", 'l', false}, {"catch-up", 'B', false}, {"backlog-lag", 'A', true},
+    {"credit", 'f', true}, {"settle", 'd', true},
+    {"lag-report", 'm', true}, {"shed-expired", 'x', true},
+    {"probe", 'N', true}, {"clock", 'Y', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t sol_consume_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true}, {"subscription", 'n', true},
+    {"aggregate", 'g', true}, {"group-by", 'k', true}, {"window", 'w', true}, {"slide", 'W', true},
+    {"latency", 'l', false},
+    {"credit", 'f', true}, {"settle", 'd', true},
+    {"probe", 'N', true}, {"clock", 'Y', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t merge_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true},
+    {"credit", 'w', true}, {"lateness", 'l', true}, {"settle", 'd', true},
+    {"probe", 'N', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t relay_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true},
+    {"route-property", 'k', true}, {"output", 'O', true}, {"queue", 'q', true},
+    {"credit", 'f', true},
+    {"probe", 'N', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t bench_options[] = {
+    CONNECTION_OPTIONS,
+    {"count", 'c', true}, {"address", 't', true}, {"subscription", 'n', true},
+    {"in-flight", 'o', true}, {"reattach", 'r', true}, {"method", 'm', true},
+    {NULL, 0, false}
+};
+
+static const perfopt_t analyze_options[] = {
+    {"threads", 'j', true}, {"key", 'k', true}, {"sequence", 's', true},
+    {"bucket", 'w', true}, {"timeline", 'T', false}, {"top", 'n', true},
+    {"help", 'h', false},
+    {NULL, 0, false}
+};
+
+static const perfopt_t proxy_options[] = {
+    {"host", 'a', true}, {"port", 'p', true}, {"listen", 'l', true},
+    {"delay", 'd', true}, {"jitter", 'j', true}, {"bandwidth", 'b', true},
+    {"max-write", 'w', true}, {"script", 'f', true},
+    {"help", 'h', false},
+    {NULL, 0, false}
+};
+
+static const perfopt_role_t roles[] = {
+    {"send", "send", send_main, send_options, "send to a queue or topic"},
+    {"receive", "receive", receive_main, receive_options, "receive from a queue or topic"},
+    {"produce", "producer", producer_main, produce_options, "publish to a topic, replicated to several brokers"},
+    {"dte-consume", "dte_consumer", dte_consumer_main, dte_consume_options, "consume a durable topic endpoint with terminus durability"},
+    {"sol-consume", "dte_solconsumer", dte_solconsumer_main, sol_consume_options, "consume a durable topic endpoint with the dsub:// prefix"},
+    {"merge", "merge_consumer", merge_consumer_main, merge_options, "merge several sources in timestamp order"},
+    {"relay", "router", router_main, relay_options, "route messages to outputs by an application property"},
+    {"bench", "sub_churn", sub_churn_main, bench_options, "durable subscription churn benchmark"},
+    {"analyze", "analyze", analyze_main, analyze_options, "analyze receive --capture files"},
+    {"proxy", "faultproxy", faultproxy_main, proxy_options, "fault injecting TCP proxy"},
+};
+
+#define ROLE_COUNT (sizeof(roles) / sizeof(roles[0]))
+
+void usage(void) {
+    printf("Usage: amqp-perf [--config <file>] <role> [options]\n");
+    printf("[Roles]:\n");
+    for (size_t i = 0; i < ROLE_COUNT; ++i) {
+        printf("\t%-12s %s\n", roles[i].name, roles[i].summary);
+    }
+    printf("'amqp-perf <role> --help' lists the options of a role\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    const char *config = NULL;
+    const perfopt_role_t *role = NULL;
+    perfopt_args_t args;
+    int i = 1, rc;
+
+    if (i + 1 < argc && strcmp(argv[i], "--config") == 0) {
+        config = argv[i + 1];
+        i += 2;
+    }
+    if (i == argc) usage();
+    for (size_t r = 0; r < ROLE_COUNT; ++r) {
+        if (strcmp(argv[i], roles[r].name) == 0) role = &roles[r];
+    }
+    if (!role) {
+        fprintf(stderr, "Unknown role: %s\n", argv[i]);
+        usage();
+    }
+    ++i;
+
+    perfopt_args_init(&args, role->sample);
+    if (config && perfopt_load_config(role, config, &args) < 0) {
+        exit(1);
+    }
+    if (perfopt_parse(role, argc - i, argv + i, &args) < 0) {
+        exit(1);
+    }
+    for (int a = 1; a < args.argc; ++a) {
+        if (strcmp(args.argv[a], "-h") == 0) {
+            perfopt_usage(stdout, role);
+            break;
+        }
+    }
+    rc = role->main(args.argc, args.argv);
+    perfopt_args_free(&args);
+    return rc;
+}
@@ -0,0 +1,759 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * analyze
+ *
+ * An offline analyzer for the columnar metadata files written by
+ * receive -o, see colsink.h. The files are memory mapped and their blocks
+ * shared out between -j threads, each thread keeps its own statistics and
+ * they are merged once every block is done:
+ *
+ *   throughput  messages and bytes per -w ms bucket of receive time, the
+ *               whole timeline with -T
+ *   latency     percentiles of the latency_us column
+ *   keys        count, bytes and latency of each value of the -k column
+ *   sequences   with -s, the gaps and duplicates of the -s column, per
+ *               -k key when both are given
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "colsink.h"
+#include "latency.h"
+#include "util.h"
+
+#define MAX_FILES 64
+#define MAX_THREADS 64
+#define NO_KEY "(none)"
+
+extern int optind;
+extern char* optarg;
+extern int optopt;
+extern int opterr;
+
+/* A mapped capture file and where its columns of interest are */
+typedef struct capture_file_t {
+  const char *path;
+  const char *base;
+  size_t size;
+  int column_count;
+  colsink_type_t types[COLSINK_MAX_COLUMNS];
+  int receive_us, bytes, latency_us, key, sequence;   /* column indexes, -1 if absent */
+} capture_file_t;
+
+/* A block of a file, located by the index pass */
+typedef struct block_view_t {
+  const capture_file_t *file;
+  uint32_t rows;
+  const char *values[COLSINK_MAX_COLUMNS];  /* unaligned arrays */
+  const char *dict[COLSINK_MAX_COLUMNS];    /* first dictionary entry of a string column */
+  uint32_t dict_count[COLSINK_MAX_COLUMNS];
+} block_view_t;
+
+/* Counts per bucket over a range that grows in both directions */
+typedef struct series_t {
+  int64_t base;             /* bucket of counts[0] */
+  size_t length;
+  uint64_t *counts;
+} series_t;
+
+/* Sequences seen once and more than once, as bitmaps from a 64 aligned base */
+typedef struct sequence_set_t {
+  int64_t base;
+  size_t words;
+  uint64_t *seen;
+  uint64_t *dup;
+} sequence_set_t;
+
+typedef struct key_stats_t {
+  char *key;
+  uint32_t hash;
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t stamped;         /* rows with a latency */
+  double latency_sum;
+  int64_t latency_max;
+  sequence_set_t sequences;
+} key_stats_t;
+
+typedef struct stats_t {
+  uint64_t rows;
+  series_t messages;        /* per bucket */
+  series_t bytes;
+  latency_histogram_t latency;
+  key_stats_t *keys;        /* open addressing table */
+  size_t key_capacity;
+  size_t key_count;
+} stats_t;
+
+typedef struct app_data_t {
+  const char *paths[MAX_FILES];
+  int file_count;
+  int threads;
+  const char *key_column;
+  const char *sequence_column;
+  int64_t bucket_us;
+  bool timeline;
+  int top;                  /* keys listed */
+
+  capture_file_t files[MAX_FILES];
+  block_view_t *blocks;
+  size_t block_count;
+  size_t block_capacity;
+  uint64_t next_block;      /* next block for a thread to take, atomic */
+  stats_t stats[MAX_THREADS];
+} app_data_t;
+
+static inline int64_t load_i64(const char *values, size_t i) {
+  int64_t v;
+  memcpy(&v, values + i * sizeof(v), sizeof(v));
+  return v;
+}
+
+static inline uint32_t load_u32(const char *values, size_t i) {
+  uint32_t v;
+  memcpy(&v, values + i * sizeof(v), sizeof(v));
+  return v;
+}
+
+static uint32_t string_hash(const char *s, size_t size) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Adds n to a bucket, growing the series to cover it */
+static void series_add(series_t *s, int64_t bucket, uint64_t n) {
+  if (s->length == 0) {
+    s->base = bucket;
+  }
+  if (bucket < s->base || bucket >= s->base + (int64_t)s->length) {
+    int64_t first = bucket < s->base ? bucket : s->base;
+    int64_t last = bucket >= s->base + (int64_t)s->length ? bucket : s->base + (int64_t)s->length - 1;
+    size_t length = (size_t)(last - first + 1);
+    /* grow by at least half so appending in time order is amortized */
+    if (length < s->length + s->length / 2) length = s->length + s->length / 2;
+    if (bucket < s->base) first = last - (int64_t)length + 1;
+    uint64_t *counts = (uint64_t*)calloc(length, sizeof(uint64_t));
+    if (s->length) memcpy(counts + (s->base - first), s->counts, s->length * sizeof(uint64_t));
+    free(s->counts);
+    s->counts = counts;
+    s->base = first;
+    s->length = length;
+  }
+  s->counts[bucket - s->base] += n;
+}
+
+static void series_merge(series_t *to, const series_t *from) {
+  for (size_t i = 0; i < from->length; ++i) {
+    if (from->counts[i]) series_add(to, from->base + (int64_t)i, from->counts[i]);
+  }
+}
+
+/* Grows a sequence set to cover the word of sequence s */
+static void sequences_cover(sequence_set_t *set, int64_t s) {
+  int64_t word = (s >= 0 ? s : s - 63) / 64;
+  if (set->words == 0) {
+    set->base = word;
+  }
+  if (word < set->base || word >= set->base + (int64_t)set->words) {
+    int64_t first = word < set->base ? word : set->base;
+    int64_t last = word >= set->base + (int64_t)set->words ? word : set->base + (int64_t)set->words - 1;
+    size_t words = (size_t)(last - first + 1);
+    if (words < set->words + set->words / 2) words = set->words + set->words / 2;
+    if (word < set->base) first = last - (int64_t)words + 1;
+    uint64_t *seen = (uint64_t*)calloc(words, sizeof(uint64_t));
+    uint64_t *dup = (uint64_t*)calloc(words, sizeof(uint64_t));
+    if (set->words) {
+      memcpy(seen + (set->base - first), set->seen, set->words * sizeof(uint64_t));
+      memcpy(dup + (set->base - first), set->dup, set->words * sizeof(uint64_t));
+    }
+    free(set->seen);
+    free(set->dup);
+    set->seen = seen;
+    set->dup = dup;
+    set->base = first;
+    set->words = words;
+  }
+}
+
+static void sequences_add(sequence_set_t *set, int64_t s) {
+  sequences_cover(set, s);
+  int64_t word = (s >= 0 ? s : s - 63) / 64;
+  uint64_t bit = 1ull << (uint64_t)(s - word * 64);
+  size_t i = (size_t)(word - set->base);
+  set->dup[i] |= set->seen[i] & bit;
+  set->seen[i] |= bit;
+}
+
+static void sequences_merge(sequence_set_t *to, const sequence_set_t *from) {
+  if (from->words == 0) {
+    return;
+  }
+  sequences_cover(to, from->base * 64);
+  sequences_cover(to, (from->base + (int64_t)from->words) * 64 - 1);
+  for (size_t i = 0; i < from->words; ++i) {
+    size_t j = (size_t)(from->base - to->base) + i;
+    to->dup[j] |= from->dup[i] | (to->seen[j] & from->seen[i]);
+    to->seen[j] |= from->seen[i];
+  }
+}
+
+/* Counts the missing sequences between the first and last seen, the gaps they form, and the duplicated ones */
+static void sequences_count(const sequence_set_t *set, uint64_t *missing, uint64_t *gaps, uint64_t *duplicated) {
+  size_t first = 0, last = set->words;
+  bool in_gap = false;
+  *missing = *gaps = *duplicated = 0;
+  while (first < last && set->seen[first] == 0) ++first;
+  while (last > first && set->seen[last - 1] == 0) --last;
+  for (size_t i = first; i < last; ++i) {
+    *duplicated += (uint64_t)__builtin_popcountll(set->dup[i]);
+    for (int b = 0; b < 64; ++b) {
+      bool seen = set->seen[i] >> b & 1;
+      /* skip the bits before the first and after the last sequence */
+      if ((i == first && (set->seen[i] & ((2ull << b) - 1)) == 0)
+          || (i == last - 1 && (set->seen[i] >> b) == 0)) {
+        continue;
+      }
+      if (!seen) {
+        ++*missing;
+        *gaps += !in_gap;
+      }
+      in_gap = !seen;
+    }
+  }
+}
+
+/* Makes room for n more keys, so the key pointers stay valid while they are added */
+static void key_reserve(stats_t *stats, size_t n) {
+  if ((stats->key_count + n) * 2 > stats->key_capacity) {
+    size_t capacity = stats->key_capacity ? stats->key_capacity : 1024;
+    while ((stats->key_count + n) * 2 > capacity) capacity *= 2;
+    key_stats_t *keys = (key_stats_t*)calloc(capacity, sizeof(key_stats_t));
+    for (size_t i = 0; i < stats->key_capacity; ++i) {
+      if (stats->keys[i].key) {
+        size_t slot = stats->keys[i].hash & (capacity - 1);
+        while (keys[slot].key) slot = (slot + 1) & (capacity - 1);
+        keys[slot] = stats->keys[i];
+      }
+    }
+    free(stats->keys);
+    stats->keys = keys;
+    stats->key_capacity = capacity;
+  }
+}
+
+static key_stats_t *key_find(stats_t *stats, const char *key, size_t size) {
+  uint32_t hash = string_hash(key, size);
+  key_reserve(stats, 1);
+  size_t slot = hash & (stats->key_capacity - 1);
+  while (stats->keys[slot].key) {
+    key_stats_t *k = &stats->keys[slot];
+    if (k->hash == hash && strlen(k->key) == size && memcmp(k->key, key, size) == 0) {
+      return k;
+    }
+    slot = (slot + 1) & (stats->key_capacity - 1);
+  }
+  key_stats_t *k = &stats->keys[slot];
+  k->key = strndup(key, size);
+  k->hash = hash;
+  ++stats->key_count;
+  return k;
+}
+
+/* Maps and checks the header of a capture file */
+static int file_open(app_data_t *app, capture_file_t *f, const char *path) {
+  struct stat st;
+  const char *names[COLSINK_MAX_COLUMNS];
+  uint8_t lengths[COLSINK_MAX_COLUMNS];
+  uint32_t count;
+  size_t pos = strlen(COLSINK_MAGIC) + sizeof(count);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  f->path = path;
+  f->size = (size_t)st.st_size;
+  f->base = f->size ? (const char*)mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (f->size && f->base == MAP_FAILED) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (f->size < pos || memcmp(f->base, COLSINK_MAGIC, strlen(COLSINK_MAGIC)) != 0) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    return -1;
+  }
+  /* the blocks are read once, in order within each thread */
+  madvise((void*)f->base, f->size, MADV_SEQUENTIAL);
+  memcpy(&count, f->base + strlen(COLSINK_MAGIC), sizeof(count));
+  if (count > COLSINK_MAX_COLUMNS) {
+    fprintf(stderr, "%s: %u columns, at most %d are supported\n", path, count, COLSINK_MAX_COLUMNS);
+    return -1;
+  }
+  f->column_count = (int)count;
+  f->receive_us = f->bytes = f->latency_us = f->key = f->sequence = -1;
+  for (int i = 0; i < f->column_count; ++i) {
+    if (pos + 2 > f->size || pos + 2 + (uint8_t)f->base[pos + 1] > f->size) {
+      fprintf(stderr, "%s: truncated header\n", path);
+      return -1;
+    }
+    f->types[i] = (colsink_type_t)(uint8_t)f->base[pos];
+    lengths[i] = (uint8_t)f->base[pos + 1];
+    names[i] = f->base + pos + 2;
+    pos += 2 + lengths[i];
+  }
+  for (int i = 0; i < f->column_count; ++i) {
+#define COLUMN_IS(name) (name && lengths[i] == strlen(name) && memcmp(names[i], name, lengths[i]) == 0)
+    if (COLUMN_IS("receive_us") && f->types[i] == COLSINK_INT64) f->receive_us = i;
+    else if (COLUMN_IS("size") && f->types[i] == COLSINK_UINT32) f->bytes = i;
+    else if (COLUMN_IS("latency_us") && f->types[i] == COLSINK_INT64) f->latency_us = i;
+    if (COLUMN_IS(app->key_column)) f->key = i;
+    if (COLUMN_IS(app->sequence_column)) f->sequence = i;
+#undef COLUMN_IS
+  }
+  if (f->receive_us < 0 || f->bytes < 0 || f->latency_us < 0) {
+    fprintf(stderr, "%s: missing the receive_us, size or latency_us column\n", path);
+    return -1;
+  }
+  if ((app->key_column && f->key < 0) || (app->sequence_column && f->sequence < 0)) {
+    fprintf(stderr, "%s: no column %s\n", path, f->key < 0 && app->key_column ? app->key_column : app->sequence_column);
+    return -1;
+  }
+  if ((f->key >= 0 && f->types[f->key] != COLSINK_STRING)
+      || (f->sequence >= 0 && f->types[f->sequence] != COLSINK_STRING && f->types[f->sequence] != COLSINK_INT64)) {
+    fprintf(stderr, "%s: -k takes a string column and -s a string or int column\n", path);
+    return -1;
+  }
+  /* index the blocks, walking the dictionaries to find where each column starts */
+  while (pos < f->size) {
+    block_view_t *v;
+    uint32_t rows;
+    if (app->block_count == app->block_capacity) {
+      app->block_capacity = app->block_capacity ? app->block_capacity * 2 : 1024;
+      app->blocks = (block_view_t*)realloc(app->blocks, app->block_capacity * sizeof(block_view_t));
+    }
+    v = &app->blocks[app->block_count];
+    if (pos + 8 > f->size || memcmp(f->base + pos, COLSINK_BLOCK_MAGIC, 4) != 0) {
+      fprintf(stderr, "%s: corrupt block at offset %zu, ignoring the rest\n", path, pos);
+      break;
+    }
+    memcpy(&rows, f->base + pos + 4, sizeof(rows));
+    pos += 8;
+    memset(v, 0, sizeof(*v));
+    v->file = f;
+    v->rows = rows;
+    for (int i = 0; i < f->column_count && pos <= f->size; ++i) {
+      if (f->types[i] == COLSINK_STRING) {
+        if (pos + sizeof(uint32_t) > f->size) { pos = f->size + 1; break; }
+        memcpy(&v->dict_count[i], f->base + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        v->dict[i] = f->base + pos;
+        for (uint32_t e = 0; e < v->dict_count[i] && pos + 2 <= f->size; ++e) {
+          uint16_t length;
+          memcpy(&length, f->base + pos, sizeof(length));
+          pos += 2 + length;
+        }
+      }
+      v->values[i] = f->base + pos;
+      pos += (size_t)rows * (f->types[i] == COLSINK_INT64 || f->types[i] == COLSINK_DOUBLE
+                             ? sizeof(int64_t) : sizeof(uint32_t));
+    }
+    if (pos > f->size) {
+      fprintf(stderr, "%s: truncated last block ignored\n", path);
+      break;
+    }
+    ++app->block_count;
+  }
+  return 0;
+}
+
+/* Resolves the dictionary entries of a string column to (start, size) pairs */
+static void dict_entries(const block_view_t *v, int column, const char **starts, uint16_t *sizes) {
+  const char *p = v->dict[column];
+  for (uint32_t e = 0; e < v->dict_count[column]; ++e) {
+    memcpy(&sizes[e], p, sizeof(uint16_t));
+    starts[e] = p + 2;
+    p += 2 + sizes[e];
+  }
+}
+
+static void analyze_block(app_data_t *app, stats_t *stats, const block_view_t *v,
+                          key_stats_t ***keys, size_t *keys_capacity,
+                          int64_t **sequences, size_t *sequences_capacity) {
+  const capture_file_t *f = v->file;
+  const char *receive = v->values[f->receive_us];
+  const char *bytes = v->values[f->bytes];
+  const char *latency = v->values[f->latency_us];
+  const char *key_index = f->key >= 0 ? v->values[f->key] : NULL;
+  const char *sequence_index = f->sequence >= 0 ? v->values[f->sequence] : NULL;
+  bool sequence_int = sequence_index && f->types[f->sequence] == COLSINK_INT64;
+  key_stats_t *no_key = NULL;
+  int64_t bucket = INT64_MIN;
+  uint64_t bucket_messages = 0, bucket_bytes = 0;
+
+  /* resolve the block's dictionaries once, rows then map by index */
+  key_reserve(stats, (key_index ? v->dict_count[f->key] : 0) + 1);
+  if (key_index) {
+    uint32_t n = v->dict_count[f->key];
+    const char **starts = (const char**)malloc((n + 1) * sizeof(char*));
+    uint16_t *sizes = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+    if (n + 1 > *keys_capacity) {
+      *keys_capacity = (n + 1) * 2;
+      *keys = (key_stats_t**)realloc(*keys, *keys_capacity * sizeof(key_stats_t*));
+    }
+    dict_entries(v, f->key, starts, sizes);
+    for (uint32_t e = 0; e < n; ++e) {
+      (*keys)[e] = key_find(stats, starts[e], sizes[e]);
+    }
+    free(starts);
+    free(sizes);
+  }
+  if (sequence_index && !sequence_int) {
+    uint32_t n = v->dict_count[f->sequence];
+    const char **starts = (const char**)malloc((n + 1) * sizeof(char*));
+    uint16_t *sizes = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+    if (n + 1 > *sequences_capacity) {
+      *sequences_capacity = (n + 1) * 2;
+      *sequences = (int64_t*)realloc(*sequences, *sequences_capacity * sizeof(int64_t));
+    }
+    dict_entries(v, f->sequence, starts, sizes);
+    for (uint32_t e = 0; e < n; ++e) {
+      char number[32];
+      size_t size = sizes[e] < sizeof(number) ? sizes[e] : sizeof(number) - 1;
+      memcpy(number, starts[e], size);
+      number[size] = '\0';
+      (*sequences)[e] = strtoll(number, NULL, 10);
+    }
+    free(starts);
+    free(sizes);
+  }
+
+  for (uint32_t r = 0; r < v->rows; ++r) {
+    int64_t us = load_i64(receive, r);
+    uint32_t size = load_u32(bytes, r);
+    int64_t lat = load_i64(latency, r);
+    int64_t b = us / app->bucket_us;
+    /* rows of a block are mostly in time order, add runs of one bucket at once */
+    if (b != bucket) {
+      if (bucket_messages) {
+        series_add(&stats->messages, bucket, bucket_messages);
+        series_add(&stats->bytes, bucket, bucket_bytes);
+      }
+      bucket = b;
+      bucket_messages = bucket_bytes = 0;
+    }
+    ++bucket_messages;
+    bucket_bytes += size;
+    if (lat >= 0) {
+      latency_histogram_record(&stats->latency, (uint64_t)lat);
+    }
+    key_stats_t *k = NULL;
+    if (key_index) {
+      uint32_t e = load_u32(key_index, r);
+      if (e < v->dict_count[f->key]) {
+        k = (*keys)[e];
+      } else {
+        if (!no_key) no_key = key_find(stats, NO_KEY, strlen(NO_KEY));
+        k = no_key;
+      }
+    } else if (sequence_index) {
+      /* sequences without keys are one stream */
+      if (!no_key) no_key = key_find(stats, NO_KEY, strlen(NO_KEY));
+      k = no_key;
+    }
+    if (k) {
+      ++k->count;
+      k->bytes += size;
+      if (lat >= 0) {
+        ++k->stamped;
+        k->latency_sum += (double)lat;
+        if (lat > k->latency_max) k->latency_max = lat;
+      }
+      if (sequence_int) {
+        int64_t s = load_i64(sequence_index, r);
+        if (s != COLSINK_NULL_INT64) {
+          sequences_add(&k->sequences, s);
+        }
+      } else if (sequence_index) {
+        uint32_t e = load_u32(sequence_index, r);
+        if (e < v->dict_count[f->sequence]) {
+          sequences_add(&k->sequences, (*sequences)[e]);
+        }
+      }
+    }
+  }
+  if (bucket_messages) {
+    series_add(&stats->messages, bucket, bucket_messages);
+    series_add(&stats->bytes, bucket, bucket_bytes);
+  }
+  stats->rows += v->rows;
+}
+
+typedef struct worker_t {
+  app_data_t *app;
+  int index;
+} worker_t;
+
+/* Takes blocks until none are left */
+static void *worker(void *arg) {
+  worker_t *w = (worker_t*)arg;
+  app_data_t *app = w->app;
+  stats_t *stats = &app->stats[w->index];
+  key_stats_t **keys = NULL;
+  int64_t *sequences = NULL;
+  size_t keys_capacity = 0, sequences_capacity = 0;
+  for (;;) {
+    uint64_t b = __atomic_fetch_add(&app->next_block, 1, __ATOMIC_RELAXED);
+    if (b >= app->block_count) {
+      break;
+    }
+    analyze_block(app, stats, &app->blocks[b], &keys, &keys_capacity, &sequences, &sequences_capacity);
+  }
+  free(keys);
+  free(sequences);
+  return NULL;
+}
+
+/* Merges the statistics of every thread into the first */
+static void merge_stats(app_data_t *app) {
+  stats_t *to = &app->stats[0];
+  for (int t = 1; t < app->threads; ++t) {
+    stats_t *from = &app->stats[t];
+    to->rows += from->rows;
+    series_merge(&to->messages, &from->messages);
+    series_merge(&to->bytes, &from->bytes);
+    latency_histogram_merge(&to->latency, &from->latency);
+    for (size_t i = 0; i < from->key_capacity; ++i) {
+      key_stats_t *fk = &from->keys[i];
+      if (!fk->key) continue;
+      key_stats_t *k = key_find(to, fk->key, strlen(fk->key));
+      k->count += fk->count;
+      k->bytes += fk->bytes;
+      k->stamped += fk->stamped;
+      k->latency_sum += fk->latency_sum;
+      if (fk->latency_max > k->latency_max) k->latency_max = fk->latency_max;
+      sequences_merge(&k->sequences, &fk->sequences);
+      free(fk->key);
+      free(fk->sequences.seen);
+      free(fk->sequences.dup);
+    }
+    free(from->keys);
+    free(from->messages.counts);
+    free(from->bytes.counts);
+  }
+}
+
+static int compare_count(const void *a, const void *b) {
+  const key_stats_t *ka = *(const key_stats_t* const*)a;
+  const key_stats_t *kb = *(const key_stats_t* const*)b;
+  return ka->count < kb->count ? 1 : ka->count > kb->count ? -1 : strcmp(ka->key, kb->key);
+}
+
+static void report(app_data_t *app) {
+  stats_t *s = &app->stats[0];
+  double bucket_secs = app->bucket_us / 1e6;
+  uint64_t buckets = 0, peak = 0, low = UINT64_MAX;
+
+  /* throughput, over the buckets between the first and last message */
+  size_t first = 0, last = s->messages.length;
+  while (first < last && s->messages.counts[first] == 0) ++first;
+  while (last > first && s->messages.counts[last - 1] == 0) --last;
+  for (size_t i = first; i < last; ++i) {
+    uint64_t n = s->messages.counts[i];
+    ++buckets;
+    if (n > peak) peak = n;
+    if (n < low) low = n;
+    if (app->timeline) {
+      printf("t=+%.3fs %llu msg %.0f msg/s %.3f MB/s\n", (i - first) * bucket_secs,
+             (unsigned long long)n, n / bucket_secs,
+             (i < s->bytes.length ? s->bytes.counts[i] : 0) / bucket_secs / 1e6);
+    }
+  }
+  if (buckets) {
+    printf("throughput: %llu messages over %.3f s, mean %.0f msg/s, lowest %.0f msg/s, peak %.0f msg/s per %.3f s bucket\n",
+           (unsigned long long)s->rows, buckets * bucket_secs, s->rows / (buckets * bucket_secs),
+           low / bucket_secs, peak / bucket_secs, bucket_secs);
+  }
+  latency_histogram_report(stdout, "latency", "us", &s->latency);
+
+  if (s->key_count) {
+    key_stats_t **sorted = (key_stats_t**)malloc(s->key_count * sizeof(key_stats_t*));
+    size_t n = 0;
+    uint64_t missing_total = 0, gaps_total = 0, duplicated_total = 0;
+    for (size_t i = 0; i < s->key_capacity; ++i) {
+      if (s->keys[i].key) sorted[n++] = &s->keys[i];
+    }
+    qsort(sorted, n, sizeof(key_stats_t*), compare_count);
+    if (app->key_column) {
+      printf("%zu keys of %s, top %d by count:\n", n, app->key_column, app->top);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      key_stats_t *k = sorted[i];
+      uint64_t missing = 0, gaps = 0, duplicated = 0;
+      if (app->sequence_column) {
+        sequences_count(&k->sequences, &missing, &gaps, &duplicated);
+        missing_total += missing;
+        gaps_total += gaps;
+        duplicated_total += duplicated;
+      }
+      if ((int)i >= app->top) {
+        continue;
+      }
+      if (app->key_column) {
+        printf("  %-24s %10llu msg %12llu bytes", k->key, (unsigned long long)k->count,
+               (unsigned long long)k->bytes);
+        if (k->stamped) {
+          printf("  latency mean %.0f us max %lld us", k->latency_sum / k->stamped, (long long)k->latency_max);
+        }
+        if (app->sequence_column) {
+          printf("  %llu gaps %llu missing %llu duplicated", (unsigned long long)gaps,
+                 (unsigned long long)missing, (unsigned long long)duplicated);
+        }
+        printf("\n");
+      }
+    }
+    if (app->sequence_column) {
+      printf("sequences of %s: %llu gaps, %llu missing, %llu duplicated\n", app->sequence_column,
+             (unsigned long long)gaps_total, (unsigned long long)missing_total,
+             (unsigned long long)duplicated_total);
+    }
+    free(sorted);
+  }
+}
+
+static void usage() {
+    printf("Usage: analyze [options] <capture file>...\n");
+    printf("[Options]:\n");
+    printf("\t-j      # of threads [# of processors]\n");
+    printf("\t-k      Column to report per key stats by, a receive -K property []\n");
+    printf("\t-s      Column of sequence numbers to report gaps and duplicates of, per -k key []\n");
+    printf("\t-w      Throughput bucket in ms [1000]\n");
+    printf("\t-T      Print the whole throughput timeline\n");
+    printf("\t-n      # of keys to list [20]\n");
+    printf("\t-h      Displays this message\n");
+    exit(0);
+
+}
+
+static void parse_args(int argc, char **argv, app_data_t *app) {
+    int c;
+    /* initialize default values*/
+    app->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    app->bucket_us = 1000000;
+    app->top = 20;
+
+    /* command line options */
+    opterr = 0;
+    while((c = getopt(argc, argv, "j:k:s:w:Tn:h")) != -1) {
+        switch(c) {
+        case 'h': usage(); break;
+        case 'j':
+            app->threads = atoi(optarg);
+            if (app->threads < 1) usage();
+            break;
+        case 'k': app->key_column = optarg; break;
+        case 's': app->sequence_column = optarg; break;
+        case 'w':
+            app->bucket_us = atoll(optarg) * 1000;
+            if (app->bucket_us <= 0) usage();
+            break;
+        case 'T': app->timeline = true; break;
+        case 'n': app->top = atoi(optarg); break;
+        default: usage(); break;
+        }
+    }
+    if (app->threads < 1) app->threads = 1;
+    if (app->threads > MAX_THREADS) app->threads = MAX_THREADS;
+    for (; optind < argc; ++optind) {
+        if (app->file_count == MAX_FILES) {
+            fprintf(stderr, "At most %d files are supported\n", MAX_FILES);
+            exit(1);
+        }
+        app->paths[app->file_count++] = argv[optind];
+    }
+    if (app->file_count == 0) usage();
+
+}
+
+int analyze_main(int argc, char **argv) {
+    static app_data_t app;
+    pthread_t threads[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+    uint64_t start;
+
+    parse_args(argc, argv, &app);
+    start = clock_now_ns();
+    for (int i = 0; i < app.file_count; ++i) {
+        if (file_open(&app, &app.files[i], app.paths[i]) < 0) {
+            exit(1);
+        }
+    }
+    if (app.threads > (int)app.block_count) {
+        app.threads = app.block_count ? (int)app.block_count : 1;
+    }
+    for (int i = 0; i < app.threads; ++i) {
+        workers[i].app = &app;
+        workers[i].index = i;
+        if (i > 0 && pthread_create(&threads[i], NULL, worker, &workers[i]) != 0) {
+            fprintf(stderr, "Unable to start thread %d\n", i);
+            exit(1);
+        }
+    }
+    worker(&workers[0]);
+    for (int i = 1; i < app.threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    merge_stats(&app);
+    {
+    double secs = (clock_now_ns() - start) / 1e9;
+    size_t bytes = 0;
+    for (int i = 0; i < app.file_count; ++i) bytes += app.files[i].size;
+    printf("%llu rows in %zu blocks of %d files, %.1f MB analyzed in %.3f s on %d threads (%.0f rows/s)\n",
+           (unsigned long long)app.stats[0].rows, app.block_count, app.file_count, bytes / 1e6, secs,
+           app.threads, secs > 0 ? app.stats[0].rows / secs : 0.0);
+    }
+    report(&app);
+
+    for (int i = 0; i < app.file_count; ++i) {
+        if (app.files[i].size) munmap((void*)app.files[i].base, app.files[i].size);
+    }
+    free(app.blocks);
+    return 0;
+}
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return analyze_main(argc, argv);
+}
+#endif
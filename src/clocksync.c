@@ -0,0 +1,116 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "clocksync.h"
+
+#include <math.h>
+#include <string.h>
+
+void clocksync_init(clocksync_t *sync) {
+    memset(sync, 0, sizeof(*sync));
+    pthread_mutex_init(&sync->lock, NULL);
+}
+
+void clocksync_free(clocksync_t *sync) {
+    pthread_mutex_destroy(&sync->lock);
+}
+
+/* Least squares line through the points, must hold the lock */
+static void fit(clocksync_t *sync) {
+    const clocksync_point_t *newest = &sync->points[(sync->point_next + CLOCKSYNC_POINTS - 1) % CLOCKSYNC_POINTS];
+    double n = sync->point_count;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, residual = 0;
+    int64_t least_delay = INT64_MAX;
+    for (int i = 0; i < sync->point_count; ++i) {
+        const clocksync_point_t *p = &sync->points[i];
+        /* relative to the newest point, the fit is evaluated near it */
+        double x = (double)(p->at_us - newest->at_us);
+        sx += x;
+        sy += p->offset_us;
+        sxx += x * x;
+        sxy += x * p->offset_us;
+        if (p->delay_us < least_delay) least_delay = p->delay_us;
+    }
+    double denominator = n * sxx - sx * sx;
+    sync->drift = sync->point_count > 1 && denominator > 0 ? (n * sxy - sx * sy) / denominator : 0;
+    sync->offset_us = (sy - sync->drift * sx) / n;
+    sync->at_us = newest->at_us;
+    for (int i = 0; i < sync->point_count; ++i) {
+        const clocksync_point_t *p = &sync->points[i];
+        double d = fabs(p->offset_us - (sync->offset_us + sync->drift * (p->at_us - sync->at_us)));
+        if (d > residual) residual = d;
+    }
+    sync->bound_us = least_delay / 2.0 + residual;
+    sync->valid = true;
+}
+
+void clocksync_add(clocksync_t *sync, int64_t t1, int64_t t2, int64_t t3, int64_t t4) {
+    clocksync_point_t p;
+    p.at_us = t4;
+    p.offset_us = ((t2 - t1) + (t3 - t4)) / 2.0;
+    p.delay_us = (t4 - t1) - (t3 - t2);
+    if (p.delay_us < 0) p.delay_us = 0;
+    pthread_mutex_lock(&sync->lock);
+    ++sync->exchanges;
+    if (sync->round == 0 || p.delay_us < sync->best.delay_us) {
+        sync->best = p;
+    }
+    if (++sync->round == CLOCKSYNC_FILTER || !sync->valid) {
+        /* the first exchange gives an estimate at once, later ones wait for a full round */
+        sync->points[sync->point_next] = sync->best;
+        sync->point_next = (sync->point_next + 1) % CLOCKSYNC_POINTS;
+        if (sync->point_count < CLOCKSYNC_POINTS) ++sync->point_count;
+        sync->round = 0;
+        fit(sync);
+    }
+    /* each direction of this exchange, in the local clock */
+    double offset = sync->offset_us + sync->drift * (t4 - sync->at_us);
+    double outbound = (t2 - t1) - offset;
+    double inbound = (t4 - t3) + offset;
+    latency_histogram_record(&sync->outbound, outbound > 0 ? (uint64_t)outbound : 0);
+    latency_histogram_record(&sync->inbound, inbound > 0 ? (uint64_t)inbound : 0);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+bool clocksync_offset(clocksync_t *sync, int64_t now_us, double *offset_us, double *bound_us) {
+    bool valid;
+    pthread_mutex_lock(&sync->lock);
+    valid = sync->valid;
+    if (valid) {
+        *offset_us = sync->offset_us + sync->drift * (now_us - sync->at_us);
+        *bound_us = sync->bound_us;
+    }
+    pthread_mutex_unlock(&sync->lock);
+    return valid;
+}
+
+void clocksync_report(FILE *out, clocksync_t *sync) {
+    pthread_mutex_lock(&sync->lock);
+    if (!sync->valid) {
+        fprintf(out, "clock offset: no exchanges\n");
+    } else {
+        fprintf(out, "clock offset %.1f us +/- %.1f, drift %.2f ppm, from %llu exchanges\n",
+                sync->offset_us, sync->bound_us, sync->drift * 1e6, (unsigned long long)sync->exchanges);
+        latency_histogram_report(out, "clock exchange outbound", "us", &sync->outbound);
+        latency_histogram_report(out, "clock exchange inbound", "us", &sync->inbound);
+    }
+    pthread_mutex_unlock(&sync->lock);
+}
@@ -0,0 +1,96 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "latency.h"
+
+/*
+ * Clock offset and drift estimate between two hosts.
+ *
+ * Built from NTP style exchanges: the local host sends a request at t1,
+ * the remote host receives it at t2 and replies at t3, and the reply
+ * arrives at t4, t1 and t4 read from the local clock, t2 and t3 from the
+ * remote one. The exchange gives the remote clock offset
+ * ((t2 - t1) + (t3 - t4)) / 2 to within half its round trip delay
+ * (t4 - t1) - (t3 - t2), the part of the delay spent in queues is what
+ * makes directions asymmetric and the offset uncertain.
+ *
+ * As NTP, only the exchange with the least delay of every
+ * CLOCKSYNC_FILTER is kept, and a line fitted through the last
+ * CLOCKSYNC_POINTS of them gives the offset and drift. The error bound
+ * is half the least delay of those points plus the largest distance of
+ * a point from the line.
+ *
+ * The estimate is guarded by a lock, one thread adds exchanges while
+ * others correct timestamps.
+ */
+
+#define CLOCKSYNC_FILTER 8          /* exchanges per point, the least delay wins */
+#define CLOCKSYNC_POINTS 16         /* points the drift is fitted over */
+
+typedef struct clocksync_point_t {
+    int64_t at_us;                  /* local time of the exchange */
+    double offset_us;               /* remote less local */
+    int64_t delay_us;               /* round trip less the remote time */
+} clocksync_point_t;
+
+typedef struct clocksync_t {
+    pthread_mutex_t lock;
+    clocksync_point_t best;         /* least delay of the current filter round */
+    int round;                      /* exchanges in the current filter round */
+    clocksync_point_t points[CLOCKSYNC_POINTS];
+    int point_count, point_next;
+
+    /* the fit, offset(t) = offset_us + drift * (t - at_us) */
+    bool valid;
+    int64_t at_us;
+    double offset_us;
+    double drift;                   /* us per us */
+    double bound_us;
+
+    uint64_t exchanges;
+    latency_histogram_t outbound;   /* local to remote one-way delay of the exchanges in us */
+    latency_histogram_t inbound;    /* remote to local */
+} clocksync_t;
+
+void clocksync_init(clocksync_t *sync);
+void clocksync_free(clocksync_t *sync);
+
+/* Adds an exchange, t1 and t4 local, t2 and t3 remote, in us since the epoch */
+void clocksync_add(clocksync_t *sync, int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+/*
+ * Returns the offset of the remote clock (remote less local) at local time
+ * now_us and its error bound, or false before the first point.
+ * */
+bool clocksync_offset(clocksync_t *sync, int64_t now_us, double *offset_us, double *bound_us);
+
+/* Prints the offset, drift, error bound and the one-way delays of the exchanges */
+void clocksync_report(FILE *out, clocksync_t *sync);
+
+#endif /* clocksync.h */
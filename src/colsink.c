@@ -0,0 +1,242 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "colsink.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the file buffer takes whole columns, so a block goes out in a few large writes */
+#define COLSINK_FILE_BUFFER (1 << 20)
+
+static size_t type_width(colsink_type_t type) {
+    return type == COLSINK_INT64 || type == COLSINK_DOUBLE ? sizeof(int64_t) : sizeof(uint32_t);
+}
+
+/* FNV-1a */
+static uint32_t string_hash(const char *value, size_t size) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char)value[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void dict_clear(colsink_dict_t *dict) {
+    if (dict->slots) {
+        memset(dict->slots, 0, dict->capacity * sizeof(uint32_t));
+    }
+    dict->count = 0;
+    dict->pool_size = 0;
+}
+
+static void dict_free(colsink_dict_t *dict) {
+    free(dict->slots);
+    free(dict->offsets);
+    free(dict->pool);
+    memset(dict, 0, sizeof(*dict));
+}
+
+static bool dict_entry_equals(const colsink_dict_t *dict, uint32_t index, const char *value, size_t size) {
+    const char *entry = dict->pool + dict->offsets[index];
+    uint16_t length;
+    memcpy(&length, entry, sizeof(length));
+    return length == size && memcmp(entry + sizeof(length), value, size) == 0;
+}
+
+static void dict_grow(colsink_dict_t *dict) {
+    size_t capacity = dict->capacity ? dict->capacity * 2 : 256;
+    uint32_t *slots = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    for (uint32_t i = 0; i < dict->count; ++i) {
+        const char *entry = dict->pool + dict->offsets[i];
+        uint16_t length;
+        memcpy(&length, entry, sizeof(length));
+        size_t slot = string_hash(entry + sizeof(length), length) & (capacity - 1);
+        while (slots[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = i + 1;
+    }
+    free(dict->slots);
+    dict->slots = slots;
+    dict->capacity = capacity;
+    dict->offsets = (size_t*)realloc(dict->offsets, capacity / 2 * sizeof(size_t));
+}
+
+/* Returns the index of a string in the dictionary, adding it if new */
+static uint32_t dict_index(colsink_dict_t *dict, const char *value, size_t size) {
+    if (size > UINT16_MAX) {
+        size = UINT16_MAX;
+    }
+    /* at most half full */
+    if ((dict->count + 1) * 2 > dict->capacity) {
+        dict_grow(dict);
+    }
+    size_t slot = string_hash(value, size) & (dict->capacity - 1);
+    while (dict->slots[slot]) {
+        uint32_t index = dict->slots[slot] - 1;
+        if (dict_entry_equals(dict, index, value, size)) {
+            return index;
+        }
+        slot = (slot + 1) & (dict->capacity - 1);
+    }
+    size_t needed = dict->pool_size + sizeof(uint16_t) + size;
+    if (needed > dict->pool_capacity) {
+        dict->pool_capacity = needed * 2;
+        dict->pool = (char*)realloc(dict->pool, dict->pool_capacity);
+    }
+    uint16_t length = (uint16_t)size;
+    dict->offsets[dict->count] = dict->pool_size;
+    memcpy(dict->pool + dict->pool_size, &length, sizeof(length));
+    memcpy(dict->pool + dict->pool_size + sizeof(length), value, size);
+    dict->pool_size = needed;
+    dict->slots[slot] = ++dict->count;
+    return dict->count - 1;
+}
+
+/* Sets the defaults of the current row */
+static void row_reset(colsink_block_t *block) {
+    colsink_t *sink = block->sink;
+    for (int i = 0; i < sink->column_count; ++i) {
+        switch (sink->types[i]) {
+        case COLSINK_INT64: ((int64_t*)block->columns[i])[block->rows] = COLSINK_NULL_INT64; break;
+        case COLSINK_UINT32: ((uint32_t*)block->columns[i])[block->rows] = 0; break;
+        case COLSINK_DOUBLE: ((double*)block->columns[i])[block->rows] = NAN; break;
+        case COLSINK_STRING: ((uint32_t*)block->columns[i])[block->rows] = COLSINK_NULL; break;
+        }
+    }
+}
+
+int colsink_open(colsink_t *sink, const char *path, int column_count,
+                 const char *const *names, const colsink_type_t *types) {
+    uint32_t count = (uint32_t)column_count;
+    memset(sink, 0, sizeof(*sink));
+    if (column_count > COLSINK_MAX_COLUMNS || !(sink->file = fopen(path, "wb"))) {
+        return -1;
+    }
+    setvbuf(sink->file, NULL, _IOFBF, COLSINK_FILE_BUFFER);
+    pthread_mutex_init(&sink->lock, NULL);
+    sink->column_count = column_count;
+    fwrite(COLSINK_MAGIC, 1, strlen(COLSINK_MAGIC), sink->file);
+    fwrite(&count, sizeof(count), 1, sink->file);
+    for (int i = 0; i < column_count; ++i) {
+        uint8_t type = (uint8_t)types[i];
+        uint8_t length = (uint8_t)(strlen(names[i]) > UINT8_MAX ? UINT8_MAX : strlen(names[i]));
+        sink->types[i] = types[i];
+        fwrite(&type, 1, 1, sink->file);
+        fwrite(&length, 1, 1, sink->file);
+        fwrite(names[i], 1, length, sink->file);
+    }
+    if (ferror(sink->file)) {
+        fclose(sink->file);
+        sink->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void colsink_close(colsink_t *sink) {
+    if (sink->file && fclose(sink->file) != 0) {
+        sink->failed = true;
+    }
+    sink->file = NULL;
+    pthread_mutex_destroy(&sink->lock);
+}
+
+void colsink_block_init(colsink_block_t *block, colsink_t *sink) {
+    memset(block, 0, sizeof(*block));
+    block->sink = sink;
+    for (int i = 0; i < sink->column_count; ++i) {
+        block->columns[i] = malloc(COLSINK_BLOCK_ROWS * type_width(sink->types[i]));
+    }
+    row_reset(block);
+}
+
+void colsink_block_free(colsink_block_t *block) {
+    if (!block->sink) {
+        return;
+    }
+    colsink_block_flush(block);
+    for (int i = 0; i < block->sink->column_count; ++i) {
+        free(block->columns[i]);
+        dict_free(&block->dicts[i]);
+    }
+    memset(block, 0, sizeof(*block));
+}
+
+void colsink_set_int64(colsink_block_t *block, int column, int64_t value) {
+    ((int64_t*)block->columns[column])[block->rows] = value;
+}
+
+void colsink_set_uint32(colsink_block_t *block, int column, uint32_t value) {
+    ((uint32_t*)block->columns[column])[block->rows] = value;
+}
+
+void colsink_set_double(colsink_block_t *block, int column, double value) {
+    ((double*)block->columns[column])[block->rows] = value;
+}
+
+void colsink_set_string(colsink_block_t *block, int column, const char *value, size_t size) {
+    ((uint32_t*)block->columns[column])[block->rows] =
+        value ? dict_index(&block->dicts[column], value, size) : COLSINK_NULL;
+}
+
+void colsink_row_end(colsink_block_t *block) {
+    if (++block->rows == COLSINK_BLOCK_ROWS) {
+        colsink_block_flush(block);
+    } else {
+        row_reset(block);
+    }
+}
+
+void colsink_block_flush(colsink_block_t *block) {
+    colsink_t *sink = block->sink;
+    uint32_t rows = (uint32_t)block->rows;
+    if (rows == 0) {
+        return;
+    }
+    pthread_mutex_lock(&sink->lock);
+    if (sink->file) {
+        long start = ftell(sink->file);
+        fwrite(COLSINK_BLOCK_MAGIC, 1, strlen(COLSINK_BLOCK_MAGIC), sink->file);
+        fwrite(&rows, sizeof(rows), 1, sink->file);
+        for (int i = 0; i < sink->column_count; ++i) {
+            if (sink->types[i] == COLSINK_STRING) {
+                colsink_dict_t *dict = &block->dicts[i];
+                fwrite(&dict->count, sizeof(dict->count), 1, sink->file);
+                fwrite(dict->pool, 1, dict->pool_size, sink->file);
+            }
+            fwrite(block->columns[i], type_width(sink->types[i]), rows, sink->file);
+        }
+        sink->failed |= ferror(sink->file) != 0;
+        sink->rows += rows;
+        ++sink->blocks;
+        sink->bytes += ftell(sink->file) - start;
+    }
+    pthread_mutex_unlock(&sink->lock);
+    block->rows = 0;
+    for (int i = 0; i < sink->column_count; ++i) {
+        dict_clear(&block->dicts[i]);
+    }
+    row_reset(block);
+}
@@ -0,0 +1,132 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+
+#ifndef COLSINK_H
+#define COLSINK_H 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Columnar capture of per-message metadata.
+ *
+ * Each writer fills its own block of up to COLSINK_BLOCK_ROWS rows, one
+ * array per column, and appends the full block to the shared file with a
+ * few large sequential writes under the sink lock. The hot path only
+ * stores values into arrays.
+ *
+ * File layout, in host byte order, little endian on x86 and ARM:
+ *
+ *   header   "AMQPCOL1", uint32 column count, then per column a uint8
+ *            type and a uint8 name length followed by the name
+ *   block    "BLK1", uint32 row count, then per column:
+ *              COLSINK_INT64   rows int64 values, COLSINK_NULL_INT64 for
+ *                              a missing value
+ *              COLSINK_UINT32  rows uint32 values
+ *              COLSINK_DOUBLE  rows IEEE 754 double values, NaN for a
+ *                              missing value
+ *              COLSINK_STRING  uint32 dictionary size, the entries as a
+ *                              uint16 length and the bytes, then rows
+ *                              uint32 dictionary indexes, COLSINK_NULL
+ *                              for a missing value
+ *
+ * Every block carries its own dictionaries so writers never share them,
+ * and a column of a block loads with a single read into an array.
+ * scripts/colsink_load.py loads a file into numpy arrays or a pandas
+ * DataFrame.
+ */
+
+#define COLSINK_MAGIC "AMQPCOL1"
+#define COLSINK_BLOCK_MAGIC "BLK1"
+#define COLSINK_MAX_COLUMNS 16
+#define COLSINK_BLOCK_ROWS 65536
+#define COLSINK_NULL UINT32_MAX
+#define COLSINK_NULL_INT64 INT64_MIN
+
+typedef enum {
+    COLSINK_INT64 = 1,
+    COLSINK_UINT32 = 2,
+    COLSINK_STRING = 3,     /* dictionary encoded */
+    COLSINK_DOUBLE = 4
+} colsink_type_t;
+
+typedef struct colsink_t {
+    FILE *file;
+    pthread_mutex_t lock;   /* serializes block writes */
+    int column_count;
+    colsink_type_t types[COLSINK_MAX_COLUMNS];
+    uint64_t rows;          /* rows written, under lock */
+    uint64_t blocks;
+    uint64_t bytes;
+    bool failed;            /* a write failed, the file is incomplete */
+} colsink_t;
+
+/* Dictionary of the distinct strings of a column in a block */
+typedef struct colsink_dict_t {
+    uint32_t *slots;        /* open addressing table of entry index + 1, 0 when empty */
+    size_t capacity;        /* # of slots, power of two */
+    uint32_t count;
+    size_t *offsets;        /* offset of each entry in pool */
+    char *pool;             /* entries as uint16 length and bytes, as written */
+    size_t pool_size;
+    size_t pool_capacity;
+} colsink_dict_t;
+
+/* A writer's block, only touched by its owner */
+typedef struct colsink_block_t {
+    colsink_t *sink;
+    size_t rows;
+    void *columns[COLSINK_MAX_COLUMNS];
+    colsink_dict_t dicts[COLSINK_MAX_COLUMNS];
+} colsink_block_t;
+
+/*
+ * Creates the file and writes the header.
+ * @returns: 0 on success or -1 if the file cannot be written
+ * */
+int colsink_open(colsink_t *sink, const char *path, int column_count,
+                 const char *const *names, const colsink_type_t *types);
+
+/* Closes the file, flush every block first */
+void colsink_close(colsink_t *sink);
+
+void colsink_block_init(colsink_block_t *block, colsink_t *sink);
+
+/* Flushes the rows still in the block and frees it */
+void colsink_block_free(colsink_block_t *block);
+
+/* Set the values of the current row, a column left unset is missing, or 0 for COLSINK_UINT32 */
+void colsink_set_int64(colsink_block_t *block, int column, int64_t value);
+void colsink_set_uint32(colsink_block_t *block, int column, uint32_t value);
+void colsink_set_double(colsink_block_t *block, int column, double value);
+void colsink_set_string(colsink_block_t *block, int column, const char *value, size_t size);
+
+/* Completes the current row, the block is written out when full */
+void colsink_row_end(colsink_block_t *block);
+
+/* Appends the block's rows to the file and empties it */
+void colsink_block_flush(colsink_block_t *block);
+
+#endif /* colsink.h */
@@ -0,0 +1,161 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "conflate.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFLATE_EMPTY (-1)
+#define CONFLATE_DELETED (-2)
+#define CONFLATE_INITIAL_CAPACITY 64 /* power of two */
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void slots_alloc(conflate_t *c, size_t capacity) {
+    c->capacity = capacity;
+    c->used = 0;
+    c->slots = (int32_t*)malloc(capacity * sizeof(int32_t));
+    for (size_t i = 0; i < capacity; ++i) {
+        c->slots[i] = CONFLATE_EMPTY;
+    }
+}
+
+static void slots_insert(conflate_t *c, int index) {
+    size_t mask = c->capacity - 1;
+    size_t i = c->entries[index].hash & mask;
+    while (c->slots[i] != CONFLATE_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    c->slots[i] = index;
+    ++c->used;
+}
+
+/* Rebuilds the slots without deleted markers, doubling the capacity if needed */
+static void rehash(conflate_t *c) {
+    size_t capacity = c->pending * 2 >= c->capacity / 2 ? c->capacity * 2 : c->capacity;
+    free(c->slots);
+    slots_alloc(c, capacity);
+    for (int i = c->head; i != CONFLATE_EMPTY; i = c->entries[i].next) {
+        slots_insert(c, i);
+    }
+}
+
+void conflate_init(conflate_t *c) {
+    memset(c, 0, sizeof(*c));
+    slots_alloc(c, CONFLATE_INITIAL_CAPACITY);
+    c->free_list = CONFLATE_EMPTY;
+    c->head = c->tail = CONFLATE_EMPTY;
+}
+
+void conflate_free(conflate_t *c) {
+    free(c->slots);
+    free(c->entries);
+    memset(c, 0, sizeof(*c));
+}
+
+static int entry_alloc(conflate_t *c) {
+    if (c->free_list != CONFLATE_EMPTY) {
+        int index = c->free_list;
+        c->free_list = c->entries[index].next;
+        return index;
+    }
+    if (c->pending == c->pool_size) {
+        c->pool_size = c->pool_size ? c->pool_size * 2 : CONFLATE_INITIAL_CAPACITY;
+        c->entries = (conflate_entry_t*)realloc(c->entries, c->pool_size * sizeof(conflate_entry_t));
+    }
+    return (int)c->pending;
+}
+
+bool conflate_put(conflate_t *c, const char *key, int64_t value) {
+    uint32_t hash = key_hash(key);
+    size_t mask = c->capacity - 1;
+    ++c->queued;
+    for (size_t i = hash & mask; c->slots[i] != CONFLATE_EMPTY; i = (i + 1) & mask) {
+        int index = c->slots[i];
+        if (index >= 0 && c->entries[index].hash == hash
+            && strncmp(c->entries[index].key, key, CONFLATE_KEY_MAX - 1) == 0) {
+            /* newer value for a pending key */
+            c->entries[index].value = value;
+            ++c->conflated;
+            return true;
+        }
+    }
+    if ((c->used + 1) * 4 > c->capacity * 3) {
+        rehash(c);
+    }
+    {
+    int index = entry_alloc(c);
+    conflate_entry_t *e = &c->entries[index];
+    strncpy(e->key, key, CONFLATE_KEY_MAX - 1);
+    e->key[CONFLATE_KEY_MAX - 1] = '\0';
+    e->hash = hash;
+    e->value = value;
+    e->enqueued = clock_now_ns();
+    e->next = CONFLATE_EMPTY;
+    if (c->tail == CONFLATE_EMPTY) {
+        c->head = index;
+    } else {
+        c->entries[c->tail].next = index;
+    }
+    c->tail = index;
+    ++c->pending;
+    slots_insert(c, index);
+    }
+    return false;
+}
+
+bool conflate_take(conflate_t *c, conflate_entry_t *entry) {
+    if (c->head == CONFLATE_EMPTY) {
+        return false;
+    }
+    int index = c->head;
+    conflate_entry_t *e = &c->entries[index];
+    size_t mask = c->capacity - 1;
+    *entry = *e;
+    c->head = e->next;
+    if (c->head == CONFLATE_EMPTY) {
+        c->tail = CONFLATE_EMPTY;
+    }
+    for (size_t i = e->hash & mask; c->slots[i] != CONFLATE_EMPTY; i = (i + 1) & mask) {
+        if (c->slots[i] == index) {
+            c->slots[i] = CONFLATE_DELETED;
+            break;
+        }
+    }
+    e->next = c->free_list;
+    c->free_list = index;
+    --c->pending;
+    return true;
+}
+
+double conflate_rate(const conflate_t *c) {
+    return c->queued ? (double)c->conflated / c->queued : 0.0;
+}
@@ -0,0 +1,80 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef CONFLATE_H
+#define CONFLATE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Conflating queue of messages waiting for credit.
+ *
+ * Pending messages are keyed in an open addressing table. Queuing a
+ * message for a key that is already pending replaces the pending value,
+ * so only the latest value per key is sent when credit returns. Keys are
+ * sent in the order they were first queued.
+ */
+
+#define CONFLATE_KEY_MAX 64
+
+typedef struct conflate_entry_t {
+    char key[CONFLATE_KEY_MAX];
+    uint32_t hash;
+    int64_t value;          /* latest value queued for key */
+    uint64_t enqueued;      /* clock_now_ns() when the key was first queued */
+    int next;               /* next entry in send order, or free list link */
+} conflate_entry_t;
+
+typedef struct conflate_t {
+    conflate_entry_t *entries;  /* entry pool, indexes are stable */
+    int32_t *slots;         /* hash table of entry indexes, CONFLATE_EMPTY or CONFLATE_DELETED */
+    size_t capacity;        /* # of slots, power of two */
+    size_t used;            /* live and deleted slots */
+    size_t pool_size;
+    int free_list;
+    int head, tail;         /* send order */
+    size_t pending;
+    uint64_t queued;        /* # of values queued */
+    uint64_t conflated;     /* # of values replaced before they were sent */
+} conflate_t;
+
+void conflate_init(conflate_t *c);
+void conflate_free(conflate_t *c);
+
+/*
+ * Queues the value for a key, replacing the value pending for the same key.
+ * @returns: true if a pending value was replaced
+ * */
+bool conflate_put(conflate_t *c, const char *key, int64_t value);
+
+/*
+ * Removes the oldest pending key.
+ * @param[out]: entry, copy of the key, latest value and first queue time
+ * @returns: false if nothing is pending
+ * */
+bool conflate_take(conflate_t *c, conflate_entry_t *entry);
+
+/* Returns the fraction of queued values replaced before they were sent */
+double conflate_rate(const conflate_t *c);
+
+#endif /* conflate.h */
@@ -0,0 +1,330 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "delta.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* unchanged runs shorter than this are sent as literals, a run costs a byte or two */
+#define DELTA_MIN_MATCH 4
+
+static uint32_t payload_checksum(const char *payload, size_t size) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char)payload[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void reserve(char **buf, size_t *capacity, size_t size) {
+    if (size > *capacity) {
+        *capacity = size * 2;
+        *buf = (char*)realloc(*buf, *capacity);
+    }
+}
+
+/* Stream names are kept to DELTA_STREAM_MAX - 1 bytes, longer names match on that prefix */
+static bool stream_matches(const delta_stream_t *s, const char *name) {
+    return strncmp(s->name, name, DELTA_STREAM_MAX - 1) == 0;
+}
+
+static delta_stream_t *stream_find(delta_codec_t *codec, const char *name) {
+    for (size_t i = 0; i < codec->count; ++i) {
+        if (stream_matches(&codec->streams[i], name)) {
+            return &codec->streams[i];
+        }
+    }
+    if (codec->count == codec->capacity) {
+        codec->capacity = codec->capacity ? codec->capacity * 2 : 16;
+        codec->streams = (delta_stream_t*)realloc(codec->streams, codec->capacity * sizeof(delta_stream_t));
+    }
+    delta_stream_t *s = &codec->streams[codec->count++];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    return s;
+}
+
+static void stream_set_base(delta_stream_t *s, const char *payload, size_t size) {
+    reserve(&s->base, &s->base_capacity, size);
+    memcpy(s->base, payload, size);
+    s->base_size = size;
+}
+
+/* LEB128 */
+static size_t varint_put(char *out, uint64_t v) {
+    size_t n = 0;
+    do {
+        unsigned char b = v & 0x7f;
+        v >>= 7;
+        out[n++] = (char)(v ? b | 0x80 : b);
+    } while (v);
+    return n;
+}
+
+static bool varint_get(const char **next, const char *end, uint64_t *v) {
+    int shift = 0;
+    *v = 0;
+    while (*next < end && shift < 64) {
+        unsigned char b = (unsigned char)*(*next)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+static size_t match_length(const char *base, size_t base_size, const char *payload, size_t size, size_t pos) {
+    size_t n = 0;
+    while (pos + n < size && pos + n < base_size && payload[pos + n] == base[pos + n]) {
+        ++n;
+    }
+    return n;
+}
+
+/*
+ * Writes the delta of payload against base to out, which holds at least
+ * limit + 20 bytes.
+ * @returns: the delta size or 0 if it would be limit bytes or more
+ * */
+static size_t delta_diff(const char *base, size_t base_size, const char *payload, size_t size, char *out, size_t limit) {
+    size_t n = varint_put(out, size);
+    size_t pos = 0;
+    while (pos < size) {
+        size_t skip = match_length(base, base_size, payload, size, pos);
+        size_t start = pos + skip, end = start;
+        while (end < size) {
+            if (end < base_size && payload[end] == base[end]
+                && match_length(base, base_size, payload, size, end) >= DELTA_MIN_MATCH) {
+                break;
+            }
+            ++end;
+        }
+        /* two varints of at most 10 bytes each, then the literal */
+        if (n + 20 + (end - start) >= limit) {
+            return 0;
+        }
+        n += varint_put(out + n, skip);
+        n += varint_put(out + n, end - start);
+        memcpy(out + n, payload + start, end - start);
+        n += end - start;
+        pos = end;
+    }
+    return n < limit ? n : 0;
+}
+
+/* Rebuilds a payload from base and a delta into out, returns false for a malformed delta */
+static bool delta_apply(const char *base, size_t base_size, pn_bytes_t delta, char **out, size_t *capacity, size_t *size) {
+    const char *next = delta.start, *end = delta.start + delta.size;
+    uint64_t total, skip, literal;
+    size_t pos = 0;
+    /* every byte past the base is a literal of the delta, anything larger is malformed */
+    if (!varint_get(&next, end, &total) || total > base_size + delta.size) {
+        return false;
+    }
+    reserve(out, capacity, total ? total : 1);
+    while (pos < total) {
+        if (!varint_get(&next, end, &skip) || !varint_get(&next, end, &literal)) {
+            return false;
+        }
+        if (skip > total - pos || pos + skip > base_size) {
+            return false;
+        }
+        memcpy(*out + pos, base + pos, skip);
+        pos += skip;
+        if (literal > total - pos || literal > (uint64_t)(end - next)) {
+            return false;
+        }
+        memcpy(*out + pos, next, literal);
+        next += literal;
+        pos += literal;
+    }
+    *size = total;
+    return next == end;
+}
+
+void delta_init(delta_codec_t *codec, int keyframe_interval) {
+    memset(codec, 0, sizeof(*codec));
+    codec->keyframe_interval = keyframe_interval;
+}
+
+void delta_free(delta_codec_t *codec) {
+    for (size_t i = 0; i < codec->count; ++i) {
+        free(codec->streams[i].base);
+    }
+    free(codec->streams);
+    free(codec->scratch);
+    memset(codec, 0, sizeof(*codec));
+}
+
+void delta_request_keyframe(delta_codec_t *codec, const char *stream) {
+    for (size_t i = 0; i < codec->count; ++i) {
+        if (!stream || stream_matches(&codec->streams[i], stream)) {
+            codec->streams[i].keyframe_due = true;
+        }
+    }
+}
+
+pn_bytes_t delta_encode(delta_codec_t *codec, const char *stream, const char *payload, size_t size, delta_frame_t *frame) {
+    delta_stream_t *s = stream_find(codec, stream);
+    size_t delta_size = 0;
+    snprintf(frame->stream, sizeof(frame->stream), "%s", s->name);
+    frame->sequence = s->sequence++;
+    frame->checksum = payload_checksum(payload, size);
+    if (s->base && !s->keyframe_due && s->since_keyframe + 1 < codec->keyframe_interval) {
+        reserve(&codec->scratch, &codec->scratch_capacity, size + 20);
+        delta_size = delta_diff(s->base, s->base_size, payload, size, codec->scratch, size);
+    }
+    stream_set_base(s, payload, size);
+    codec->stats.payload_bytes += size;
+    frame->keyframe = delta_size == 0;
+    if (frame->keyframe) {
+        s->since_keyframe = 0;
+        s->keyframe_due = false;
+        ++codec->stats.keyframes;
+        codec->stats.body_bytes += size;
+        return pn_bytes(size, s->base);
+    }
+    ++s->since_keyframe;
+    ++codec->stats.deltas;
+    codec->stats.body_bytes += delta_size;
+    return pn_bytes(delta_size, codec->scratch);
+}
+
+void delta_message_set(pn_message_t *message, const delta_frame_t *frame, pn_bytes_t body) {
+    pn_data_t *properties = message_properties_append(message);
+    pn_data_put_string(properties, pn_bytes(strlen(DELTA_STREAM_KEY), DELTA_STREAM_KEY));
+    pn_data_put_string(properties, pn_bytes(strlen(frame->stream), frame->stream));
+    pn_data_put_string(properties, pn_bytes(strlen(DELTA_SEQUENCE_KEY), DELTA_SEQUENCE_KEY));
+    pn_data_put_ulong(properties, frame->sequence);
+    pn_data_put_string(properties, pn_bytes(strlen(DELTA_KEYFRAME_KEY), DELTA_KEYFRAME_KEY));
+    pn_data_put_bool(properties, frame->keyframe);
+    pn_data_put_string(properties, pn_bytes(strlen(DELTA_CHECKSUM_KEY), DELTA_CHECKSUM_KEY));
+    pn_data_put_uint(properties, frame->checksum);
+    pn_data_exit(properties);
+    pn_data_put_binary(pn_message_body(message), body);
+}
+
+/* Reads the frame properties and the binary body, false if the message is not delta encoded */
+static bool frame_get(pn_message_t *message, delta_frame_t *frame, pn_bytes_t *body) {
+    pn_data_t *properties = pn_message_properties(message);
+    pn_data_t *data = pn_message_body(message);
+    pn_bytes_t stream;
+    if (!data_map_find(properties, DELTA_STREAM_KEY) || pn_data_type(properties) != PN_STRING) {
+        return false;
+    }
+    stream = pn_data_get_string(properties);
+    snprintf(frame->stream, sizeof(frame->stream), "%.*s", (int)stream.size, stream.start);
+    if (!data_map_find(properties, DELTA_SEQUENCE_KEY) || pn_data_type(properties) != PN_ULONG) {
+        return false;
+    }
+    frame->sequence = pn_data_get_ulong(properties);
+    if (!data_map_find(properties, DELTA_KEYFRAME_KEY) || pn_data_type(properties) != PN_BOOL) {
+        return false;
+    }
+    frame->keyframe = pn_data_get_bool(properties);
+    if (!data_map_find(properties, DELTA_CHECKSUM_KEY) || pn_data_type(properties) != PN_UINT) {
+        return false;
+    }
+    frame->checksum = pn_data_get_uint(properties);
+    pn_data_rewind(data);
+    if (!pn_data_next(data) || pn_data_type(data) != PN_BINARY) {
+        return false;
+    }
+    *body = pn_data_get_binary(data);
+    return true;
+}
+
+delta_result_t delta_message_decode(delta_codec_t *codec, pn_message_t *message, delta_frame_t *frame, pn_bytes_t *payload) {
+    pn_bytes_t body;
+    size_t size = 0;
+    if (!frame_get(message, frame, &body)) {
+        return DELTA_NOT_ENCODED;
+    }
+    delta_stream_t *s = stream_find(codec, frame->stream);
+    if (frame->keyframe) {
+        stream_set_base(s, body.start, body.size);
+    } else if (!s->synced || frame->sequence != s->sequence) {
+        /* a stream joined mid way waits for its first keyframe without counting a gap */
+        if (s->synced) {
+            ++codec->stats.gaps;
+            s->synced = false;
+        }
+        ++codec->stats.dropped;
+        return DELTA_WAITING;
+    } else {
+        if (!delta_apply(s->base, s->base_size, body, &codec->scratch, &codec->scratch_capacity, &size)) {
+            s->synced = false;
+            ++codec->stats.gaps;
+            ++codec->stats.dropped;
+            return DELTA_WAITING;
+        }
+        /* the rebuilt payload becomes the base, the old base the scratch */
+        char *rebuilt = codec->scratch;
+        size_t rebuilt_capacity = codec->scratch_capacity;
+        codec->scratch = s->base;
+        codec->scratch_capacity = s->base_capacity;
+        s->base = rebuilt;
+        s->base_capacity = rebuilt_capacity;
+        s->base_size = size;
+    }
+    if (payload_checksum(s->base, s->base_size) != frame->checksum) {
+        if (s->synced || frame->keyframe) {
+            ++codec->stats.gaps;
+        }
+        s->synced = false;
+        ++codec->stats.dropped;
+        return DELTA_WAITING;
+    }
+    s->synced = true;
+    s->sequence = frame->sequence + 1;
+    if (frame->keyframe) {
+        ++codec->stats.keyframes;
+    } else {
+        ++codec->stats.deltas;
+    }
+    codec->stats.payload_bytes += s->base_size;
+    codec->stats.body_bytes += body.size;
+    *payload = pn_bytes(s->base_size, s->base);
+    return DELTA_OK;
+}
+
+void delta_stats_merge(delta_stats_t *to, const delta_stats_t *from) {
+    to->keyframes += from->keyframes;
+    to->deltas += from->deltas;
+    to->payload_bytes += from->payload_bytes;
+    to->body_bytes += from->body_bytes;
+    to->gaps += from->gaps;
+    to->dropped += from->dropped;
+}
+
+void delta_report(FILE *out, const char *name, const delta_stats_t *stats) {
+    fprintf(out, "delta %s: %llu keyframes, %llu deltas, %llu payload bytes in %llu body bytes (%.1f%%), "
+            "%llu gaps, %llu dropped waiting for a keyframe\n", name,
+            (unsigned long long)stats->keyframes, (unsigned long long)stats->deltas,
+            (unsigned long long)stats->payload_bytes, (unsigned long long)stats->body_bytes,
+            stats->payload_bytes ? 100.0 * stats->body_bytes / stats->payload_bytes : 0.0,
+            (unsigned long long)stats->gaps, (unsigned long long)stats->dropped);
+}
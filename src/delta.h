@@ -0,0 +1,131 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+
+#ifndef DELTA_H
+#define DELTA_H 1
+
+#include <proton/message.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Delta encoding of repetitive payloads.
+ *
+ * Messages of a stream, the messages of one key or one link, are sent as
+ * byte level deltas against the previous payload of the stream, with a
+ * full keyframe every keyframe interval, on request and whenever the delta
+ * would not be smaller. A delta is a sequence of (unchanged run, literal
+ * run) pairs at the same offsets as the previous payload, so it suits
+ * payloads of a fixed layout that change in place, such as snapshots.
+ *
+ * The stream, its sequence, the keyframe flag and a checksum of the full
+ * payload travel as application properties, the keyframe or delta as a
+ * binary body. The decoder rebuilds each payload from the previous one,
+ * and after a gap in the sequence, or a checksum mismatch, it drops the
+ * stream's messages until the next keyframe.
+ */
+
+#define DELTA_STREAM_KEY "delta-stream"     /* string, the key or link of the stream */
+#define DELTA_SEQUENCE_KEY "delta-seq"      /* ulong, sequence within the stream */
+#define DELTA_KEYFRAME_KEY "delta-kf"       /* boolean, true for a full payload */
+#define DELTA_CHECKSUM_KEY "delta-sum"      /* uint, FNV-1a of the full payload */
+
+#define DELTA_STREAM_MAX 64
+
+typedef struct delta_frame_t {
+    char stream[DELTA_STREAM_MAX];
+    uint64_t sequence;
+    bool keyframe;
+    uint32_t checksum;
+} delta_frame_t;
+
+/* The last payload of a stream */
+typedef struct delta_stream_t {
+    char name[DELTA_STREAM_MAX];
+    char *base;
+    size_t base_size;
+    size_t base_capacity;
+    uint64_t sequence;      /* next sequence to send or expected */
+    int since_keyframe;     /* deltas sent since the last keyframe */
+    bool keyframe_due;      /* encoder: a keyframe was requested */
+    bool synced;            /* decoder: base holds the payload of sequence - 1 */
+} delta_stream_t;
+
+typedef struct delta_stats_t {
+    uint64_t keyframes;
+    uint64_t deltas;
+    uint64_t payload_bytes; /* full payloads sent or rebuilt */
+    uint64_t body_bytes;    /* keyframe and delta bodies */
+    uint64_t gaps;          /* sequence gaps and checksum mismatches seen by the decoder */
+    uint64_t dropped;       /* messages dropped waiting for a keyframe */
+} delta_stats_t;
+
+typedef struct delta_codec_t {
+    delta_stream_t *streams;    /* streams are few, one per key or link, searched in order */
+    size_t count;
+    size_t capacity;
+    int keyframe_interval;  /* a keyframe at least every n messages of a stream */
+    char *scratch;          /* delta being encoded or payload being rebuilt */
+    size_t scratch_capacity;
+    delta_stats_t stats;
+} delta_codec_t;
+
+typedef enum {
+    DELTA_OK,               /* the payload is rebuilt */
+    DELTA_WAITING,          /* dropped, the stream waits for a keyframe */
+    DELTA_NOT_ENCODED       /* the message carries no delta properties */
+} delta_result_t;
+
+void delta_init(delta_codec_t *codec, int keyframe_interval);
+void delta_free(delta_codec_t *codec);
+
+/* Makes the next message of a stream a keyframe, NULL for every stream */
+void delta_request_keyframe(delta_codec_t *codec, const char *stream);
+
+/*
+ * Encodes the next payload of a stream.
+ * @param[out]: frame, the properties to send with delta_message_set()
+ * @returns: the body to send, the payload itself for a keyframe or a
+ *           delta valid until the next call
+ * */
+pn_bytes_t delta_encode(delta_codec_t *codec, const char *stream, const char *payload, size_t size, delta_frame_t *frame);
+
+/* Sets the frame properties and the binary body of a message */
+void delta_message_set(pn_message_t *message, const delta_frame_t *frame, pn_bytes_t body);
+
+/*
+ * Decodes the payload of a delta encoded message.
+ * @param[out]: payload, the full payload valid until the next call
+ * @returns: DELTA_OK, DELTA_WAITING or DELTA_NOT_ENCODED
+ * */
+delta_result_t delta_message_decode(delta_codec_t *codec, pn_message_t *message, delta_frame_t *frame, pn_bytes_t *payload);
+
+/* Adds the counts of 'from' to 'to' */
+void delta_stats_merge(delta_stats_t *to, const delta_stats_t *from);
+
+/* Prints the frame counts, gaps and the body to payload size ratio */
+void delta_report(FILE *out, const char *name, const delta_stats_t *stats);
+
+#endif /* delta.h */
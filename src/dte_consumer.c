@@ -22,6 +22,20 @@
  * This Sample demonstrates creating a durable subscription 
  * with a topic using an AMQP address prefix and consuming 
  * messages from the subscription.
+ *
+ * With -B the consumer switches to a bulk profile while it drains a
+ * backlog, with a large credit window, messages decoded and acknowledged
+ * in batches and console output suppressed, and back to the low latency
+ * live profile once it has caught up. The backlog is measured by the lag
+ * estimate, a moving average of message age from the producer timestamps,
+ * which -m reports as a metric.
+ *
+ * With -x, expired messages are settled without being decoded, found by
+ * scanning the header and properties sections of the encoded message.
+ *
+ * Without -B, -f sets the credit window kept open on the link, and -d
+ * presettled asks the broker to send the messages settled, at most once,
+ * with no dispositions to return.
  */
 
 #include <proton/connection.h>
@@ -33,14 +47,41 @@
 #include <proton/session.h>
 #include <proton/transport.h>
 #include <proton/sasl.h>
+#include <proton/ssl.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "aggregate.h"
+#include "lag.h"
+#include "latency.h"
+#include "section.h"
+#include "probe.h"
 #include "util.h"
 
+/* Consumption profile, the catch-up mode switches between LIVE_PROFILE and BULK_PROFILE */
+typedef struct profile_t {
+  const char *name;
+  int credit;               /* credit window kept open on the link */
+  int ack_batch;            /* # of messages decoded and acknowledged together */
+  bool print;               /* write messages to the console */
+} profile_t;
+
+static const profile_t LIVE_PROFILE = { "live", 10, 1, true };
+static const profile_t BULK_PROFILE = { "bulk", 5000, 500, false };
+
+#define CATCHUP_FLUSH_MS 100        /* longest a partial batch waits for more messages */
+#define CATCHUP_SATURATED_COUNT 50  /* consecutive deliveries with credit saturated before switching to bulk */
+
+/* A complete message waiting for its batch to be decoded and acknowledged */
+typedef struct batch_entry_t {
+  pn_delivery_t *delivery;
+  pn_rwbytes_t data;
+  bool expired;             /* shed without decoding */
+} batch_entry_t;
+
 typedef struct app_data_t {
   const char *host, *port;
   const char *username, *password;
@@ -49,11 +90,46 @@ typedef struct app_data_t {
   char *amqp_address_prefix;
   const char *container_id;
   int message_count;
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+  const char *clock_address; /* clock offset exchange address, NULL for none */
+  clocksync_t clock;        /* producer clock offset estimate */
+  agg_config_t agg_config;  /* aggregation enabled when agg_config.field is set */
+  bool latency;             /* record the latency of stamped messages */
+  bool catchup;             /* switch between the live and bulk profiles */
+  uint64_t catchup_age_ms;  /* lag estimate that indicates a backlog */
+  unsigned lag_report_ms;   /* lag metric period, 0 for none */
+  uint64_t expired_outcome; /* PN_ACCEPTED or PN_MODIFIED to shed expired messages, 0 to process them */
+  unsigned timer_ms;        /* proactor timeout period, 0 for none */
+  int credit;               /* credit window without -B */
+  bool presettled;          /* ask the broker to send the messages settled */
 
   pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  aggregator_t *aggregator;
+  latency_recorder_t latency_recorder;
+  pn_message_t *message;    /* reused to decode each message */
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  uint64_t open_time;       /* clock_now_ns() at PN_CONNECTION_REMOTE_OPEN */
   int received;
+  int expired;              /* messages shed */
   bool finished;
   pn_rwbytes_t msgin;       /* Partially received message */
+  pn_connection_t *connection;
+  pn_link_t *receiver;
+  const profile_t *profile;
+  batch_entry_t *batch;     /* BULK_PROFILE.ack_batch entries */
+  int batch_size;
+  uint64_t batch_start;     /* clock_now_ns() when the first message of the batch arrived */
+  int delivered;            /* # of complete messages read, including those waiting in the batch */
+  int delivered_at_wake;
+  lag_estimator_t lag;
+  uint64_t next_lag_report; /* clock_now_ns() of the next lag metric */
+  int saturated;            /* consecutive deliveries that found credit saturated */
+  int bulk_start_count;     /* received count when the bulk profile started */
+  uint64_t bulk_start;      /* clock_now_ns() when the bulk profile started */
 } app_data_t;
 
 static const int BATCH = 1000; /* Batch size for unlimited receive */
@@ -114,16 +190,27 @@ static int set_topic_prefix_from_connection(app_data_t *app, pn_connection_t *pn
     return rc; 
 }
 
-static void decode_message(pn_rwbytes_t data) {
-  pn_message_t *m = pn_message();
+static void decode_message(app_data_t* app, pn_rwbytes_t data) {
+  pn_message_t *m = app->message;
+  pn_message_clear(m);
   int err = pn_message_decode(m, data.start, data.size);
   if (!err) {
-    /* Print the decoded message */
-    pn_string_t *s = pn_string(NULL);
-    pn_inspect(pn_message_body(m), s);
-    printf("%s\n", pn_string_get(s));
-    pn_free(s);
-    pn_message_free(m);
+    if (app->latency) {
+      latency_record(&app->latency_recorder, m);
+    }
+    lag_observe(&app->lag, m);
+    if (app->aggregator) {
+      /* only the window aggregates are written out */
+      uint64_t now = clock_wall_ms();
+      aggregator_tick(app->aggregator, now);
+      aggregator_add(app->aggregator, 0, m, now);
+    } else if (app->profile->print) {
+      /* Print the decoded message */
+      pn_string_t *s = pn_string(NULL);
+      pn_inspect(pn_message_body(m), s);
+      printf("%s\n", pn_string_get(s));
+      pn_free(s);
+    }
     free(data.start);
   } else {
     fprintf(stderr, "decode_message: %s\n", pn_code(err));
@@ -131,6 +218,161 @@ static void decode_message(pn_rwbytes_t data) {
   }
 }
 
+/*
+ * Settles an expired message with the -x outcome without decoding it. A
+ * message that cannot be scanned is left to decode_message() to report.
+ * Returns false for a message that has not expired.
+ * */
+static bool shed_expired(app_data_t* app, pn_delivery_t* d, pn_rwbytes_t data) {
+  section_expiry_t expiry;
+  int64_t now = (int64_t)clock_wall_ms();
+  if (!app->expired_outcome || section_scan_expiry(data.start, data.size, &expiry) < 0
+      || !section_expired(&expiry, now, now)) {
+    return false;
+  }
+  if (app->expired_outcome == PN_MODIFIED) {
+    /* not to be redelivered here, the broker may dead letter it */
+    pn_disposition_t *disposition = pn_delivery_local(d);
+    pn_disposition_set_failed(disposition, true);
+    pn_disposition_set_undeliverable(disposition, true);
+  }
+  pn_delivery_update(d, app->expired_outcome);
+  /* still a measure of how far behind the consumer is */
+  lag_add(&app->lag, lag_age_ms(expiry.creation_time, now));
+  free(data.start);
+  ++app->expired;
+  return true;
+}
+
+/* Keeps a credit window open, never granting more than the messages left */
+static void top_up_credit(app_data_t* app, pn_link_t* l, int window) {
+  int credit = pn_link_credit(l);
+  if (credit >= window / 2) {
+    return;
+  }
+  {
+  int grant = window - credit;
+  if (app->message_count) {
+    int remaining = app->message_count - app->delivered - credit;
+    if (grant > remaining) grant = remaining;
+  }
+  if (grant > 0) {
+    pn_link_flow(l, grant);
+  }
+  }
+}
+
+static void set_profile(app_data_t* app, const profile_t* profile) {
+  if (profile == app->profile) {
+    return;
+  }
+  if (profile == &BULK_PROFILE) {
+    printf("backlog detected after %d messages, switching to the %s profile\n", app->received, profile->name);
+    app->bulk_start = clock_now_ns();
+    app->bulk_start_count = app->received;
+  } else {
+    double secs = (clock_now_ns() - app->bulk_start) / 1e9;
+    int drained = app->received - app->bulk_start_count;
+    printf("caught up, drained %d messages in %.3f ms (%.0f msg/s), switching to the %s profile\n",
+           drained, secs * 1e3, secs > 0 ? drained / secs : 0.0, profile->name);
+  }
+  /* credit already granted by the bulk profile is used up before the live window is topped up */
+  app->profile = profile;
+  app->saturated = 0;
+}
+
+/* Decodes the batched messages then accepts and settles them together */
+static void flush_batch(app_data_t* app) {
+  for (int i = 0; i < app->batch_size; ++i) {
+    batch_entry_t *b = &app->batch[i];
+    b->expired = shed_expired(app, b->delivery, b->data);
+    if (!b->expired) {
+      decode_message(app, b->data);
+    }
+  }
+  for (int i = 0; i < app->batch_size; ++i) {
+    /* a message the broker sent settled takes no outcome */
+    if (!app->batch[i].expired && !pn_delivery_settled(app->batch[i].delivery)) {
+      pn_delivery_update(app->batch[i].delivery, PN_ACCEPTED);
+    }
+    pn_delivery_settle(app->batch[i].delivery);
+  }
+  app->received += app->batch_size;
+  app->batch_size = 0;
+  if (app->message_count && app->received >= app->message_count) {
+    pn_session_t *ssn = pn_link_session(app->receiver);
+    double secs = (clock_now_ns() - app->open_time) / 1e9;
+    printf("%d messages received in %.3f ms (%.0f msg/s)\n",
+           app->received, secs * 1e3, secs > 0 ? app->received / secs : 0.0);
+    pn_link_close(app->receiver);
+    pn_session_close(ssn);
+    pn_connection_close(pn_session_connection(ssn));
+  }
+}
+
+/*
+ * Handles a complete message in catch-up mode. A backlog is detected when
+ * the lag estimate reaches -A, or for messages without a producer time, when
+ * the broker keeps the credit window saturated with deliveries waiting to be
+ * processed. The consumer has caught up when the estimate is below half of
+ * -A, or when a batch does not fill within CATCHUP_FLUSH_MS.
+ * */
+static void catchup_delivery(app_data_t* app, pn_link_t* l, pn_delivery_t* d, pn_rwbytes_t data) {
+  batch_entry_t *b = &app->batch[app->batch_size++];
+  b->delivery = d;
+  b->data = data;
+  if (app->batch_size == 1) {
+    app->batch_start = clock_now_ns();
+  }
+  ++app->delivered;
+  /* the next delivery becomes current while this one waits for its batch */
+  pn_link_advance(l);
+  if (app->batch_size < app->profile->ack_batch && app->delivered != app->message_count) {
+    return;
+  }
+  {
+  /* the unprocessed deliveries are counted before the batch is flushed */
+  bool saturated = pn_link_queued(l) >= LIVE_PROFILE.credit / 2;
+  double lag;
+  flush_batch(app);
+  if (app->message_count && app->received >= app->message_count) {
+    return;
+  }
+  lag = lag_ms(&app->lag);
+  if (lag >= 0) {
+    if (app->profile == &LIVE_PROFILE && lag >= app->catchup_age_ms) {
+      set_profile(app, &BULK_PROFILE);
+    } else if (app->profile == &BULK_PROFILE && lag < app->catchup_age_ms / 2) {
+      set_profile(app, &LIVE_PROFILE);
+    }
+  } else if (app->profile == &LIVE_PROFILE) {
+    app->saturated = saturated ? app->saturated + 1 : 0;
+    if (app->saturated >= CATCHUP_SATURATED_COUNT) {
+      set_profile(app, &BULK_PROFILE);
+    }
+  }
+  top_up_credit(app, l, app->profile->credit);
+  }
+}
+
+/* Flushes a batch that did not fill in time, which means the backlog is drained */
+static void catchup_wake(app_data_t* app) {
+  bool idle = app->delivered == app->delivered_at_wake;
+  app->delivered_at_wake = app->delivered;
+  if (!app->receiver || pn_link_state(app->receiver) & PN_LOCAL_CLOSED) {
+    return;
+  }
+  if (app->batch_size > 0 && clock_now_ns() - app->batch_start >= CATCHUP_FLUSH_MS * 1000000ull) {
+    flush_batch(app);
+    idle = true;
+  }
+  /* the average trails an idle link, the last message shows whether the backlog is gone */
+  if (idle && app->profile == &BULK_PROFILE && app->lag.last_ms < (int64_t)app->catchup_age_ms / 2) {
+    set_profile(app, &LIVE_PROFILE);
+    top_up_credit(app, app->receiver, app->profile->credit);
+  }
+}
+
 /* Return true to continue, false to exit */
 static bool handle(app_data_t* app, pn_event_t* event) {
   switch (pn_event_type(event)) {
@@ -144,9 +386,12 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      }
      pn_connection_set_container(c, app->container_id);
      pn_connection_open(c);
+     app->connection = c;
    } break;
    
    case PN_CONNECTION_REMOTE_OPEN: {
+     report_connection_open(event, app->connect_start, app->ssl);
+     app->open_time = clock_now_ns();
      pn_connection_t* c = pn_event_connection(event);
      
      /* read amqp topic prefix from connection remote properties */
@@ -188,10 +433,14 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      /* set terminus fields to indicate a durable subscription */
      pn_terminus_set_expiry_policy(source, PN_EXPIRE_NEVER);
      pn_terminus_set_durability(source, PN_CONFIGURATION);
+     if (app->presettled) {
+       pn_link_set_snd_settle_mode(l, PN_SND_SETTLED);
+     }
      /* open link */
      pn_link_open(l);
+     app->receiver = l;
      /* cannot receive without granting credit: */
-     pn_link_flow(l, app->message_count ? app->message_count : BATCH);
+     top_up_credit(app, l, app->catchup ? app->profile->credit : app->credit);
      }
    } break;
 
@@ -215,21 +464,27 @@ static bool handle(app_data_t* app, pn_event_t* event) {
        } else if (recv < 0 && recv != PN_EOS) {        /* Unexpected error */
          pn_condition_format(pn_link_condition(l), "broker", "PN_DELIVERY error: %s", pn_code(recv));
          pn_link_close(l);               /* Unexpected error, close the link */
+       } else if (!pn_delivery_partial(d) && app->catchup) {
+         catchup_delivery(app, l, d, *m);
+         *m = pn_rwbytes_null;
        } else if (!pn_delivery_partial(d)) { /* Message is complete */
-         decode_message(*m);
+         if (!shed_expired(app, d, *m)) {
+           decode_message(app, *m);
+           /* Accept the delivery, unless the broker sent it settled */
+           if (!pn_delivery_settled(d)) {
+             pn_delivery_update(d, PN_ACCEPTED);
+           }
+         }
          *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
-         /* Accept the delivery */
-         pn_delivery_update(d, PN_ACCEPTED);
          pn_delivery_settle(d);  /* settle and free d */
-         if (app->message_count == 0) {
-           /* receive forever - see if more credit is needed */
-           if (pn_link_credit(l) < BATCH/2) {
-             /* Grant enough credit to bring it up to BATCH: */
-             pn_link_flow(l, BATCH - pn_link_credit(l));
-           }
-         } else if (++app->received >= app->message_count) {
+         ++app->delivered;
+         /* see if more credit is needed */
+         top_up_credit(app, l, app->credit);
+         if (app->message_count && ++app->received >= app->message_count) {
            pn_session_t *ssn = pn_link_session(l);
-           printf("%d messages received\n", app->received);
+           double secs = (clock_now_ns() - app->open_time) / 1e9;
+           printf("%d messages received in %.3f ms (%.0f msg/s)\n",
+                  app->received, secs * 1e3, secs > 0 ? app->received / secs : 0.0);
            pn_link_close(l);
            pn_session_close(ssn);
            pn_connection_close(pn_session_connection(ssn));
@@ -239,7 +494,35 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      break;
    }
 
+   case PN_PROACTOR_TIMEOUT:
+    /* close aggregation windows while no messages arrive */
+    if (app->aggregator) {
+      aggregator_tick(app->aggregator, clock_wall_ms());
+    }
+    if (app->lag_report_ms && clock_now_ns() >= app->next_lag_report) {
+      app->next_lag_report = clock_now_ns() + app->lag_report_ms * 1000000ull;
+      lag_report(stdout, app->subscription_name, &app->lag);
+    }
+    /* flush partial batches from the connection's own context */
+    if (app->catchup && app->connection && !app->finished) {
+      pn_connection_wake(app->connection);
+    }
+    if (app->timer_ms && !app->finished) {
+      pn_proactor_set_timeout(app->proactor, app->timer_ms);
+    }
+    break;
+
+   case PN_CONNECTION_WAKE:
+    if (app->catchup) {
+      catchup_wake(app);
+    }
+    break;
+
    case PN_TRANSPORT_CLOSED:
+    app->finished = true;
+    if (app->timer_ms) {
+      pn_proactor_cancel_timeout(app->proactor);
+    }
     check_condition(event, pn_transport_condition(pn_event_transport(event)));
     break;
 
@@ -269,7 +552,7 @@ static bool handle(app_data_t* app, pn_event_t* event) {
     return true;
 }
 
-void run(app_data_t *app) {
+static void run(app_data_t *app) {
   /* Loop and handle events */
   do {
     pn_event_batch_t *events = pn_proactor_wait(app->proactor);
@@ -283,7 +566,7 @@ void run(app_data_t *app) {
   } while(true);
 }
 
-void usage() {
+static void usage() {
     printf("Usage: dte_consumer [options] \n");
     printf("[Options]:\n");
     printf("\t-a      The host address [localhost]\n");
@@ -294,6 +577,23 @@ void usage() {
     printf("\t-i      Container id [dte_consumer:<pid>]\n");
     printf("\t-u      Client authentication username []\n");
     printf("\t-P      Client authentication password []\n");
+    printf("\t-g      Aggregate numeric application property <name>, or 'body', instead of printing messages []\n");
+    printf("\t-k      Group aggregates by application property <name> []\n");
+    printf("\t-w      Aggregation window in ms [1000]\n");
+    printf("\t-W      Aggregation window slide in ms, less than -w for sliding windows [-w]\n");
+    printf("\t-l      Record the latency of messages stamped by the sender\n");
+    printf("\t-B      Catch-up mode, drain a backlog with bulk credit, batched acks and no console output\n");
+    printf("\t-A      Lag estimate in ms that indicates a backlog, use with -B [5000]\n");
+    printf("\t-m      Report the lag estimate every <ms> []\n");
+    printf("\t-x      Shed expired messages without decoding them, settled as 'accept' or 'modify' []\n");
+    printf("\t-f      Credit window kept open on the link, without -B [-c, or 1000 for unlimited]\n");
+    printf("\t-d      Settlement, 'unsettled' accepts each message, 'presettled' asks the broker to send\n");
+    printf("\t        them settled, at most once [unsettled]\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-Y      Estimate the producer clock offset by exchanges with a producer serving <address>\n");
+    printf("\t        and correct the latency by it, implies -N 1000 []\n");
     printf("\t-h      Displays this message\n");
     exit(0);
 
@@ -307,7 +607,7 @@ void usage() {
 
 #define AMQP_TOPIC_PREFIX_LEN AMQP_TOPIC_PREFIX_SIZE -1
 
-void parse_args(int argc, char **argv, app_data_t *app) {
+static void parse_args(int argc, char **argv, app_data_t *app) {
     char c;
     char con_id[PN_MAX_ADDR];
     if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
@@ -317,12 +617,20 @@ void parse_args(int argc, char **argv, app_data_t *app) {
     /* initialize default values*/
     app->container_id = strdup(con_id); /* default to using argv[0] */
     app->host = "localhost";
-    app->port = "amqp";
+    app->port = NULL; /* amqp or amqps */
     app->subscription_name = "my_sub"; 
     app->amqp_address = "my_topic";
     app->message_count = 10;
     app->username = NULL;
     app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+    app->clock_address = NULL;
+    app->agg_config.window_ms = 1000;
+    app->agg_config.slots = 1;
+    app->agg_config.sink = stdout;
+    app->catchup_age_ms = 5000;
     
     /*
      * Set a default amqp topic prefix since broker do not always
@@ -335,7 +643,7 @@ void parse_args(int argc, char **argv, app_data_t *app) {
 
     /* command line options */
     opterr = 0;
-    while((c = getopt(argc, argv, "i:a:c:t:p:u:P:n:h")) != -1) {
+    while((c = getopt(argc, argv, "i:a:c:t:p:u:P:n:g:k:w:W:lBA:m:x:f:d:sC:Y:N:h")) != -1) {
         switch(c) {
         case 'h': usage(); break;
         case 'c':
@@ -356,13 +664,75 @@ void parse_args(int argc, char **argv, app_data_t *app) {
         case 'p': app->port = optarg; break;
         case 'u': app->username = optarg; break;
         case 'P': app->password = optarg; break;
+        case 'g': app->agg_config.field = optarg; break;
+        case 'k': app->agg_config.key = optarg; break;
+        case 'w':
+            app->agg_config.window_ms = strtoull(optarg, NULL, 10);
+            if (app->agg_config.window_ms == 0) usage();
+            break;
+        case 'W':
+            app->agg_config.slide_ms = strtoull(optarg, NULL, 10);
+            if (app->agg_config.slide_ms == 0) usage();
+            break;
+        case 'l': app->latency = true; break;
+        case 'B': app->catchup = true; break;
+        case 'A':
+            app->catchup_age_ms = strtoull(optarg, NULL, 10);
+            if (app->catchup_age_ms == 0) usage();
+            break;
+        case 'm':
+            app->lag_report_ms = atoi(optarg);
+            if (app->lag_report_ms == 0) usage();
+            break;
+        case 'x':
+            if (strcmp(optarg, "accept") == 0) app->expired_outcome = PN_ACCEPTED;
+            else if (strcmp(optarg, "modify") == 0) app->expired_outcome = PN_MODIFIED;
+            else usage();
+            break;
+        case 'f':
+            app->credit = atoi(optarg);
+            if (app->credit < 1) usage();
+            break;
+        case 'd':
+            if (strcmp(optarg, "unsettled") == 0) app->presettled = false;
+            else if (strcmp(optarg, "presettled") == 0) app->presettled = true;
+            else usage();
+            break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        case 'Y': app->clock_address = optarg; break;
         default: usage(); break;
         }
     }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (!app->credit) {
+        app->credit = app->message_count ? app->message_count : BATCH;
+    }
+    if (app->agg_config.slide_ms == 0) {
+        app->agg_config.slide_ms = app->agg_config.window_ms; /* tumbling */
+    }
+    if (app->agg_config.field && !(app->aggregator = aggregator(&app->agg_config))) {
+        fprintf(stderr, "Aggregation slide must divide the window length\n");
+        exit(1);
+    }
+    if (app->aggregator) {
+        app->timer_ms = app->agg_config.slide_ms;
+    }
+    if (app->catchup && (app->timer_ms == 0 || app->timer_ms > CATCHUP_FLUSH_MS)) {
+        app->timer_ms = CATCHUP_FLUSH_MS;
+    }
+    if (app->lag_report_ms && (app->timer_ms == 0 || app->timer_ms > app->lag_report_ms)) {
+        app->timer_ms = app->lag_report_ms;
+    }
 
 }
 
-int main(int argc, char **argv) {
+int dte_consumer_main(int argc, char **argv) {
     struct app_data_t app = {0};
     char addr[PN_MAX_ADDR];
 
@@ -370,19 +740,80 @@ int main(int argc, char **argv) {
 
     /* Create the proactor and connect */
     app.proactor = pn_proactor();
+    app.message = pn_message();
+    app.profile = &LIVE_PROFILE;
+    lag_init(&app.lag, LAG_ALPHA);
+    app.next_lag_report = clock_now_ns() + app.lag_report_ms * 1000000ull;
+    if (app.catchup) {
+        app.batch = (batch_entry_t*)calloc(BULK_PROFILE.ack_batch, sizeof(batch_entry_t));
+    }
     pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
     fprintf(stdout, "Connecting to host: %s\n", addr);
 
     /* Initialize Sasl transport */
     pn_transport_t *pnt = pn_transport();
     pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+        if (ssl_client_init(pnt, app.ssl_domain, app.host, app.port) < 0) {
+            exit(1);
+        }
+    }
 
+    app.connect_start = clock_now_ns();
     pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+    if (app.timer_ms) {
+        pn_proactor_set_timeout(app.proactor, app.timer_ms);
+    }
     fprintf(stdout, "waiting to receive %d messages from amqp address: %s\n", app.message_count, app.amqp_address);
+    if (app.clock_address) {
+        clocksync_init(&app.clock);
+        app.latency_recorder.clock = &app.clock;
+    }
+    if (app.clock_address && !app.probe_ms) {
+        app.probe_ms = 1000;
+    }
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        if (app.clock_address) {
+            probe.clock_mode = PROBE_CLOCK_QUERY;
+            probe.clock_address = app.clock_address;
+            probe.clock = &app.clock;
+        }
+        probe_start_sample(&app.probe, &probe);
+    }
     run(&app);
+    if (app.expired_outcome) {
+        printf("%d expired messages shed\n", app.expired);
+    }
+    if (app.lag_report_ms) {
+        lag_report(stdout, app.subscription_name, &app.lag);
+    }
+    if (app.latency) {
+        latency_report(stdout, &app.latency_recorder);
+    }
+    pn_message_free(app.message);
+    free(app.batch);
+    if (app.aggregator) {
+        /* flush the windows still open */
+        aggregator_tick(app.aggregator, clock_wall_ms() + app.agg_config.window_ms);
+        aggregator_free(app.aggregator);
+    }
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
     pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
     /* app cleanup */
+    if (app.clock_address) clocksync_free(&app.clock);
     str_free(app.container_id);
     str_free(app.amqp_address_prefix);
     return exit_code;
 }
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return dte_consumer_main(argc, argv);
+}
+#endif
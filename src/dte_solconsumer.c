@@ -22,6 +22,10 @@
  * This Sample demonstrates how to create a durable subscription
  * and consume messages using an AMQP receiver link with the 
  * solace amqp address prefix 'dsub://'. 
+ *
+ * -f sets the credit window kept open on the link, and -d presettled asks
+ * the broker to send the messages settled, at most once, with no
+ * dispositions to return.
  */
 
 #include <proton/connection.h>
@@ -33,12 +37,16 @@
 #include <proton/session.h>
 #include <proton/transport.h>
 #include <proton/sasl.h>
+#include <proton/ssl.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "aggregate.h"
+#include "latency.h"
+#include "probe.h"
 #include "util.h"
 
 typedef struct app_data_t {
@@ -49,8 +57,24 @@ typedef struct app_data_t {
   const char *amqp_address_prefix;
   const char *container_id;
   int message_count;
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+  const char *clock_address; /* clock offset exchange address, NULL for none */
+  clocksync_t clock;        /* producer clock offset estimate */
+  agg_config_t agg_config;  /* aggregation enabled when agg_config.field is set */
+  bool latency;             /* record the latency of stamped messages */
+  int credit;               /* credit window kept open on the link */
+  bool presettled;          /* ask the broker to send the messages settled */
 
   pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  aggregator_t *aggregator;
+  latency_recorder_t latency_recorder;
+  pn_message_t *message;    /* reused to decode each message */
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  uint64_t open_time;       /* clock_now_ns() at PN_CONNECTION_REMOTE_OPEN */
   int received;
   bool finished;
   pn_rwbytes_t msgin;       /* Partially received message */
@@ -60,6 +84,22 @@ static const int BATCH = 1000; /* Batch size for unlimited receive */
 
 static int exit_code = 0;
 
+/* Keeps the credit window open, never granting more than the messages left */
+static void top_up_credit(app_data_t* app, pn_link_t* l) {
+  int credit = pn_link_credit(l);
+  int grant = app->credit - credit;
+  if (credit >= app->credit / 2) {
+    return;
+  }
+  if (app->message_count) {
+    int remaining = app->message_count - app->received - credit;
+    if (grant > remaining) grant = remaining;
+  }
+  if (grant > 0) {
+    pn_link_flow(l, grant);
+  }
+}
+
 extern int optind;
 extern char* optarg;
 extern int optopt;
@@ -76,16 +116,26 @@ static void check_condition(pn_event_t *e, pn_condition_t *cond) {
   }
 }
 
-static void decode_message(pn_rwbytes_t data) {
-  pn_message_t *m = pn_message();
+static void decode_message(app_data_t* app, pn_rwbytes_t data) {
+  pn_message_t *m = app->message;
+  pn_message_clear(m);
   int err = pn_message_decode(m, data.start, data.size);
   if (!err) {
-    /* Print the decoded message */
-    pn_string_t *s = pn_string(NULL);
-    pn_inspect(pn_message_body(m), s);
-    printf("%s\n", pn_string_get(s));
-    pn_free(s);
-    pn_message_free(m);
+    if (app->latency) {
+      latency_record(&app->latency_recorder, m);
+    }
+    if (app->aggregator) {
+      /* only the window aggregates are written out */
+      uint64_t now = clock_wall_ms();
+      aggregator_tick(app->aggregator, now);
+      aggregator_add(app->aggregator, 0, m, now);
+    } else {
+      /* Print the decoded message */
+      pn_string_t *s = pn_string(NULL);
+      pn_inspect(pn_message_body(m), s);
+      printf("%s\n", pn_string_get(s));
+      pn_free(s);
+    }
     free(data.start);
   } else {
     fprintf(stderr, "decode_message: %s\n", pn_code(err));
@@ -109,6 +159,8 @@ static bool handle(app_data_t* app, pn_event_t* event) {
    } break;
    
    case PN_CONNECTION_REMOTE_OPEN: {
+     report_connection_open(event, app->connect_start, app->ssl);
+     app->open_time = clock_now_ns();
      pn_connection_t* c = pn_event_connection(event);
      pn_session_t* s = pn_session(c);
      pn_session_open(s);
@@ -138,9 +190,12 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      printf("Setting amqp link terminus address to: '%s'\n", amqp_address);
      /* set the topic on the subscription and durability */
      pn_terminus_set_address(pn_link_source(l), amqp_address);
+     if (app->presettled) {
+       pn_link_set_snd_settle_mode(l, PN_SND_SETTLED);
+     }
      pn_link_open(l);
      /* cannot receive without granting credit: */
-     pn_link_flow(l, app->message_count ? app->message_count : BATCH);
+     top_up_credit(app, l);
      }
    } break;
 
@@ -165,20 +220,21 @@ static bool handle(app_data_t* app, pn_event_t* event) {
          pn_condition_format(pn_link_condition(l), "broker", "PN_DELIVERY error: %s", pn_code(recv));
          pn_link_close(l);               /* Unexpected error, close the link */
        } else if (!pn_delivery_partial(d)) { /* Message is complete */
-         decode_message(*m);
+         decode_message(app, *m);
          *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
-         /* Accept the delivery */
-         pn_delivery_update(d, PN_ACCEPTED);
+         /* Accept the delivery, unless the broker sent it settled */
+         if (!pn_delivery_settled(d)) {
+           pn_delivery_update(d, PN_ACCEPTED);
+         }
          pn_delivery_settle(d);  /* settle and free d */
-         if (app->message_count == 0) {
-           /* receive forever - see if more credit is needed */
-           if (pn_link_credit(l) < BATCH/2) {
-             /* Grant enough credit to bring it up to BATCH: */
-             pn_link_flow(l, BATCH - pn_link_credit(l));
-           }
-         } else if (++app->received >= app->message_count) {
+         ++app->received;
+         /* see if more credit is needed */
+         top_up_credit(app, l);
+         if (app->message_count && app->received >= app->message_count) {
            pn_session_t *ssn = pn_link_session(l);
-           printf("%d messages received\n", app->received);
+           double secs = (clock_now_ns() - app->open_time) / 1e9;
+           printf("%d messages received in %.3f ms (%.0f msg/s)\n",
+                  app->received, secs * 1e3, secs > 0 ? app->received / secs : 0.0);
            pn_link_close(l);
            pn_session_close(ssn);
            pn_connection_close(pn_session_connection(ssn));
@@ -188,7 +244,21 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      break;
    }
 
+   case PN_PROACTOR_TIMEOUT:
+    /* close aggregation windows while no messages arrive */
+    if (app->aggregator) {
+      aggregator_tick(app->aggregator, clock_wall_ms());
+      if (!app->finished) {
+        pn_proactor_set_timeout(app->proactor, app->agg_config.slide_ms);
+      }
+    }
+    break;
+
    case PN_TRANSPORT_CLOSED:
+    app->finished = true;
+    if (app->aggregator) {
+      pn_proactor_cancel_timeout(app->proactor);
+    }
     check_condition(event, pn_transport_condition(pn_event_transport(event)));
     break;
 
@@ -218,7 +288,7 @@ static bool handle(app_data_t* app, pn_event_t* event) {
     return true;
 }
 
-void run(app_data_t *app) {
+static void run(app_data_t *app) {
   /* Loop and handle events */
   do {
     pn_event_batch_t *events = pn_proactor_wait(app->proactor);
@@ -232,7 +302,7 @@ void run(app_data_t *app) {
   } while(true);
 }
 
-void usage() {
+static void usage() {
     printf("Usage: dte_solconsumer [options] \n");
     printf("[Options]:\n");
     printf("\t-a      The host address [localhost]\n");
@@ -243,6 +313,19 @@ void usage() {
     printf("\t-i      Container name [dte_sol_consumer]\n");
     printf("\t-u      Client authentication username []\n");
     printf("\t-P      Client authentication password []\n");
+    printf("\t-g      Aggregate numeric application property <name>, or 'body', instead of printing messages []\n");
+    printf("\t-k      Group aggregates by application property <name> []\n");
+    printf("\t-w      Aggregation window in ms [1000]\n");
+    printf("\t-W      Aggregation window slide in ms, less than -w for sliding windows [-w]\n");
+    printf("\t-l      Record the latency of messages stamped by the sender\n");
+    printf("\t-f      Credit window kept open on the link [-c, or 1000 for unlimited]\n");
+    printf("\t-d      Settlement, 'unsettled' accepts each message, 'presettled' asks the broker to send\n");
+    printf("\t        them settled, at most once [unsettled]\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-Y      Estimate the producer clock offset by exchanges with a producer serving <address>\n");
+    printf("\t        and correct the latency by it, implies -N 1000 []\n");
     printf("\t-h      Displays this message\n");
     exit(0);
 
@@ -252,7 +335,7 @@ void usage() {
 
 #define AMQP_DURABLE_TOPIC_ENDPOINT_PREFIX DEFAULT_AMQP_DURABLE_TOPIC_ENDPOINT_PREFIX
 
-void parse_args(int argc, char **argv, app_data_t *app) {
+static void parse_args(int argc, char **argv, app_data_t *app) {
     char c;
     char con_id[PN_MAX_ADDR];
     if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
@@ -262,12 +345,19 @@ void parse_args(int argc, char **argv, app_data_t *app) {
     /* initialize default values*/
     app->container_id = strdup(con_id); /* default to using argv[0] */
     app->host = "localhost";
-    app->port = "amqp";
+    app->port = NULL; /* amqp or amqps */
     app->subscription_name = "my_sub"; 
     app->amqp_address = "my_topic";
     app->message_count = 10;
     app->username = NULL;
     app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+    app->clock_address = NULL;
+    app->agg_config.window_ms = 1000;
+    app->agg_config.slots = 1;
+    app->agg_config.sink = stdout;
 
     /*
      * The 'dsub://' is the address prefix for durable subscriptions for the
@@ -277,7 +367,7 @@ void parse_args(int argc, char **argv, app_data_t *app) {
 
     /* command line options */
     opterr = 0;
-    while((c = getopt(argc, argv, "i:a:c:t:p:u:P:n:h")) != -1) {
+    while((c = getopt(argc, argv, "i:a:c:t:p:u:P:n:g:k:w:W:lf:d:sC:Y:N:h")) != -1) {
         switch(c) {
         case 'h': usage(); break;
         case 'c':
@@ -298,13 +388,52 @@ void parse_args(int argc, char **argv, app_data_t *app) {
         case 'p': app->port = optarg; break;
         case 'u': app->username = optarg; break;
         case 'P': app->password = optarg; break;
+        case 'g': app->agg_config.field = optarg; break;
+        case 'k': app->agg_config.key = optarg; break;
+        case 'w':
+            app->agg_config.window_ms = strtoull(optarg, NULL, 10);
+            if (app->agg_config.window_ms == 0) usage();
+            break;
+        case 'W':
+            app->agg_config.slide_ms = strtoull(optarg, NULL, 10);
+            if (app->agg_config.slide_ms == 0) usage();
+            break;
+        case 'l': app->latency = true; break;
+        case 'f':
+            app->credit = atoi(optarg);
+            if (app->credit < 1) usage();
+            break;
+        case 'd':
+            if (strcmp(optarg, "unsettled") == 0) app->presettled = false;
+            else if (strcmp(optarg, "presettled") == 0) app->presettled = true;
+            else usage();
+            break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        case 'Y': app->clock_address = optarg; break;
         default: usage(); break;
         }
     }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (!app->credit) {
+        app->credit = app->message_count ? app->message_count : BATCH;
+    }
+    if (app->agg_config.slide_ms == 0) {
+        app->agg_config.slide_ms = app->agg_config.window_ms; /* tumbling */
+    }
+    if (app->agg_config.field && !(app->aggregator = aggregator(&app->agg_config))) {
+        fprintf(stderr, "Aggregation slide must divide the window length\n");
+        exit(1);
+    }
 
 }
 
-int main(int argc, char **argv) {
+int dte_solconsumer_main(int argc, char **argv) {
     struct app_data_t app = {0};
     char addr[PN_MAX_ADDR];
 
@@ -312,17 +441,65 @@ int main(int argc, char **argv) {
 
     /* Create the proactor and connect */
     app.proactor = pn_proactor();
+    app.message = pn_message();
     pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
     fprintf(stdout, "Connecting to host: %s\n", addr);
 
     /* Initialize Sasl transport */
     pn_transport_t *pnt = pn_transport();
     pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+        if (ssl_client_init(pnt, app.ssl_domain, app.host, app.port) < 0) {
+            exit(1);
+        }
+    }
 
+    app.connect_start = clock_now_ns();
     pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+    if (app.aggregator) {
+        pn_proactor_set_timeout(app.proactor, app.agg_config.slide_ms);
+    }
     fprintf(stdout, "waiting to receive %d messages from amqp address: %s\n", app.message_count, app.amqp_address);
+    if (app.clock_address) {
+        clocksync_init(&app.clock);
+        app.latency_recorder.clock = &app.clock;
+    }
+    if (app.clock_address && !app.probe_ms) {
+        app.probe_ms = 1000;
+    }
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        if (app.clock_address) {
+            probe.clock_mode = PROBE_CLOCK_QUERY;
+            probe.clock_address = app.clock_address;
+            probe.clock = &app.clock;
+        }
+        probe_start_sample(&app.probe, &probe);
+    }
     run(&app);
+    if (app.latency) {
+        latency_report(stdout, &app.latency_recorder);
+    }
+    pn_message_free(app.message);
+    if (app.aggregator) {
+        /* flush the windows still open */
+        aggregator_tick(app.aggregator, clock_wall_ms() + app.agg_config.window_ms);
+        aggregator_free(app.aggregator);
+    }
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
     pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
+    if (app.clock_address) clocksync_free(&app.clock);
     str_free(app.container_id);
     return exit_code;
 }
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return dte_solconsumer_main(argc, argv);
+}
+#endif
@@ -0,0 +1,632 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * faultproxy
+ *
+ * A TCP proxy to put between the samples and a broker to test recovery
+ * and tuning over a bad network. Every byte is forwarded unchanged, and
+ * the proxy can add latency and jitter, cap the bandwidth, stall the
+ * traffic, split writes into small pieces and reset every connection.
+ *
+ * The faults are set on the command line or changed over time by a script
+ * of lines "<ms since start> <command> [<value>]", where a command is one
+ * of latency, jitter, bandwidth, chunk, stall, reset, clear and exit:
+ *
+ *     0      latency 100
+ *     0      jitter 20
+ *     5000   reset
+ *     8000   stall 3000
+ *     15000  exit
+ *
+ * The proxy reports the time from each reset to the next accepted
+ * connection and the bytes each connection carried, so the cost of a
+ * failure shows as reconnect time and as bytes sent again.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define MAX_SESSIONS 64
+#define MAX_ACTIONS 256
+#define CHUNK_SIZE 16384
+#define QUEUE_MAX (4 * 1024 * 1024)   /* bytes held per direction before reads stop */
+#define CHUNK_GAP_NS 1000000ull       /* pause between the pieces of a split write */
+
+/* Bytes read from one side, waiting to be written to the other */
+typedef struct chunk_t {
+  struct chunk_t *next;
+  uint64_t due;             /* clock_now_ns() when it may be written */
+  size_t size;
+  size_t offset;            /* bytes already written */
+  char data[CHUNK_SIZE];
+} chunk_t;
+
+/* One direction of a proxied connection */
+typedef struct pipe_t {
+  int from, to;
+  chunk_t *head, *tail;
+  size_t queued;
+  uint64_t last_due;        /* chunks keep their order whatever the jitter */
+  uint64_t next_write;      /* clock_now_ns() of the next piece of a split write */
+  double tokens;            /* bandwidth allowance in bytes */
+  uint64_t refill;          /* clock_now_ns() of the last token refill */
+  bool blocked;             /* the last write would block, wait for POLLOUT */
+  bool eof;                 /* 'from' closed, shut 'to' down once the queue drains */
+  bool shut;
+  uint64_t bytes;
+} pipe_t;
+
+/* A client connection and its broker connection */
+typedef struct session_t {
+  int id;
+  bool used;
+  bool connecting;          /* waiting for the broker connection */
+  int client, broker;
+  pipe_t up;                /* client to broker */
+  pipe_t down;              /* broker to client */
+  uint64_t accepted;        /* clock_now_ns() */
+} session_t;
+
+/* The faults currently applied to every connection */
+typedef struct faults_t {
+  unsigned latency_ms;      /* added to every byte in each direction */
+  unsigned jitter_ms;       /* up to +/- this much on top of the latency */
+  uint64_t bandwidth;       /* bytes per second per direction, 0 for no cap */
+  size_t chunk;             /* largest write, 0 for no limit */
+  uint64_t stall_until;     /* clock_now_ns() until which nothing is written */
+} faults_t;
+
+typedef struct action_t {
+  uint64_t at_ms;
+  char command[16];
+  long long value;
+} action_t;
+
+typedef struct app_data_t {
+  const char *listen_port;
+  const char *host, *port;
+  const char *script;
+  faults_t faults;
+  action_t actions[MAX_ACTIONS];
+  int action_count;
+  int next_action;
+
+  struct sockaddr_storage broker_addr;
+  socklen_t broker_addr_len;
+  int listener;
+  session_t sessions[MAX_SESSIONS];
+  int next_id;
+  uint64_t start;           /* clock_now_ns() at startup */
+  uint64_t last_reset;      /* clock_now_ns() of the last reset, 0 before the first */
+  bool reconnect_pending;   /* no connection accepted since the last reset */
+  int resets;
+  uint64_t bytes_up, bytes_down;  /* forwarded by closed sessions */
+  uint64_t dropped;         /* bytes queued when their connection was reset */
+  uint64_t reconnect_ns;    /* sum of the reset to accept times */
+  int reconnects;
+} app_data_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+extern int optind;
+extern char* optarg;
+extern int optopt;
+extern int opterr;
+
+static void on_signal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+/* Prints a line prefixed with the ms since startup */
+static void report(app_data_t* app, const char* fmt, ...) {
+  va_list ap;
+  printf("[%10.1f] ", (clock_now_ns() - app->start) / 1e6);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+  fflush(stdout);
+}
+
+static void set_nonblocking(int fd) {
+  int one = 1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  /* small writes must leave as they are written for split writes to reach the peer split */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Closes a socket with a TCP reset instead of an orderly shutdown */
+static void close_reset(int fd) {
+  struct linger linger = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  close(fd);
+}
+
+static void pipe_init(pipe_t* p, int from, int to) {
+  memset(p, 0, sizeof(*p));
+  p->from = from;
+  p->to = to;
+  p->refill = clock_now_ns();
+}
+
+/* Frees the queue, returns the bytes it still held */
+static size_t pipe_clear(pipe_t* p) {
+  size_t dropped = 0;
+  while (p->head) {
+    chunk_t *c = p->head;
+    p->head = c->next;
+    dropped += c->size - c->offset;
+    free(c);
+  }
+  p->tail = NULL;
+  p->queued = 0;
+  return dropped;
+}
+
+static void session_close(app_data_t* app, session_t* s, bool reset) {
+  app->dropped += pipe_clear(&s->up) + pipe_clear(&s->down);
+  app->bytes_up += s->up.bytes;
+  app->bytes_down += s->down.bytes;
+  report(app, "connection %d closed after %.1f ms, %llu bytes up, %llu bytes down%s", s->id,
+         (clock_now_ns() - s->accepted) / 1e6, (unsigned long long)s->up.bytes,
+         (unsigned long long)s->down.bytes, reset ? ", reset" : "");
+  if (reset) {
+    close_reset(s->client);
+    close_reset(s->broker);
+  } else {
+    close(s->client);
+    close(s->broker);
+  }
+  s->used = false;
+}
+
+static void session_accept(app_data_t* app) {
+  int client = accept(app->listener, NULL, NULL);
+  session_t *s = NULL;
+  uint64_t now = clock_now_ns();
+  if (client < 0) {
+    return;
+  }
+  for (int i = 0; i < MAX_SESSIONS && !s; ++i) {
+    if (!app->sessions[i].used) s = &app->sessions[i];
+  }
+  if (!s) {
+    fprintf(stderr, "At most %d connections are supported\n", MAX_SESSIONS);
+    close(client);
+    return;
+  }
+  memset(s, 0, sizeof(*s));
+  s->id = ++app->next_id;
+  s->used = true;
+  s->accepted = now;
+  s->client = client;
+  s->broker = socket(app->broker_addr.ss_family, SOCK_STREAM, 0);
+  set_nonblocking(client);
+  set_nonblocking(s->broker);
+  pipe_init(&s->up, s->client, s->broker);
+  pipe_init(&s->down, s->broker, s->client);
+  if (app->reconnect_pending) {
+    app->reconnect_pending = false;
+    app->reconnect_ns += now - app->last_reset;
+    ++app->reconnects;
+    report(app, "connection %d accepted, reconnect after %.1f ms", s->id, (now - app->last_reset) / 1e6);
+  } else {
+    report(app, "connection %d accepted", s->id);
+  }
+  if (connect(s->broker, (struct sockaddr*)&app->broker_addr, app->broker_addr_len) < 0) {
+    if (errno != EINPROGRESS) {
+      report(app, "connection %d: broker connect failed: %s", s->id, strerror(errno));
+      session_close(app, s, true);
+      return;
+    }
+    s->connecting = true;
+  }
+}
+
+/* Reads what the socket has into the queue, stamped with the time it may be written */
+static int pipe_read(app_data_t* app, pipe_t* p) {
+  faults_t *f = &app->faults;
+  while (p->queued < QUEUE_MAX) {
+    chunk_t *c = (chunk_t*)malloc(sizeof(chunk_t));
+    ssize_t n = read(p->from, c->data, sizeof(c->data));
+    if (n <= 0) {
+      free(c);
+      if (n == 0) {
+        p->eof = true;
+        return 0;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    {
+    int64_t delay = (int64_t)f->latency_ms * 1000000;
+    if (f->jitter_ms) {
+      delay += ((int64_t)(rand() % (2 * f->jitter_ms + 1)) - f->jitter_ms) * 1000000;
+    }
+    c->due = clock_now_ns() + (delay > 0 ? (uint64_t)delay : 0);
+    if (c->due < p->last_due) c->due = p->last_due;
+    p->last_due = c->due;
+    }
+    c->size = (size_t)n;
+    c->offset = 0;
+    c->next = NULL;
+    if (p->tail) p->tail->next = c; else p->head = c;
+    p->tail = c;
+    p->queued += c->size;
+  }
+  return 0;
+}
+
+/*
+ * Writes the queued bytes that are due, within the bandwidth allowance and
+ * the chunk limit. Returns the clock_now_ns() at which it can write again,
+ * UINT64_MAX if it has nothing to write or waits for POLLOUT, or 0 on error.
+ * */
+static uint64_t pipe_write(app_data_t* app, pipe_t* p, uint64_t now) {
+  faults_t *f = &app->faults;
+  if (f->bandwidth) {
+    double burst = f->bandwidth / 20.0 > CHUNK_SIZE ? f->bandwidth / 20.0 : CHUNK_SIZE;
+    p->tokens += f->bandwidth * ((now - p->refill) / 1e9);
+    if (p->tokens > burst) p->tokens = burst;
+  }
+  p->refill = now;
+  while (p->head && !p->blocked) {
+    chunk_t *c = p->head;
+    size_t size = c->size - c->offset;
+    ssize_t n;
+    if (now < c->due) return c->due;
+    if (now < f->stall_until) return f->stall_until;
+    if (now < p->next_write) return p->next_write;
+    if (f->bandwidth) {
+      if (p->tokens < 1) {
+        return now + (uint64_t)((1 - p->tokens) / f->bandwidth * 1e9) + 1;
+      }
+      if (size > (size_t)p->tokens) size = (size_t)p->tokens;
+    }
+    if (f->chunk && size > f->chunk) size = f->chunk;
+    n = write(p->to, c->data + c->offset, size);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        p->blocked = true;
+        break;
+      }
+      return errno == EINTR ? now : 0;
+    }
+    c->offset += (size_t)n;
+    p->queued -= (size_t)n;
+    p->bytes += (uint64_t)n;
+    if (f->bandwidth) p->tokens -= n;
+    if (c->offset == c->size) {
+      p->head = c->next;
+      if (!p->head) p->tail = NULL;
+      free(c);
+    }
+    if (f->chunk) {
+      /* one piece at a time so the peer reads them apart */
+      p->next_write = now + CHUNK_GAP_NS;
+      return p->head ? p->next_write : UINT64_MAX;
+    }
+  }
+  if (!p->head && p->eof && !p->shut) {
+    shutdown(p->to, SHUT_WR);
+    p->shut = true;
+  }
+  return UINT64_MAX;
+}
+
+static void reset_all(app_data_t* app) {
+  int count = 0;
+  uint64_t dropped = app->dropped;
+  for (int i = 0; i < MAX_SESSIONS; ++i) {
+    if (app->sessions[i].used) {
+      session_close(app, &app->sessions[i], true);
+      ++count;
+    }
+  }
+  ++app->resets;
+  app->last_reset = clock_now_ns();
+  app->reconnect_pending = count > 0;
+  report(app, "reset %d connections, %llu bytes in flight dropped", count,
+         (unsigned long long)(app->dropped - dropped));
+}
+
+/* Runs the script actions that are due, returns false on exit */
+static bool run_script(app_data_t* app, uint64_t now) {
+  faults_t *f = &app->faults;
+  while (app->next_action < app->action_count) {
+    action_t *a = &app->actions[app->next_action];
+    if (now < app->start + a->at_ms * 1000000ull) {
+      break;
+    }
+    ++app->next_action;
+    if (strcmp(a->command, "latency") == 0) {
+      f->latency_ms = (unsigned)a->value;
+    } else if (strcmp(a->command, "jitter") == 0) {
+      f->jitter_ms = (unsigned)a->value;
+    } else if (strcmp(a->command, "bandwidth") == 0) {
+      f->bandwidth = (uint64_t)a->value;
+    } else if (strcmp(a->command, "chunk") == 0) {
+      f->chunk = (size_t)a->value;
+    } else if (strcmp(a->command, "stall") == 0) {
+      f->stall_until = now + (uint64_t)a->value * 1000000ull;
+    } else if (strcmp(a->command, "clear") == 0) {
+      memset(f, 0, sizeof(*f));
+    } else if (strcmp(a->command, "reset") == 0) {
+      reset_all(app);
+      continue;
+    } else if (strcmp(a->command, "exit") == 0) {
+      return false;
+    }
+    report(app, "%s %lld", a->command, a->value);
+  }
+  return true;
+}
+
+static void load_script(app_data_t* app) {
+  FILE *in = fopen(app->script, "r");
+  char line[256];
+  int number = 0;
+  if (!in) {
+    fprintf(stderr, "Unable to open script %s: %s\n", app->script, strerror(errno));
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), in)) {
+    action_t *a = &app->actions[app->action_count];
+    unsigned long long at;
+    int fields;
+    ++number;
+    if (line[strspn(line, " \t\r\n")] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+      continue;
+    }
+    if (app->action_count == MAX_ACTIONS) {
+      fprintf(stderr, "At most %d script actions are supported\n", MAX_ACTIONS);
+      exit(1);
+    }
+    a->value = 0;
+    fields = sscanf(line, "%llu %15s %lld", &at, a->command, &a->value);
+    if (fields < 2 || (app->action_count > 0 && at < app->actions[app->action_count - 1].at_ms)) {
+      fprintf(stderr, "%s:%d: expected '<ms> <command> [<value>]' in time order\n", app->script, number);
+      exit(1);
+    }
+    a->at_ms = at;
+    ++app->action_count;
+  }
+  fclose(in);
+}
+
+static int listen_on(const char* port) {
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((uint16_t)atoi(port));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    fprintf(stderr, "Unable to listen on port %s: %s\n", port, strerror(errno));
+    exit(1);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+static void resolve_broker(app_data_t* app) {
+  struct addrinfo hints, *res;
+  int rc;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rc = getaddrinfo(app->host, app->port, &hints, &res)) != 0) {
+    fprintf(stderr, "Unable to resolve %s:%s: %s\n", app->host, app->port, gai_strerror(rc));
+    exit(1);
+  }
+  memcpy(&app->broker_addr, res->ai_addr, res->ai_addrlen);
+  app->broker_addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+}
+
+/* Forwards until stopped or the script exits */
+static void run(app_data_t *app) {
+  struct pollfd fds[1 + 2 * MAX_SESSIONS];
+  session_t *owners[1 + 2 * MAX_SESSIONS];
+  bool client_side[1 + 2 * MAX_SESSIONS];
+  while (!stopping) {
+    uint64_t now = clock_now_ns();
+    uint64_t wake = UINT64_MAX;
+    int nfds = 1;
+    int timeout;
+    if (!run_script(app, now)) {
+      break;
+    }
+    if (app->next_action < app->action_count) {
+      wake = app->start + app->actions[app->next_action].at_ms * 1000000ull;
+    }
+    /* write what is due and collect what to wait for */
+    fds[0].fd = app->listener;
+    fds[0].events = POLLIN;
+    owners[0] = NULL;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+      session_t *s = &app->sessions[i];
+      if (!s->used) {
+        continue;
+      }
+      if (!s->connecting) {
+        uint64_t up = pipe_write(app, &s->up, now);
+        uint64_t down = pipe_write(app, &s->down, now);
+        if (up == 0 || down == 0) {
+          session_close(app, s, true);
+          continue;
+        }
+        if (s->up.shut && s->down.shut) {
+          session_close(app, s, false);
+          continue;
+        }
+        if (up < wake) wake = up;
+        if (down < wake) wake = down;
+      }
+      fds[nfds].events = (s->connecting || s->up.eof || s->up.queued >= QUEUE_MAX ? 0 : POLLIN)
+                       | (s->down.blocked ? POLLOUT : 0);
+      fds[nfds + 1].events = s->connecting ? POLLOUT
+                           : (s->down.eof || s->down.queued >= QUEUE_MAX ? 0 : POLLIN) | (s->up.blocked ? POLLOUT : 0);
+      for (int side = 0; side < 2; ++side, ++nfds) {
+        /* a socket with nothing to wait for would keep reporting its hang up */
+        fds[nfds].fd = fds[nfds].events ? (side == 0 ? s->client : s->broker) : -1;
+        owners[nfds] = s;
+        client_side[nfds] = side == 0;
+      }
+    }
+    now = clock_now_ns();
+    timeout = wake == UINT64_MAX ? 1000 : wake <= now ? 0 : (int)((wake - now + 999999) / 1000000);
+    if (timeout > 1000) timeout = 1000;
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      session_accept(app);
+    }
+    for (int i = 1; i < nfds; ++i) {
+      session_t *s = owners[i];
+      bool is_client = client_side[i];
+      if (!s->used || !fds[i].revents) {
+        continue;
+      }
+      if (s->connecting && !is_client) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->broker, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+          report(app, "connection %d: broker connect failed: %s", s->id, strerror(err));
+          session_close(app, s, true);
+        } else {
+          s->connecting = false;
+        }
+        continue;
+      }
+      if (fds[i].revents & POLLOUT) {
+        (is_client ? &s->down : &s->up)->blocked = false;
+      }
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (pipe_read(app, is_client ? &s->up : &s->down) < 0) {
+          /* pass a reset on to the other side */
+          session_close(app, s, true);
+        }
+      }
+    }
+  }
+}
+
+static void usage() {
+    printf("Usage: faultproxy [options] \n");
+    printf("[Options]:\n");
+    printf("\t-l      Port to listen on [5673]\n");
+    printf("\t-a      The broker host address [localhost]\n");
+    printf("\t-p      The broker port [5672]\n");
+    printf("\t-d      Latency in ms added in each direction [0]\n");
+    printf("\t-j      Jitter in ms, +/- on top of the latency [0]\n");
+    printf("\t-b      Bandwidth cap in bytes per second per direction, 0 for none [0]\n");
+    printf("\t-w      Largest write in bytes, splits the stream into pieces 1ms apart, 0 for none [0]\n");
+    printf("\t-f      Script of '<ms> <command> [<value>]' lines, commands are latency, jitter,\n");
+    printf("\t        bandwidth, chunk, stall <ms>, reset, clear and exit []\n");
+    printf("\t-h      Displays this message\n");
+    exit(0);
+
+}
+
+static void parse_args(int argc, char **argv, app_data_t *app) {
+    int c;
+    /* initialize default values*/
+    app->listen_port = "5673";
+    app->host = "localhost";
+    app->port = "5672";
+
+    /* command line options */
+    opterr = 0;
+    while((c = getopt(argc, argv, "l:a:p:d:j:b:w:f:h")) != -1) {
+        switch(c) {
+        case 'h': usage(); break;
+        case 'l': app->listen_port = optarg; break;
+        case 'a': app->host = optarg; break;
+        case 'p': app->port = optarg; break;
+        case 'd': app->faults.latency_ms = atoi(optarg); break;
+        case 'j': app->faults.jitter_ms = atoi(optarg); break;
+        case 'b': app->faults.bandwidth = strtoull(optarg, NULL, 10); break;
+        case 'w': app->faults.chunk = strtoul(optarg, NULL, 10); break;
+        case 'f': app->script = optarg; break;
+        default: usage(); break;
+        }
+    }
+    if (app->script) {
+        load_script(app);
+    }
+}
+
+int faultproxy_main(int argc, char **argv) {
+    static app_data_t app;
+
+    parse_args(argc, argv, &app);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    resolve_broker(&app);
+    app.listener = listen_on(app.listen_port);
+    app.start = clock_now_ns();
+    report(&app, "forwarding port %s to %s:%s", app.listen_port, app.host, app.port);
+
+    run(&app);
+
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (app.sessions[i].used) {
+            session_close(&app, &app.sessions[i], false);
+        }
+    }
+    close(app.listener);
+    report(&app, "%d connections, %d resets, %llu bytes up, %llu bytes down, %llu bytes dropped",
+           app.next_id, app.resets, (unsigned long long)app.bytes_up,
+           (unsigned long long)app.bytes_down, (unsigned long long)app.dropped);
+    if (app.reconnects) {
+        report(&app, "average reconnect %.1f ms over %d resets", app.reconnect_ns / 1e6 / app.reconnects,
+               app.reconnects);
+    }
+    return 0;
+}
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return faultproxy_main(argc, argv);
+}
+#endif
@@ -0,0 +1,104 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "hashring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a with a final avalanche so similar keys spread over the ring */
+static uint32_t ring_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int point_compare(const void *a, const void *b) {
+    const hashring_point_t *pa = (const hashring_point_t*)a;
+    const hashring_point_t *pb = (const hashring_point_t*)b;
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    /* equal hashes are rare, order them by node so lookups are deterministic */
+    return pa->node - pb->node;
+}
+
+void hashring_init(hashring_t *ring) {
+    memset(ring, 0, sizeof(*ring));
+}
+
+void hashring_free(hashring_t *ring) {
+    free(ring->points);
+    memset(ring, 0, sizeof(*ring));
+}
+
+void hashring_add(hashring_t *ring, int node, const char *name, int vnodes) {
+    if (ring->count + vnodes > ring->capacity) {
+        ring->capacity = (ring->count + vnodes) * 2;
+        ring->points = (hashring_point_t*)realloc(ring->points, ring->capacity * sizeof(hashring_point_t));
+    }
+    for (int i = 0; i < vnodes; ++i) {
+        char point[256];
+        snprintf(point, sizeof(point), "%s#%d", name, i);
+        ring->points[ring->count].hash = ring_hash(point);
+        ring->points[ring->count].node = node;
+        ++ring->count;
+    }
+    qsort(ring->points, ring->count, sizeof(hashring_point_t), point_compare);
+}
+
+void hashring_remove(hashring_t *ring, int node) {
+    size_t kept = 0;
+    for (size_t i = 0; i < ring->count; ++i) {
+        if (ring->points[i].node != node) {
+            ring->points[kept++] = ring->points[i];
+        }
+    }
+    ring->count = kept;
+}
+
+int hashring_lookup(const hashring_t *ring, const char *key) {
+    if (ring->count == 0) {
+        return -1;
+    }
+    uint32_t h = ring_hash(key);
+    size_t lo = 0, hi = ring->count;
+    /* first point at or after h */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    /* past the last point wraps around to the first */
+    return ring->points[lo == ring->count ? 0 : lo].node;
+}
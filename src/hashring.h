@@ -0,0 +1,60 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef HASHRING_H
+#define HASHRING_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Consistent hash ring.
+ *
+ * Each node is placed on the ring at several virtual points and a key
+ * belongs to the node of the first point at or after the key's hash. Adding
+ * or removing a node only moves the keys of the points it gains or loses,
+ * every other key keeps its node.
+ */
+
+typedef struct hashring_point_t {
+    uint32_t hash;
+    int node;
+} hashring_point_t;
+
+typedef struct hashring_t {
+    hashring_point_t *points;   /* sorted by hash */
+    size_t count;
+    size_t capacity;
+} hashring_t;
+
+void hashring_init(hashring_t *ring);
+void hashring_free(hashring_t *ring);
+
+/* Places a node at 'vnodes' points derived from its name */
+void hashring_add(hashring_t *ring, int node, const char *name, int vnodes);
+
+/* Removes every point of a node */
+void hashring_remove(hashring_t *ring, int node);
+
+/* Returns the node a key belongs to, or -1 for an empty ring */
+int hashring_lookup(const hashring_t *ring, const char *key);
+
+#endif /* hashring.h */
@@ -0,0 +1,88 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "lag.h"
+#include "latency.h"
+#include "util.h"
+
+#include <proton/codec.h>
+
+void lag_init(lag_estimator_t *lag, double alpha) {
+    lag->alpha = alpha;
+    lag->ewma_ms = 0;
+    lag->last_ms = -1;
+    lag->max_ms = -1;
+    lag->samples = 0;
+    lag->untimed = 0;
+}
+
+int64_t lag_message_age_ms(pn_message_t *message) {
+    pn_timestamp_t created = pn_message_get_creation_time(message);
+    pn_data_t *properties;
+    int64_t age;
+    if (created > 0) {
+        return lag_age_ms(created, (int64_t)clock_wall_ms());
+    }
+    properties = pn_message_properties(message);
+    if (!data_map_find(properties, LATENCY_STAMP_KEY) || pn_data_type(properties) != PN_LONG) {
+        return -1;
+    }
+    age = ((int64_t)clock_wall_us() - pn_data_get_long(properties)) / 1000;
+    return age < 0 ? 0 : age;
+}
+
+int64_t lag_age_ms(int64_t producer_ms, int64_t now_ms) {
+    if (producer_ms <= 0) {
+        return -1;
+    }
+    /* a producer clock ahead of ours is skew, not negative lag */
+    return now_ms < producer_ms ? 0 : now_ms - producer_ms;
+}
+
+void lag_add(lag_estimator_t *lag, int64_t age_ms) {
+    if (age_ms < 0) {
+        ++lag->untimed;
+        return;
+    }
+    /* the first message seeds the average */
+    lag->ewma_ms = lag->samples ? lag->ewma_ms + lag->alpha * (age_ms - lag->ewma_ms) : (double)age_ms;
+    lag->last_ms = age_ms;
+    if (age_ms > lag->max_ms) lag->max_ms = age_ms;
+    ++lag->samples;
+}
+
+bool lag_observe(lag_estimator_t *lag, pn_message_t *message) {
+    int64_t age = lag_message_age_ms(message);
+    lag_add(lag, age);
+    return age >= 0;
+}
+
+double lag_ms(const lag_estimator_t *lag) {
+    return lag->samples ? lag->ewma_ms : -1;
+}
+
+void lag_report(FILE *out, const char *name, lag_estimator_t *lag) {
+    fprintf(out, "lag name=%s ewma_ms=%.1f last_ms=%lld max_ms=%lld samples=%llu untimed=%llu\n",
+            name, lag_ms(lag), (long long)lag->last_ms, (long long)lag->max_ms,
+            (unsigned long long)lag->samples, (unsigned long long)lag->untimed);
+    fflush(out);
+    lag->max_ms = -1;
+}
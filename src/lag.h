@@ -0,0 +1,78 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+
+#ifndef LAG_H
+#define LAG_H 1
+
+#include <proton/message.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Consumer lag estimate.
+ *
+ * The lag of a message is the local receive time less its producer time,
+ * the creation time or else the LATENCY_STAMP_KEY stamp. The estimate is
+ * an exponentially weighted moving average of the lag of every timed
+ * message, so a single late message does not flip a decision while a
+ * growing backlog shows within a few tens of messages. Lags below zero
+ * are clock skew between the hosts and count as zero.
+ */
+
+#define LAG_ALPHA 0.05      /* weight of each new message in the average */
+
+typedef struct lag_estimator_t {
+    double alpha;
+    double ewma_ms;         /* smoothed lag, valid once samples > 0 */
+    int64_t last_ms;        /* lag of the last timed message */
+    int64_t max_ms;         /* largest lag since the last report */
+    uint64_t samples;       /* timed messages */
+    uint64_t untimed;       /* messages without a producer time */
+} lag_estimator_t;
+
+void lag_init(lag_estimator_t *lag, double alpha);
+
+/* Returns the age in ms of a message against the local wall clock, -1 if it carries no producer time */
+int64_t lag_message_age_ms(pn_message_t *message);
+
+/* Returns the age in ms of a producer time against now_ms, -1 if producer_ms is not set */
+int64_t lag_age_ms(int64_t producer_ms, int64_t now_ms);
+
+/* Adds the age of a message from lag_message_age_ms() to the estimate, -1 counts as untimed */
+void lag_add(lag_estimator_t *lag, int64_t age_ms);
+
+/* Adds a decoded message to the estimate, returns false if it carries no producer time */
+bool lag_observe(lag_estimator_t *lag, pn_message_t *message);
+
+/* Returns the smoothed lag in ms, -1 before the first timed message */
+double lag_ms(const lag_estimator_t *lag);
+
+/*
+ * Writes the estimate as one metric line, for example
+ * "lag name=my_sub ewma_ms=12.5 last_ms=10 max_ms=40 samples=1000 untimed=0",
+ * and starts a new interval for max_ms.
+ * */
+void lag_report(FILE *out, const char *name, lag_estimator_t *lag);
+
+#endif /* lag.h */
@@ -0,0 +1,244 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "latency.h"
+#include "clocksync.h"
+#include "util.h"
+
+#include <proton/codec.h>
+#include <proton/message.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int latency_sampler_parse(latency_sampler_t *sampler, const char *spec) {
+    char *end = NULL;
+    unsigned long long n = strtoull(spec, &end, 10);
+    memset(sampler, 0, sizeof(*sampler));
+    if (end == spec || n == 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        sampler->interval_ns = n * 1000000ull;
+    } else if (*end == '\0') {
+        sampler->every_n = n;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+bool latency_sample(latency_sampler_t *sampler) {
+    if (sampler->every_n) {
+        return sampler->count++ % sampler->every_n == 0;
+    }
+    uint64_t now = clock_now_ns();
+    if (now >= sampler->next_ns) {
+        sampler->next_ns = now + sampler->interval_ns;
+        return true;
+    }
+    return false;
+}
+
+void latency_stamp(pn_message_t *message) {
+    pn_data_t *properties = message_properties_append(message);
+    if (properties) {
+        pn_data_put_string(properties, pn_bytes(sizeof(LATENCY_STAMP_KEY) - 1, LATENCY_STAMP_KEY));
+        pn_data_put_long(properties, (int64_t)clock_wall_us());
+        pn_data_exit(properties);
+    }
+}
+
+static int bucket_index(uint64_t value) {
+    if (value < LATENCY_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);   /* >= 4 */
+    int sub = (int)((value >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return LATENCY_SUB_BUCKETS + (exponent - 4) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/* Returns the middle of the value range of a bucket */
+static uint64_t bucket_value(int index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int exponent = (index - LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS + 4;
+    uint64_t sub = (uint64_t)((index - LATENCY_SUB_BUCKETS) % LATENCY_SUB_BUCKETS);
+    uint64_t width = 1ull << (exponent - 4);
+    return (LATENCY_SUB_BUCKETS + sub) * width + width / 2;
+}
+
+void latency_histogram_record(latency_histogram_t *h, uint64_t value) {
+    ++h->buckets[bucket_index(value)];
+    if (h->count == 0 || value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+    ++h->count;
+    h->sum += (double)value;
+    h->sum_squares += (double)value * (double)value;
+}
+
+void latency_histogram_merge(latency_histogram_t *to, const latency_histogram_t *from) {
+    if (from->count == 0) {
+        return;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        to->buckets[i] += from->buckets[i];
+    }
+    if (to->count == 0 || from->min < to->min) to->min = from->min;
+    if (from->max > to->max) to->max = from->max;
+    to->count += from->count;
+    to->sum += from->sum;
+    to->sum_squares += from->sum_squares;
+}
+
+/* Returns the value of the sample with 1-based rank */
+static uint64_t value_at_rank(const latency_histogram_t *h, uint64_t rank) {
+    uint64_t seen = 0;
+    if (rank >= h->count) {
+        return h->max;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            return v > h->max ? h->max : v < h->min ? h->min : v;
+        }
+    }
+    return h->max;
+}
+
+uint64_t latency_histogram_quantile(const latency_histogram_t *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    return value_at_rank(h, (uint64_t)ceil(q * h->count));
+}
+
+/* Returns the send time stamp of a message, -1 if it carries none */
+static int64_t message_stamp_us(pn_message_t *message) {
+    pn_data_t *properties = pn_message_properties(message);
+    if (!data_map_find(properties, LATENCY_STAMP_KEY) || pn_data_type(properties) != PN_LONG) {
+        return -1;
+    }
+    return pn_data_get_long(properties);
+}
+
+int64_t latency_message_us(pn_message_t *message) {
+    int64_t sent = message_stamp_us(message);
+    if (sent < 0) {
+        return -1;
+    }
+    int64_t latency = (int64_t)clock_wall_us() - sent;
+    return latency > 0 ? latency : 0;
+}
+
+int latency_record(latency_recorder_t *recorder, pn_message_t *message) {
+    int64_t sent = message_stamp_us(message);
+    int64_t now = (int64_t)clock_wall_us();
+    double offset, bound, latency;
+    ++recorder->messages;
+    if (sent < 0) {
+        return 0;
+    }
+    latency = (double)(now - sent);
+    if (recorder->clock && clocksync_offset(recorder->clock, now, &offset, &bound)) {
+        /* the stamp reads the producer clock, offset ahead of ours */
+        latency += offset;
+        ++recorder->corrected;
+        if (bound > recorder->bound_us) recorder->bound_us = bound;
+    }
+    latency_histogram_record(&recorder->histogram, latency > 0 ? (uint64_t)latency : 0);
+    return 1;
+}
+
+void latency_histogram_report(FILE *out, const char *name, const char *unit, const latency_histogram_t *h) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *labels[] = { "p50", "p90", "p99", "p99.9" };
+    static const double z = 1.96;   /* 95% confidence */
+    double n = (double)h->count;
+    if (h->count == 0) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+    double mean = h->sum / n;
+    double variance = h->count > 1 ? (h->sum_squares - n * mean * mean) / (n - 1) : 0;
+    double mean_error = z * sqrt(variance > 0 ? variance : 0) / sqrt(n);
+    fprintf(out, "%s: %llu samples, mean %.1f %s +/- %.1f, min %llu %s, max %llu %s\n",
+            name, (unsigned long long)h->count, mean, unit, mean_error,
+            (unsigned long long)h->min, unit, (unsigned long long)h->max, unit);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+        /* the rank of a sample quantile is binomial, bound it by +/- z standard deviations */
+        double q = quantiles[i];
+        double rank = ceil(q * n);
+        double spread = z * sqrt(n * q * (1 - q));
+        uint64_t lo = rank - spread < 1 ? 1 : (uint64_t)(rank - spread);
+        uint64_t hi = rank + spread > n ? h->count : (uint64_t)ceil(rank + spread);
+        fprintf(out, "%s:   %-5s %llu %s [%llu, %llu]%s\n", name, labels[i],
+                (unsigned long long)value_at_rank(h, (uint64_t)rank), unit,
+                (unsigned long long)value_at_rank(h, lo), (unsigned long long)value_at_rank(h, hi),
+                n * (1 - q) < 10 ? " too few samples" : "");
+    }
+}
+
+void latency_report(FILE *out, const latency_recorder_t *recorder) {
+    fprintf(out, "latency sampled %llu of %llu messages (%.3f%%)\n",
+            (unsigned long long)recorder->histogram.count, (unsigned long long)recorder->messages,
+            recorder->messages ? 100.0 * recorder->histogram.count / recorder->messages : 0.0);
+    if (recorder->clock) {
+        fprintf(out, "latency corrected for the producer clock offset on %llu samples, error bound up to %.1f us\n",
+                (unsigned long long)recorder->corrected, recorder->bound_us);
+    }
+    latency_histogram_report(out, "latency", "us", &recorder->histogram);
+}
+
+static const char *const send_stage_names[LATENCY_SEND_STAGES] = {
+    "total", "credit wait", "dispatch", "encode", "link send",
+    "transport write", "broker ack", "settle"
+};
+
+static const char *const recv_stage_names[LATENCY_RECV_STAGES] = {
+    "total", "transfer", "decode", "processing", "settle"
+};
+
+void latency_stages_init(latency_stages_t *stages, bool sender) {
+    memset(stages, 0, sizeof(*stages));
+    stages->count = sender ? LATENCY_SEND_STAGES : LATENCY_RECV_STAGES;
+    stages->names = sender ? send_stage_names : recv_stage_names;
+}
+
+void latency_stages_record(latency_stages_t *stages, const latency_trace_t *trace) {
+    uint64_t previous = trace->at[0];
+    for (int i = 1; i < stages->count; ++i) {
+        uint64_t at = trace->at[i] > previous ? trace->at[i] : previous;
+        latency_histogram_record(&stages->histograms[i], at - previous);
+        previous = at;
+    }
+    latency_histogram_record(&stages->histograms[0], previous - trace->at[0]);
+}
+
+void latency_stages_report(FILE *out, const latency_stages_t *stages) {
+    for (int i = 1; i < stages->count; ++i) {
+        latency_histogram_report(out, stages->names[i], "ns", &stages->histograms[i]);
+    }
+    latency_histogram_report(out, stages->names[0], "ns", &stages->histograms[0]);
+}
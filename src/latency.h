@@ -0,0 +1,174 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H 1
+
+#include <proton/message.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+/*
+ * Sampled end to end latency measurement.
+ *
+ * Producers stamp only a sample of their messages with the send time in
+ * the LATENCY_STAMP_KEY application property, the presence of the
+ * property is the sample bit. Consumers record only stamped messages, so
+ * the measurement cost stays constant however high the message rate.
+ */
+
+#define LATENCY_STAMP_KEY "lat-ts"  /* wall clock send time in us */
+
+/* log-linear buckets: 16 exact buckets then 16 sub buckets per power of two */
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS + 60 * LATENCY_SUB_BUCKETS)
+
+/*
+ * Stages a sampled message passes through, a trace holds the clock_now_ns()
+ * reading taken at each stage and the stage histograms attribute the time
+ * between consecutive stages.
+ */
+#define LATENCY_MAX_STAGES 8
+
+/* Sender stages, in order */
+typedef enum {
+    LATENCY_SEND_ENQUEUE,           /* the application queued the message */
+    LATENCY_SEND_CREDIT,            /* link credit became available for it */
+    LATENCY_SEND_ENCODE_START,
+    LATENCY_SEND_ENCODE_END,
+    LATENCY_SEND_LINK_SEND,         /* pn_link_send() returned */
+    LATENCY_SEND_TRANSPORT_WRITE,   /* the event batch was handed back for writing */
+    LATENCY_SEND_REMOTE_DISPOSITION,
+    LATENCY_SEND_SETTLE,
+    LATENCY_SEND_STAGES
+} latency_send_stage_t;
+
+/* Receiver stages, in order */
+typedef enum {
+    LATENCY_RECV_TRANSPORT_READ,    /* first bytes of the delivery were read */
+    LATENCY_RECV_DELIVERY_COMPLETE,
+    LATENCY_RECV_DECODE,
+    LATENCY_RECV_PROCESSED,
+    LATENCY_RECV_SETTLE,
+    LATENCY_RECV_STAGES
+} latency_recv_stage_t;
+
+typedef struct latency_trace_t {
+    uint64_t at[LATENCY_MAX_STAGES];
+    struct latency_trace_t *next;   /* free for use by the owner, eg. a pending list */
+} latency_trace_t;
+
+/* Chooses which messages a producer stamps */
+typedef struct latency_sampler_t {
+    uint64_t every_n;       /* stamp 1 in every_n messages, 0 when time based */
+    uint64_t interval_ns;   /* stamp at most one message per interval */
+    uint64_t count;
+    uint64_t next_ns;
+} latency_sampler_t;
+
+/* Latency histogram, values are accurate to about 6% */
+typedef struct latency_histogram_t {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t min, max;
+    double sum, sum_squares;
+} latency_histogram_t;
+
+struct clocksync_t;
+
+/* Consumer side recorder of stamped messages */
+typedef struct latency_recorder_t {
+    latency_histogram_t histogram;
+    uint64_t messages;      /* all messages seen, stamped or not */
+    struct clocksync_t *clock; /* producer clock offset estimate, NULL when the clocks agree */
+    uint64_t corrected;     /* stamps corrected by the clock offset estimate */
+    double bound_us;        /* largest error bound of a correction */
+} latency_recorder_t;
+
+/* Per-stage histograms in ns, histogram 0 is the total from the first to the last stage */
+typedef struct latency_stages_t {
+    int count;
+    const char *const *names;
+    latency_histogram_t histograms[LATENCY_MAX_STAGES];
+} latency_stages_t;
+
+/*
+ * Parses a sample specification: '<n>' stamps one in n messages ('1'
+ * stamps every message) and '<n>ms' stamps at most one message every n
+ * milliseconds.
+ * @returns: 0 on success or -1 for an invalid specification
+ * */
+int latency_sampler_parse(latency_sampler_t *sampler, const char *spec);
+
+/* Returns true if the next message should be stamped, call once per message */
+bool latency_sample(latency_sampler_t *sampler);
+
+/* Adds the send time stamp to a message before it is encoded */
+void latency_stamp(pn_message_t *message);
+
+void latency_histogram_record(latency_histogram_t *h, uint64_t value);
+
+/* Adds the counts of 'from' to 'to' */
+void latency_histogram_merge(latency_histogram_t *to, const latency_histogram_t *from);
+
+/* Returns the value at quantile q (0 to 1) */
+uint64_t latency_histogram_quantile(const latency_histogram_t *h, double q);
+
+/* Returns the latency in us of a decoded message, or -1 if it carries no stamp */
+int64_t latency_message_us(pn_message_t *message);
+
+/*
+ * Records the latency of a decoded message if it carries a stamp. With a
+ * clock offset estimate the stamp is moved to the local clock first.
+ * @returns: 1 if the message was stamped and recorded, 0 otherwise
+ * */
+int latency_record(latency_recorder_t *recorder, pn_message_t *message);
+
+/*
+ * Prints a histogram summary: count, mean with the 95% confidence
+ * interval of the mean, and p50/p90/p99/p99.9 with the 95% confidence
+ * interval of each quantile as estimated from a sample of this size.
+ * */
+void latency_histogram_report(FILE *out, const char *name, const char *unit, const latency_histogram_t *h);
+
+/* Prints the sampling ratio, the clock correction and the histogram summary */
+void latency_report(FILE *out, const latency_recorder_t *recorder);
+
+/* Marks a trace stage with the current time */
+#define latency_trace_mark(trace, stage) ((trace)->at[(stage)] = clock_now_ns())
+
+/* Prepares the stage histograms for LATENCY_SEND_STAGES or LATENCY_RECV_STAGES */
+void latency_stages_init(latency_stages_t *stages, bool sender);
+
+/*
+ * Records the time between consecutive stages of a complete trace.
+ * A stage that was not marked takes the time of the stage before it.
+ * */
+void latency_stages_record(latency_stages_t *stages, const latency_trace_t *trace);
+
+/* Prints the histogram summary of every stage and the total */
+void latency_stages_report(FILE *out, const latency_stages_t *stages);
+
+#endif /* latency.h */
@@ -0,0 +1,622 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * merge_consumer
+ *
+ * This Sample demonstrates receiving from several queues or topics,
+ * possibly on different brokers, and emitting a single stream ordered
+ * by message creation time.
+ *
+ * Each source keeps a bounded lookahead window of decoded messages and
+ * is only granted credit for the free space in its window, so a fast
+ * source cannot use unbounded memory while a slow one catches up.
+ * A min-heap of the source heads performs the k-way merge and a
+ * message is emitted once it is at or below the watermark: the oldest
+ * timestamp any active source could still deliver. A source that has
+ * been silent for longer than the allowed lateness is considered idle
+ * and no longer holds the watermark back.
+ *
+ * With -d presettled the brokers are asked to send the messages settled,
+ * at most once, and the emitted messages are not accepted.
+ */
+
+#include <proton/connection.h>
+#include <proton/condition.h>
+#include <proton/delivery.h>
+#include <proton/link.h>
+#include <proton/message.h>
+#include <proton/proactor.h>
+#include <proton/session.h>
+#include <proton/transport.h>
+#include <proton/sasl.h>
+#include <proton/ssl.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "probe.h"
+#include "util.h"
+
+#define MAX_SOURCES 16
+
+/* A decoded message waiting in a source lookahead window */
+typedef struct pending_t {
+  pn_message_t *message;
+  pn_delivery_t *delivery;
+  pn_timestamp_t timestamp;
+} pending_t;
+
+/* A queue or topic subscription that is merged into the output stream */
+typedef struct source_t {
+  const char *address;
+  const char *host, *port;
+  int index;
+  pn_connection_t *connection;
+  pn_link_t *link;
+  uint64_t connect_start;     /* clock_now_ns() before connecting */
+
+  pending_t *window;          /* ring buffer of window_size messages */
+  int head, count;
+  pn_delivery_t **done;       /* emitted deliveries to settle on the source connection */
+  int done_count;
+  pn_rwbytes_t msgin;         /* Partially received message */
+
+  pn_timestamp_t last_timestamp; /* newest timestamp received, sources deliver in order */
+  uint64_t last_arrival;      /* clock_now_ns() of the last message received */
+  int received;
+  int max_buffered;
+  bool closed;
+} source_t;
+
+typedef struct app_data_t {
+  const char *host, *port;
+  const char *username, *password;
+  const char *container_id;
+  int message_count;
+  int window_size;            /* lookahead window per source */
+  int lateness_ms;            /* silence before a source no longer holds the watermark */
+  bool presettled;            /* ask the brokers to send the messages settled */
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+
+  pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  source_t sources[MAX_SOURCES];
+  int source_count;
+  int heap[MAX_SOURCES];      /* min-heap of source indexes by head timestamp */
+  int heap_size;
+
+  pn_timestamp_t last_emitted;
+  int emitted;
+  int out_of_order;           /* emitted behind an earlier message, arrived too late */
+  bool finished;
+} app_data_t;
+
+static int exit_code = 0;
+
+extern int optind;
+extern char* optarg;
+extern int optopt;
+extern int opterr;
+
+#define str_free(strptr) free((void *)strptr)
+
+static void check_condition(pn_event_t *e, pn_condition_t *cond) {
+  if (pn_condition_is_set(cond)) {
+    fprintf(stderr, "%s: %s: %s\n", pn_event_type_name(pn_event_type(e)),
+            pn_condition_get_name(cond), pn_condition_get_description(cond));
+    pn_connection_close(pn_event_connection(e));
+    exit_code = 1;
+  }
+}
+
+static pn_timestamp_t head_timestamp(app_data_t *app, int source) {
+  source_t *s = &app->sources[source];
+  return s->window[s->head].timestamp;
+}
+
+static void heap_swap(app_data_t *app, int i, int j) {
+  int t = app->heap[i];
+  app->heap[i] = app->heap[j];
+  app->heap[j] = t;
+}
+
+static void heap_sift_up(app_data_t *app, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (head_timestamp(app, app->heap[parent]) <= head_timestamp(app, app->heap[i])) break;
+    heap_swap(app, i, parent);
+    i = parent;
+  }
+}
+
+static void heap_sift_down(app_data_t *app, int i) {
+  for (;;) {
+    int l = 2 * i + 1, r = l + 1, min = i;
+    if (l < app->heap_size && head_timestamp(app, app->heap[l]) < head_timestamp(app, app->heap[min])) min = l;
+    if (r < app->heap_size && head_timestamp(app, app->heap[r]) < head_timestamp(app, app->heap[min])) min = r;
+    if (min == i) break;
+    heap_swap(app, i, min);
+    i = min;
+  }
+}
+
+/* Adds a decoded message to the source window, the source joins the heap when its window was empty */
+static void source_push(app_data_t *app, source_t *s, pn_message_t *m, pn_delivery_t *d) {
+  pending_t *p = &s->window[(s->head + s->count) % app->window_size];
+  p->message = m;
+  p->delivery = d;
+  p->timestamp = pn_message_get_creation_time(m);
+  if (p->timestamp == 0) {
+    /* no producer timestamp, order by arrival */
+    p->timestamp = (pn_timestamp_t)(clock_now_ns() / 1000000);
+  }
+  if (p->timestamp > s->last_timestamp) {
+    s->last_timestamp = p->timestamp;
+  }
+  s->last_arrival = clock_now_ns();
+  if (++s->count > s->max_buffered) {
+    s->max_buffered = s->count;
+  }
+  if (s->count == 1) {
+    app->heap[app->heap_size++] = s->index;
+    heap_sift_up(app, app->heap_size - 1);
+  }
+}
+
+/*
+ * Returns the timestamp up to which messages can be emitted in order.
+ * Sources deliver in timestamp order, so a source with buffered messages
+ * cannot deliver anything older than its head and an empty source nothing
+ * older than the last message it delivered. Idle sources are ignored.
+ * */
+static pn_timestamp_t watermark(app_data_t *app, uint64_t now) {
+  pn_timestamp_t wm = INT64_MAX;
+  for (int i = 0; i < app->source_count; ++i) {
+    source_t *s = &app->sources[i];
+    pn_timestamp_t ts;
+    if (s->closed) continue;
+    if (s->count > 0) {
+      ts = s->window[s->head].timestamp;
+    } else if (now - s->last_arrival > (uint64_t)app->lateness_ms * 1000000) {
+      continue; /* idle source */
+    } else {
+      ts = s->last_timestamp;
+    }
+    if (ts < wm) wm = ts;
+  }
+  return wm;
+}
+
+static void print_message(source_t *s, pn_message_t *m) {
+  pn_string_t *str = pn_string(NULL);
+  pn_inspect(pn_message_body(m), str);
+  printf("[%s] %s\n", s->address, pn_string_get(str));
+  pn_free(str);
+}
+
+/*
+ * Settles emitted deliveries and tops the source credit back up to the
+ * free space in its window. Must be called while handling an event for
+ * the source connection.
+ * */
+static void flush_source(app_data_t *app, source_t *s) {
+  for (int i = 0; i < s->done_count; ++i) {
+    if (!pn_delivery_settled(s->done[i])) {
+      pn_delivery_update(s->done[i], PN_ACCEPTED);
+    }
+    pn_delivery_settle(s->done[i]);
+  }
+  s->done_count = 0;
+  if (s->link && !app->finished) {
+    int credit = app->window_size - s->count - pn_link_credit(s->link);
+    if (credit > 0) {
+      pn_link_flow(s->link, credit);
+    }
+  }
+}
+
+/*
+ * Emits every message at or below the watermark in timestamp order.
+ * Sources other than 'current' are woken to settle and replenish credit
+ * from their own connection context.
+ * */
+static void merge(app_data_t *app, source_t *current) {
+  pn_timestamp_t wm = watermark(app, clock_now_ns());
+  while (app->heap_size > 0 && !app->finished) {
+    source_t *s = &app->sources[app->heap[0]];
+    pending_t *p = &s->window[s->head];
+    if (p->timestamp > wm) break;
+    if (p->timestamp < app->last_emitted) {
+      ++app->out_of_order;
+    } else {
+      app->last_emitted = p->timestamp;
+    }
+    print_message(s, p->message);
+    pn_message_free(p->message);
+    s->done[s->done_count++] = p->delivery;
+    s->head = (s->head + 1) % app->window_size;
+    if (--s->count > 0) {
+      heap_sift_down(app, 0);
+    } else {
+      app->heap[0] = app->heap[--app->heap_size];
+      heap_sift_down(app, 0);
+    }
+    if (++app->emitted == app->message_count) {
+      app->finished = true;
+      pn_proactor_cancel_timeout(app->proactor);
+    }
+  }
+  for (int i = 0; i < app->source_count; ++i) {
+    source_t *s = &app->sources[i];
+    if (s == current) {
+      flush_source(app, s);
+    } else if ((s->done_count > 0 || app->finished) && s->connection && !s->closed) {
+      pn_connection_wake(s->connection);
+    }
+  }
+}
+
+static void close_source(source_t *s) {
+  pn_session_t *ssn = pn_link_session(s->link);
+  pn_link_close(s->link);
+  pn_session_close(ssn);
+  pn_connection_close(pn_session_connection(ssn));
+}
+
+/* Return true to continue, false to exit */
+static bool handle(app_data_t* app, pn_event_t* event) {
+  pn_connection_t *c = pn_event_connection(event);
+  source_t *src = c ? (source_t*)pn_connection_get_context(c) : NULL;
+
+  switch (pn_event_type(event)) {
+
+   case PN_CONNECTION_INIT: {
+     /* Set authenticate credentials if present */
+     if (app->username) {
+        pn_connection_set_user(c, app->username);
+        pn_connection_set_password(c, app->password);
+     }
+     pn_session_t* s = pn_session(c);
+     pn_connection_set_container(c, app->container_id);
+     pn_connection_open(c);
+     pn_session_open(s);
+     {
+     char link_name[PN_MAX_ADDR];
+     snprintf(link_name, sizeof(link_name), "merge_receiver_%d", src->index);
+     src->link = pn_receiver(s, link_name);
+     pn_terminus_set_address(pn_link_source(src->link), src->address);
+     if (app->presettled) {
+       pn_link_set_snd_settle_mode(src->link, PN_SND_SETTLED);
+     }
+     pn_link_open(src->link);
+     /* credit is bounded by the lookahead window */
+     pn_link_flow(src->link, app->window_size);
+     }
+   } break;
+
+   case PN_CONNECTION_REMOTE_OPEN:
+     printf("source %s ", src->address);
+     report_connection_open(event, src->connect_start, app->ssl);
+     break;
+
+   case PN_CONNECTION_WAKE:
+     if (app->finished) {
+       flush_source(app, src);
+       close_source(src);
+     } else {
+       flush_source(app, src);
+     }
+     break;
+
+   case PN_DELIVERY: {
+     /* A message has been received */
+     pn_delivery_t *d = pn_event_delivery(event);
+     if (pn_delivery_readable(d)) {
+       pn_link_t *l = pn_delivery_link(d);
+       size_t size = pn_delivery_pending(d);
+       pn_rwbytes_t* m = &src->msgin; /* Append data to incoming message buffer */
+       int recv;
+       size_t oldsize = m->size;
+       m->size += size;
+       m->start = (char*)realloc(m->start, m->size);
+       recv = pn_link_recv(l, m->start + oldsize, m->size);
+       if (recv == PN_ABORTED) {
+         fprintf(stderr, "Message aborted\n");
+         m->size = 0;           /* Forget the data we accumulated */
+         pn_delivery_settle(d); /* Free the delivery so we can receive the next message */
+         pn_link_flow(l, 1);    /* Replace credit for aborted message */
+       } else if (recv < 0 && recv != PN_EOS) {        /* Unexpected error */
+         pn_condition_format(pn_link_condition(l), "broker", "PN_DELIVERY error: %s", pn_code(recv));
+         pn_link_close(l);               /* Unexpected error, close the link */
+       } else if (!pn_delivery_partial(d)) { /* Message is complete */
+         pn_message_t *msg = pn_message();
+         int err = pn_message_decode(msg, m->start, m->size);
+         free(m->start);
+         *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
+         if (err) {
+           fprintf(stderr, "decode_message: %s\n", pn_code(err));
+           pn_message_free(msg);
+           exit_code = 1;
+           break;
+         }
+         ++src->received;
+         /* settled once emitted */
+         source_push(app, src, msg, d);
+         merge(app, src);
+         if (app->finished) {
+           close_source(src);
+         }
+       }
+     }
+     break;
+   }
+
+   case PN_PROACTOR_TIMEOUT:
+     /* re-evaluate the watermark for sources that went idle */
+     if (!app->finished) {
+       merge(app, NULL);
+       pn_proactor_set_timeout(app->proactor, app->lateness_ms);
+     }
+     break;
+
+   case PN_TRANSPORT_CLOSED:
+    if (src) src->closed = true;
+    check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    break;
+
+   case PN_CONNECTION_REMOTE_CLOSE:
+    check_condition(event, pn_connection_remote_condition(pn_event_connection(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_SESSION_REMOTE_CLOSE:
+    check_condition(event, pn_session_remote_condition(pn_event_session(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_LINK_REMOTE_CLOSE:
+   case PN_LINK_REMOTE_DETACH:
+    check_condition(event, pn_link_remote_condition(pn_event_link(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_PROACTOR_INACTIVE:
+    return false;
+    break;
+
+   default:
+    break;
+  }
+    return true;
+}
+
+/*
+ * Sources on different connections share the merge state, run() must be
+ * called from a single thread.
+ * */
+static void run(app_data_t *app) {
+  /* Loop and handle events */
+  do {
+    pn_event_batch_t *events = pn_proactor_wait(app->proactor);
+    pn_event_t *e;
+    for (e = pn_event_batch_next(events); e; e = pn_event_batch_next(events)) {
+      if (!handle(app, e) || exit_code != 0) {
+        return;
+      }
+    }
+    pn_proactor_done(app->proactor, events);
+  } while(true);
+}
+
+static void usage() {
+    printf("Usage: merge_consumer [options] \n");
+    printf("[Options]:\n");
+    printf("\t-a      The host address [localhost]\n");
+    printf("\t-p      The host port [5672]\n");
+    printf("\t-c      # of merged messages to receive, 0 receives forever [10]\n");
+    printf("\t-t      Source address[@<host>[:<port>]], repeat for each source [examples]\n");
+    printf("\t-w      Lookahead window, the credit and max messages buffered per source [100]\n");
+    printf("\t-l      Lateness in ms before a silent source stops holding back the merge [1000]\n");
+    printf("\t-d      Settlement, 'unsettled' accepts each message, 'presettled' asks the brokers to send\n");
+    printf("\t        them settled, at most once [unsettled]\n");
+    printf("\t-i      Container name [merge_consumer:<pid>]\n");
+    printf("\t-u      Client authentication username []\n");
+    printf("\t-P      Client authentication password []\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-h      Displays this message\n");
+    exit(0);
+
+}
+
+static void parse_args(int argc, char **argv, app_data_t *app) {
+    char c;
+    char con_id[PN_MAX_ADDR];
+    if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
+        fprintf(stderr, "Unable to format container id from source: %s", argv[0]);
+        exit(1);
+    }
+    /* initialize default values*/
+    app->container_id = strdup(con_id); /* default to using argv[0] */
+    app->host = "localhost";
+    app->port = NULL; /* amqp or amqps */
+    app->message_count = 10;
+    app->window_size = 100;
+    app->lateness_ms = 1000;
+    app->source_count = 0;
+    /* default to anonymous authentication */
+    app->username = NULL;
+    app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+
+    /* command line options */
+    opterr = 0;
+    while((c = getopt(argc, argv, "i:a:c:t:w:l:d:p:u:P:sC:N:h")) != -1) {
+        switch(c) {
+        case 'h': usage(); break;
+        case 'c':
+            app->message_count = atoi(optarg);
+            if (app->message_count < 0) usage();
+            break;
+        case 'a': app->host = optarg; break;
+        case 'i':
+            if (container_id(con_id, PN_MAX_ADDR, optarg, sizeof(optarg)) < 0) {
+                fprintf(stderr, "Unable to format container id from source: %s", optarg);
+                exit(1);
+            }
+            str_free(app->container_id);
+            app->container_id = strdup(con_id);
+            break;
+        case 't': {
+            if (app->source_count == MAX_SOURCES) {
+                fprintf(stderr, "At most %d sources are supported\n", MAX_SOURCES);
+                exit(1);
+            }
+            /* <address>[@<host>[:<port>]] */
+            source_t *s = &app->sources[app->source_count];
+            char *at = strrchr(optarg, '@');
+            s->index = app->source_count++;
+            s->address = optarg;
+            if (at) {
+                char *sep = strrchr(at, ':');
+                *at = '\0';
+                s->host = at + 1;
+                if (sep) {
+                    *sep = '\0';
+                    s->port = sep + 1;
+                }
+            }
+            break;
+        }
+        case 'w':
+            app->window_size = atoi(optarg);
+            if (app->window_size < 1) usage();
+            break;
+        case 'l':
+            app->lateness_ms = atoi(optarg);
+            if (app->lateness_ms < 1) usage();
+            break;
+        case 'd':
+            if (strcmp(optarg, "unsettled") == 0) app->presettled = false;
+            else if (strcmp(optarg, "presettled") == 0) app->presettled = true;
+            else usage();
+            break;
+        case 'p': app->port = optarg; break;
+        case 'u': app->username = optarg; break;
+        case 'P': app->password = optarg; break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        default: usage(); break;
+        }
+    }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (app->source_count == 0) {
+        app->sources[0].address = "examples";
+        app->source_count = 1;
+    }
+    for (int i = 0; i < app->source_count; ++i) {
+        source_t *s = &app->sources[i];
+        if (!s->host) s->host = app->host;
+        if (!s->port) s->port = app->port;
+    }
+}
+
+int merge_consumer_main(int argc, char **argv) {
+    struct app_data_t app = {0};
+    char addr[PN_MAX_ADDR];
+
+    parse_args(argc, argv, &app);
+
+    app.proactor = pn_proactor();
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+    }
+    /* one connection per source, all driven by the same proactor */
+    for (int i = 0; i < app.source_count; ++i) {
+        source_t *s = &app.sources[i];
+        s->window = (pending_t*)calloc(app.window_size, sizeof(pending_t));
+        s->done = (pn_delivery_t**)calloc(app.window_size, sizeof(pn_delivery_t*));
+        s->connection = pn_connection();
+        pn_connection_set_context(s->connection, s);
+        pn_proactor_addr(addr, sizeof(addr), s->host, s->port);
+        fprintf(stdout, "Connecting to host: %s for source: %s\n", addr, s->address);
+
+        /* Initialize Sasl transport */
+        pn_transport_t *pnt = pn_transport();
+        pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+        if (app.ssl && ssl_client_init(pnt, app.ssl_domain, s->host, s->port) < 0) {
+            exit(1);
+        }
+        s->connect_start = clock_now_ns();
+        s->last_arrival = s->connect_start;
+        pn_proactor_connect2(app.proactor, s->connection, pnt, addr);
+    }
+    pn_proactor_set_timeout(app.proactor, app.lateness_ms);
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        probe_start_sample(&app.probe, &probe);
+    }
+    run(&app);
+
+    printf("%d messages merged from %d sources, %d out of order\n",
+           app.emitted, app.source_count, app.out_of_order);
+    for (int i = 0; i < app.source_count; ++i) {
+        source_t *s = &app.sources[i];
+        printf("source %s received %d, max buffered %d\n", s->address, s->received, s->max_buffered);
+    }
+
+    /* program cleanup */
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
+    pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
+    for (int i = 0; i < app.source_count; ++i) {
+        source_t *s = &app.sources[i];
+        for (int j = 0; j < s->count; ++j) {
+            pn_message_free(s->window[(s->head + j) % app.window_size].message);
+        }
+        free(s->window);
+        free(s->done);
+        free(s->msgin.start);
+    }
+    str_free(app.container_id);
+    return exit_code;
+}
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return merge_consumer_main(argc, argv);
+}
+#endif
@@ -0,0 +1,182 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "perfopt.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PERFOPT_LINE 4096
+
+static void args_push(perfopt_args_t *args, const char *arg, size_t length) {
+    if (args->argc + 2 > args->capacity) {
+        args->capacity = args->capacity ? args->capacity * 2 : 16;
+        args->argv = (char**)realloc(args->argv, args->capacity * sizeof(char*));
+    }
+    args->argv[args->argc] = (char*)malloc(length + 1);
+    memcpy(args->argv[args->argc], arg, length);
+    args->argv[args->argc][length] = '\0';
+    args->argv[++args->argc] = NULL;
+}
+
+/* Adds the short option, and its value if it takes one */
+static void args_push_option(perfopt_args_t *args, const perfopt_t *option, const char *value) {
+    char flag[2] = {'-', option->letter};
+    args_push(args, flag, sizeof(flag));
+    if (option->value) {
+        args_push(args, value, strlen(value));
+    }
+}
+
+void perfopt_args_init(perfopt_args_t *args, const char *argv0) {
+    memset(args, 0, sizeof(*args));
+    args_push(args, argv0, strlen(argv0));
+}
+
+void perfopt_args_free(perfopt_args_t *args) {
+    for (int i = 0; i < args->argc; ++i) {
+        free(args->argv[i]);
+    }
+    free(args->argv);
+    memset(args, 0, sizeof(*args));
+}
+
+const perfopt_t *perfopt_find(const perfopt_role_t *role, const char *name, size_t length) {
+    for (const perfopt_t *o = role->options; o->name; ++o) {
+        if (strlen(o->name) == length && memcmp(o->name, name, length) == 0) {
+            return o;
+        }
+    }
+    return NULL;
+}
+
+static bool flag_off(const char *value) {
+    return strcmp(value, "false") == 0 || strcmp(value, "no") == 0
+        || strcmp(value, "off") == 0 || strcmp(value, "0") == 0;
+}
+
+/* Trims white space from both ends in place */
+static char *trim(char *s) {
+    char *end = s + strlen(s);
+    while (isspace((unsigned char)*s)) ++s;
+    while (end > s && isspace((unsigned char)end[-1])) --end;
+    *end = '\0';
+    return s;
+}
+
+int perfopt_load_config(const perfopt_role_t *role, const char *path, perfopt_args_t *args) {
+    char line[PERFOPT_LINE];
+    bool common = true, selected = true;
+    int number = 0;
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Unable to open config file: %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char *hash = strchr(line, '#');
+        char *key, *value, *eq;
+        const perfopt_t *option;
+        ++number;
+        if (hash) *hash = '\0';
+        key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+        if (*key == '[') {
+            char *close = strchr(key, ']');
+            if (!close) {
+                fprintf(stderr, "%s:%d: unterminated section\n", path, number);
+                fclose(file);
+                return -1;
+            }
+            *close = '\0';
+            common = false;
+            selected = strcmp(trim(key + 1), role->name) == 0;
+            continue;
+        }
+        if (!selected) {
+            continue;
+        }
+        eq = strchr(key, '=');
+        value = eq ? trim(eq + 1) : NULL;
+        if (eq) {
+            *eq = '\0';
+            key = trim(key);
+        }
+        option = perfopt_find(role, key, strlen(key));
+        if (!option) {
+            if (common) continue; /* meant for other roles */
+            fprintf(stderr, "%s:%d: %s has no option '%s'\n", path, number, role->name, key);
+            fclose(file);
+            return -1;
+        }
+        if (option->value && !value) {
+            fprintf(stderr, "%s:%d: '%s' needs a value\n", path, number, key);
+            fclose(file);
+            return -1;
+        }
+        if (!option->value && value && flag_off(value)) {
+            continue;
+        }
+        args_push_option(args, option, value);
+    }
+    fclose(file);
+    return 0;
+}
+
+int perfopt_parse(const perfopt_role_t *role, int argc, char **argv, perfopt_args_t *args) {
+    for (int i = 0; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *eq;
+        const perfopt_t *option;
+        if (strncmp(arg, "--", 2) != 0 || arg[2] == '\0') {
+            args_push(args, arg, strlen(arg));
+            continue;
+        }
+        arg += 2;
+        eq = strchr(arg, '=');
+        option = perfopt_find(role, arg, eq ? (size_t)(eq - arg) : strlen(arg));
+        if (!option) {
+            fprintf(stderr, "%s has no option '--%s'\n", role->name, arg);
+            return -1;
+        }
+        if (!option->value) {
+            if (!eq || !flag_off(eq + 1)) args_push_option(args, option, NULL);
+        } else if (eq) {
+            args_push_option(args, option, eq + 1);
+        } else if (i + 1 < argc) {
+            args_push_option(args, option, argv[++i]);
+        } else {
+            fprintf(stderr, "'--%s' needs a value\n", arg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void perfopt_usage(FILE *out, const perfopt_role_t *role) {
+    fprintf(out, "Long options of %s, also config file keys:\n", role->name);
+    for (const perfopt_t *o = role->options; o->name; ++o) {
+        fprintf(out, "\t--%-20s -%c%s\n", o->name, o->letter, o->value ? " <value>" : "");
+    }
+}
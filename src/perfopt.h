@@ -0,0 +1,97 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PERFOPT_H
+#define PERFOPT_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Long options and config files for the amqp-perf roles.
+ *
+ * Each role is one of the samples, run through its own <sample>_main()
+ * and getopt parsing. A role lists the long names of its short options.
+ * A long name means the same setting in every role that has it, whatever
+ * its letter, eg. --credit is -f in receive and -w in merge, and settings
+ * that differ have different names, eg. the --latency flag of the
+ * consumers and the --latency-sample interval of the senders, so a common
+ * config file entry only reaches the roles it means something to. Long
+ * options and config file entries are translated to the short options,
+ * so every setting a sample takes is reachable by name.
+ *
+ * Config file options come before the command line, a later value of a
+ * single valued option replaces an earlier one, so the command line wins.
+ */
+
+/* A long option of a role */
+typedef struct perfopt_t {
+    const char *name;           /* --<name>, and the config file key */
+    char letter;                /* the short option of the role */
+    bool value;                 /* takes a value, otherwise a flag */
+} perfopt_t;
+
+typedef int (*perfopt_main_fn)(int argc, char **argv);
+
+typedef struct perfopt_role_t {
+    const char *name;           /* subcommand */
+    const char *sample;         /* the sample run as the role, its argv[0] */
+    perfopt_main_fn main;
+    const perfopt_t *options;   /* ends with a NULL name */
+    const char *summary;
+} perfopt_role_t;
+
+/* Argument vector passed to a role, every string is owned by it */
+typedef struct perfopt_args_t {
+    char **argv;                /* NULL terminated */
+    int argc;
+    int capacity;
+} perfopt_args_t;
+
+void perfopt_args_init(perfopt_args_t *args, const char *argv0);
+void perfopt_args_free(perfopt_args_t *args);
+
+/* Returns the option of a role by long name, NULL if it has none */
+const perfopt_t *perfopt_find(const perfopt_role_t *role, const char *name, size_t length);
+
+/*
+ * Adds the options of a config file. Lines are 'name = value', or 'name'
+ * alone for a flag, and '#' starts a comment. A flag set to false, no, off
+ * or 0 is left out. Options before the first '[section]' apply to every
+ * role that has them, the options of a '[<role>]' section only to that
+ * role and must be known to it. Options may repeat.
+ * @returns: 0 on success, -1 after printing the error
+ * */
+int perfopt_load_config(const perfopt_role_t *role, const char *path, perfopt_args_t *args);
+
+/*
+ * Adds command line arguments, translating --name=value, --name value and
+ * --flag to the short options of the role. Anything else, short options
+ * included, is passed on as it is.
+ * @returns: 0 on success, -1 after printing the error
+ * */
+int perfopt_parse(const perfopt_role_t *role, int argc, char **argv, perfopt_args_t *args);
+
+/* Prints the long options of a role with their short options */
+void perfopt_usage(FILE *out, const perfopt_role_t *role);
+
+#endif /* perfopt.h */
@@ -0,0 +1,499 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "probe.h"
+
+#include <proton/condition.h>
+#include <proton/connection.h>
+#include <proton/delivery.h>
+#include <proton/link.h>
+#include <proton/message.h>
+#include <proton/sasl.h>
+#include <proton/session.h>
+#include <proton/transport.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* an encoded probe is a few dozen bytes, a clock request adds its reply-to address */
+#define PROBE_BUFFER (256 + PN_MAX_ADDR)
+
+static void probe_connect(probe_t *probe) {
+    char addr[PN_MAX_ADDR];
+    pn_transport_t *pnt = pn_transport();
+    pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (probe->config.ssl_domain
+        && ssl_client_init(pnt, probe->config.ssl_domain, probe->config.host, probe->config.port) < 0) {
+        pn_transport_free(pnt);
+        return;
+    }
+    pn_proactor_addr(addr, sizeof(addr), probe->config.host, probe->config.port);
+    probe->connection = pn_connection();
+    pn_proactor_connect2(probe->proactor, probe->connection, pnt, addr);
+}
+
+/* Encodes and sends a message, returns false if it does not fit the buffer */
+static bool probe_send_message(pn_link_t *sender, pn_message_t *message, uint64_t tag) {
+    char buf[PROBE_BUFFER];
+    size_t size = sizeof(buf);
+    if (pn_message_encode(message, buf, &size) != 0) {
+        return false;
+    }
+    pn_delivery(sender, pn_dtag((const char *)&tag, sizeof(tag)));
+    pn_link_send(sender, buf, size);
+    pn_link_advance(sender);
+    return true;
+}
+
+static void put_long_property(pn_data_t *properties, const char *key, int64_t value) {
+    pn_data_put_string(properties, pn_bytes(strlen(key), key));
+    pn_data_put_long(properties, value);
+}
+
+static bool get_long_property(pn_message_t *message, const char *key, int64_t *value) {
+    pn_data_t *properties = pn_message_properties(message);
+    if (!data_map_find(properties, key) || pn_data_type(properties) != PN_LONG) {
+        return false;
+    }
+    *value = pn_data_get_long(properties);
+    return true;
+}
+
+/* Sends the next probe: the sequence as message id and the send time as body */
+static void probe_send(probe_t *probe) {
+    pn_message_t *message = pn_message();
+    pn_data_put_ulong(pn_message_id(message), probe->sequence);
+    pn_data_put_long(pn_message_body(message), (int64_t)(clock_now_ns() / 1000));
+    if (probe_send_message(probe->sender, message, probe->sequence)) {
+        ++probe->sequence;
+        ++probe->sent;
+    }
+    pn_message_free(message);
+}
+
+/* Sends a clock request with the temporary queue as reply-to */
+static void probe_clock_request(probe_t *probe) {
+    pn_message_t *message = pn_message();
+    pn_data_t *properties;
+    pn_message_set_reply_to(message, probe->reply_to);
+    properties = message_properties_append(message);
+    put_long_property(properties, PROBE_CLOCK_T1, (int64_t)clock_wall_us());
+    pn_data_exit(properties);
+    if (probe_send_message(probe->clock_sender, message, probe->clock_requests)) {
+        ++probe->clock_requests;
+    }
+    pn_message_free(message);
+}
+
+/* Forgets a peer, closing its sender unless it is closed already */
+static void peer_drop(probe_t *probe, int i) {
+    probe_peer_t *peer = &probe->peers[i];
+    if (pn_link_state(peer->sender) & PN_LOCAL_ACTIVE) {
+        pn_link_close(peer->sender);
+    }
+    free(peer->address);
+    probe->peers[i] = probe->peers[--probe->peer_count];
+}
+
+/*
+ * Returns the sender to a reply-to address, attaching one for a new
+ * address. With every slot taken the least recently answered peer, most
+ * likely gone, makes room.
+ * */
+static pn_link_t *peer_sender(probe_t *probe, pn_session_t *session, const char *address) {
+    char name[PN_MAX_ADDR];
+    probe_peer_t *peer;
+    for (int i = 0; i < probe->peer_count; ++i) {
+        if (strcmp(probe->peers[i].address, address) == 0) {
+            probe->peers[i].used = probe->clock_served;
+            return probe->peers[i].sender;
+        }
+    }
+    if (probe->peer_count == PROBE_MAX_PEERS) {
+        int oldest = 0;
+        for (int i = 1; i < probe->peer_count; ++i) {
+            if (probe->peers[i].used < probe->peers[oldest].used) oldest = i;
+        }
+        peer_drop(probe, oldest);
+    }
+    peer = &probe->peers[probe->peer_count++];
+    /* a dropped sender may still be detaching, so names are never reused */
+    snprintf(name, sizeof(name), "probe_peer_%llu", (unsigned long long)probe->peer_links++);
+    peer->address = strdup(address);
+    peer->used = probe->clock_served;
+    peer->sender = pn_sender(session, name);
+    pn_terminus_set_address(pn_link_target(peer->sender), address);
+    pn_link_open(peer->sender);
+    return peer->sender;
+}
+
+/*
+ * Closes a peer sender the broker detached, for example when the querying
+ * probe's temporary queue went away. Returns false for the probe's own links.
+ * */
+static bool peer_detached(probe_t *probe, pn_link_t *l) {
+    if (l == probe->sender || l == probe->receiver || l == probe->clock_sender || l == probe->clock_receiver) {
+        return false;
+    }
+    for (int i = 0; i < probe->peer_count; ++i) {
+        if (probe->peers[i].sender == l) {
+            peer_drop(probe, i);
+            return true;
+        }
+    }
+    /* dropped already */
+    if (pn_link_state(l) & PN_LOCAL_ACTIVE) {
+        pn_link_close(l);
+    }
+    return true;
+}
+
+static void free_peers(probe_t *probe) {
+    for (int i = 0; i < probe->peer_count; ++i) {
+        free(probe->peers[i].address);
+    }
+    probe->peer_count = 0;
+}
+
+/* Answers a clock request received at received_us, the reply is stamped just before it is sent */
+static void probe_serve(probe_t *probe, pn_session_t *session, const char *bytes, size_t size, int64_t received_us) {
+    pn_message_t *request = pn_message();
+    int64_t t1;
+    const char *reply_to;
+    pn_link_t *sender;
+    if (pn_message_decode(request, bytes, size) == 0
+        && get_long_property(request, PROBE_CLOCK_T1, &t1)
+        && (reply_to = pn_message_get_reply_to(request)) != NULL
+        && (sender = peer_sender(probe, session, reply_to)) != NULL) {
+        pn_message_t *reply = pn_message();
+        pn_data_t *properties = message_properties_append(reply);
+        put_long_property(properties, PROBE_CLOCK_T1, t1);
+        put_long_property(properties, PROBE_CLOCK_T2, received_us);
+        put_long_property(properties, PROBE_CLOCK_T3, (int64_t)clock_wall_us());
+        pn_data_exit(properties);
+        if (probe_send_message(sender, reply, probe->clock_served)) {
+            ++probe->clock_served;
+        }
+        pn_message_free(reply);
+    }
+    pn_message_free(request);
+}
+
+/*
+ * Times a probe back, probes come back in order so a skipped sequence was
+ * lost. A clock reply, received at received_us, goes to the clock estimate.
+ * */
+static void probe_receive(probe_t *probe, const char *bytes, size_t size, int64_t received_us) {
+    pn_message_t *message = pn_message();
+    int64_t t1, t2, t3;
+    if (pn_message_decode(message, bytes, size) != 0) {
+        /* not a probe */
+    } else if (get_long_property(message, PROBE_CLOCK_T1, &t1)
+        && get_long_property(message, PROBE_CLOCK_T2, &t2)
+        && get_long_property(message, PROBE_CLOCK_T3, &t3)) {
+        if (probe->config.clock) {
+            clocksync_add(probe->config.clock, t1, t2, t3, received_us);
+        }
+        ++probe->clock_replies;
+    } else {
+        pn_data_t *id = pn_message_id(message);
+        pn_data_t *body = pn_message_body(message);
+        pn_data_rewind(id);
+        pn_data_rewind(body);
+        if (pn_data_next(id) && pn_data_type(id) == PN_ULONG
+            && pn_data_next(body) && pn_data_type(body) == PN_LONG) {
+            uint64_t sequence = pn_data_get_ulong(id);
+            int64_t rtt = (int64_t)(clock_now_ns() / 1000) - pn_data_get_long(body);
+            if (sequence >= probe->expected) {
+                probe->lost += sequence - probe->expected;
+                probe->expected = sequence + 1;
+            }
+            probe->last_us = rtt < 0 ? 0 : (uint64_t)rtt;
+            latency_histogram_record(&probe->interval, probe->last_us);
+            latency_histogram_record(&probe->total, probe->last_us);
+            ++probe->received;
+        }
+    }
+    pn_message_free(message);
+}
+
+static void probe_metric(probe_t *probe) {
+    printf("probe name=%s rtt_last_us=%llu rtt_p50_us=%llu rtt_p99_us=%llu rtt_max_us=%llu"
+           " sent=%llu received=%llu lost=%llu reconnects=%llu\n",
+           probe->config.name, (unsigned long long)probe->last_us,
+           (unsigned long long)latency_histogram_quantile(&probe->interval, 0.5),
+           (unsigned long long)latency_histogram_quantile(&probe->interval, 0.99),
+           (unsigned long long)probe->interval.max,
+           (unsigned long long)probe->sent, (unsigned long long)probe->received,
+           (unsigned long long)probe->lost, (unsigned long long)probe->reconnects);
+    fflush(stdout);
+    memset(&probe->interval, 0, sizeof(probe->interval));
+}
+
+static void probe_condition(pn_event_t *e, pn_condition_t *cond) {
+    if (pn_condition_is_set(cond)) {
+        fprintf(stderr, "probe %s: %s: %s\n", pn_event_type_name(pn_event_type(e)),
+                pn_condition_get_name(cond), pn_condition_get_description(cond));
+    }
+}
+
+/* Return true to continue, false to exit */
+static bool probe_handle(probe_t *probe, pn_event_t *event) {
+    switch (pn_event_type(event)) {
+
+    case PN_CONNECTION_INIT: {
+        pn_connection_t *c = pn_event_connection(event);
+        char con_id[PN_MAX_ADDR];
+        if (probe->config.username) {
+            pn_connection_set_user(c, probe->config.username);
+            pn_connection_set_password(c, probe->config.password);
+        }
+        /* the broker takes the container id as the client name, which must be unique */
+        snprintf(con_id, sizeof(con_id), "%s/probe", probe->config.container_id);
+        pn_connection_set_container(c, con_id);
+        pn_connection_open(c);
+        pn_session_t *s = pn_session(c);
+        pn_session_open(s);
+        /* the broker creates a temporary queue and names it in the remote source */
+        probe->receiver = pn_receiver(s, "probe_receiver");
+        pn_terminus_set_dynamic(pn_link_source(probe->receiver), true);
+        pn_link_open(probe->receiver);
+        pn_link_flow(probe->receiver, PROBE_CREDIT);
+        if (probe->config.clock_mode == PROBE_CLOCK_SERVE) {
+            probe->clock_receiver = pn_receiver(s, "probe_clock_receiver");
+            pn_terminus_set_address(pn_link_source(probe->clock_receiver), probe->config.clock_address);
+            pn_link_open(probe->clock_receiver);
+            pn_link_flow(probe->clock_receiver, PROBE_CREDIT);
+        }
+    } break;
+
+    case PN_LINK_REMOTE_OPEN: {
+        pn_link_t *l = pn_event_link(event);
+        if (l == probe->receiver && !probe->sender) {
+            const char *address = pn_terminus_get_address(pn_link_remote_source(l));
+            snprintf(probe->reply_to, sizeof(probe->reply_to), "%s", address ? address : "");
+            probe->sender = pn_sender(pn_link_session(l), "probe_sender");
+            pn_terminus_set_address(pn_link_target(probe->sender), address);
+            pn_link_open(probe->sender);
+            if (probe->config.clock_mode == PROBE_CLOCK_QUERY) {
+                probe->clock_sender = pn_sender(pn_link_session(l), "probe_clock_sender");
+                pn_terminus_set_address(pn_link_target(probe->clock_sender), probe->config.clock_address);
+                pn_link_open(probe->clock_sender);
+            }
+        }
+    } break;
+
+    case PN_DELIVERY: {
+        pn_delivery_t *d = pn_event_delivery(event);
+        pn_link_t *l = pn_delivery_link(d);
+        if (pn_link_is_sender(l)) {
+            if (pn_delivery_remote_state(d)) {
+                pn_delivery_settle(d);
+            }
+        } else if (pn_delivery_readable(d)) {
+            size_t size = pn_delivery_pending(d);
+            pn_rwbytes_t *m = &probe->msgin;
+            m->start = (char*)realloc(m->start, m->size + size);
+            int recv = pn_link_recv(l, m->start + m->size, size);
+            if (recv > 0) {
+                m->size += recv;
+            }
+            if (!pn_delivery_partial(d) || recv < 0) {
+                int64_t received_us = (int64_t)clock_wall_us();
+                if (recv == PN_ABORTED) {
+                    /* nothing to time */
+                } else if (l == probe->clock_receiver) {
+                    probe_serve(probe, pn_link_session(l), m->start, m->size, received_us);
+                } else {
+                    probe_receive(probe, m->start, m->size, received_us);
+                }
+                m->size = 0;
+                pn_delivery_update(d, PN_ACCEPTED);
+                pn_delivery_settle(d);
+                pn_link_flow(l, 1);
+            }
+        }
+    } break;
+
+    case PN_PROACTOR_TIMEOUT:
+        if (probe->stopping) {
+            break;
+        }
+        if (!probe->connection) {
+            ++probe->reconnects;
+            probe_connect(probe);
+        } else if (probe->sender && pn_link_credit(probe->sender) > 0) {
+            probe_send(probe);
+            if (probe->sent % PROBE_REPORT_EVERY == 0) {
+                probe_metric(probe);
+            }
+        }
+        if (probe->clock_sender && pn_link_credit(probe->clock_sender) > 0) {
+            probe_clock_request(probe);
+        }
+        pn_proactor_set_timeout(probe->proactor, probe->config.interval_ms);
+        break;
+
+    case PN_PROACTOR_INTERRUPT:
+        probe->stopping = true;
+        pn_proactor_cancel_timeout(probe->proactor);
+        if (probe->connection) {
+            pn_connection_close(probe->connection);
+        }
+        break;
+
+    case PN_TRANSPORT_CLOSED:
+        probe_condition(event, pn_transport_condition(pn_event_transport(event)));
+        /* the temporary queue went with the connection, reconnect on the next timeout */
+        probe->lost += probe->sequence - probe->expected;
+        probe->expected = probe->sequence;
+        probe->connection = NULL;
+        probe->sender = probe->receiver = NULL;
+        probe->clock_sender = probe->clock_receiver = NULL;
+        free_peers(probe);
+        probe->msgin.size = 0;
+        break;
+
+    case PN_CONNECTION_REMOTE_CLOSE:
+        probe_condition(event, pn_connection_remote_condition(pn_event_connection(event)));
+        pn_connection_close(pn_event_connection(event));
+        break;
+
+    case PN_SESSION_REMOTE_CLOSE:
+        probe_condition(event, pn_session_remote_condition(pn_event_session(event)));
+        pn_connection_close(pn_event_connection(event));
+        break;
+
+    case PN_LINK_REMOTE_CLOSE:
+    case PN_LINK_REMOTE_DETACH:
+        /* a peer going away only takes its sender, the probe's own links take the connection */
+        if (!peer_detached(probe, pn_event_link(event))) {
+            probe_condition(event, pn_link_remote_condition(pn_event_link(event)));
+            pn_connection_close(pn_event_connection(event));
+        }
+        break;
+
+    case PN_PROACTOR_INACTIVE:
+        return false;
+
+    default:
+        break;
+    }
+    return true;
+}
+
+static void *probe_run(void *arg) {
+    probe_t *probe = (probe_t*)arg;
+    bool running = true;
+    while (running) {
+        pn_event_batch_t *events = pn_proactor_wait(probe->proactor);
+        pn_event_t *e;
+        for (e = pn_event_batch_next(events); e && running; e = pn_event_batch_next(events)) {
+            running = probe_handle(probe, e);
+        }
+        pn_proactor_done(probe->proactor, events);
+    }
+    return NULL;
+}
+
+int probe_parse_interval(const char *arg, unsigned *interval_ms) {
+    char *end;
+    unsigned long ms;
+    if (*arg < '0' || *arg > '9') {
+        return -1;
+    }
+    errno = 0;
+    ms = strtoul(arg, &end, 10);
+    if (*end || errno || ms > UINT_MAX) {
+        return -1;
+    }
+    *interval_ms = (unsigned)ms;
+    return 0;
+}
+
+void probe_config_init(probe_config_t *config, const char *host, const char *port,
+                       const char *username, const char *password,
+                       const char *container_id, pn_ssl_domain_t *ssl_domain, unsigned interval_ms) {
+    memset(config, 0, sizeof(*config));
+    config->host = host;
+    config->port = port;
+    config->username = username;
+    config->password = password;
+    config->container_id = container_id;
+    config->ssl_domain = ssl_domain;
+    config->name = container_id;
+    config->interval_ms = interval_ms;
+    config->clock_mode = PROBE_CLOCK_NONE;
+}
+
+int probe_start(probe_t *probe, const probe_config_t *config) {
+    memset(probe, 0, sizeof(*probe));
+    probe->config = *config;
+    probe->proactor = pn_proactor();
+    probe_connect(probe);
+    if (!probe->connection) {
+        pn_proactor_free(probe->proactor);
+        return -1;
+    }
+    /* the timer runs until the probe stops, so the proactor never goes inactive before */
+    pn_proactor_set_timeout(probe->proactor, config->interval_ms);
+    if (pthread_create(&probe->thread, NULL, probe_run, probe) != 0) {
+        pn_proactor_free(probe->proactor);
+        return -1;
+    }
+    probe->started = true;
+    return 0;
+}
+
+void probe_start_sample(probe_t *probe, const probe_config_t *config) {
+    if (probe_start(probe, config) < 0) {
+        fprintf(stderr, "Unable to start the broker round trip probe\n");
+        exit(1);
+    }
+}
+
+void probe_stop(probe_t *probe) {
+    if (!probe->started) {
+        return;
+    }
+    pn_proactor_interrupt(probe->proactor);
+    pthread_join(probe->thread, NULL);
+    pn_proactor_free(probe->proactor);
+    free(probe->msgin.start);
+    free_peers(probe);
+    probe->started = false;
+}
+
+void probe_report(FILE *out, const probe_t *probe) {
+    fprintf(out, "probe sent %llu, received %llu, lost %llu, reconnects %llu\n",
+            (unsigned long long)probe->sent, (unsigned long long)probe->received,
+            (unsigned long long)probe->lost, (unsigned long long)probe->reconnects);
+    latency_histogram_report(out, "probe round trip", "us", &probe->total);
+    if (probe->config.clock_mode == PROBE_CLOCK_SERVE) {
+        fprintf(out, "probe clock requests served %llu\n", (unsigned long long)probe->clock_served);
+    } else if (probe->config.clock_mode == PROBE_CLOCK_QUERY) {
+        fprintf(out, "probe clock requests %llu, replies %llu\n",
+                (unsigned long long)probe->clock_requests, (unsigned long long)probe->clock_replies);
+        if (probe->config.clock) clocksync_report(out, probe->config.clock);
+    }
+}
@@ -0,0 +1,143 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PROBE_H
+#define PROBE_H 1
+
+#include <proton/proactor.h>
+#include <proton/ssl.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clocksync.h"
+#include "latency.h"
+
+/*
+ * Broker round trip probe.
+ *
+ * A probe runs its own connection, proactor and thread next to a sample's
+ * data path. It attaches a receiver to a dynamic (temporary) queue, sends
+ * a small message holding a sequence number and the send time to that
+ * queue every interval and times each one back. With at most one probe
+ * in flight per interval, the time measures the broker path alone, not
+ * the queueing of the data links, so a data path latency spike can be
+ * told apart from a slower broker.
+ *
+ * Every PROBE_REPORT_EVERY probes a metric line is printed, for example
+ * "probe name=send rtt_last_us=210 rtt_p50_us=200 rtt_p99_us=320
+ * rtt_max_us=320 sent=10 received=10 lost=0 reconnects=0". A dropped
+ * connection counts its outstanding probes as lost and is reconnected.
+ *
+ * A probe can also run NTP style clock exchanges with a probe on another
+ * host over a clock address, see clocksync.h. The serving probe, on the
+ * producer host, receives requests on the clock address and replies to
+ * their reply-to address with its receive and send times. The querying
+ * probe, on the consumer host, sends a request every interval with its
+ * temporary queue as reply-to and adds the replies to its estimate of the
+ * producer clock. Only one probe should serve a clock address.
+ */
+
+#define PROBE_REPORT_EVERY 10       /* probes per metric line */
+#define PROBE_CREDIT 10             /* probes the receiver can take at once */
+#define PROBE_MAX_PEERS 16          /* reply-to addresses a serving probe keeps a sender for */
+
+/* The -N option of the samples */
+#define PROBE_USAGE "\t-N      Probe the broker round trip on a temporary queue every <ms>, 0 for none [0]\n"
+
+/* Application properties of the clock exchange, wall clock us */
+#define PROBE_CLOCK_T1 "clk-t1"     /* request sent */
+#define PROBE_CLOCK_T2 "clk-t2"     /* request received */
+#define PROBE_CLOCK_T3 "clk-t3"     /* reply sent */
+
+typedef enum probe_clock_t {
+    PROBE_CLOCK_NONE,
+    PROBE_CLOCK_SERVE,              /* reply to the requests sent to clock_address */
+    PROBE_CLOCK_QUERY               /* send requests to clock_address */
+} probe_clock_t;
+
+typedef struct probe_config_t {
+    const char *host, *port;
+    const char *username, *password;
+    const char *container_id;       /* the probe connects as '<container_id>/probe' */
+    pn_ssl_domain_t *ssl_domain;    /* NULL without SSL */
+    const char *name;               /* metric name */
+    unsigned interval_ms;
+    probe_clock_t clock_mode;
+    const char *clock_address;
+    clocksync_t *clock;             /* the estimate the replies are added to when querying */
+} probe_config_t;
+
+/* A sender to the reply-to address of a querying probe */
+typedef struct probe_peer_t {
+    char *address;
+    pn_link_t *sender;
+    uint64_t used;                  /* clock_served when last answered */
+} probe_peer_t;
+
+typedef struct probe_t {
+    probe_config_t config;
+    pthread_t thread;
+    bool started;
+
+    /* only touched by the probe thread until probe_stop() returns */
+    pn_proactor_t *proactor;
+    pn_connection_t *connection;    /* NULL while disconnected */
+    pn_link_t *sender, *receiver;
+    pn_link_t *clock_sender, *clock_receiver;
+    char reply_to[PN_MAX_ADDR];     /* address of the temporary queue */
+    probe_peer_t peers[PROBE_MAX_PEERS];
+    int peer_count;
+    uint64_t peer_links;            /* peer senders attached, names them uniquely */
+    pn_rwbytes_t msgin;             /* Partially received probe */
+    bool stopping;
+    uint64_t sequence;              /* sequence of the next probe */
+    uint64_t expected;              /* sequence of the next probe due back */
+    uint64_t sent, received, lost, reconnects;
+    uint64_t clock_requests, clock_replies, clock_served;
+    uint64_t last_us;
+    latency_histogram_t interval;   /* round trip in us since the last metric line */
+    latency_histogram_t total;
+} probe_t;
+
+/* Parses the -N interval of a sample, returns 0 or -1 if it is not a number of ms */
+int probe_parse_interval(const char *arg, unsigned *interval_ms);
+
+/* Sets the connection options of a probe named after container_id, without a clock exchange */
+void probe_config_init(probe_config_t *config, const char *host, const char *port,
+                       const char *username, const char *password,
+                       const char *container_id, pn_ssl_domain_t *ssl_domain, unsigned interval_ms);
+
+/* Connects the probe and starts its thread, returns 0 on success or -1 */
+int probe_start(probe_t *probe, const probe_config_t *config);
+
+/* Starts the probe of a sample, exits with a message if it cannot start */
+void probe_start_sample(probe_t *probe, const probe_config_t *config);
+
+/* Closes the probe connection and joins its thread */
+void probe_stop(probe_t *probe);
+
+/* Prints the round trip and clock summary of the whole run, call after probe_stop() */
+void probe_report(FILE *out, const probe_t *probe);
+
+#endif /* probe.h */
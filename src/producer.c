@@ -21,6 +21,14 @@
  * 
  * This sample demonstrates how to send messages to a topic
  * using an amqp address prefix.
+ *
+ * Given several brokers with -b, each message is replicated to
+ * every broker over parallel connections from the same proactor
+ * and completes once the first -m brokers have accepted it.
+ *
+ * -z pads the message body to a size, and -d presettled sends the
+ * messages settled, at most once, each one complete once sent to -m
+ * brokers.
  */
 
 #include <proton/connection.h>
@@ -33,14 +41,38 @@
 #include <proton/session.h>
 #include <proton/transport.h>
 #include <proton/sasl.h>
+#include <proton/ssl.h>
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "latency.h"
+#include "probe.h"
 #include "util.h"
 
+#define MAX_BROKERS 8
+
+/* An encoded message shared by all the brokers it is replicated to */
+typedef struct replica_t {
+  pn_bytes_t encoded;
+  uint64_t first_send;      /* clock_now_ns() when first sent to any broker */
+  int acks;                 /* # of brokers that accepted the message */
+  int settled;              /* # of brokers done with the encoded buffer */
+  int winner;               /* broker that completed the ack quorum, -1 while pending */
+} replica_t;
+
+/* A broker connection messages are replicated to */
+typedef struct broker_t {
+  const char *host, *port;
+  int index;
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  int sent;
+  int acknowledged;
+  int wins;                 /* # of messages this broker completed the quorum for */
+} broker_t;
+
 typedef struct app_data_t {
   const char *host, *port;
   const char *username, *password;
@@ -48,11 +80,28 @@ typedef struct app_data_t {
   char *amqp_topic_prefix;
   const char *container_id;
   int message_count;
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+  const char *clock_address; /* clock offset exchange address, NULL for none */
+  bool latency;             /* stamp a sample of the messages */
+  latency_sampler_t latency_sampler;
+  pn_millis_t ttl_ms;       /* message time to live, 0 for none */
+  size_t body_size;         /* string body padded to this size, 0 for just the sequence */
+  bool presettled;          /* send settled, done once sent */
 
   pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  uint64_t open_time;       /* clock_now_ns() at PN_CONNECTION_REMOTE_OPEN */
   pn_rwbytes_t message_buffer;
-  int sent;
-  int acknowledged;
+  broker_t brokers[MAX_BROKERS];
+  int broker_count;
+  int ack_quorum;           /* # of broker acks that complete a message */
+  replica_t *replicas;      /* indexed by message sequence */
+  int encoded;              /* # of messages encoded so far */
+  int completed;            /* # of messages that reached the ack quorum */
+  uint64_t completion_ns;   /* sum of first send to quorum times */
 } app_data_t;
 
 static int exit_code = 0;
@@ -132,23 +181,41 @@ static int set_topic_prefix_from_connection(app_data_t* app, pn_connection_t* pn
 }
 
 /* Create a message with a string "sequence_<number>" encode it and return the encoded buffer. */
-static pn_bytes_t encode_message(app_data_t* app) {
-  /* Construct a message with the string "sequence_<app.sent>" */
+static pn_bytes_t encode_message(app_data_t* app, int sequence) {
+  /* Construct a message with the string "sequence_<sequence>" */
   pn_message_t* message = pn_message();
   pn_data_t* body = pn_message_body(message);
   /* Create string for amqp message body */
   size_t slen = sizeof("sequence_") + 12;
-  char* sbuf = malloc(slen);
-  int swritten = sprintf(sbuf, "sequence_%d", app->sent);
+  char* sbuf = malloc(slen > app->body_size ? slen : app->body_size);
+  int swritten = sprintf(sbuf, "sequence_%d", sequence);
   if (swritten < 0) {
-    fprintf(stderr, "error writing message body string for sequence %d", app->sent);
+    fprintf(stderr, "error writing message body string for sequence %d", sequence);
     exit(1);
   }
+  /* pad the sequence up to -z */
+  if ((size_t)swritten < app->body_size) {
+    memset(sbuf + swritten, '.', app->body_size - swritten);
+    swritten = (int)app->body_size;
+  }
   pn_data_put_string(body, pn_bytes(swritten, sbuf));
 
   /* set message durable flag */
   pn_message_set_durable(message, true);
 
+  /* brokers rewrite the ttl to the time left, the absolute expiry time stays put */
+  if (app->ttl_ms) {
+    pn_timestamp_t now = (pn_timestamp_t)clock_wall_ms();
+    pn_message_set_ttl(message, app->ttl_ms);
+    pn_message_set_creation_time(message, now);
+    pn_message_set_expiry_time(message, now + app->ttl_ms);
+  }
+
+  /* stamp a sample of the messages for latency measurement */
+  if (app->latency && latency_sample(&app->latency_sampler)) {
+    latency_stamp(message);
+  }
+
   /* encode the message, expanding the encode buffer as needed */
   if (app->message_buffer.start == NULL) {
     static const size_t initial_size = 128;
@@ -174,6 +241,65 @@ static pn_bytes_t encode_message(app_data_t* app) {
   }
 }
 
+/*
+ * Returns the replica for message 'sequence', encoding it on first use.
+ * The encoded bytes are copied out of the reusable encode buffer once
+ * and the same copy is sent to every broker.
+ * */
+static replica_t* get_replica(app_data_t* app, int sequence) {
+  replica_t* r = &app->replicas[sequence];
+  if (sequence == app->encoded) {
+    pn_bytes_t msgbuf = encode_message(app, sequence + 1);
+    char* copy = (char*)malloc(msgbuf.size);
+    memcpy(copy, msgbuf.start, msgbuf.size);
+    r->encoded = pn_bytes(msgbuf.size, copy);
+    r->first_send = clock_now_ns();
+    r->winner = -1;
+    ++app->encoded;
+  }
+  return r;
+}
+
+/* Settles d and frees the shared encoded buffer once every broker is done with it */
+static void release_replica(app_data_t* app, replica_t* r, pn_delivery_t* d) {
+  pn_delivery_settle(d);
+  if (++r->settled == app->broker_count) {
+    free((void*)r->encoded.start);
+    r->encoded = pn_bytes_null;
+  }
+}
+
+/*
+ * Counts a message accepted by a broker, or sent settled, completes it
+ * with the ack quorum and closes the broker's connection once all are done.
+ * */
+static void replica_acked(app_data_t* app, broker_t* b, replica_t* r, pn_delivery_t* d) {
+  pn_connection_t* c = pn_session_connection(pn_link_session(pn_delivery_link(d)));
+  ++b->acknowledged;
+  if (++r->acks == app->ack_quorum) {
+    /* the first ack_quorum acknowledgements complete the message */
+    r->winner = b->index;
+    ++b->wins;
+    app->completion_ns += clock_now_ns() - r->first_send;
+    if (++app->completed == app->message_count) {
+      double secs = (clock_now_ns() - app->open_time) / 1e9;
+      printf("%d messages %s in %.3f ms (%.0f msg/s)\n", app->completed,
+             app->presettled ? "sent settled" : "sent and acknowledged",
+             secs * 1e3, secs > 0 ? app->completed / secs : 0.0);
+      if (app->broker_count > 1) {
+        printf("acknowledged by %d of %d brokers, average completion %.3f ms\n",
+               app->ack_quorum, app->broker_count,
+               app->completion_ns / 1e6 / app->completed);
+      }
+    }
+  }
+  release_replica(app, r, d);
+  if (b->acknowledged == app->message_count) {
+    /* Continue handling events till we receive TRANSPORT_CLOSED */
+    pn_connection_close(c);
+  }
+}
+
 /* Returns true to continue, false if finished */
 static bool handle(app_data_t* app, pn_event_t* event) {
   switch (pn_event_type(event)) {
@@ -193,6 +319,14 @@ static bool handle(app_data_t* app, pn_event_t* event) {
    case PN_CONNECTION_REMOTE_OPEN: {
      char amqp_topic[PN_MAX_ADDR];
      pn_connection_t* c = pn_event_connection(event);
+     broker_t* b = (broker_t*)pn_connection_get_context(c);
+     if (app->broker_count > 1) {
+       printf("broker %s:%s ", b->host, b->port);
+     }
+     report_connection_open(event, b->connect_start, app->ssl);
+     if (app->open_time == 0) {
+       app->open_time = clock_now_ns();
+     }
      set_topic_prefix_from_connection(app, c);
      pn_session_t* s = pn_session(c);
      pn_session_open(s);
@@ -209,6 +343,9 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      }
      printf("setting amqp topic:'%s'\n", amqp_topic);
      pn_terminus_set_address(pn_link_target(l), amqp_topic);
+     if (app->presettled) {
+       pn_link_set_snd_settle_mode(l, PN_SND_SETTLED);
+     }
      pn_link_open(l);
      break;
      }
@@ -218,15 +355,19 @@ static bool handle(app_data_t* app, pn_event_t* event) {
    case PN_LINK_FLOW: {
      /* The peer has given us some credit, now we can send messages */
      pn_link_t *sender = pn_event_link(event);
-     while (pn_link_credit(sender) > 0 && app->sent < app->message_count) {
-       ++app->sent;
-       /* Use sent counter as unique delivery tag. */
-       pn_delivery(sender, pn_dtag((const char *)&app->sent, sizeof(app->sent)));
-       {
-       pn_bytes_t msgbuf = encode_message(app);
-       pn_link_send(sender, msgbuf.start, msgbuf.size);
-       }
+     broker_t* b = (broker_t*)pn_connection_get_context(pn_event_connection(event));
+     while (pn_link_credit(sender) > 0 && b->sent < app->message_count) {
+       int sequence = b->sent++;
+       /* Use the message sequence as unique delivery tag. */
+       pn_delivery_t* d = pn_delivery(sender, pn_dtag((const char *)&sequence, sizeof(sequence)));
+       /* encoded once, shared with the other brokers */
+       replica_t* r = get_replica(app, sequence);
+       pn_link_send(sender, r->encoded.start, r->encoded.size);
        pn_link_advance(sender);
+       if (app->presettled) {
+         /* nothing comes back for a settled message */
+         replica_acked(app, b, r, d);
+       }
      }
      break;
    }
@@ -234,12 +375,13 @@ static bool handle(app_data_t* app, pn_event_t* event) {
    case PN_DELIVERY: {
      /* We received acknowledgement from the peer that a message was delivered. */
      pn_delivery_t* d = pn_event_delivery(event);
+     broker_t* b = (broker_t*)pn_connection_get_context(pn_event_connection(event));
+     pn_delivery_tag_t tag = pn_delivery_tag(d);
+     int sequence = 0;
+     memcpy(&sequence, tag.start, sizeof(sequence));
+     replica_t* r = &app->replicas[sequence];
      if (pn_delivery_remote_state(d) == PN_ACCEPTED) {
-       if (++app->acknowledged == app->message_count) {
-         printf("%d messages sent and acknowledged\n", app->acknowledged);
-         pn_connection_close(pn_event_connection(event));
-         /* Continue handling events till we receive TRANSPORT_CLOSED */
-       }
+       replica_acked(app, b, r, d);
      } else {
        pn_disposition_t* disposition = pn_delivery_remote(d);
        fprintf(stderr, "unexpected delivery state %d\n", (int)pn_delivery_remote_state(d));
@@ -278,7 +420,7 @@ static bool handle(app_data_t* app, pn_event_t* event) {
   return true;
 }
 
-void run(app_data_t *app) {
+static void run(app_data_t *app) {
   /* Loop and handle events */
   do {
     pn_event_batch_t *events = pn_proactor_wait(app->proactor);
@@ -300,21 +442,32 @@ void run(app_data_t *app) {
 
 #define AMQP_TOPIC_PREFIX_LEN AMQP_TOPIC_PREFIX_SIZE -1
 
-void usage(void) {
+static void usage(void) {
     printf("Usage: producer [options] \n");
     printf("\t-a      The host address [localhost]\n");
     printf("\t-p      The host port [5672]\n");
     printf("\t-c      # of messages to send [10]\n");
+    printf("\t-b      Replicate to broker <host>[:<port>], repeat for each broker, replaces -a []\n");
+    printf("\t-m      # of broker acknowledgements that complete a message [1]\n");
     printf("\t-t      Target address topic [my_topic]\n");
     printf("\t-i      AMQP Container id [producer:<pid>]\n");
     printf("\t-u      Client authentication username []\n");
     printf("\t-P      Client authentication password []\n");
+    printf("\t-e      Message time to live in ms []\n");
+    printf("\t-z      Message body size in bytes, the sequence string padded [the sequence]\n");
+    printf("\t-d      Settlement, 'unsettled' waits for the brokers to accept each message, 'presettled'\n");
+    printf("\t        sends them settled, at most once [unsettled]\n");
+    printf("\t-l      Stamp 1 in <n> messages, or one every <n>ms, for latency measurement []\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-Y      Answer the clock offset exchanges of consumers on other hosts at <address>, implies -N 1000 []\n");
     printf("\t-h      Displays this message\n");
     exit(0);
 
 }
 
-void parse_args(int argc, char **argv, app_data_t *app){
+static void parse_args(int argc, char **argv, app_data_t *app){
     char c;
     char con_id[PN_MAX_ADDR];
     if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
@@ -324,11 +477,17 @@ void parse_args(int argc, char **argv, app_data_t *app){
     /* initialize default values*/
     app->container_id = strdup(con_id); /* default to using argv[0] */
     app->host = "localhost";
-    app->port = "amqp";
+    app->port = NULL; /* amqp or amqps */
     app->message_count = 10;
     app->username = NULL;
     app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+    app->clock_address = NULL;
     app->amqp_address = "my_topic";
+    app->broker_count = 0;
+    app->ack_quorum = 1;
     /* 
      * Set a default amqp topic prefix since broker do not always
      * advertise a topic prefix. 
@@ -340,7 +499,7 @@ void parse_args(int argc, char **argv, app_data_t *app){
 
     /* command line options */
     opterr = 0;
-    while((c = getopt(argc, argv, "i:a:c:t:p:P:u:h")) != -1) {
+    while((c = getopt(argc, argv, "i:a:b:c:m:t:p:P:u:e:z:d:l:sC:Y:N:h")) != -1) {
         switch(c) {
         case 'h': usage(); break;
         case 'c': 
@@ -360,31 +519,133 @@ void parse_args(int argc, char **argv, app_data_t *app){
         case 'p': app->port = optarg; break;
         case 'P': app->password = optarg; break;
         case 'u': app->username = optarg; break;
+        case 'b': {
+            if (app->broker_count == MAX_BROKERS) {
+                fprintf(stderr, "At most %d brokers are supported\n", MAX_BROKERS);
+                exit(1);
+            }
+            broker_t* b = &app->brokers[app->broker_count];
+            char* sep = strrchr(optarg, ':');
+            b->index = app->broker_count++;
+            b->host = optarg;
+            b->port = NULL;
+            if (sep) {
+                *sep = '\0';
+                b->port = sep + 1;
+            }
+            break;
+        }
+        case 'm':
+            app->ack_quorum = atoi(optarg);
+            if (app->ack_quorum < 1) usage();
+            break;
+        case 'e':
+            app->ttl_ms = strtoul(optarg, NULL, 10);
+            if (app->ttl_ms == 0) usage();
+            break;
+        case 'z': app->body_size = strtoul(optarg, NULL, 10); break;
+        case 'd':
+            if (strcmp(optarg, "unsettled") == 0) app->presettled = false;
+            else if (strcmp(optarg, "presettled") == 0) app->presettled = true;
+            else usage();
+            break;
+        case 'l':
+            if (latency_sampler_parse(&app->latency_sampler, optarg) < 0) usage();
+            app->latency = true;
+            break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        case 'Y': app->clock_address = optarg; break;
         default: usage(); break;
         }
     }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (app->broker_count == 0) {
+        /* not replicating, the single broker is -a -p */
+        app->brokers[0].host = app->host;
+        app->broker_count = 1;
+    }
+    for (int i = 0; i < app->broker_count; ++i) {
+        if (!app->brokers[i].port) app->brokers[i].port = app->port;
+    }
+    if (app->ack_quorum > app->broker_count) {
+        fprintf(stderr, "Ack quorum %d exceeds the number of brokers %d\n",
+                app->ack_quorum, app->broker_count);
+        exit(1);
+    }
 
 }
 
-int main(int argc, char **argv) {
+int producer_main(int argc, char **argv) {
     struct app_data_t app = {0};
     char addr[PN_MAX_ADDR];
   
     parse_args(argc, argv, &app);
     
     app.proactor = pn_proactor();
-    pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
-    /* Initial Sasl transport for authentication */
-    pn_transport_t *pnt = pn_transport();
-    pn_sasl_t *sasl = pn_sasl(pnt);
-    pn_sasl_set_allow_insecure_mechs(sasl, true);
-    
-    pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+    app.replicas = (replica_t*)calloc(app.message_count ? app.message_count : 1, sizeof(replica_t));
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+    }
+    /* one connection per broker, all driven by the same proactor */
+    for (int i = 0; i < app.broker_count; ++i) {
+        broker_t *b = &app.brokers[i];
+        pn_connection_t *c = pn_connection();
+        pn_connection_set_context(c, b);
+        pn_proactor_addr(addr, sizeof(addr), b->host, b->port);
+        /* Initial Sasl transport for authentication */
+        pn_transport_t *pnt = pn_transport();
+        pn_sasl_t *sasl = pn_sasl(pnt);
+        pn_sasl_set_allow_insecure_mechs(sasl, true);
+        if (app.ssl && ssl_client_init(pnt, app.ssl_domain, b->host, b->port) < 0) {
+            exit(1);
+        }
+        b->connect_start = clock_now_ns();
+        pn_proactor_connect2(app.proactor, c, pnt, addr);
+    }
+    if (app.clock_address && !app.probe_ms) {
+        app.probe_ms = 1000;
+    }
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        if (app.clock_address) {
+            probe.clock_mode = PROBE_CLOCK_SERVE;
+            probe.clock_address = app.clock_address;
+        }
+        probe_start_sample(&app.probe, &probe);
+    }
     run(&app);
+    if (app.broker_count > 1) {
+        for (int i = 0; i < app.broker_count; ++i) {
+            printf("broker %s:%s acknowledged %d, first to complete %d of %d messages\n",
+                   app.brokers[i].host, app.brokers[i].port, app.brokers[i].acknowledged,
+                   app.brokers[i].wins, app.completed);
+        }
+    }
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
     pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
     /* free app data */
+    for (int i = 0; i < app.encoded; ++i) {
+        free((void*)app.replicas[i].encoded.start);
+    }
+    free(app.replicas);
     free(app.message_buffer.start);
     str_free(app.container_id);
     str_free(app.amqp_topic_prefix);
     return exit_code;
 }
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return producer_main(argc, argv);
+}
+#endif
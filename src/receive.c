@@ -23,6 +23,28 @@
  * Session, Receiver Link and how to receive messages using 
  * an AMQP address with the QPID Proton C API.
  *
+ * Given several sources with -R, each source link is a priority lane:
+ * higher priority links get a larger share of the -f credit, with -S lower
+ * priority links get no new credit while a higher priority link is busy,
+ * and the messages of each event batch are processed by priority.
+ *
+ * With -M the sample scales between a minimum and maximum number of
+ * consumers, each one a connection with its own receiver links served by
+ * its own proactor thread. Consumers are added while messages lag, credit
+ * stays saturated or the consumers are busy, and removed when idle after
+ * draining their credit. Lag is a moving average of message age from the
+ * producer timestamps, reported with -m.
+ *
+ * With -x, expired messages are settled without being decoded, found by
+ * scanning the header and properties sections of the encoded message.
+ *
+ * With -o the receive time, size, source address, latency and the -K
+ * properties of every message are captured to a columnar file instead of
+ * printing the messages, see colsink.h.
+ *
+ * Messages delta encoded by send -D are rebuilt from the previous payload
+ * of their stream. Each consumer keeps its own streams, so with several
+ * consumers sharing a queue a consumer sees gaps and waits for keyframes.
  */
 
 #include <proton/connection.h>
@@ -34,25 +56,162 @@
 #include <proton/session.h>
 #include <proton/transport.h>
 #include <proton/sasl.h>
+#include <proton/ssl.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "aggregate.h"
+#include "colsink.h"
+#include "delta.h"
+#include "lag.h"
+#include "latency.h"
+#include "section.h"
+#include "probe.h"
 #include "util.h"
 
+#define MAX_SOURCES 16
+#define MAX_CONSUMERS 16
+#define PRIORITIES 10   /* 0 lowest to 9 highest, as AMQP message priority */
+
+/* Columns of the -o capture, followed by one per -K property */
+enum {
+  CAPTURE_RECEIVE_US,       /* wall clock time of decoding */
+  CAPTURE_SIZE,             /* encoded bytes */
+  CAPTURE_ADDRESS,          /* source address */
+  CAPTURE_LATENCY_US,       /* from the latency stamp, -1 if not stamped */
+  CAPTURE_KEYS
+};
+#define MAX_CAPTURE_KEYS (COLSINK_MAX_COLUMNS - CAPTURE_KEYS)
+
+/* Autoscale thresholds on the fraction of time the consumers spend processing */
+#define SCALE_UP_UTILIZATION 0.8
+#define SCALE_DOWN_UTILIZATION 0.3
+
+/* A receiver link */
+typedef struct source_t {
+  const char *address;
+  int priority;
+  int index;
+  pn_link_t *link;
+  int window;               /* credit kept open on the link */
+  int batch_received;       /* # of messages completed in the current event batch */
+  int received;
+  pn_rwbytes_t msgin;       /* Partially received message */
+  latency_trace_t trace;    /* stages of the message being received */
+} source_t;
+
+/* A complete message collected during an event batch */
+typedef struct completed_t {
+  source_t *source;
+  pn_delivery_t *delivery;
+  pn_rwbytes_t data;
+  latency_trace_t trace;
+  bool stamped;             /* the message carries a latency stamp */
+  int64_t age_ms;           /* lag_message_age_ms() at decode */
+  int64_t arrival_ms;       /* clock_wall_ms() when complete, with -x */
+  bool expired;             /* shed without decoding */
+} completed_t;
+
+/*
+ * A connection with a receiver link per source. Only the thread handling
+ * the connection's event batch touches it, except for the fields noted.
+ * */
+typedef struct consumer_t {
+  int index;                /* aggregator slot */
+  pn_connection_t *connection;
+  source_t sources[MAX_SOURCES];
+  completed_t *completed;   /* messages completed in the current event batch */
+  int completed_size;
+  int completed_capacity;
+  pn_message_t *message;    /* reused to decode each message */
+  delta_codec_t delta;      /* streams of delta encoded messages */
+  colsink_block_t capture;  /* metadata rows not written yet */
+  latency_recorder_t latency_recorder;
+  latency_stages_t stages;
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  int granted;              /* credit granted on the links */
+  int arrived;              /* messages that used credit */
+  bool active;              /* connecting or connected, under app lock */
+  bool draining;            /* scaling down, under app lock */
+  bool drain_started;
+  bool drained;             /* no credit left, close at the batch boundary */
+  bool closing;
+} consumer_t;
+
+struct app_data_t;
+
+/* A proactor thread */
+typedef struct worker_t {
+  struct app_data_t *app;
+  int index;                /* 0 is the main thread, which never scales down */
+} worker_t;
+
 typedef struct app_data_t {
   const char *host, *port;
   const char *username, *password;
   const char *amqp_address;
   const char *container_id;
   int message_count;
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+  const char *clock_address; /* clock offset exchange address, NULL for none */
+  clocksync_t clock;        /* producer clock offset estimate */
+  agg_config_t agg_config;  /* aggregation enabled when agg_config.field is set */
+  bool latency;             /* record the latency of stamped messages */
+  bool latency_stages;      /* trace the stages of stamped messages */
+  source_t sources[MAX_SOURCES];
+  int source_count;
+  unsigned priorities;      /* bit mask of the source priorities */
+  bool strict_priority;     /* no new credit for a source while a higher priority one is busy */
+  int credit;               /* credit split between the sources and consumers, 0 for the default */
+  bool presettled;          /* ask the broker to send the messages settled */
+  int min_consumers, max_consumers;
+  unsigned scale_interval_ms;
+  int64_t scale_age_ms;     /* lag estimate that indicates the consumers fall behind */
+  unsigned lag_report_ms;   /* lag metric period, 0 for none */
+  uint64_t expired_outcome; /* PN_ACCEPTED or PN_MODIFIED to shed expired messages, 0 to process them */
+  const char *capture_path; /* columnar metadata file, NULL prints the messages */
+  const char *capture_keys[MAX_CAPTURE_KEYS];
+  colsink_type_t capture_types[MAX_CAPTURE_KEYS]; /* of the -K columns */
+  int capture_key_count;
+  colsink_t capture;
 
   pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  char addr[PN_MAX_ADDR];
+  aggregator_t *aggregator;
+  unsigned timer_ms;        /* proactor timeout period, 0 for none */
+  uint64_t next_scale;      /* clock_now_ns() of the next autoscale decision */
+  uint64_t next_lag_report; /* clock_now_ns() of the next lag metric */
+  consumer_t *consumers;    /* max_consumers */
+  worker_t workers[MAX_CONSUMERS];
+  pthread_t threads[MAX_CONSUMERS];
+  bool thread_created[MAX_CONSUMERS];
+  bool thread_running[MAX_CONSUMERS];
+
+  /* shared by the threads, under lock */
+  pthread_mutex_t lock;
+  uint64_t open_time;       /* clock_now_ns() at the first PN_CONNECTION_REMOTE_OPEN */
   int received;
+  int expired;              /* messages shed */
+  int granted;              /* credit granted and not returned by a drain */
+  bool done;                /* all messages received, consumers close */
   bool finished;
-  pn_rwbytes_t msgin;       /* Partially received message */
+  int active_consumers;     /* consumers connecting or connected and not draining */
+  int open_consumers;       /* consumers with a transport */
+  int peak_consumers;
+  int threads_wanted;
+  uint64_t busy_ns;         /* time spent processing since the last autoscale decision */
+  int batches;
+  int saturated_batches;    /* batches that found a link without credit */
+  lag_estimator_t lag;      /* over the messages of every consumer */
+  uint64_t scale_lag_samples; /* lag.samples at the last autoscale decision */
 } app_data_t;
 
 static const int BATCH = 1000; /* Batch size for unlimited receive */
@@ -76,25 +235,438 @@ static void check_condition(pn_event_t *e, pn_condition_t *cond) {
   }
 }
 
-static void decode_message(pn_rwbytes_t data) {
-  pn_message_t *m = pn_message();
+/* Reads a numeric property as an int64, exact for the 64 bit integer types */
+static bool property_int64(pn_data_t* properties, int64_t* value) {
+  double number;
+  switch (pn_data_type(properties)) {
+  case PN_LONG: *value = pn_data_get_long(properties); return true;
+  case PN_ULONG: *value = (int64_t)pn_data_get_ulong(properties); return true;
+  case PN_TIMESTAMP: *value = pn_data_get_timestamp(properties); return true;
+  default:
+    if (!data_get_number(properties, &number)) return false;
+    *value = (int64_t)number;
+    return true;
+  }
+}
+
+/* Adds a row of the message's metadata to the consumer's capture block */
+static void capture_message(app_data_t* app, consumer_t* cs, const source_t* source, pn_message_t* m, size_t size) {
+  colsink_block_t *block = &cs->capture;
+  pn_data_t *properties = pn_message_properties(m);
+  colsink_set_int64(block, CAPTURE_RECEIVE_US, (int64_t)clock_wall_us());
+  colsink_set_uint32(block, CAPTURE_SIZE, (uint32_t)size);
+  colsink_set_string(block, CAPTURE_ADDRESS, source->address, strlen(source->address));
+  colsink_set_int64(block, CAPTURE_LATENCY_US, latency_message_us(m));
+  for (int i = 0; i < app->capture_key_count; ++i) {
+    double number;
+    int64_t integer;
+    if (!data_map_find(properties, app->capture_keys[i])) {
+      continue;
+    }
+    /* a typed column leaves a value of another type missing */
+    if (app->capture_types[i] == COLSINK_INT64) {
+      if (property_int64(properties, &integer)) {
+        colsink_set_int64(block, CAPTURE_KEYS + i, integer);
+      }
+    } else if (app->capture_types[i] == COLSINK_DOUBLE) {
+      if (data_get_number(properties, &number)) {
+        colsink_set_double(block, CAPTURE_KEYS + i, number);
+      }
+    } else if (pn_data_type(properties) == PN_STRING || pn_data_type(properties) == PN_SYMBOL) {
+      pn_bytes_t value = pn_data_type(properties) == PN_STRING ? pn_data_get_string(properties)
+                                                               : pn_data_get_symbol(properties);
+      colsink_set_string(block, CAPTURE_KEYS + i, value.start, value.size);
+    } else if (data_get_number(properties, &number)) {
+      char value[32];
+      int n = snprintf(value, sizeof(value), "%.17g", number);
+      colsink_set_string(block, CAPTURE_KEYS + i, value, (size_t)n);
+    }
+  }
+  colsink_row_end(block);
+}
+
+/* Returns true if the message carries a latency stamp */
+static bool decode_message(app_data_t* app, consumer_t* cs, const source_t* source, pn_rwbytes_t data, latency_trace_t* trace, int64_t* age_ms) {
+  pn_message_t *m = cs->message;
+  bool stamped = false;
+  pn_message_clear(m);
   int err = pn_message_decode(m, data.start, data.size);
   if (!err) {
-    /* Print the decoded message */
-    pn_string_t *s = pn_string(NULL);
-    pn_inspect(pn_message_body(m), s);
-    printf("%s\n", pn_string_get(s));
-    pn_free(s);
-    pn_message_free(m);
+    if (app->latency_stages) {
+      latency_trace_mark(trace, LATENCY_RECV_DECODE);
+    }
+    if (app->latency) {
+      stamped = latency_record(&cs->latency_recorder, m);
+    }
+    /* added to the lag estimate at the batch boundary */
+    *age_ms = lag_message_age_ms(m);
+    /* rebuild delta encoded payloads whether or not they are printed, to follow their streams */
+    delta_frame_t frame;
+    pn_bytes_t payload;
+    delta_result_t delta = delta_message_decode(&cs->delta, m, &frame, &payload);
+    if (app->capture_path) {
+      capture_message(app, cs, source, m, data.size);
+    }
+    if (app->aggregator) {
+      /* only the window aggregates are written out */
+      uint64_t now = clock_wall_ms();
+      aggregator_tick(app->aggregator, now);
+      aggregator_add(app->aggregator, cs->index, m, now);
+    } else if (app->capture_path) {
+      /* only the metadata is written out */
+    } else if (delta == DELTA_OK) {
+      printf("%s #%llu: %zu byte %s\n", frame.stream, (unsigned long long)frame.sequence,
+             payload.size, frame.keyframe ? "keyframe" : "payload from delta");
+    } else if (delta == DELTA_WAITING) {
+      printf("%s #%llu: dropped waiting for a keyframe\n", frame.stream, (unsigned long long)frame.sequence);
+    } else {
+      /* Print the decoded message */
+      pn_string_t *s = pn_string(NULL);
+      pn_inspect(pn_message_body(m), s);
+      printf("%s\n", pn_string_get(s));
+      pn_free(s);
+    }
+    if (app->latency_stages) {
+      latency_trace_mark(trace, LATENCY_RECV_PROCESSED);
+    }
     free(data.start);
   } else {
     fprintf(stderr, "decode_message: %s\n", pn_code(err));
     exit_code = 1;
   }
+  return stamped;
+}
+
+/*
+ * Settles an expired message with the -x outcome without decoding it. A
+ * message that cannot be scanned is left to decode_message() to report.
+ * Returns false for a message that has not expired.
+ * */
+static bool shed_expired(app_data_t* app, completed_t* c) {
+  section_expiry_t expiry;
+  int64_t now = (int64_t)clock_wall_ms();
+  if (section_scan_expiry(c->data.start, c->data.size, &expiry) < 0
+      || !section_expired(&expiry, c->arrival_ms, now)) {
+    return false;
+  }
+  if (app->expired_outcome == PN_MODIFIED) {
+    /* not to be redelivered here, the broker may dead letter it */
+    pn_disposition_t *disposition = pn_delivery_local(c->delivery);
+    pn_disposition_set_failed(disposition, true);
+    pn_disposition_set_undeliverable(disposition, true);
+  }
+  pn_delivery_update(c->delivery, app->expired_outcome);
+  /* still a measure of how far behind the consumers are */
+  c->age_ms = lag_age_ms(expiry.creation_time, now);
+  free(c->data.start);
+  c->data = pn_rwbytes_null;
+  return true;
+}
+
+/* Grants credit on a consumer's link, counting it against the messages left */
+static void flow(app_data_t* app, consumer_t* cs, pn_link_t* l, int credit) {
+  pthread_mutex_lock(&app->lock);
+  app->granted += credit;
+  pthread_mutex_unlock(&app->lock);
+  cs->granted += credit;
+  pn_link_flow(l, credit);
+}
+
+/* Keeps the credit window of a source open, never granting more than the messages left */
+static void top_up_credit(app_data_t* app, consumer_t* cs, source_t* src) {
+  int credit = pn_link_credit(src->link);
+  int grant = src->window - credit;
+  if (credit >= (src->window + 1) / 2) {
+    return;
+  }
+  if (app->message_count) {
+    pthread_mutex_lock(&app->lock);
+    int remaining = app->message_count - app->granted;
+    pthread_mutex_unlock(&app->lock);
+    if (grant > remaining) grant = remaining;
+  }
+  if (grant > 0) {
+    flow(app, cs, src->link, grant);
+  }
+}
+
+/*
+ * Grants credit in priority order, with strict priority a source gets no
+ * new credit while a higher priority source received messages in the batch.
+ * A source left short of credit wakes the connection so the grant runs
+ * again after the next batch, else it would wait for a message that can
+ * not arrive. A draining consumer gets no new credit.
+ * */
+static void grant_credit(app_data_t* app, consumer_t* cs) {
+  bool busy = false;
+  bool starved = false;
+  if (cs->drain_started) {
+    return;
+  }
+  for (int p = PRIORITIES - 1; p >= 0; --p) {
+    bool level_busy = false;
+    if (!(app->priorities & (1u << p))) {
+      continue;
+    }
+    for (int i = 0; i < app->source_count; ++i) {
+      source_t *src = &cs->sources[i];
+      if (src->priority == p) {
+        if (!(busy && app->strict_priority)) {
+          top_up_credit(app, cs, src);
+        } else if (pn_link_credit(src->link) < (src->window + 1) / 2) {
+          starved = true;
+        }
+        level_busy |= src->batch_received > 0;
+        src->batch_received = 0;
+      }
+    }
+    busy |= level_busy;
+  }
+  if (starved) {
+    /* the woken batch is idle unless the higher priorities are still busy */
+    pn_connection_wake(cs->connection);
+  }
+}
+
+/* Asks the other consumers to close once all messages are received, called under app lock */
+static void wake_consumers(app_data_t* app, consumer_t* except) {
+  for (int i = 0; i < app->max_consumers; ++i) {
+    consumer_t *other = &app->consumers[i];
+    if (other != except && other->active && other->connection) {
+      pn_connection_wake(other->connection);
+    }
+  }
+}
+
+/*
+ * Processes the messages completed during an event batch together at the
+ * batch boundary, while the batch's connection is still ours: decode all of
+ * them, highest priority source first, then accept and settle all of them,
+ * then grant credit once. The dispositions go out in the same transport write.
+ * */
+static void process_completed(app_data_t* app, consumer_t* cs) {
+  int n = cs->completed_size;
+  uint64_t start = clock_now_ns();
+  bool saturated = false;
+  bool was_done;
+  int expired = 0;
+  for (int i = 0; i < n; ++i) {
+    completed_t *c = &cs->completed[i];
+    c->age_ms = -1;
+    c->stamped = false;
+    c->expired = app->expired_outcome && shed_expired(app, c);
+    expired += c->expired;
+  }
+  for (int p = PRIORITIES - 1; p >= 0 && n > expired; --p) {
+    if (!(app->priorities & (1u << p))) {
+      continue;
+    }
+    for (int i = 0; i < n; ++i) {
+      completed_t *c = &cs->completed[i];
+      if (i + 1 < n) {
+        __builtin_prefetch(cs->completed[i + 1].data.start);
+      }
+      if (c->source->priority == p && !c->expired) {
+        c->stamped = decode_message(app, cs, c->source, c->data, &c->trace, &c->age_ms);
+      }
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    completed_t *c = &cs->completed[i];
+    /* a message the broker sent settled takes no outcome */
+    if (!c->expired && !pn_delivery_settled(c->delivery)) {
+      pn_delivery_update(c->delivery, PN_ACCEPTED);
+    }
+    pn_delivery_settle(c->delivery);  /* settle and free the delivery */
+    if (app->latency_stages && c->stamped) {
+      latency_trace_mark(&c->trace, LATENCY_RECV_SETTLE);
+      latency_stages_record(&cs->stages, &c->trace);
+    }
+    ++c->source->received;
+    ++c->source->batch_received;
+  }
+  cs->completed_size = 0;
+  for (int i = 0; i < app->source_count; ++i) {
+    saturated |= pn_link_credit(cs->sources[i].link) == 0;
+  }
+
+  pthread_mutex_lock(&app->lock);
+  was_done = app->done;
+  app->received += n;
+  app->expired += expired;
+  if (n > 0) {
+    app->busy_ns += clock_now_ns() - start;
+    ++app->batches;
+    app->saturated_batches += saturated;
+  }
+  for (int i = 0; i < n; ++i) {
+    lag_add(&app->lag, cs->completed[i].age_ms);
+  }
+  if (app->message_count && app->received >= app->message_count) {
+    app->done = true;
+  }
+  if (app->done && !was_done) {
+    if (app->message_count && app->received >= app->message_count) {
+      double secs = (clock_now_ns() - app->open_time) / 1e9;
+      printf("%d messages received in %.3f ms (%.0f msg/s)\n",
+             app->received, secs * 1e3, secs > 0 ? app->received / secs : 0.0);
+    }
+    wake_consumers(app, cs);
+  }
+  pthread_mutex_unlock(&app->lock);
+  /* see if more credit is needed */
+  grant_credit(app, cs);
+}
+
+/* Closes a consumer that is done or drained once its batch is processed */
+static void consumer_batch_done(app_data_t* app, consumer_t* cs) {
+  bool done;
+  if (!cs->connection || cs->closing) {
+    return;
+  }
+  process_completed(app, cs);
+  pthread_mutex_lock(&app->lock);
+  done = app->done;
+  pthread_mutex_unlock(&app->lock);
+  if (done || cs->drained) {
+    pn_session_t *ssn = pn_link_session(cs->sources[0].link);
+    for (int i = 0; i < app->source_count; ++i) {
+      pn_link_close(cs->sources[i].link);
+    }
+    pn_session_close(ssn);
+    pn_connection_close(cs->connection);
+    cs->closing = true;
+  }
+}
+
+/* Starts draining a consumer that is scaled down, the sender uses up or returns the credit */
+static void consumer_drain(app_data_t* app, consumer_t* cs) {
+  cs->drain_started = true;
+  for (int i = 0; i < app->source_count; ++i) {
+    pn_link_drain(cs->sources[i].link, 0);
+  }
+}
+
+/* Marks a draining consumer drained once no link has credit left */
+static void consumer_check_drained(app_data_t* app, consumer_t* cs) {
+  if (!cs->drain_started || cs->drained) {
+    return;
+  }
+  for (int i = 0; i < app->source_count; ++i) {
+    if (pn_link_draining(cs->sources[i].link)) {
+      return;
+    }
+  }
+  cs->drained = true;
+  /* credit the sender returned is free for the other consumers */
+  pthread_mutex_lock(&app->lock);
+  app->granted -= cs->granted - cs->arrived;
+  pthread_mutex_unlock(&app->lock);
+}
+
+/* Connects a consumer, called under app lock from any thread */
+static int consumer_connect(app_data_t* app, consumer_t* cs) {
+  pn_transport_t *pnt = pn_transport();
+  pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+  if (app->ssl && ssl_client_init(pnt, app->ssl_domain, app->host, app->port) < 0) {
+    pn_transport_free(pnt);
+    return -1;
+  }
+  memcpy(cs->sources, app->sources, sizeof(cs->sources));
+  for (int i = 0; i < app->source_count; ++i) {
+    cs->sources[i].received = 0;
+  }
+  cs->completed_size = 0;
+  cs->granted = cs->arrived = 0;
+  cs->draining = cs->drain_started = cs->drained = cs->closing = false;
+  cs->active = true;
+  cs->connection = pn_connection();
+  pn_connection_set_context(cs->connection, cs);
+  ++app->active_consumers;
+  ++app->open_consumers;
+  if (app->active_consumers > app->peak_consumers) app->peak_consumers = app->active_consumers;
+  cs->connect_start = clock_now_ns();
+  pn_proactor_connect2(app->proactor, cs->connection, pnt, app->addr);
+  return 0;
+}
+
+static void* worker(void* arg);
+
+/* Runs a thread for every wanted thread slot, called under app lock */
+static void start_threads(app_data_t* app) {
+  for (int i = 1; i < app->threads_wanted; ++i) {
+    if (!app->thread_running[i]) {
+      if (app->thread_created[i]) {
+        /* the slot's last thread returned after scaling down */
+        pthread_join(app->threads[i], NULL);
+      }
+      app->thread_running[i] = true;
+      app->thread_created[i] = true;
+      pthread_create(&app->threads[i], NULL, worker, &app->workers[i]);
+    }
+  }
+}
+
+/*
+ * Adds a consumer while the lag estimate is -A or more and timed messages
+ * arrived in the interval, credit is saturated in most batches or the
+ * consumers are busy, and removes one when none of that holds and the
+ * consumers are mostly idle.
+ * */
+static void autoscale(app_data_t* app) {
+  double interval_ns = app->scale_interval_ms * 1e6;
+  double utilization;
+  bool lagging, saturated;
+  const char *reason;
+  pthread_mutex_lock(&app->lock);
+  utilization = app->active_consumers ? app->busy_ns / (interval_ns * app->active_consumers) : 0;
+  /* the estimate only moves when timed messages arrive, a stale one is no evidence of lag */
+  lagging = app->lag.samples > app->scale_lag_samples && lag_ms(&app->lag) >= app->scale_age_ms;
+  saturated = app->batches > 0 && app->saturated_batches * 2 > app->batches;
+  reason = lagging ? "messages lag" : saturated ? "credit saturated" : "consumers busy";
+  if (app->done || app->finished) {
+    /* nothing to scale */
+  } else if ((lagging || saturated || utilization > SCALE_UP_UTILIZATION)
+             && app->active_consumers < app->max_consumers) {
+    for (int i = 0; i < app->max_consumers; ++i) {
+      consumer_t *cs = &app->consumers[i];
+      if (!cs->active && !cs->connection) {
+        if (consumer_connect(app, cs) == 0) {
+          app->threads_wanted = app->active_consumers;
+          start_threads(app);
+          printf("scaling up to %d consumers, %s (lag %.1f ms, utilization %.0f%%, %d of %d batches saturated)\n",
+                 app->active_consumers, reason, lag_ms(&app->lag), utilization * 100,
+                 app->saturated_batches, app->batches);
+        }
+        break;
+      }
+    }
+  } else if (!lagging && !saturated && utilization < SCALE_DOWN_UTILIZATION
+             && app->active_consumers > app->min_consumers) {
+    /* the newest consumer drains its credit, then closes */
+    for (int i = app->max_consumers - 1; i >= 0; --i) {
+      consumer_t *cs = &app->consumers[i];
+      if (cs->active && !cs->draining && cs->connection) {
+        cs->draining = true;
+        --app->active_consumers;
+        app->threads_wanted = app->active_consumers;
+        pn_connection_wake(cs->connection);
+        printf("scaling down to %d consumers (utilization %.0f%%)\n",
+               app->active_consumers, utilization * 100);
+        break;
+      }
+    }
+  }
+  app->busy_ns = 0;
+  app->batches = app->saturated_batches = 0;
+  app->scale_lag_samples = app->lag.samples;
+  pthread_mutex_unlock(&app->lock);
 }
 
 /* Return true to continue, false to exit */
 static bool handle(app_data_t* app, pn_event_t* event) {
+  pn_connection_t *connection = pn_event_connection(event);
+  consumer_t *cs = connection ? (consumer_t*)pn_connection_get_context(connection) : NULL;
   switch (pn_event_type(event)) {
 
    case PN_CONNECTION_INIT: {
@@ -108,32 +680,72 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      pn_connection_set_container(c, app->container_id);
      pn_connection_open(c);
      pn_session_open(s);
-     {
-     pn_link_t* l = pn_receiver(s, "my_receiver");
-     /*
-      * Set the terminus address to the target destination or node
-      * on the remote broker.
-      *
-      * The Solace Pubsub+ broker treats all un-prefixed termini
-      * addresses as queues, alternatively adding the 'queue://'
-      * prefix to the terminus address will receive messages from
-      * a queue as well.
-      * */
-     pn_terminus_set_address(pn_link_source(l), app->amqp_address);
-     pn_link_open(l);
-     /* cannot receive without granting credit: */
-     pn_link_flow(l, app->message_count ? app->message_count : BATCH);
+     for (int i = 0; i < app->source_count; ++i) {
+       source_t *src = &cs->sources[i];
+       char name[32] = "my_receiver";
+       if (i > 0 || cs->index > 0) {
+         snprintf(name, sizeof(name), "my_receiver_%d_%d", cs->index, i);
+       }
+       pn_link_t* l = pn_receiver(s, name);
+       /*
+        * Set the terminus address to the target destination or node
+        * on the remote broker.
+        *
+        * The Solace Pubsub+ broker treats all un-prefixed termini
+        * addresses as queues, alternatively adding the 'queue://'
+        * prefix to the terminus address will receive messages from
+        * a queue as well.
+        * */
+       pn_terminus_set_address(pn_link_source(l), src->address);
+       if (app->presettled) {
+         pn_link_set_snd_settle_mode(l, PN_SND_SETTLED);
+       }
+       pn_link_set_context(l, src);
+       pn_link_open(l);
+       src->link = l;
      }
+     /* cannot receive without granting credit, higher priorities first: */
+     grant_credit(app, cs);
    } break;
 
+   case PN_CONNECTION_REMOTE_OPEN:
+     report_connection_open(event, cs->connect_start, app->ssl);
+     pthread_mutex_lock(&app->lock);
+     if (!app->open_time) app->open_time = clock_now_ns();
+     pthread_mutex_unlock(&app->lock);
+     break;
+
+   case PN_CONNECTION_WAKE: {
+     /* scaled down or all messages received, closed at the batch boundary,
+        or a source short of credit, granted at the batch boundary */
+     bool draining;
+     pthread_mutex_lock(&app->lock);
+     draining = cs->draining;
+     pthread_mutex_unlock(&app->lock);
+     if (draining && !cs->drain_started) {
+       consumer_drain(app, cs);
+       consumer_check_drained(app, cs);
+     }
+     break;
+   }
+
+   case PN_LINK_FLOW:
+     /* the sender used up or returned the credit of a draining link */
+     consumer_check_drained(app, cs);
+     break;
+
    case PN_DELIVERY: {
      /* A message has been received */
      pn_delivery_t *d = pn_event_delivery(event);
      if (pn_delivery_readable(d)) {
        pn_link_t *l = pn_delivery_link(d);
+       source_t *src = (source_t*)pn_link_get_context(l);
        size_t size = pn_delivery_pending(d);
-       pn_rwbytes_t* m = &app->msgin; /* Append data to incoming message buffer */
+       pn_rwbytes_t* m = &src->msgin; /* Append data to incoming message buffer */
        int recv;
+       if (app->latency_stages && m->size == 0) {
+         latency_trace_mark(&src->trace, LATENCY_RECV_TRANSPORT_READ);
+       }
        size_t oldsize = m->size;
        m->size += size;
        m->start = (char*)realloc(m->start, m->size);
@@ -142,36 +754,91 @@ static bool handle(app_data_t* app, pn_event_t* event) {
          fprintf(stderr, "Message aborted\n");
          m->size = 0;           /* Forget the data we accumulated */
          pn_delivery_settle(d); /* Free the delivery so we can receive the next message */
-         pn_link_flow(l, 1);    /* Replace credit for aborted message */
+         ++cs->arrived;
+         flow(app, cs, l, 1);   /* Replace credit for aborted message */
        } else if (recv < 0 && recv != PN_EOS) {        /* Unexpected error */
          pn_condition_format(pn_link_condition(l), "broker", "PN_DELIVERY error: %s", pn_code(recv));
          pn_link_close(l);               /* Unexpected error, close the link */
        } else if (!pn_delivery_partial(d)) { /* Message is complete */
-         decode_message(*m);
-         *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
-         /* Accept the delivery */
-         pn_delivery_update(d, PN_ACCEPTED);
-         pn_delivery_settle(d);  /* settle and free d */
-         if (app->message_count == 0) {
-           /* receive forever - see if more credit is needed */
-           if (pn_link_credit(l) < BATCH/2) {
-             /* Grant enough credit to bring it up to BATCH: */
-             pn_link_flow(l, BATCH - pn_link_credit(l));
-           }
-         } else if (++app->received >= app->message_count) {
-           pn_session_t *ssn = pn_link_session(l);
-           printf("%d messages received\n", app->received);
-           pn_link_close(l);
-           pn_session_close(ssn);
-           pn_connection_close(pn_session_connection(ssn));
+         completed_t *c;
+         if (app->latency_stages) {
+           latency_trace_mark(&src->trace, LATENCY_RECV_DELIVERY_COMPLETE);
+         }
+         ++cs->arrived;
+         /* processed with the rest of the event batch */
+         if (cs->completed_size == cs->completed_capacity) {
+           cs->completed_capacity = cs->completed_capacity ? cs->completed_capacity * 2 : 64;
+           cs->completed = (completed_t*)realloc(cs->completed, cs->completed_capacity * sizeof(completed_t));
          }
+         c = &cs->completed[cs->completed_size++];
+         c->source = src;
+         c->delivery = d;
+         c->data = *m;
+         c->trace = src->trace;
+         c->arrival_ms = app->expired_outcome ? (int64_t)clock_wall_ms() : 0;
+         *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
+         /* the next delivery becomes current while this one waits for the batch boundary */
+         pn_link_advance(l);
        }
      }
      break;
    }
 
+   case PN_PROACTOR_TIMEOUT: {
+    bool finished;
+    /* close aggregation windows while no messages arrive */
+    if (app->aggregator) {
+      aggregator_tick(app->aggregator, clock_wall_ms());
+    }
+    if (app->max_consumers > app->min_consumers && clock_now_ns() >= app->next_scale) {
+      app->next_scale = clock_now_ns() + app->scale_interval_ms * 1000000ull;
+      autoscale(app);
+    }
+    if (app->lag_report_ms && clock_now_ns() >= app->next_lag_report) {
+      app->next_lag_report = clock_now_ns() + app->lag_report_ms * 1000000ull;
+      pthread_mutex_lock(&app->lock);
+      lag_report(stdout, app->container_id, &app->lag);
+      pthread_mutex_unlock(&app->lock);
+    }
+    pthread_mutex_lock(&app->lock);
+    finished = app->finished;
+    pthread_mutex_unlock(&app->lock);
+    if (!finished) {
+      pn_proactor_set_timeout(app->proactor, app->timer_ms);
+    }
+    break;
+   }
+
    case PN_TRANSPORT_CLOSED:
     check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    for (int i = 0; i < cs->completed_size; ++i) {
+      free(cs->completed[i].data.start);
+    }
+    cs->completed_size = 0;
+    pthread_mutex_lock(&app->lock);
+    for (int i = 0; i < app->source_count; ++i) {
+      free(cs->sources[i].msgin.start);
+      cs->sources[i].msgin = pn_rwbytes_null;
+      app->sources[i].received += cs->sources[i].received;
+    }
+    if (!cs->draining) {
+      --app->active_consumers;
+      /* a consumer lost to an error is not replaced */
+      if (!app->done) app->done = exit_code != 0;
+    }
+    cs->active = false;
+    cs->connection = NULL;
+    if (--app->open_consumers == 0) {
+      /* stop the timer so the proactor goes inactive */
+      app->finished = true;
+      if (app->timer_ms) {
+        pn_proactor_cancel_timeout(app->proactor);
+      }
+    }
+    if (app->done) {
+      wake_consumers(app, cs);
+    }
+    pthread_mutex_unlock(&app->lock);
     break;
 
    case PN_CONNECTION_REMOTE_CLOSE:
@@ -191,6 +858,9 @@ static bool handle(app_data_t* app, pn_event_t* event) {
     break;
 
    case PN_PROACTOR_INACTIVE:
+   case PN_PROACTOR_INTERRUPT:
+    /* pass the interrupt on so every thread returns */
+    pn_proactor_interrupt(app->proactor);
     return false;
     break;
 
@@ -200,36 +870,86 @@ static bool handle(app_data_t* app, pn_event_t* event) {
     return true;
 }
 
-void run(app_data_t *app) {
+/* Handles event batches until the proactor is done or the thread's slot is scaled down */
+static void run(app_data_t *app, int thread) {
   /* Loop and handle events */
   do {
     pn_event_batch_t *events = pn_proactor_wait(app->proactor);
+    pn_connection_t *c = pn_event_batch_connection(events);
     pn_event_t *e;
     for (e = pn_event_batch_next(events); e; e = pn_event_batch_next(events)) {
-      if (!handle(app, e) || exit_code != 0) {
+      if (!handle(app, e)) {
+        pn_proactor_done(app->proactor, events);
         return;
       }
     }
+    if (c) {
+      consumer_batch_done(app, (consumer_t*)pn_connection_get_context(c));
+    }
     pn_proactor_done(app->proactor, events);
+    if (exit_code != 0 && app->max_consumers == 1) {
+      return;
+    }
+    if (thread > 0) {
+      bool scaled_down;
+      pthread_mutex_lock(&app->lock);
+      scaled_down = thread >= app->threads_wanted;
+      if (scaled_down) app->thread_running[thread] = false;
+      pthread_mutex_unlock(&app->lock);
+      if (scaled_down) {
+        return;
+      }
+    }
   } while(true);
 }
 
-void usage() {
+static void* worker(void* arg) {
+  worker_t *w = (worker_t*)arg;
+  run(w->app, w->index);
+  return NULL;
+}
+
+static void usage() {
     printf("Usage: receive [options] \n");
     printf("[Options]:\n");
     printf("\t-a      The host address [localhost]\n");
     printf("\t-p      The host port [5672]\n");
     printf("\t-c      # of messages to receive [10]\n");
     printf("\t-t      Target address [examples]\n");
+    printf("\t-R      Source address[,priority] sharing the connection, repeat for several links [-t,4]\n");
+    printf("\t-S      Strict priority, no new credit for a source while a higher priority source is busy, use with -R\n");
+    printf("\t-f      Credit window, split between the sources by priority and between the consumers\n");
+    printf("\t        [-c for a single source and consumer, otherwise 1000]\n");
+    printf("\t-d      Settlement, 'unsettled' accepts each message, 'presettled' asks the broker to send\n");
+    printf("\t        them settled, at most once [unsettled]\n");
+    printf("\t-M      min[:max] consumers, each a connection with its own thread, scaled between the two [1:1]\n");
+    printf("\t-I      Autoscale decision interval in ms, use with -M [1000]\n");
+    printf("\t-A      Lag estimate in ms above which consumers are added, use with -M [1000]\n");
+    printf("\t-m      Report the lag estimate every <ms> []\n");
+    printf("\t-x      Shed expired messages without decoding them, settled as 'accept' or 'modify' []\n");
+    printf("\t-o      Capture the metadata of every message to this columnar file instead of printing them []\n");
+    printf("\t-K      Application property to capture as a column, <name>:int or <name>:double for a\n");
+    printf("\t        numeric column, repeat for several, use with -o []\n");
     printf("\t-i      Container name [receive:<pid>]\n");
     printf("\t-u      Client authentication username []\n");
     printf("\t-P      Client authentication password []\n");
+    printf("\t-g      Aggregate numeric application property <name>, or 'body', instead of printing messages []\n");
+    printf("\t-k      Group aggregates by application property <name> []\n");
+    printf("\t-w      Aggregation window in ms [1000]\n");
+    printf("\t-W      Aggregation window slide in ms, less than -w for sliding windows [-w]\n");
+    printf("\t-l      Record the latency of messages stamped by the sender\n");
+    printf("\t-L      Report the per-stage latency of stamped messages, implies -l\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-Y      Estimate the producer clock offset by exchanges with a producer serving <address>\n");
+    printf("\t        and correct the latency by it, implies -N 1000 []\n");
     printf("\t-h      Displays this message\n");
     exit(0);
 
 }
 
-void parse_args(int argc, char **argv, app_data_t *app) {
+static void parse_args(int argc, char **argv, app_data_t *app) {
     char c;
     char con_id[PN_MAX_ADDR];
     if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
@@ -239,16 +959,25 @@ void parse_args(int argc, char **argv, app_data_t *app) {
     /* initialize default values*/
     app->container_id = strdup(con_id); /* default to using argv[0] */
     app->host = "localhost";
-    app->port = "amqp";
+    app->port = NULL; /* amqp or amqps */
     app->amqp_address = "examples";
     app->message_count = 10;
     /* default to anonymous authentication */
     app->username = NULL;
     app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+    app->clock_address = NULL;
+    app->agg_config.window_ms = 1000;
+    app->min_consumers = app->max_consumers = 1;
+    app->scale_interval_ms = 1000;
+    app->scale_age_ms = 1000;
+    app->agg_config.sink = stdout;
 
     /* command line options */
     opterr = 0;
-    while((c = getopt(argc, argv, "i:a:c:t:p:u:P:h")) != -1) {
+    while((c = getopt(argc, argv, "i:a:c:t:R:Sf:d:M:I:A:m:x:o:K:p:u:P:g:k:w:W:lLsC:Y:N:h")) != -1) {
         switch(c) {
         case 'h': usage(); break;
         case 'c':
@@ -265,37 +994,314 @@ void parse_args(int argc, char **argv, app_data_t *app) {
             app->container_id = strdup(con_id);
             break;
         case 't': app->amqp_address = optarg; break;
+        case 'R': {
+            if (app->source_count == MAX_SOURCES) {
+                fprintf(stderr, "At most %d sources are supported\n", MAX_SOURCES);
+                exit(1);
+            }
+            /* <address>[,<priority>] */
+            source_t *src = &app->sources[app->source_count];
+            char *sep = strchr(optarg, ',');
+            src->index = app->source_count++;
+            src->address = optarg;
+            src->priority = PN_DEFAULT_PRIORITY;
+            if (sep) {
+                *sep = '\0';
+                src->priority = atoi(sep + 1);
+                if (src->priority < 0 || src->priority >= PRIORITIES) usage();
+            }
+            break;
+        }
+        case 'S': app->strict_priority = true; break;
+        case 'f':
+            app->credit = atoi(optarg);
+            if (app->credit < 1) usage();
+            break;
+        case 'd':
+            if (strcmp(optarg, "unsettled") == 0) app->presettled = false;
+            else if (strcmp(optarg, "presettled") == 0) app->presettled = true;
+            else usage();
+            break;
+        case 'M': {
+            /* <min>[:<max>] */
+            char *sep = strchr(optarg, ':');
+            app->min_consumers = app->max_consumers = atoi(optarg);
+            if (sep) app->max_consumers = atoi(sep + 1);
+            if (app->min_consumers < 1 || app->max_consumers < app->min_consumers) usage();
+            if (app->max_consumers > MAX_CONSUMERS) {
+                fprintf(stderr, "At most %d consumers are supported\n", MAX_CONSUMERS);
+                exit(1);
+            }
+            break;
+        }
+        case 'I':
+            app->scale_interval_ms = atoi(optarg);
+            if (app->scale_interval_ms == 0) usage();
+            break;
+        case 'A': app->scale_age_ms = atoll(optarg); break;
+        case 'm':
+            app->lag_report_ms = atoi(optarg);
+            if (app->lag_report_ms == 0) usage();
+            break;
+        case 'x':
+            if (strcmp(optarg, "accept") == 0) app->expired_outcome = PN_ACCEPTED;
+            else if (strcmp(optarg, "modify") == 0) app->expired_outcome = PN_MODIFIED;
+            else usage();
+            break;
+        case 'o': app->capture_path = optarg; break;
+        case 'K': {
+            if (app->capture_key_count == MAX_CAPTURE_KEYS) {
+                fprintf(stderr, "At most %d properties can be captured\n", MAX_CAPTURE_KEYS);
+                exit(1);
+            }
+            /* <name>[:int|:double] */
+            char *sep = strrchr(optarg, ':');
+            colsink_type_t type = COLSINK_STRING;
+            if (sep && strcmp(sep + 1, "int") == 0) {
+                type = COLSINK_INT64;
+            } else if (sep && strcmp(sep + 1, "double") == 0) {
+                type = COLSINK_DOUBLE;
+            }
+            if (type != COLSINK_STRING) *sep = '\0';
+            app->capture_types[app->capture_key_count] = type;
+            app->capture_keys[app->capture_key_count++] = optarg;
+            break;
+        }
         case 'p': app->port = optarg; break;
         case 'u': app->username = optarg; break;
         case 'P': app->password = optarg; break;
+        case 'g': app->agg_config.field = optarg; break;
+        case 'k': app->agg_config.key = optarg; break;
+        case 'w':
+            app->agg_config.window_ms = strtoull(optarg, NULL, 10);
+            if (app->agg_config.window_ms == 0) usage();
+            break;
+        case 'W':
+            app->agg_config.slide_ms = strtoull(optarg, NULL, 10);
+            if (app->agg_config.slide_ms == 0) usage();
+            break;
+        case 'l': app->latency = true; break;
+        case 'L': app->latency = true; app->latency_stages = true; break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        case 'Y': app->clock_address = optarg; break;
         default: usage(); break;
         }
     }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (app->source_count == 0 && app->max_consumers == 1) {
+        /* a single source keeps the whole credit window */
+        source_t *src = &app->sources[app->source_count++];
+        src->address = app->amqp_address;
+        src->priority = PN_DEFAULT_PRIORITY;
+        src->window = app->credit ? app->credit : app->message_count ? app->message_count : BATCH;
+    } else {
+        /* priority p gets a share of the credit weighted p + 1, split between the consumers */
+        int credit = app->credit ? app->credit : BATCH;
+        int weights = 0;
+        if (app->source_count == 0) {
+            source_t *src = &app->sources[app->source_count++];
+            src->address = app->amqp_address;
+            src->priority = PN_DEFAULT_PRIORITY;
+        }
+        for (int i = 0; i < app->source_count; ++i) {
+            weights += app->sources[i].priority + 1;
+        }
+        for (int i = 0; i < app->source_count; ++i) {
+            source_t *src = &app->sources[i];
+            src->window = credit * (src->priority + 1) / weights / app->max_consumers;
+            if (src->window < 1) src->window = 1;
+        }
+    }
+    for (int i = 0; i < app->source_count; ++i) {
+        app->priorities |= 1u << app->sources[i].priority;
+    }
+    if (app->agg_config.slide_ms == 0) {
+        app->agg_config.slide_ms = app->agg_config.window_ms; /* tumbling */
+    }
+    app->agg_config.slots = app->max_consumers;
+    if (app->agg_config.field && !(app->aggregator = aggregator(&app->agg_config))) {
+        fprintf(stderr, "Aggregation slide must divide the window length\n");
+        exit(1);
+    }
 
 }
 
-int main(int argc, char **argv) {
+int receive_main(int argc, char **argv) {
     struct app_data_t app = {0};
-    char addr[PN_MAX_ADDR];
+    int started;
 
     parse_args(argc, argv, &app);
+    pthread_mutex_init(&app.lock, NULL);
+    if (app.capture_path) {
+        const char *names[COLSINK_MAX_COLUMNS] = { "receive_us", "size", "address", "latency_us" };
+        colsink_type_t types[COLSINK_MAX_COLUMNS] = { COLSINK_INT64, COLSINK_UINT32, COLSINK_STRING, COLSINK_INT64 };
+        for (int i = 0; i < app.capture_key_count; ++i) {
+            names[CAPTURE_KEYS + i] = app.capture_keys[i];
+            types[CAPTURE_KEYS + i] = app.capture_types[i];
+        }
+        if (colsink_open(&app.capture, app.capture_path, CAPTURE_KEYS + app.capture_key_count, names, types) < 0) {
+            fprintf(stderr, "Unable to write %s\n", app.capture_path);
+            exit(1);
+        }
+    }
+    lag_init(&app.lag, LAG_ALPHA);
+    app.consumers = (consumer_t*)calloc(app.max_consumers, sizeof(consumer_t));
+    for (int i = 0; i < app.max_consumers; ++i) {
+        consumer_t *cs = &app.consumers[i];
+        cs->index = i;
+        cs->message = pn_message();
+        delta_init(&cs->delta, 0);
+        if (app.capture_path) {
+            colsink_block_init(&cs->capture, &app.capture);
+        }
+        latency_stages_init(&cs->stages, false);
+        app.workers[i].app = &app;
+        app.workers[i].index = i;
+    }
 
     /* Create the proactor and connect */
     app.proactor = pn_proactor();
-    pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
-    fprintf(stdout, "Connecting to host: %s\n", addr);
-
-    /* Initialize Sasl transport */
-    pn_transport_t *pnt = pn_transport();
-    pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    pn_proactor_addr(app.addr, sizeof(app.addr), app.host, app.port);
+    fprintf(stdout, "Connecting to host: %s\n", app.addr);
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+    }
 
+    if (app.clock_address) {
+        clocksync_init(&app.clock);
+        for (int i = 0; i < app.max_consumers; ++i) {
+            app.consumers[i].latency_recorder.clock = &app.clock;
+        }
+    }
+    if (app.clock_address && !app.probe_ms) {
+        app.probe_ms = 1000;
+    }
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        if (app.clock_address) {
+            probe.clock_mode = PROBE_CLOCK_QUERY;
+            probe.clock_address = app.clock_address;
+            probe.clock = &app.clock;
+        }
+        probe_start_sample(&app.probe, &probe);
+    }
     /* initialize and start proton event proactor loop */
-    pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+    pthread_mutex_lock(&app.lock);
+    for (int i = 0; i < app.min_consumers; ++i) {
+        if (consumer_connect(&app, &app.consumers[i]) < 0) {
+            exit(1);
+        }
+    }
+    app.threads_wanted = app.min_consumers;
+    start_threads(&app);
+    pthread_mutex_unlock(&app.lock);
+    if (app.aggregator) {
+        app.timer_ms = app.agg_config.slide_ms;
+    }
+    if (app.max_consumers > app.min_consumers) {
+        if (!app.timer_ms || app.scale_interval_ms < app.timer_ms) app.timer_ms = app.scale_interval_ms;
+        app.next_scale = clock_now_ns() + app.scale_interval_ms * 1000000ull;
+    }
+    if (app.lag_report_ms) {
+        if (!app.timer_ms || app.lag_report_ms < app.timer_ms) app.timer_ms = app.lag_report_ms;
+        app.next_lag_report = clock_now_ns() + app.lag_report_ms * 1000000ull;
+    }
+    if (app.timer_ms) {
+        pn_proactor_set_timeout(app.proactor, app.timer_ms);
+    }
     fprintf(stdout, "waiting to receive %d messages from amqp address: %s\n", app.message_count, app.amqp_address);
-    run(&app);
+    run(&app, 0);
+    started = 0;
+    for (int i = 1; i < app.max_consumers; ++i) {
+        if (app.thread_created[i]) {
+            pthread_join(app.threads[i], NULL);
+            ++started;
+        }
+    }
+    if (app.source_count > 1) {
+        for (int i = 0; i < app.source_count; ++i) {
+            printf("source %s priority %d: %d messages\n", app.sources[i].address,
+                   app.sources[i].priority, app.sources[i].received);
+        }
+    }
+    if (app.max_consumers > app.min_consumers) {
+        printf("peak of %d consumers on %d threads\n", app.peak_consumers, started + 1);
+    }
+    /* every consumer recorded its own messages */
+    for (int i = 1; i < app.max_consumers; ++i) {
+        consumer_t *cs = &app.consumers[i];
+        latency_histogram_merge(&app.consumers[0].latency_recorder.histogram, &cs->latency_recorder.histogram);
+        app.consumers[0].latency_recorder.messages += cs->latency_recorder.messages;
+        app.consumers[0].latency_recorder.corrected += cs->latency_recorder.corrected;
+        if (cs->latency_recorder.bound_us > app.consumers[0].latency_recorder.bound_us) {
+            app.consumers[0].latency_recorder.bound_us = cs->latency_recorder.bound_us;
+        }
+        for (int s = 0; s < cs->stages.count; ++s) {
+            latency_histogram_merge(&app.consumers[0].stages.histograms[s], &cs->stages.histograms[s]);
+        }
+    }
+    for (int i = 1; i < app.max_consumers; ++i) {
+        delta_stats_merge(&app.consumers[0].delta.stats, &app.consumers[i].delta.stats);
+    }
+    {
+    delta_stats_t *delta = &app.consumers[0].delta.stats;
+    if (delta->keyframes + delta->deltas + delta->dropped > 0) {
+        delta_report(stdout, "received", delta);
+    }
+    }
+    if (app.expired_outcome) {
+        printf("%d expired messages shed\n", app.expired);
+    }
+    if (app.lag_report_ms) {
+        lag_report(stdout, app.container_id, &app.lag);
+    }
+    if (app.latency) {
+        latency_report(stdout, &app.consumers[0].latency_recorder);
+    }
+    if (app.latency_stages) {
+        latency_stages_report(stdout, &app.consumers[0].stages);
+    }
+    for (int i = 0; i < app.max_consumers; ++i) {
+        pn_message_free(app.consumers[i].message);
+        delta_free(&app.consumers[i].delta);
+        colsink_block_free(&app.consumers[i].capture);
+        free(app.consumers[i].completed);
+    }
+    if (app.capture_path) {
+        colsink_close(&app.capture);
+        printf("captured %llu messages in %llu blocks, %llu bytes to %s%s\n",
+               (unsigned long long)app.capture.rows, (unsigned long long)app.capture.blocks,
+               (unsigned long long)app.capture.bytes, app.capture_path,
+               app.capture.failed ? ", write failed" : "");
+    }
+    free(app.consumers);
 
     /* program cleanup */
+    if (app.aggregator) {
+        /* flush the windows still open */
+        aggregator_tick(app.aggregator, clock_wall_ms() + app.agg_config.window_ms);
+        aggregator_free(app.aggregator);
+    }
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
     pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
+    pthread_mutex_destroy(&app.lock);
+    if (app.clock_address) clocksync_free(&app.clock);
     str_free(app.container_id);
     return exit_code;
 }
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return receive_main(argc, argv);
+}
+#endif
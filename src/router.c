@@ -0,0 +1,1039 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * router
+ *
+ * This Sample demonstrates content based routing. Every message received
+ * from one queue or topic is passed on to one of several outputs chosen
+ * by an application property, read straight from the encoded message by
+ * the section scanner without decoding it.
+ *
+ * An output is a file, an in-memory ring or a link to another address.
+ * Each output has its own writer thread fed through a bounded queue, so a
+ * slow disk or a slow downstream consumer only holds up its own writer.
+ * The credit of the receiving link never exceeds the free slots of the
+ * fullest queue, so a message always finds room in its queue and the
+ * slowest output throttles the broker instead of growing a backlog in
+ * memory. A message is settled upstream with the outcome of its output,
+ * once written to its file or ring or accepted downstream.
+ */
+
+#include <proton/connection.h>
+#include <proton/condition.h>
+#include <proton/delivery.h>
+#include <proton/link.h>
+#include <proton/message.h>
+#include <proton/proactor.h>
+#include <proton/session.h>
+#include <proton/transport.h>
+#include <proton/sasl.h>
+#include <proton/ssl.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashring.h"
+#include "section.h"
+#include "probe.h"
+#include "util.h"
+
+#define MAX_OUTPUTS 16
+#define OUTPUT_VNODES 64          /* hash ring points per output for unmatched values */
+#define WRITER_BATCH 64           /* queued messages a writer takes at a time */
+#define FILE_BUFFER (1 << 20)
+
+typedef enum output_kind_t {
+  OUTPUT_FILE,                /* file:<path>, length prefixed encoded messages */
+  OUTPUT_RING,                /* ring:<slots>, the latest messages kept in memory */
+  OUTPUT_LINK                 /* link:<address>, sent on to the broker */
+} output_kind_t;
+
+/* A message on its way through an output */
+typedef struct item_t {
+  pn_rwbytes_t data;          /* the encoded message, owned by the item */
+  pn_delivery_t *delivery;    /* upstream delivery, only touched by the receiving thread */
+} item_t;
+
+struct app_data_t;
+struct output_t;
+
+/* A finished message to settle upstream */
+typedef struct done_t {
+  pn_delivery_t *delivery;
+  uint64_t outcome;
+  bool undeliverable;         /* PN_MODIFIED, not to be redelivered here */
+  struct output_t *output;    /* holds the message's slot until it is settled */
+} done_t;
+
+typedef struct output_t {
+  int index;
+  output_kind_t kind;
+  const char *target;         /* path, # of ring slots or address */
+  const char **values;        /* property values routed here */
+  int value_count;
+  bool catch_all;             /* '*', receives the unmatched values */
+  struct app_data_t *app;
+  pthread_t thread;
+
+  /* the queue and the in-flight count are guarded by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  item_t *queue;              /* ring buffer of app->queue_size items */
+  int head, count;
+  int in_flight;              /* taken by the writer, not finished yet */
+  int unsettled;              /* finished, not settled upstream yet */
+  bool closing;
+
+  /* writer state */
+  FILE *file;
+  pn_rwbytes_t *ring;
+  int ring_slots, ring_next;
+  uint64_t ring_laps;
+  pn_proactor_t *proactor;
+  pn_connection_t *connection;
+  pn_link_t *sender;
+  uint64_t tag;
+  bool closed;
+  uint64_t connect_start;
+
+  /* counters, written by the writer thread */
+  uint64_t written, bytes, failed;
+  /* credit held back by this output, kept by the receiving thread */
+  uint64_t blocked_since, blocked_ns;
+  int max_queued;
+} output_t;
+
+typedef struct app_data_t {
+  const char *host, *port;
+  const char *username, *password;
+  const char *container_id;
+  const char *address;
+  const char *property;       /* application property the routing is based on */
+  int message_count;
+  int queue_size;             /* slots of each output queue */
+  int credit;                 /* most receive credit open at once, 0 for the free queue slots */
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+
+  pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  pn_connection_t *connection;
+  pn_link_t *receiver;
+  uint64_t connect_start;
+  pn_rwbytes_t msgin;         /* Partially received message */
+  output_t outputs[MAX_OUTPUTS];
+  int output_count;
+  output_t *catch_all;
+  hashring_t ring;
+
+  /* finished messages handed back by the writers, guarded by lock */
+  pthread_mutex_t lock;
+  done_t *done, *settling;     /* swapped when settling */
+  int done_count;
+  bool wake_pending;
+  bool closed;                /* the connection is gone, no more wakes */
+
+  int routed, settled;
+  int malformed;              /* messages the scanner could not read, sent to the catch-all */
+  uint64_t start_ns;
+  bool finished;
+} app_data_t;
+
+static int exit_code = 0;
+
+extern int optind;
+extern char* optarg;
+extern int optopt;
+extern int opterr;
+
+#define str_free(strptr) free((void *)strptr)
+
+static void check_condition(pn_event_t *e, pn_condition_t *cond) {
+  if (pn_condition_is_set(cond)) {
+    fprintf(stderr, "%s: %s: %s\n", pn_event_type_name(pn_event_type(e)),
+            pn_condition_get_name(cond), pn_condition_get_description(cond));
+    pn_connection_close(pn_event_connection(e));
+    exit_code = 1;
+  }
+}
+
+static const char *kind_name(output_kind_t kind) {
+  switch (kind) {
+   case OUTPUT_FILE: return "file";
+   case OUTPUT_RING: return "ring";
+   default: return "link";
+  }
+}
+
+/*
+ * Formats the routing value of a string, symbol or integer property.
+ * Returns false for any other type.
+ * */
+static bool property_text(const section_value_t *value, char *buf, size_t buf_size,
+                          const char **start, size_t *size) {
+  int64_t l;
+  uint64_t u;
+  if (section_value_string(value, start, size)) {
+    return true;
+  }
+  if (section_value_long(value, &l)) {
+    snprintf(buf, buf_size, "%" PRId64, l);
+  } else if (section_value_uint(value, &u)) {
+    snprintf(buf, buf_size, "%" PRIu64, u);
+  } else {
+    return false;
+  }
+  *start = buf;
+  *size = strlen(buf);
+  return true;
+}
+
+/*
+ * Picks the output of an encoded message. A value listed by an output
+ * goes there, any other value or a missing property goes to the catch-all
+ * output or, without one, to the output the value hashes to.
+ * */
+static output_t *route(app_data_t *app, const char *bytes, size_t size) {
+  section_value_t value;
+  char text[PN_MAX_ADDR];
+  const char *start = "";
+  size_t len = 0;
+  int rc = section_scan_property(bytes, size, app->property, &value);
+  if (rc < 0) {
+    ++app->malformed;
+  } else if (rc == 1 && property_text(&value, text, sizeof(text), &start, &len)) {
+    for (int i = 0; i < app->output_count; ++i) {
+      output_t *o = &app->outputs[i];
+      for (int j = 0; j < o->value_count; ++j) {
+        if (strlen(o->values[j]) == len && memcmp(o->values[j], start, len) == 0) {
+          return o;
+        }
+      }
+    }
+  }
+  if (app->catch_all) {
+    return app->catch_all;
+  }
+  if (start != text) {
+    if (len >= sizeof(text)) len = sizeof(text) - 1;
+    memmove(text, start, len);
+    text[len] = '\0';
+  }
+  return &app->outputs[hashring_lookup(&app->ring, text)];
+}
+
+/* Wakes the receiving thread to settle finished messages, must hold app->lock */
+static void app_wake(app_data_t *app) {
+  if (!app->wake_pending && !app->closed) {
+    app->wake_pending = true;
+    pn_connection_wake(app->connection);
+  }
+}
+
+/* Hands finished messages back to the receiving thread */
+static void output_finish(output_t *o, const item_t *items, int n, uint64_t outcome, bool undeliverable) {
+  app_data_t *app = o->app;
+  pthread_mutex_lock(&o->lock);
+  o->in_flight -= n;
+  o->unsettled += n;
+  pthread_mutex_unlock(&o->lock);
+  pthread_mutex_lock(&app->lock);
+  for (int i = 0; i < n; ++i) {
+    app->done[app->done_count].delivery = items[i].delivery;
+    app->done[app->done_count].outcome = outcome;
+    app->done[app->done_count].undeliverable = undeliverable;
+    app->done[app->done_count].output = o;
+    ++app->done_count;
+  }
+  app_wake(app);
+  pthread_mutex_unlock(&app->lock);
+}
+
+/* Takes up to max queued items for the writer, must hold o->lock */
+static int output_take(app_data_t *app, output_t *o, item_t *items, int max) {
+  int n = 0;
+  while (o->count > 0 && n < max) {
+    items[n++] = o->queue[o->head];
+    o->head = (o->head + 1) % app->queue_size;
+    --o->count;
+  }
+  o->in_flight += n;
+  return n;
+}
+
+/* Writes one message to a file or ring output, returns false on error */
+static bool output_write(output_t *o, item_t *item) {
+  if (o->kind == OUTPUT_FILE) {
+    uint32_t size = (uint32_t)item->data.size;
+    bool ok = fwrite(&size, sizeof(size), 1, o->file) == 1
+      && fwrite(item->data.start, 1, item->data.size, o->file) == item->data.size;
+    free(item->data.start);
+    return ok;
+  }
+  /* the ring keeps the message, dropping the oldest when full */
+  pn_rwbytes_t *slot = &o->ring[o->ring_next];
+  free(slot->start);
+  *slot = item->data;
+  if (++o->ring_next == o->ring_slots) {
+    o->ring_next = 0;
+    ++o->ring_laps;
+  }
+  return true;
+}
+
+/* Writer thread of a file or ring output */
+static void *queue_writer(void *arg) {
+  output_t *o = (output_t*)arg;
+  item_t items[WRITER_BATCH];
+  for (;;) {
+    int n;
+    bool ok = true;
+    size_t bytes = 0;
+    pthread_mutex_lock(&o->lock);
+    while (o->count == 0 && !o->closing) {
+      pthread_cond_wait(&o->ready, &o->lock);
+    }
+    n = output_take(o->app, o, items, WRITER_BATCH);
+    pthread_mutex_unlock(&o->lock);
+    if (n == 0) {
+      break; /* closing and drained */
+    }
+    for (int i = 0; i < n; ++i) {
+      bytes += items[i].data.size;
+      ok = output_write(o, &items[i]) && ok;
+    }
+    /* the batch goes out in one write before it is accepted upstream */
+    if (o->kind == OUTPUT_FILE) {
+      ok = fflush(o->file) == 0 && ok;
+    }
+    if (ok) {
+      o->written += n;
+      o->bytes += bytes;
+    } else {
+      o->failed += n;
+    }
+    /* the broker redelivers a batch that did not reach the file */
+    output_finish(o, items, n, ok ? PN_ACCEPTED : PN_RELEASED, false);
+  }
+  return NULL;
+}
+
+/* Sends queued messages while the downstream link has credit */
+static void link_send(app_data_t *app, output_t *o) {
+  item_t items[WRITER_BATCH];
+  int n;
+  do {
+    int credit = pn_link_credit(o->sender);
+    if (credit <= 0) {
+      return;
+    }
+    pthread_mutex_lock(&o->lock);
+    n = output_take(app, o, items, credit < WRITER_BATCH ? credit : WRITER_BATCH);
+    pthread_mutex_unlock(&o->lock);
+    for (int i = 0; i < n; ++i) {
+      uint64_t tag = ++o->tag;
+      pn_delivery_t *d = pn_delivery(o->sender, pn_dtag((const char *)&tag, sizeof(tag)));
+      /* settled upstream with the outcome of this delivery */
+      pn_delivery_set_context(d, items[i].delivery);
+      pn_link_send(o->sender, items[i].data.start, items[i].data.size);
+      pn_link_advance(o->sender);
+      o->bytes += items[i].data.size;
+      free(items[i].data.start);
+    }
+  } while (n == WRITER_BATCH);
+}
+
+/*
+ * Releases the messages still sent or queued on a link output whose
+ * connection is gone, the broker redelivers them. A connection lost
+ * before the router closes it stops the router, the credit would stay
+ * held by the output's queue otherwise.
+ * */
+static void link_closed(app_data_t *app, output_t *o) {
+  item_t items[WRITER_BATCH];
+  bool lost;
+  int n;
+  pthread_mutex_lock(&o->lock);
+  lost = !o->closing;
+  o->closed = true;
+  pthread_mutex_unlock(&o->lock);
+  if (o->sender) {
+    for (pn_delivery_t *d = pn_unsettled_head(o->sender); d; d = pn_unsettled_next(d)) {
+      item_t item = {pn_rwbytes_null, (pn_delivery_t*)pn_delivery_get_context(d)};
+      ++o->failed;
+      output_finish(o, &item, 1, PN_RELEASED, false);
+    }
+  }
+  do {
+    pthread_mutex_lock(&o->lock);
+    n = output_take(app, o, items, WRITER_BATCH);
+    pthread_mutex_unlock(&o->lock);
+    for (int i = 0; i < n; ++i) {
+      free(items[i].data.start);
+    }
+    if (n > 0) {
+      o->failed += n;
+      output_finish(o, items, n, PN_RELEASED, false);
+    }
+  } while (n > 0);
+  if (lost) {
+    fprintf(stderr, "output %s closed, stopping the router\n", o->target);
+    exit_code = 1;
+    pthread_mutex_lock(&app->lock);
+    app_wake(app);
+    pthread_mutex_unlock(&app->lock);
+  }
+}
+
+/* Closes the downstream connection once closing and nothing is left to send or settle */
+static void link_close_if_drained(output_t *o) {
+  bool drained;
+  pthread_mutex_lock(&o->lock);
+  drained = o->closing && o->count == 0 && o->in_flight == 0 && !o->closed;
+  if (drained) o->closed = true;
+  pthread_mutex_unlock(&o->lock);
+  if (drained) {
+    pn_connection_close(o->connection);
+  }
+}
+
+static bool handle_link(output_t *o, pn_event_t *event) {
+  app_data_t *app = o->app;
+  switch (pn_event_type(event)) {
+
+   case PN_CONNECTION_INIT: {
+     pn_connection_t* c = pn_event_connection(event);
+     char link_name[PN_MAX_ADDR];
+     char con_id[PN_MAX_ADDR];
+     if (app->username) {
+        pn_connection_set_user(c, app->username);
+        pn_connection_set_password(c, app->password);
+     }
+     pn_session_t* s = pn_session(c);
+     /* the broker takes the container id as the client name, which must be unique */
+     snprintf(con_id, sizeof(con_id), "%s/output%d", app->container_id, o->index);
+     pn_connection_set_container(c, con_id);
+     pn_connection_open(c);
+     pn_session_open(s);
+     snprintf(link_name, sizeof(link_name), "router_output_%d", o->index);
+     o->sender = pn_sender(s, link_name);
+     pn_terminus_set_address(pn_link_target(o->sender), o->target);
+     pn_link_open(o->sender);
+   } break;
+
+   case PN_CONNECTION_REMOTE_OPEN:
+     printf("output %s ", o->target);
+     report_connection_open(event, o->connect_start, app->ssl);
+     break;
+
+   case PN_LINK_FLOW:
+   case PN_CONNECTION_WAKE:
+     if (o->sender) {
+       link_send(app, o);
+     }
+     link_close_if_drained(o);
+     break;
+
+   case PN_DELIVERY: {
+     /*
+      * The downstream outcome settles the upstream delivery: a rejected
+      * message is rejected upstream, a modified one is passed on modified
+      * with its undeliverable here flag, and a released one is released.
+      * */
+     pn_delivery_t *d = pn_event_delivery(event);
+     uint64_t outcome = pn_delivery_remote_state(d);
+     if (outcome && outcome != PN_RECEIVED) {
+       item_t item = {pn_rwbytes_null, (pn_delivery_t*)pn_delivery_get_context(d)};
+       bool undeliverable = false;
+       if (outcome == PN_ACCEPTED) {
+         ++o->written;
+       } else {
+         ++o->failed;
+       }
+       if (outcome == PN_MODIFIED) {
+         undeliverable = pn_disposition_is_undeliverable(pn_delivery_remote(d));
+       } else if (outcome != PN_ACCEPTED && outcome != PN_REJECTED) {
+         outcome = PN_RELEASED;
+       }
+       pn_delivery_settle(d);
+       output_finish(o, &item, 1, outcome, undeliverable);
+       link_close_if_drained(o);
+     }
+   } break;
+
+   case PN_TRANSPORT_CLOSED:
+    check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    link_closed(app, o);
+    break;
+
+   case PN_CONNECTION_REMOTE_CLOSE:
+    check_condition(event, pn_connection_remote_condition(pn_event_connection(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_SESSION_REMOTE_CLOSE:
+    check_condition(event, pn_session_remote_condition(pn_event_session(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_LINK_REMOTE_CLOSE:
+   case PN_LINK_REMOTE_DETACH:
+    check_condition(event, pn_link_remote_condition(pn_event_link(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_PROACTOR_INACTIVE:
+    return false;
+
+   default:
+    break;
+  }
+  return true;
+}
+
+/* Writer thread of a link output, runs the proactor of its own connection */
+static void *link_writer(void *arg) {
+  output_t *o = (output_t*)arg;
+  bool running = true;
+  while (running) {
+    pn_event_batch_t *events = pn_proactor_wait(o->proactor);
+    pn_event_t *e;
+    for (e = pn_event_batch_next(events); e && running; e = pn_event_batch_next(events)) {
+      running = handle_link(o, e);
+    }
+    pn_proactor_done(o->proactor, events);
+  }
+  return NULL;
+}
+
+/* Wakes the writer of an output for new items or to close */
+static void output_wake(output_t *o) {
+  if (o->kind == OUTPUT_LINK) {
+    if (!o->closed) pn_connection_wake(o->connection);
+  } else {
+    pthread_cond_signal(&o->ready);
+  }
+}
+
+/* Queues a message on its output, the credit granted guarantees a free slot */
+static void output_push(app_data_t *app, output_t *o, pn_rwbytes_t data, pn_delivery_t *d) {
+  pthread_mutex_lock(&o->lock);
+  item_t *item = &o->queue[(o->head + o->count) % app->queue_size];
+  item->data = data;
+  item->delivery = d;
+  if (++o->count > o->max_queued) {
+    o->max_queued = o->count;
+  }
+  output_wake(o);
+  pthread_mutex_unlock(&o->lock);
+}
+
+static void output_close(output_t *o) {
+  pthread_mutex_lock(&o->lock);
+  o->closing = true;
+  output_wake(o);
+  pthread_mutex_unlock(&o->lock);
+}
+
+/*
+ * Tops the receiver credit up to the free slots of the fullest output
+ * queue, and at most -f, counting the time each output holds the credit
+ * at zero. A slot stays taken until its message is settled upstream,
+ * which bounds the done lists. Credit is granted in steps of a quarter of
+ * the window to keep flow frames few.
+ * */
+static void flow(app_data_t *app) {
+  uint64_t now = clock_now_ns();
+  int free_slots = INT_MAX;
+  int window = app->credit ? app->credit : app->queue_size;
+  int credit, grant;
+  for (int i = 0; i < app->output_count; ++i) {
+    output_t *o = &app->outputs[i];
+    int f;
+    pthread_mutex_lock(&o->lock);
+    f = app->queue_size - o->count - o->in_flight - o->unsettled;
+    pthread_mutex_unlock(&o->lock);
+    if (f == 0 && o->blocked_since == 0) {
+      o->blocked_since = now;
+    } else if (f > 0 && o->blocked_since != 0) {
+      o->blocked_ns += now - o->blocked_since;
+      o->blocked_since = 0;
+    }
+    if (f < free_slots) free_slots = f;
+  }
+  if (app->message_count > 0 && app->message_count - app->routed < free_slots) {
+    free_slots = app->message_count - app->routed;
+  }
+  if (window < free_slots) free_slots = window;
+  credit = pn_link_credit(app->receiver);
+  grant = free_slots - credit;
+  if (grant > 0 && (credit == 0 || grant >= window / 4)) {
+    pn_link_flow(app->receiver, grant);
+  }
+}
+
+/* Settles the messages the writers have finished with their outcomes */
+static void settle_done(app_data_t *app) {
+  int settled[MAX_OUTPUTS] = {0};
+  done_t *done;
+  int count;
+  /* the writers keep appending to the other list while these are settled */
+  pthread_mutex_lock(&app->lock);
+  done = app->done;
+  count = app->done_count;
+  app->done = app->settling;
+  app->settling = done;
+  app->done_count = 0;
+  app->wake_pending = false;
+  pthread_mutex_unlock(&app->lock);
+  for (int i = 0; i < count; ++i) {
+    if (done[i].outcome == PN_MODIFIED) {
+      pn_disposition_t *disposition = pn_delivery_local(done[i].delivery);
+      pn_disposition_set_failed(disposition, true);
+      pn_disposition_set_undeliverable(disposition, done[i].undeliverable);
+    }
+    pn_delivery_update(done[i].delivery, done[i].outcome);
+    pn_delivery_settle(done[i].delivery);
+    ++settled[done[i].output->index];
+  }
+  /* the slots are free for new credit */
+  for (int i = 0; i < app->output_count; ++i) {
+    if (settled[i]) {
+      output_t *o = &app->outputs[i];
+      pthread_mutex_lock(&o->lock);
+      o->unsettled -= settled[i];
+      pthread_mutex_unlock(&o->lock);
+    }
+  }
+  app->settled += count;
+}
+
+static void finish(app_data_t *app) {
+  pn_session_t *ssn = pn_link_session(app->receiver);
+  for (int i = 0; i < app->output_count; ++i) {
+    output_close(&app->outputs[i]);
+  }
+  pn_link_close(app->receiver);
+  pn_session_close(ssn);
+  pn_connection_close(app->connection);
+}
+
+/* Return true to continue, false to exit */
+static bool handle(app_data_t* app, pn_event_t* event) {
+  switch (pn_event_type(event)) {
+
+   case PN_CONNECTION_INIT: {
+     pn_connection_t* c = pn_event_connection(event);
+     /* Set authenticate credentials if present */
+     if (app->username) {
+        pn_connection_set_user(c, app->username);
+        pn_connection_set_password(c, app->password);
+     }
+     pn_session_t* s = pn_session(c);
+     pn_connection_set_container(c, app->container_id);
+     pn_connection_open(c);
+     pn_session_open(s);
+     app->receiver = pn_receiver(s, "router_receiver");
+     pn_terminus_set_address(pn_link_source(app->receiver), app->address);
+     pn_link_open(app->receiver);
+     flow(app);
+   } break;
+
+   case PN_CONNECTION_REMOTE_OPEN:
+     printf("source %s ", app->address);
+     report_connection_open(event, app->connect_start, app->ssl);
+     app->start_ns = clock_now_ns();
+     break;
+
+   case PN_CONNECTION_WAKE:
+     settle_done(app);
+     if (app->finished) {
+       if (app->settled == app->routed) finish(app);
+     } else {
+       flow(app);
+     }
+     break;
+
+   case PN_DELIVERY: {
+     /* A message has been received */
+     pn_delivery_t *d = pn_event_delivery(event);
+     if (pn_delivery_readable(d)) {
+       pn_link_t *l = pn_delivery_link(d);
+       size_t size = pn_delivery_pending(d);
+       pn_rwbytes_t* m = &app->msgin; /* Append data to incoming message buffer */
+       int recv;
+       size_t oldsize = m->size;
+       m->size += size;
+       m->start = (char*)realloc(m->start, m->size);
+       recv = pn_link_recv(l, m->start + oldsize, m->size);
+       if (recv == PN_ABORTED) {
+         fprintf(stderr, "Message aborted\n");
+         m->size = 0;           /* Forget the data we accumulated */
+         pn_delivery_settle(d); /* Free the delivery so we can receive the next message */
+         flow(app);             /* Replace credit for aborted message */
+       } else if (recv < 0 && recv != PN_EOS) {        /* Unexpected error */
+         pn_condition_format(pn_link_condition(l), "broker", "PN_DELIVERY error: %s", pn_code(recv));
+         pn_link_close(l);               /* Unexpected error, close the link */
+       } else if (!pn_delivery_partial(d)) { /* Message is complete */
+         /* the output takes the encoded message, settled once it is finished */
+         output_push(app, route(app, m->start, m->size), *m, d);
+         *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
+         if (++app->routed == app->message_count) {
+           app->finished = true;
+         }
+       }
+     }
+     break;
+   }
+
+   case PN_TRANSPORT_CLOSED:
+    check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    /* the connection is freed once the batch is done, the writers must not wake it */
+    pthread_mutex_lock(&app->lock);
+    app->closed = true;
+    pthread_mutex_unlock(&app->lock);
+    break;
+
+   case PN_CONNECTION_REMOTE_CLOSE:
+    check_condition(event, pn_connection_remote_condition(pn_event_connection(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_SESSION_REMOTE_CLOSE:
+    check_condition(event, pn_session_remote_condition(pn_event_session(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_LINK_REMOTE_CLOSE:
+   case PN_LINK_REMOTE_DETACH:
+    check_condition(event, pn_link_remote_condition(pn_event_link(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_PROACTOR_INACTIVE:
+    return false;
+    break;
+
+   default:
+    break;
+  }
+    return true;
+}
+
+static void run(app_data_t *app) {
+  /* Loop and handle events */
+  do {
+    pn_event_batch_t *events = pn_proactor_wait(app->proactor);
+    pn_event_t *e;
+    for (e = pn_event_batch_next(events); e; e = pn_event_batch_next(events)) {
+      if (!handle(app, e) || exit_code != 0) {
+        return;
+      }
+    }
+    pn_proactor_done(app->proactor, events);
+  } while(true);
+}
+
+static void usage() {
+    printf("Usage: router [options] \n");
+    printf("[Options]:\n");
+    printf("\t-a      The host address [localhost]\n");
+    printf("\t-p      The host port [5672]\n");
+    printf("\t-c      # of messages to route, 0 routes forever [10]\n");
+    printf("\t-t      Source address [examples]\n");
+    printf("\t-k      Application property to route on [key]\n");
+    printf("\t-O      Output <value>[,<value>...]=file:<path>|ring:<slots>|link:<address>, repeat for each output,\n");
+    printf("\t        '*' takes the unmatched values, without it they are hashed across the outputs [*=ring:1024]\n");
+    printf("\t-q      Queue slots per output, the receive credit is bounded by the fullest queue [256]\n");
+    printf("\t-f      Most receive credit open at once, 0 for the free slots of the fullest queue [0]\n");
+    printf("\t-i      Container name [router:<pid>]\n");
+    printf("\t-u      Client authentication username []\n");
+    printf("\t-P      Client authentication password []\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-h      Displays this message\n");
+    exit(0);
+
+}
+
+/* Parses <value>[,<value>...]=<kind>:<target> into an output */
+static bool parse_output(app_data_t *app, char *spec) {
+  output_t *o = &app->outputs[app->output_count];
+  char *eq = strchr(spec, '=');
+  char *colon = eq ? strchr(eq, ':') : NULL;
+  if (!colon) {
+    return false;
+  }
+  *eq = *colon = '\0';
+  if (strcmp(eq + 1, "file") == 0) {
+    o->kind = OUTPUT_FILE;
+  } else if (strcmp(eq + 1, "ring") == 0) {
+    o->kind = OUTPUT_RING;
+    o->ring_slots = atoi(colon + 1);
+    if (o->ring_slots < 1) return false;
+  } else if (strcmp(eq + 1, "link") == 0) {
+    o->kind = OUTPUT_LINK;
+  } else {
+    return false;
+  }
+  o->target = colon + 1;
+  o->values = (const char**)calloc(strlen(spec) + 1, sizeof(const char*));
+  for (char *v = strtok(spec, ","); v; v = strtok(NULL, ",")) {
+    if (strcmp(v, "*") == 0) {
+      o->catch_all = true;
+      app->catch_all = o;
+    } else {
+      o->values[o->value_count++] = v;
+    }
+  }
+  o->index = app->output_count++;
+  return true;
+}
+
+static void parse_args(int argc, char **argv, app_data_t *app) {
+    char c;
+    char con_id[PN_MAX_ADDR];
+    if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
+        fprintf(stderr, "Unable to format container id from source: %s", argv[0]);
+        exit(1);
+    }
+    /* initialize default values*/
+    app->container_id = strdup(con_id); /* default to using argv[0] */
+    app->host = "localhost";
+    app->port = NULL; /* amqp or amqps */
+    app->message_count = 10;
+    app->address = "examples";
+    app->property = "key";
+    app->queue_size = 256;
+    app->output_count = 0;
+    /* default to anonymous authentication */
+    app->username = NULL;
+    app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+
+    /* command line options */
+    opterr = 0;
+    while((c = getopt(argc, argv, "i:a:c:t:k:O:q:f:p:u:P:sC:N:h")) != -1) {
+        switch(c) {
+        case 'h': usage(); break;
+        case 'c':
+            app->message_count = atoi(optarg);
+            if (app->message_count < 0) usage();
+            break;
+        case 'a': app->host = optarg; break;
+        case 'i':
+            if (container_id(con_id, PN_MAX_ADDR, optarg, sizeof(optarg)) < 0) {
+                fprintf(stderr, "Unable to format container id from source: %s", optarg);
+                exit(1);
+            }
+            str_free(app->container_id);
+            app->container_id = strdup(con_id);
+            break;
+        case 't': app->address = optarg; break;
+        case 'k': app->property = optarg; break;
+        case 'O':
+            if (app->output_count == MAX_OUTPUTS) {
+                fprintf(stderr, "At most %d outputs are supported\n", MAX_OUTPUTS);
+                exit(1);
+            }
+            if (!parse_output(app, optarg)) {
+                fprintf(stderr, "Invalid output: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'q':
+            app->queue_size = atoi(optarg);
+            if (app->queue_size < 1) usage();
+            break;
+        case 'f':
+            app->credit = atoi(optarg);
+            if (app->credit < 0) usage();
+            break;
+        case 'p': app->port = optarg; break;
+        case 'u': app->username = optarg; break;
+        case 'P': app->password = optarg; break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        default: usage(); break;
+        }
+    }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (app->output_count == 0) {
+        static char default_output[] = "*=ring:1024";
+        parse_output(app, default_output);
+    }
+}
+
+/* Connects a transport of the app to the broker on a proactor */
+static void connect_broker(app_data_t *app, pn_proactor_t *proactor, pn_connection_t *c) {
+    char addr[PN_MAX_ADDR];
+    pn_proactor_addr(addr, sizeof(addr), app->host, app->port);
+    /* Initialize Sasl transport */
+    pn_transport_t *pnt = pn_transport();
+    pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (app->ssl && ssl_client_init(pnt, app->ssl_domain, app->host, app->port) < 0) {
+        exit(1);
+    }
+    pn_proactor_connect2(proactor, c, pnt, addr);
+}
+
+static void output_start(app_data_t *app, output_t *o) {
+    o->app = app;
+    o->queue = (item_t*)calloc(app->queue_size, sizeof(item_t));
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->ready, NULL);
+    hashring_add(&app->ring, o->index, o->target, OUTPUT_VNODES);
+    switch (o->kind) {
+     case OUTPUT_FILE:
+        if (!(o->file = fopen(o->target, "wb"))) {
+            fprintf(stderr, "Unable to open output file: %s\n", o->target);
+            exit(1);
+        }
+        setvbuf(o->file, NULL, _IOFBF, FILE_BUFFER);
+        pthread_create(&o->thread, NULL, queue_writer, o);
+        break;
+     case OUTPUT_RING:
+        o->ring = (pn_rwbytes_t*)calloc(o->ring_slots, sizeof(pn_rwbytes_t));
+        pthread_create(&o->thread, NULL, queue_writer, o);
+        break;
+     case OUTPUT_LINK:
+        o->proactor = pn_proactor();
+        o->connection = pn_connection();
+        o->connect_start = clock_now_ns();
+        connect_broker(app, o->proactor, o->connection);
+        pthread_create(&o->thread, NULL, link_writer, o);
+        break;
+    }
+}
+
+static void output_free(app_data_t *app, output_t *o) {
+    for (int i = 0; i < o->count; ++i) {
+        free(o->queue[(o->head + i) % app->queue_size].data.start);
+    }
+    if (o->ring) {
+        for (int i = 0; i < o->ring_slots; ++i) {
+            free(o->ring[i].start);
+        }
+        free(o->ring);
+    }
+    if (o->file) fclose(o->file);
+    if (o->proactor) pn_proactor_free(o->proactor);
+    free(o->queue);
+    free(o->values);
+    pthread_cond_destroy(&o->ready);
+    pthread_mutex_destroy(&o->lock);
+}
+
+int router_main(int argc, char **argv) {
+    struct app_data_t app = {0};
+    char addr[PN_MAX_ADDR];
+
+    parse_args(argc, argv, &app);
+
+    app.proactor = pn_proactor();
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+    }
+    pthread_mutex_init(&app.lock, NULL);
+    /* every unsettled message is queued, being written or waiting in the done list */
+    app.done = (done_t*)calloc((size_t)app.queue_size * app.output_count, sizeof(done_t));
+    app.settling = (done_t*)calloc((size_t)app.queue_size * app.output_count, sizeof(done_t));
+    app.connection = pn_connection();
+    hashring_init(&app.ring);
+    for (int i = 0; i < app.output_count; ++i) {
+        output_start(&app, &app.outputs[i]);
+    }
+
+    pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
+    fprintf(stdout, "Connecting to host: %s routing %s on '%s' to %d outputs\n",
+            addr, app.address, app.property, app.output_count);
+    app.connect_start = clock_now_ns();
+    connect_broker(&app, app.proactor, app.connection);
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        probe_start_sample(&app.probe, &probe);
+    }
+    run(&app);
+    pthread_mutex_lock(&app.lock);
+    app.closed = true;
+    pthread_mutex_unlock(&app.lock);
+
+    /* the writers finish what is queued before they exit */
+    for (int i = 0; i < app.output_count; ++i) {
+        output_t *o = &app.outputs[i];
+        if (!o->closing) output_close(o);
+        pthread_join(o->thread, NULL);
+    }
+    {
+    double secs = app.start_ns ? (clock_now_ns() - app.start_ns) / 1e9 : 0;
+    printf("%d messages routed, %d settled, %d malformed", app.routed, app.settled, app.malformed);
+    if (secs > 0) printf(", %.0f msgs/sec", app.routed / secs);
+    printf("\n");
+    }
+    for (int i = 0; i < app.output_count; ++i) {
+        output_t *o = &app.outputs[i];
+        if (o->blocked_since) o->blocked_ns += clock_now_ns() - o->blocked_since;
+        printf("output %d %s:%s written %" PRIu64 ", failed %" PRIu64 ", bytes %" PRIu64
+               ", max queued %d, held credit at zero for %.3f sec",
+               o->index, kind_name(o->kind), o->target, o->written, o->failed, o->bytes,
+               o->max_queued, o->blocked_ns / 1e9);
+        if (o->kind == OUTPUT_RING) printf(", ring laps %" PRIu64, o->ring_laps);
+        printf("\n");
+    }
+
+    /* program cleanup */
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
+    pn_proactor_free(app.proactor);
+    for (int i = 0; i < app.output_count; ++i) {
+        output_free(&app, &app.outputs[i]);
+    }
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
+    hashring_free(&app.ring);
+    pthread_mutex_destroy(&app.lock);
+    free(app.done);
+    free(app.settling);
+    free(app.msgin.start);
+    str_free(app.container_id);
+    return exit_code;
+}
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return router_main(argc, argv);
+}
+#endif
@@ -0,0 +1,136 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "sched.h"
+
+#include <string.h>
+
+#define SCHED_NONE (-1)
+
+static void clear_turns(scheduler_t *s) {
+    for (int p = 0; p < SCHED_PRIORITIES; ++p) {
+        s->head[p] = s->tail[p] = SCHED_NONE;
+    }
+}
+
+void sched_init(scheduler_t *s, size_t quantum, bool strict, sched_ready_fn ready, sched_send_fn send, void *context) {
+    memset(s, 0, sizeof(*s));
+    s->quantum = quantum;
+    s->strict = strict;
+    s->ready = ready;
+    s->send = send;
+    s->context = context;
+    clear_turns(s);
+}
+
+int sched_add(scheduler_t *s, int weight, int priority) {
+    if (s->count == SCHED_MAX_LINKS) {
+        return -1;
+    }
+    sched_link_t *l = &s->links[s->count];
+    memset(l, 0, sizeof(*l));
+    l->weight = weight > 0 ? weight : 1;
+    l->priority = priority < 0 ? 0 : priority >= SCHED_PRIORITIES ? SCHED_PRIORITIES - 1 : priority;
+    l->next = SCHED_NONE;
+    return s->count++;
+}
+
+void sched_reset(scheduler_t *s) {
+    for (int i = 0; i < s->count; ++i) {
+        sched_link_t *l = &s->links[i];
+        l->deficit = 0;
+        l->active = false;
+        l->next = SCHED_NONE;
+        l->bytes = 0;
+        l->messages = 0;
+    }
+    clear_turns(s);
+}
+
+/* Without strict priority every link takes turns at level 0 */
+static int level(const scheduler_t *s, int link) {
+    return s->strict ? s->links[link].priority : 0;
+}
+
+static void push_back(scheduler_t *s, int link) {
+    sched_link_t *l = &s->links[link];
+    int p = level(s, link);
+    l->active = true;
+    l->next = SCHED_NONE;
+    if (s->tail[p] == SCHED_NONE) {
+        s->head[p] = link;
+    } else {
+        s->links[s->tail[p]].next = link;
+    }
+    s->tail[p] = link;
+}
+
+/* Removes the next link of the highest level with active links, SCHED_NONE if there is none */
+static int pop_front(scheduler_t *s) {
+    for (int p = SCHED_PRIORITIES - 1; p >= 0; --p) {
+        int link = s->head[p];
+        if (link != SCHED_NONE) {
+            s->head[p] = s->links[link].next;
+            if (s->head[p] == SCHED_NONE) {
+                s->tail[p] = SCHED_NONE;
+            }
+            return link;
+        }
+    }
+    return SCHED_NONE;
+}
+
+void sched_wake(scheduler_t *s, int link) {
+    if (link >= 0 && link < s->count && !s->links[link].active && s->ready(s->context, link)) {
+        push_back(s, link);
+    }
+}
+
+void sched_run(scheduler_t *s) {
+    int link;
+    while ((link = pop_front(s)) != SCHED_NONE) {
+        sched_link_t *l = &s->links[link];
+        l->deficit += (int64_t)(s->quantum * l->weight);
+        while (l->deficit > 0 && s->ready(s->context, link)) {
+            size_t bytes = s->send(s->context, link);
+            l->deficit -= (int64_t)bytes;
+            l->bytes += bytes;
+            ++l->messages;
+        }
+        if (s->ready(s->context, link)) {
+            push_back(s, link);
+        } else {
+            /* an idle link does not bank its unused turn */
+            l->active = false;
+            if (l->deficit > 0) l->deficit = 0;
+        }
+    }
+}
+
+double sched_fairness(const scheduler_t *s) {
+    double sum = 0, sum_squares = 0;
+    for (int i = 0; i < s->count; ++i) {
+        double share = (double)s->links[i].bytes / s->links[i].weight;
+        sum += share;
+        sum_squares += share * share;
+    }
+    return sum_squares > 0 ? sum * sum / (s->count * sum_squares) : 1.0;
+}
@@ -0,0 +1,93 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef SCHED_H
+#define SCHED_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Deficit round robin scheduler over sender links.
+ *
+ * Links with credit and messages to send take turns. Each turn adds the
+ * quantum times the link's weight to its deficit and the link sends until
+ * the deficit is spent, so over time every backlogged link gets a share of
+ * the bytes sent in proportion to its weight, whatever its message sizes.
+ * The overdraft of the last message of a turn is repaid from the next one.
+ *
+ * With strict priority, links take turns only while no link of a higher
+ * priority is ready, weights share the bytes between links of the same
+ * priority. Otherwise priorities are ignored and only weights count.
+ */
+
+#define SCHED_MAX_LINKS 16
+#define SCHED_PRIORITIES 10 /* 0 lowest to 9 highest, as AMQP message priority */
+
+/* Returns true if the link has credit and a message to send */
+typedef bool (*sched_ready_fn)(void *context, int link);
+
+/* Sends one message on the link, returns the # of bytes sent */
+typedef size_t (*sched_send_fn)(void *context, int link);
+
+typedef struct sched_link_t {
+    int weight;
+    int priority;
+    int64_t deficit;        /* bytes the link may still send this turn */
+    bool active;            /* queued for a turn */
+    int next;               /* next active link */
+    uint64_t bytes;         /* total bytes sent */
+    uint64_t messages;      /* total messages sent */
+} sched_link_t;
+
+typedef struct scheduler_t {
+    sched_link_t links[SCHED_MAX_LINKS];
+    int count;
+    size_t quantum;         /* bytes per turn per unit of weight */
+    bool strict;            /* serve higher priorities first */
+    int head[SCHED_PRIORITIES], tail[SCHED_PRIORITIES]; /* active links in turn order */
+    sched_ready_fn ready;
+    sched_send_fn send;
+    void *context;
+} scheduler_t;
+
+void sched_init(scheduler_t *s, size_t quantum, bool strict, sched_ready_fn ready, sched_send_fn send, void *context);
+
+/* Adds a link with a weight of 1 or more and a priority, returns its index */
+int sched_add(scheduler_t *s, int weight, int priority);
+
+/* Clears the turn order, deficits and counters, keeping the links and their weights */
+void sched_reset(scheduler_t *s);
+
+/* Queues the link for a turn if it is ready, call when it gets credit or messages */
+void sched_wake(scheduler_t *s, int link);
+
+/* Gives turns to the active links until none is ready */
+void sched_run(scheduler_t *s);
+
+/*
+ * Returns Jain's fairness index of the bytes sent per unit of weight, from
+ * 1/n when one link got everything to 1 when every link got its share.
+ * */
+double sched_fairness(const scheduler_t *s);
+
+#endif /* sched.h */
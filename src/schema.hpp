@@ -0,0 +1,333 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+
+#ifndef SCHEMA_HPP
+#define SCHEMA_HPP 1
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+extern "C" {
+#include "section.h"
+}
+
+/*
+ * Compile time codec for messages with a fixed schema.
+ *
+ * A schema lists the application properties of a message, each a key and
+ * a struct member, and the struct member that is the message body:
+ *
+ *     static constexpr char SENSOR[] = "sensor";
+ *     struct reading { int64_t sensor; double value; };
+ *     using reading_codec = schema::codec<reading,
+ *         schema::body<&reading::value>,
+ *         schema::field<SENSOR, &reading::sensor>>;
+ *
+ * The encoded message has the sections encode_message() writes: a header
+ * with the durable flag and priority, the application properties and an
+ * amqp-value body. Every value has a fixed width encoding, so the whole
+ * message except the values is built at compile time and encoding copies
+ * it and stores each value at its offset.
+ *
+ * Decoding reads the values from their offsets once it has checked that
+ * the constant bytes match, and otherwise falls back to the section
+ * scanner for messages with the same fields encoded another way, for
+ * example by pn_message_encode().
+ */
+
+namespace schema {
+
+/* Milliseconds since the epoch, encoded as an AMQP timestamp */
+struct timestamp {
+    int64_t ms;
+};
+
+/* The fixed width AMQP encoding of a member type */
+template <typename T> struct wire;
+template <> struct wire<bool>      { static constexpr uint8_t code = 0x56; static constexpr size_t width = 1; };
+template <> struct wire<uint8_t>   { static constexpr uint8_t code = 0x50; static constexpr size_t width = 1; };
+template <> struct wire<int8_t>    { static constexpr uint8_t code = 0x51; static constexpr size_t width = 1; };
+template <> struct wire<uint16_t>  { static constexpr uint8_t code = 0x60; static constexpr size_t width = 2; };
+template <> struct wire<int16_t>   { static constexpr uint8_t code = 0x61; static constexpr size_t width = 2; };
+template <> struct wire<uint32_t>  { static constexpr uint8_t code = 0x70; static constexpr size_t width = 4; };
+template <> struct wire<int32_t>   { static constexpr uint8_t code = 0x71; static constexpr size_t width = 4; };
+template <> struct wire<float>     { static constexpr uint8_t code = 0x72; static constexpr size_t width = 4; };
+template <> struct wire<uint64_t>  { static constexpr uint8_t code = 0x80; static constexpr size_t width = 8; };
+template <> struct wire<int64_t>   { static constexpr uint8_t code = 0x81; static constexpr size_t width = 8; };
+template <> struct wire<double>    { static constexpr uint8_t code = 0x82; static constexpr size_t width = 8; };
+template <> struct wire<timestamp> { static constexpr uint8_t code = 0x83; static constexpr size_t width = 8; };
+
+namespace detail {
+
+template <typename M> struct member;
+template <typename C, typename T> struct member<T C::*> {
+    using owner = C;
+    using type = T;
+};
+
+constexpr size_t length(const char *s) {
+    size_t n = 0;
+    while (s[n]) ++n;
+    return n;
+}
+
+/* The value bits of a member, as the unsigned integer of the same width */
+template <typename T> inline uint64_t bits(const T &v) {
+    if constexpr (std::is_same<T, bool>::value) {
+        return v ? 1 : 0;
+    } else if constexpr (std::is_same<T, timestamp>::value) {
+        return (uint64_t)v.ms;
+    } else if constexpr (std::is_floating_point<T>::value) {
+        typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type u;
+        std::memcpy(&u, &v, sizeof(u));
+        return u;
+    } else {
+        return (uint64_t)v;
+    }
+}
+
+template <typename T> inline T from_bits(uint64_t u) {
+    if constexpr (std::is_same<T, bool>::value) {
+        return u != 0;
+    } else if constexpr (std::is_same<T, timestamp>::value) {
+        return timestamp{(int64_t)u};
+    } else if constexpr (std::is_floating_point<T>::value) {
+        typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type w = (decltype(w))u;
+        T v;
+        std::memcpy(&v, &w, sizeof(v));
+        return v;
+    } else {
+        return (T)u;
+    }
+}
+
+inline void store(char *p, uint64_t v, size_t width) {
+    for (size_t i = width; i-- > 0; v >>= 8) {
+        p[i] = (char)(v & 0xff);
+    }
+}
+
+inline uint64_t load(const char *p, size_t width) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < width; ++i) {
+        v = v << 8 | (unsigned char)p[i];
+    }
+    return v;
+}
+
+/* Reads a value encoded any way that fits T, for the fallback path */
+template <typename T> inline bool read(const section_value_t &value, T &out) {
+    if constexpr (std::is_same<T, bool>::value) {
+        if (value.code == 0x41 || value.code == 0x42) {
+            out = value.code == 0x41;
+            return true;
+        }
+        if (value.code != 0x56) return false;
+        out = *value.start != 0;
+        return true;
+    } else if constexpr (std::is_same<T, timestamp>::value) {
+        return value.code == 0x83 && section_value_long(&value, &out.ms);
+    } else if constexpr (std::is_floating_point<T>::value) {
+        if (value.code == 0x82) {
+            out = (T)from_bits<double>(load(value.start, 8));
+        } else if (value.code == 0x72) {
+            out = (T)from_bits<float>(load(value.start, 4));
+        } else {
+            return false;
+        }
+        return true;
+    } else if constexpr (std::is_unsigned<T>::value) {
+        uint64_t u;
+        if (!section_value_uint(&value, &u)) return false;
+        out = (T)u;
+        return true;
+    } else {
+        int64_t l;
+        if (!section_value_long(&value, &l)) return false;
+        out = (T)l;
+        return true;
+    }
+}
+
+} /* namespace detail */
+
+/* An application property: its key and the struct member holding its value */
+template <const char *Key, auto Member>
+struct field {
+    using type = typename detail::member<decltype(Member)>::type;
+    static constexpr const char *key = Key;
+    static constexpr size_t key_size = detail::length(Key);
+    static_assert(key_size < 256, "keys are encoded as str8");
+    /* str8 key, then the constructor and value */
+    static constexpr size_t size = 2 + key_size + 1 + wire<type>::width;
+    static constexpr auto member = Member;
+};
+
+/* The struct member that is the amqp-value body */
+template <auto Member>
+struct body {
+    using type = typename detail::member<decltype(Member)>::type;
+    static constexpr auto member = Member;
+};
+
+template <typename Struct, typename Body, typename... Fields>
+class codec {
+  public:
+    static constexpr size_t FIELDS = sizeof...(Fields);
+    /* descriptor, list8 with durable true and a ubyte priority */
+    static constexpr size_t HEADER_SIZE = 3 + 3 + 1 + 2;
+    static constexpr size_t PROPERTIES_SIZE = 3 + 1 + 4 + 4 + (0 + ... + Fields::size);
+    static constexpr size_t BODY_SIZE = 3 + 1 + wire<typename Body::type>::width;
+    /* the encoded size of every message */
+    static constexpr size_t SIZE = HEADER_SIZE + PROPERTIES_SIZE + BODY_SIZE;
+
+    /*
+     * Encodes a message into 'out', which must have room for SIZE bytes.
+     * @returns: SIZE, or 0 if 'capacity' is too small
+     * */
+    static size_t encode(const Struct &message, char *out, size_t capacity, uint8_t priority = 4) {
+        if (capacity < SIZE) {
+            return 0;
+        }
+        std::memcpy(out, layout.skeleton.data(), SIZE);
+        out[PRIORITY_OFFSET] = (char)priority;
+        size_t i = 0;
+        ((detail::store(out + layout.offsets[i], detail::bits(message.*Fields::member), wire<typename Fields::type>::width), ++i), ...);
+        detail::store(out + layout.offsets[FIELDS], detail::bits(message.*Body::member), wire<typename Body::type>::width);
+        return SIZE;
+    }
+
+    /*
+     * Decodes a message into 'message'. Messages in this codec's layout
+     * are read at fixed offsets, others through the section scanner.
+     * @returns: true if every field and the body were found
+     * */
+    static bool decode(const char *bytes, size_t size, Struct &message) {
+        if (matches(bytes, size)) {
+            size_t i = 0;
+            ((message.*Fields::member = detail::from_bits<typename Fields::type>(
+                  detail::load(bytes + layout.offsets[i], wire<typename Fields::type>::width)), ++i), ...);
+            message.*Body::member = detail::from_bits<typename Body::type>(
+                detail::load(bytes + layout.offsets[FIELDS], wire<typename Body::type>::width));
+            return true;
+        }
+        return decode_sections(bytes, size, message);
+    }
+
+  private:
+    static constexpr size_t PRIORITY_OFFSET = HEADER_SIZE - 1;
+
+    /* The constant bytes between two values */
+    struct run_t {
+        size_t start, size;
+    };
+
+    struct layout_t {
+        std::array<char, SIZE> skeleton;
+        std::array<size_t, FIELDS + 1> offsets;     /* of the field values then the body value */
+        std::array<run_t, FIELDS + 2> runs;         /* the constant bytes around the values */
+    };
+
+    struct writer_t {
+        layout_t l{};
+        size_t at = 0;
+        size_t run_start = 0;
+        size_t runs = 0;
+
+        constexpr void put(uint8_t b) { l.skeleton[at++] = (char)b; }
+        constexpr void put32(uint32_t v) {
+            for (int shift = 24; shift >= 0; shift -= 8) put((uint8_t)(v >> shift));
+        }
+        /* leaves room for a value and closes the run of constant bytes before it */
+        constexpr void value(size_t width) {
+            l.runs[runs++] = run_t{run_start, at - run_start};
+            at += width;
+            run_start = at;
+        }
+        template <typename F> constexpr void add_field(size_t index) {
+            put(0xa1);
+            put((uint8_t)F::key_size);
+            for (size_t k = 0; k < F::key_size; ++k) put((uint8_t)F::key[k]);
+            put(wire<typename F::type>::code);
+            l.offsets[index] = at;
+            value(wire<typename F::type>::width);
+        }
+    };
+
+    static constexpr layout_t make_layout() {
+        writer_t w;
+        size_t index = 0;
+        w.put(0x00); w.put(0x53); w.put(SECTION_HEADER);
+        w.put(0xc0); w.put(4); w.put(2);
+        w.put(0x41);                        /* durable */
+        w.put(0x50);                        /* priority, set by encode() */
+        w.value(1);
+        w.put(0x00); w.put(0x53); w.put(SECTION_APPLICATION_PROPERTIES);
+        w.put(0xd1);
+        w.put32((uint32_t)(PROPERTIES_SIZE - 8));
+        w.put32((uint32_t)(2 * FIELDS));
+        (w.template add_field<Fields>(index++), ...);
+        w.put(0x00); w.put(0x53); w.put(SECTION_AMQP_VALUE);
+        w.put(wire<typename Body::type>::code);
+        w.l.offsets[FIELDS] = w.at;
+        w.value(wire<typename Body::type>::width);
+        return w.l;
+    }
+
+    static constexpr layout_t layout = make_layout();
+
+    static bool matches(const char *bytes, size_t size) {
+        if (size != SIZE) {
+            return false;
+        }
+        for (const run_t &r : layout.runs) {
+            if (std::memcmp(bytes + r.start, layout.skeleton.data() + r.start, r.size) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool decode_sections(const char *bytes, size_t size, Struct &message) {
+        section_reader_t reader;
+        section_t section;
+        bool properties = false, body = false;
+        section_reader_init(&reader, bytes, size);
+        while (section_next(&reader, &section) == 1) {
+            if (section.code == SECTION_APPLICATION_PROPERTIES) {
+                section_value_t value;
+                properties = ((section_map_get(&section.value, Fields::key, &value)
+                               && detail::read(value, message.*Fields::member)) && ... && true);
+            } else if (section.code == SECTION_AMQP_VALUE) {
+                body = detail::read(section.value, message.*Body::member);
+            }
+        }
+        return (properties || FIELDS == 0) && body;
+    }
+};
+
+} /* namespace schema */
+
+#endif /* schema.hpp */
@@ -0,0 +1,233 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "section.h"
+
+#include <string.h>
+
+/* Format codes used by name */
+#define CODE_DESCRIBED  0x00
+#define CODE_NULL       0x40
+#define CODE_LIST0      0x45
+
+static uint64_t read_be(const unsigned char *p, size_t width) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < width; ++i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+void section_reader_init(section_reader_t *reader, const char *bytes, size_t size) {
+    reader->next = bytes;
+    reader->end = bytes + size;
+}
+
+int section_value_read(const char **next, const char *end, section_value_t *value) {
+    const unsigned char *p = (const unsigned char*)*next;
+    const unsigned char *e = (const unsigned char*)end;
+    size_t width = 0, size = 0;
+    uint8_t code;
+    if (p >= e) {
+        return -1;
+    }
+    code = *p++;
+    if (code == CODE_DESCRIBED) {
+        /* the descriptor is skipped, the value is what is described */
+        section_value_t descriptor;
+        *next = (const char*)p;
+        if (section_value_read(next, end, &descriptor) < 0) {
+            return -1;
+        }
+        return section_value_read(next, end, value);
+    }
+    /* the high nibble gives the size of the value or of its size field */
+    switch (code >> 4) {
+     case 0x4: size = 0; break;
+     case 0x5: size = 1; break;
+     case 0x6: size = 2; break;
+     case 0x7: size = 4; break;
+     case 0x8: size = 8; break;
+     case 0x9: size = 16; break;
+     case 0xa: case 0xc: case 0xe: width = 1; break;
+     case 0xb: case 0xd: case 0xf: width = 4; break;
+     default: return -1;
+    }
+    if (width) {
+        if ((size_t)(e - p) < width) {
+            return -1;
+        }
+        size = (size_t)read_be(p, width);
+        p += width;
+    }
+    if ((size_t)(e - p) < size) {
+        return -1;
+    }
+    value->code = code;
+    value->start = (const char*)p;
+    value->size = size;
+    value->count = 0;
+    if ((code >> 4) == 0xc || (code >> 4) == 0xd) {
+        /* lists and maps count their elements after the size */
+        if (size < width) {
+            return -1;
+        }
+        value->count = (uint32_t)read_be(p, width);
+        value->start += width;
+        value->size -= width;
+    }
+    *next = (const char*)(p + size);
+    return 0;
+}
+
+int section_next(section_reader_t *reader, section_t *section) {
+    section_value_t descriptor;
+    if (reader->next >= reader->end) {
+        return 0;
+    }
+    if ((unsigned char)*reader->next != CODE_DESCRIBED) {
+        return -1;
+    }
+    ++reader->next;
+    if (section_value_read(&reader->next, reader->end, &descriptor) < 0) {
+        return -1;
+    }
+    if (!section_value_uint(&descriptor, &section->code)) {
+        section->code = 0;
+    }
+    return section_value_read(&reader->next, reader->end, &section->value) < 0 ? -1 : 1;
+}
+
+bool section_list_get(const section_value_t *list, uint32_t index, section_value_t *element) {
+    const char *next = list->start;
+    const char *end = list->start + list->size;
+    uint8_t kind = list->code & 0xf0;
+    if (list->code == CODE_LIST0 || (kind != 0xc0 && kind != 0xd0) || index >= list->count) {
+        return false;
+    }
+    for (uint32_t i = 0; i <= index; ++i) {
+        if (section_value_read(&next, end, element) < 0) {
+            return false;
+        }
+    }
+    return element->code != CODE_NULL;
+}
+
+bool section_map_get(const section_value_t *map, const char *key, section_value_t *value) {
+    const char *next = map->start;
+    const char *end = map->start + map->size;
+    size_t key_size = strlen(key);
+    if (map->code != 0xc1 && map->code != 0xd1) {
+        return false;
+    }
+    for (uint32_t i = 0; i + 1 < map->count; i += 2) {
+        section_value_t k;
+        const char *start;
+        size_t size;
+        if (section_value_read(&next, end, &k) < 0 || section_value_read(&next, end, value) < 0) {
+            return false;
+        }
+        if (section_value_string(&k, &start, &size) && size == key_size && memcmp(start, key, size) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool section_value_uint(const section_value_t *value, uint64_t *out) {
+    const unsigned char *p = (const unsigned char*)value->start;
+    switch (value->code) {
+     case 0x43: case 0x44: *out = 0; return true;              /* uint0, ulong0 */
+     case 0x50: case 0x52: case 0x53: *out = *p; return true;  /* ubyte, smalluint, smallulong */
+     case 0x60: case 0x70: case 0x80:                          /* ushort, uint, ulong */
+        *out = read_be(p, value->size);
+        return true;
+     default: return false;
+    }
+}
+
+bool section_value_long(const section_value_t *value, int64_t *out) {
+    const unsigned char *p = (const unsigned char*)value->start;
+    switch (value->code) {
+     case 0x51: case 0x54: case 0x55: *out = (int8_t)*p; return true; /* byte, smallint, smalllong */
+     case 0x61: *out = (int16_t)read_be(p, 2); return true;           /* short */
+     case 0x71: *out = (int32_t)read_be(p, 4); return true;           /* int */
+     case 0x81: case 0x83: *out = (int64_t)read_be(p, 8); return true; /* long, timestamp */
+     default: return false;
+    }
+}
+
+bool section_value_string(const section_value_t *value, const char **start, size_t *size) {
+    switch (value->code) {
+     case 0xa1: case 0xb1: case 0xa3: case 0xb3:    /* str8, str32, sym8, sym32 */
+        *start = value->start;
+        *size = value->size;
+        return true;
+     default: return false;
+    }
+}
+
+int section_scan_expiry(const char *bytes, size_t size, section_expiry_t *expiry) {
+    section_reader_t reader;
+    section_t section;
+    section_value_t field;
+    int rc;
+    memset(expiry, 0, sizeof(*expiry));
+    section_reader_init(&reader, bytes, size);
+    while ((rc = section_next(&reader, &section)) == 1 && section.code < SECTION_APPLICATION_PROPERTIES) {
+        if (section.code == SECTION_HEADER) {
+            uint64_t ttl;
+            if (section_list_get(&section.value, SECTION_HEADER_TTL, &field) && section_value_uint(&field, &ttl)) {
+                expiry->ttl_ms = (uint32_t)ttl;
+            }
+        } else if (section.code == SECTION_PROPERTIES) {
+            if (section_list_get(&section.value, SECTION_PROPERTIES_ABSOLUTE_EXPIRY_TIME, &field)) {
+                section_value_long(&field, &expiry->absolute_expiry_time);
+            }
+            if (section_list_get(&section.value, SECTION_PROPERTIES_CREATION_TIME, &field)) {
+                section_value_long(&field, &expiry->creation_time);
+            }
+            /* nothing after the properties is needed */
+            break;
+        }
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+int section_scan_property(const char *bytes, size_t size, const char *key, section_value_t *value) {
+    section_reader_t reader;
+    section_t section;
+    int rc;
+    section_reader_init(&reader, bytes, size);
+    while ((rc = section_next(&reader, &section)) == 1 && section.code <= SECTION_APPLICATION_PROPERTIES) {
+        if (section.code == SECTION_APPLICATION_PROPERTIES) {
+            return section_map_get(&section.value, key, value) ? 1 : 0;
+        }
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+bool section_expired(const section_expiry_t *expiry, int64_t arrival_ms, int64_t now_ms) {
+    if (expiry->absolute_expiry_time > 0) {
+        return now_ms >= expiry->absolute_expiry_time;
+    }
+    return expiry->ttl_ms > 0 && now_ms >= arrival_ms + expiry->ttl_ms;
+}
@@ -0,0 +1,125 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+
+#ifndef SECTION_H
+#define SECTION_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scanner over the sections of an encoded AMQP message.
+ *
+ * Reads the described sections one by one, skipping each by its encoded
+ * size, so fields of the header, properties and application properties
+ * are found without decoding the message or its body. Values are views
+ * of the encoded bytes, nothing is copied or allocated.
+ */
+
+/* Section descriptors */
+#define SECTION_HEADER                  0x70
+#define SECTION_DELIVERY_ANNOTATIONS    0x71
+#define SECTION_MESSAGE_ANNOTATIONS     0x72
+#define SECTION_PROPERTIES              0x73
+#define SECTION_APPLICATION_PROPERTIES  0x74
+#define SECTION_DATA                    0x75
+#define SECTION_AMQP_SEQUENCE           0x76
+#define SECTION_AMQP_VALUE              0x77
+#define SECTION_FOOTER                  0x78
+
+/* Fields of the header and properties lists */
+#define SECTION_HEADER_TTL              2
+#define SECTION_PROPERTIES_ABSOLUTE_EXPIRY_TIME 8
+#define SECTION_PROPERTIES_CREATION_TIME 9
+
+/* An encoded value */
+typedef struct section_value_t {
+    uint8_t code;           /* format code */
+    const char *start;      /* the value, for lists and maps their first element */
+    size_t size;            /* bytes at start */
+    uint32_t count;         /* # of elements of a list, keys and values of a map */
+} section_value_t;
+
+typedef struct section_t {
+    uint64_t code;          /* descriptor, 0 for a symbolic descriptor */
+    section_value_t value;
+} section_t;
+
+typedef struct section_reader_t {
+    const char *next;
+    const char *end;
+} section_reader_t;
+
+/* Expiry fields of a message, 0 when absent */
+typedef struct section_expiry_t {
+    uint32_t ttl_ms;
+    int64_t creation_time;  /* ms since the epoch */
+    int64_t absolute_expiry_time;
+} section_expiry_t;
+
+void section_reader_init(section_reader_t *reader, const char *bytes, size_t size);
+
+/* Reads the next section, returns 1 if read, 0 at the end, -1 for a malformed message */
+int section_next(section_reader_t *reader, section_t *section);
+
+/* Reads the value at *next and moves *next past it, returns 0 or -1 if malformed */
+int section_value_read(const char **next, const char *end, section_value_t *value);
+
+/* Finds element 'index' of a list, returns false if the list is shorter or the element null */
+bool section_list_get(const section_value_t *list, uint32_t index, section_value_t *element);
+
+/* Finds the value of a string or symbol key in a map */
+bool section_map_get(const section_value_t *map, const char *key, section_value_t *value);
+
+/* Reads an unsigned integer of any width */
+bool section_value_uint(const section_value_t *value, uint64_t *out);
+
+/* Reads a signed integer of any width or a timestamp */
+bool section_value_long(const section_value_t *value, int64_t *out);
+
+/* Reads a string or symbol, not null terminated */
+bool section_value_string(const section_value_t *value, const char **start, size_t *size);
+
+/*
+ * Reads the ttl of the header and the expiry and creation times of the
+ * properties, stopping at the application properties.
+ * @returns: 0, or -1 for a malformed message
+ * */
+int section_scan_expiry(const char *bytes, size_t size, section_expiry_t *expiry);
+
+/*
+ * Finds an application property of a message, stopping at the body.
+ * @returns: 1 if found, 0 if not, or -1 for a malformed message
+ * */
+int section_scan_property(const char *bytes, size_t size, const char *key, section_value_t *value);
+
+/*
+ * Returns true if a message expired at now_ms, by its absolute expiry time
+ * or else the header ttl counted from arrival_ms. Intermediaries rewrite the
+ * ttl to the time left when they forward a message, so it does not count
+ * from the creation time; a message only checked as it arrives expires by
+ * its absolute expiry time alone.
+ * */
+bool section_expired(const section_expiry_t *expiry, int64_t arrival_ms, int64_t now_ms);
+
+#endif /* section.h */
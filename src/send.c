@@ -22,6 +22,29 @@
  * This sample shows the basics of creating an AMQP Connection, 
  * Session, Sender Link, and sending a message using an AMQP 
  * address with the QPID Proton C API. 
+ *
+ * With -k the application generates keyed updates at its own rate and
+ * conflates them while waiting for credit, only the latest value of
+ * each key is sent when credit returns.
+ *
+ * Given several targets with -T, one sender link per target shares the
+ * connection through a deficit round robin scheduler, each link gets a
+ * share of the bytes sent in proportion to its weight. Targets can be
+ * priority lanes, with -S a lane sends only while no higher priority lane
+ * has credit and messages, so control messages do not queue behind bulk.
+ *
+ * With -H the targets are shards of one stream, each message goes to the
+ * target its key property hashes to on a consistent hash ring, so all the
+ * messages of a key stay in order on one queue.
+ *
+ * With -D the messages are snapshots of -Z bytes that change a few bytes
+ * at a time, sent as deltas against the previous snapshot of the same key,
+ * or of the same target without keys, with a keyframe every -D messages
+ * and on every new connection.
+ *
+ * -z pads the message body to a size, and -d presettled sends the
+ * messages settled, at most once, without waiting for the broker to
+ * accept them.
  */
 
 #include <proton/connection.h>
@@ -33,25 +56,94 @@
 #include <proton/session.h>
 #include <proton/transport.h>
 #include <proton/sasl.h>
+#include <proton/ssl.h>
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "conflate.h"
+#include "delta.h"
+#include "hashring.h"
+#include "latency.h"
+#include "sched.h"
+#include "probe.h"
 #include "util.h"
 
+#define GENERATE_INTERVAL_MS 1
+#define SNAPSHOT_RECORD 16      /* bytes per record of a generated snapshot */
+#define MAX_TARGETS SCHED_MAX_LINKS
+
+/* A sender link and the messages it sends */
+typedef struct target_t {
+  const char *address;
+  int weight;
+  int priority;             /* AMQP priority of the messages and scheduling priority with -S */
+  int count;                /* # of messages to send */
+  int index;
+  pn_link_t *link;
+  uint64_t credit_time;     /* clock_now_ns() when the link last got credit */
+  int sent;
+  int acknowledged;
+  uint64_t *send_times;     /* clock_now_ns() at send, indexed by link sequence */
+  int *sequences;           /* message sequences routed to the target with -H, indexed by link sequence */
+  int keys;                 /* # of keys routed to the target with -H */
+  uint64_t done_time;       /* clock_now_ns() when the last message was acknowledged */
+  latency_histogram_t latency; /* send to acknowledgement in us */
+} target_t;
+
 typedef struct app_data_t {
   const char *host, *port;
   const char *username, *password;
   const char *amqp_address;
   const char *container_id;
   int message_count;
+  int connections;          /* # of times to connect and send message_count */
+  bool ssl;
+  const char *ssl_ca_db;
+  unsigned probe_ms;        /* broker round trip probe interval, 0 for none */
+  probe_t probe;
+  const char *clock_address; /* clock offset exchange address, NULL for none */
+  bool latency;             /* stamp a sample of the messages */
+  latency_sampler_t latency_sampler;
+  pn_millis_t ttl_ms;       /* message time to live, 0 for none */
+  bool latency_stages;      /* trace the stages of stamped messages */
+  const char *conflate_key; /* conflate pending messages on this property, NULL sends on credit */
+  int conflate_keys;        /* # of distinct key values generated */
+  const char *shard_key;    /* route messages to targets by hashing this property, NULL for no sharding */
+  int shard_vnodes;         /* virtual nodes per shard per unit of weight */
+  int generate_rate;        /* messages generated per second, 0 generates all at once */
+  size_t quantum;           /* scheduler bytes per turn per unit of weight */
+  bool strict_priority;     /* higher priority targets send first */
+  int delta_interval;       /* send snapshots as deltas with a keyframe every n messages, 0 sends strings */
+  size_t snapshot_size;     /* bytes per snapshot, use with delta_interval */
+  size_t body_size;         /* string body padded to this size, 0 for just the sequence */
+  bool presettled;          /* send settled, done once sent */
 
   pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain; /* shared by all connections for session resumption */
   pn_rwbytes_t message_buffer;
   int sent;
   int acknowledged;
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  uint64_t open_time;       /* clock_now_ns() at PN_CONNECTION_REMOTE_OPEN */
+  uint64_t total_open_ns;   /* sum of connection open times */
+  latency_stages_t stages;
+  latency_trace_t *unwritten; /* traces of messages sent in the current event batch */
+  pn_connection_t *connection;
+  target_t targets[MAX_TARGETS];
+  int target_count;
+  int total_count;          /* # of messages all targets send */
+  scheduler_t sched;
+  double fairness;          /* fairness index when the first target ran out of messages */
+  bool fairness_taken;
+  conflate_t pending;       /* generated messages waiting for credit */
+  hashring_t ring;          /* shard ring of the targets */
+  int generated;
+  uint64_t generate_start;  /* clock_now_ns() when generation started */
+  delta_codec_t delta;
+  char *snapshot;           /* snapshot being encoded */
 } app_data_t;
 
 static int exit_code = 0;
@@ -90,23 +182,78 @@ static void check_condition(pn_event_t *e, pn_condition_t *cond) {
   }
 }
 
-/* Create a message with a string "sequence_<number>" encode it and return the encoded buffer. */
-static pn_bytes_t encode_message(app_data_t* app) {
-  /* Construct a message with the string "sequence_<app.sent>" */
+/*
+ * Fills app->snapshot with version n of a table of fixed width records,
+ * version n + 1 updates the value of one record.
+ * */
+static void make_snapshot(app_data_t* app, int n) {
+  int records = (int)(app->snapshot_size / SNAPSHOT_RECORD);
+  char record[SNAPSHOT_RECORD + 1];
+  for (int i = 0; i < records; ++i) {
+    /* record i has been updated once per pass over the records, plus once in the current pass */
+    unsigned long long value = (unsigned long long)i * 1000 + n / records + (i < n % records);
+    snprintf(record, sizeof(record), "%04d:%010llu\n", i % 10000, value % 10000000000ULL);
+    memcpy(app->snapshot + i * SNAPSHOT_RECORD, record, SNAPSHOT_RECORD);
+  }
+}
+
+/*
+ * Create a message with a string "sequence_<number>", or with -D a delta
+ * encoded snapshot, encode it and return the encoded buffer.
+ * The message carries the conflation key property if 'key' is set and
+ * a latency stamp if 'stamp' is set.
+ * */
+static pn_bytes_t encode_message(app_data_t* app, target_t* t, int sequence, const char* key, bool stamp) {
+  const char* key_property = app->conflate_key ? app->conflate_key : app->shard_key;
+  /* Construct a message with the string "sequence_<sequence>" */
   pn_message_t* message = pn_message();
   pn_data_t* body = pn_message_body(message);
-  /* Create string for amqp message body */
-  size_t slen = sizeof("sequence_") + 12;
-  char* sbuf = malloc(slen);
-  int swritten = sprintf(sbuf, "sequence_%d", app->sent);
-  if (swritten < 0) {
-    fprintf(stderr, "error writing message body string for sequence %d", app->sent);
-    exit(1);
+  char* sbuf = NULL;
+  if (!app->delta_interval) {
+    /* Create string for amqp message body */
+    size_t slen = sizeof("sequence_") + 12;
+    sbuf = malloc(slen > app->body_size ? slen : app->body_size);
+    int swritten = sprintf(sbuf, "sequence_%d", sequence);
+    if (swritten < 0) {
+      fprintf(stderr, "error writing message body string for sequence %d", sequence);
+      exit(1);
+    }
+    /* pad the sequence up to -z */
+    if ((size_t)swritten < app->body_size) {
+      memset(sbuf + swritten, '.', app->body_size - swritten);
+      swritten = (int)app->body_size;
+    }
+    pn_data_put_string(body, pn_bytes(swritten, sbuf));
   }
-  pn_data_put_string(body, pn_bytes(swritten, sbuf));
 
   /* set message durable flag */
   pn_message_set_durable(message, true);
+  pn_message_set_priority(message, (uint8_t)t->priority);
+
+  /* brokers rewrite the ttl to the time left, the absolute expiry time stays put */
+  if (app->ttl_ms) {
+    pn_timestamp_t now = (pn_timestamp_t)clock_wall_ms();
+    pn_message_set_ttl(message, app->ttl_ms);
+    pn_message_set_creation_time(message, now);
+    pn_message_set_expiry_time(message, now + app->ttl_ms);
+  }
+
+  if (key) {
+    pn_data_t* properties = message_properties_append(message);
+    pn_data_put_string(properties, pn_bytes(strlen(key_property), key_property));
+    pn_data_put_string(properties, pn_bytes(strlen(key), key));
+    pn_data_exit(properties);
+  }
+  if (app->delta_interval) {
+    /* the messages of a key, or of the target without keys, are one stream of snapshots */
+    delta_frame_t frame;
+    make_snapshot(app, sequence);
+    pn_bytes_t delta = delta_encode(&app->delta, key ? key : t->address, app->snapshot, app->snapshot_size, &frame);
+    delta_message_set(message, &frame, delta);
+  }
+  if (stamp) {
+    latency_stamp(message);
+  }
 
   /* encode the message, expanding the encode buffer as needed */
   if (app->message_buffer.start == NULL) {
@@ -129,10 +276,251 @@ static pn_bytes_t encode_message(app_data_t* app) {
     exit(1);
   }
   pn_message_free(message);
+  free(sbuf);
   return pn_bytes(mbuf.size, mbuf.start);
   }
 }
 
+/* Formats the value of key n of the generated keys */
+static void format_key(char* key, int n) {
+  snprintf(key, CONFLATE_KEY_MAX, "key_%d", n);
+}
+
+static void message_done(app_data_t* app, target_t* t);
+
+/*
+ * Sends one message on a target's link, 'entry' is the conflated message to
+ * send or NULL for the next sequence.
+ * @returns: the # of bytes sent
+ * */
+static size_t send_message(app_data_t* app, target_t* t, const conflate_entry_t* entry) {
+  pn_link_t *sender = t->link;
+  int sequence = t->sent++;
+  size_t size;
+  ++app->sent;
+  /* Use the link's sent counter as unique delivery tag. */
+  pn_delivery_t *d = pn_delivery(sender, pn_dtag((const char *)&sequence, sizeof(sequence)));
+  /* stamp a sample of the messages for latency measurement */
+  bool stamp = app->latency && latency_sample(&app->latency_sampler);
+  latency_trace_t *trace = NULL;
+  if (stamp && app->latency_stages) {
+    trace = (latency_trace_t*)calloc(1, sizeof(latency_trace_t));
+    /* without conflation all -c messages are queued by the application when the connection opens */
+    trace->at[LATENCY_SEND_ENQUEUE] = entry ? entry->enqueued : app->open_time;
+    trace->at[LATENCY_SEND_CREDIT] = t->credit_time;
+    latency_trace_mark(trace, LATENCY_SEND_ENCODE_START);
+  }
+  {
+  pn_bytes_t msgbuf;
+  if (entry) {
+    msgbuf = encode_message(app, t, (int)entry->value, entry->key, stamp);
+  } else if (t->sequences) {
+    /* the key of a routed message follows from its sequence */
+    char key[CONFLATE_KEY_MAX];
+    int routed = t->sequences[sequence];
+    format_key(key, routed % app->conflate_keys);
+    msgbuf = encode_message(app, t, routed, key, stamp);
+  } else {
+    msgbuf = encode_message(app, t, app->sent, NULL, stamp);
+  }
+  if (trace) latency_trace_mark(trace, LATENCY_SEND_ENCODE_END);
+  t->send_times[sequence] = clock_now_ns();
+  pn_link_send(sender, msgbuf.start, msgbuf.size);
+  size = msgbuf.size;
+  }
+  if (trace) {
+    latency_trace_mark(trace, LATENCY_SEND_LINK_SEND);
+    pn_delivery_set_context(d, trace);
+    /* written when the batch is done */
+    trace->next = app->unwritten;
+    app->unwritten = trace;
+  }
+  pn_link_advance(sender);
+  if (app->presettled) {
+    /* nothing comes back for a settled message */
+    pn_delivery_settle(d);
+    message_done(app, t);
+  }
+  return size;
+}
+
+/* Frees the stage trace of a delivery settled without recording it */
+static void drop_trace(pn_delivery_t *d) {
+  latency_trace_t *trace = (latency_trace_t*)pn_delivery_get_context(d);
+  if (trace) {
+    pn_delivery_set_context(d, NULL);
+    free(trace);
+  }
+}
+
+/* Frees the traces of deliveries still outstanding when the connection closes */
+static void drop_traces(app_data_t *app) {
+  app->unwritten = NULL;
+  for (int i = 0; i < app->target_count; ++i) {
+    pn_link_t *link = app->targets[i].link;
+    for (pn_delivery_t *d = link ? pn_unsettled_head(link) : NULL; d; d = pn_unsettled_next(d)) {
+      drop_trace(d);
+    }
+  }
+}
+
+/* Scheduler callback, a target is ready with credit and a message to send */
+static bool target_ready(void* context, int link) {
+  app_data_t* app = (app_data_t*)context;
+  target_t* t = &app->targets[link];
+  if (!app->conflate_key && t->sent == t->count) {
+    /* the first target to run out of messages ends the contention between them */
+    if (!app->fairness_taken) {
+      app->fairness = sched_fairness(&app->sched);
+      app->fairness_taken = true;
+    }
+    return false;
+  }
+  return t->link && pn_link_credit(t->link) > 0 && (!app->conflate_key || app->pending.pending > 0);
+}
+
+/* Scheduler callback, sends the target's next message */
+static size_t target_send(void* context, int link) {
+  app_data_t* app = (app_data_t*)context;
+  if (app->conflate_key) {
+    /* only the latest value of each pending key goes out */
+    conflate_entry_t entry;
+    conflate_take(&app->pending, &entry);
+    return send_message(app, &app->targets[link], &entry);
+  }
+  return send_message(app, &app->targets[link], NULL);
+}
+
+/*
+ * Generates the keyed messages due at the -g rate since generation started,
+ * a message for a key that is still waiting for credit replaces the pending one.
+ * */
+static void generate_due(app_data_t* app) {
+  int due = app->message_count;
+  if (app->generate_rate > 0) {
+    uint64_t elapsed = clock_now_ns() - app->generate_start;
+    uint64_t n = elapsed / 1000 * (uint64_t)app->generate_rate / 1000000;
+    if (n < (uint64_t)due) due = (int)n;
+  }
+  for (; app->generated < due; ++app->generated) {
+    char key[CONFLATE_KEY_MAX];
+    format_key(key, rand() % app->conflate_keys);
+    conflate_put(&app->pending, key, app->generated);
+  }
+}
+
+/*
+ * Routes the -c messages to the targets by consistent hashing of their keys,
+ * the weight of a target scales its share of the ring. Prints the keys and
+ * messages of each shard, the skew, and how few keys would move if the last
+ * shard were removed.
+ * */
+static void route_messages(app_data_t* app) {
+  char key[CONFLATE_KEY_MAX];
+  int *owners = (int*)malloc(app->conflate_keys * sizeof(int));
+  int max_count = 0;
+  hashring_init(&app->ring);
+  for (int i = 0; i < app->target_count; ++i) {
+    target_t *t = &app->targets[i];
+    hashring_add(&app->ring, i, t->address, app->shard_vnodes * t->weight);
+    t->count = 0;
+    t->keys = 0;
+  }
+  for (int k = 0; k < app->conflate_keys; ++k) {
+    format_key(key, k);
+    owners[k] = hashring_lookup(&app->ring, key);
+    ++app->targets[owners[k]].keys;
+  }
+  /* message j carries key j % keys */
+  for (int j = 0; j < app->message_count; ++j) {
+    ++app->targets[owners[j % app->conflate_keys]].count;
+  }
+  for (int i = 0; i < app->target_count; ++i) {
+    target_t *t = &app->targets[i];
+    t->sequences = (int*)malloc((t->count > 0 ? t->count : 1) * sizeof(int));
+    if (t->count > max_count) max_count = t->count;
+    t->count = 0;
+  }
+  for (int j = 0; j < app->message_count; ++j) {
+    target_t *t = &app->targets[owners[j % app->conflate_keys]];
+    t->sequences[t->count++] = j;
+  }
+  app->total_count = app->message_count;
+  for (int i = 0; i < app->target_count; ++i) {
+    printf("shard %s: %d keys, %d messages\n", app->targets[i].address,
+           app->targets[i].keys, app->targets[i].count);
+  }
+  if (app->message_count > 0) {
+    printf("shard skew (max / mean messages): %.3f\n",
+           max_count * (double)app->target_count / app->message_count);
+  }
+  if (app->target_count > 1) {
+    /* only the keys of the removed shard move */
+    int last = app->target_count - 1;
+    int moved = 0;
+    hashring_remove(&app->ring, last);
+    for (int k = 0; k < app->conflate_keys; ++k) {
+      format_key(key, k);
+      moved += hashring_lookup(&app->ring, key) != owners[k];
+    }
+    printf("removing shard %s would move %d of %d keys (%.1f%%)\n", app->targets[last].address,
+           moved, app->conflate_keys, 100.0 * moved / app->conflate_keys);
+    hashring_add(&app->ring, last, app->targets[last].address, app->shard_vnodes * app->targets[last].weight);
+  }
+  free(owners);
+}
+
+/* Returns true once every message has been sent and acknowledged */
+static bool send_complete(app_data_t* app) {
+  if (app->conflate_key) {
+    return app->generated == app->message_count && app->pending.pending == 0
+      && app->acknowledged == app->sent;
+  }
+  return app->acknowledged == app->total_count;
+}
+
+/* Prints the share, rate and acknowledgement latency of each target */
+static void report_targets(app_data_t* app) {
+  for (int i = 0; i < app->target_count; ++i) {
+    target_t *t = &app->targets[i];
+    sched_link_t *l = &app->sched.links[i];
+    double secs = t->done_time ? (t->done_time - app->open_time) / 1e9 : 0;
+    char name[PN_MAX_ADDR];
+    printf("target %s weight %d priority %d: %llu messages, %llu bytes, done in %.3f ms (%.0f msg/s)\n",
+           t->address, t->weight, t->priority, (unsigned long long)l->messages, (unsigned long long)l->bytes,
+           secs * 1e3, secs > 0 ? t->acknowledged / secs : 0.0);
+    snprintf(name, sizeof(name), "%s latency", t->address);
+    latency_histogram_report(stdout, name, "us", &t->latency);
+  }
+  if (app->fairness_taken && !app->strict_priority) {
+    printf("fairness index while all targets were backlogged: %.3f\n", app->fairness);
+  }
+}
+
+/* Counts a message accepted, or sent settled, and closes the connection once all are done */
+static void message_done(app_data_t* app, target_t* t) {
+  if (++t->acknowledged == t->count) {
+    t->done_time = clock_now_ns();
+  }
+  ++app->acknowledged;
+  if (send_complete(app)) {
+    double secs = (clock_now_ns() - app->open_time) / 1e9;
+    printf("%d messages %s in %.3f ms (%.0f msg/s)\n", app->acknowledged,
+           app->presettled ? "sent settled" : "sent and acknowledged",
+           secs * 1e3, secs > 0 ? app->acknowledged / secs : 0.0);
+    if (app->conflate_key) {
+      printf("%d messages generated, %llu conflated on '%s' (%.1f%%)\n",
+             app->generated, (unsigned long long)app->pending.conflated,
+             app->conflate_key, 100.0 * conflate_rate(&app->pending));
+    }
+    if (app->target_count > 1) {
+      report_targets(app);
+    }
+    pn_connection_close(app->connection);
+    /* Continue handling events till we receive TRANSPORT_CLOSED */
+  }
+}
+
 /* Returns true to continue, false if finished */
 static bool handle(app_data_t* app, pn_event_t* event) {
   switch (pn_event_type(event)) {
@@ -148,35 +536,73 @@ static bool handle(app_data_t* app, pn_event_t* event) {
      pn_connection_set_container(c, app->container_id);
      pn_connection_open(c);
      pn_session_open(s);
-     {
-     pn_link_t* l = pn_sender(s, "my_sender");
-     /* 
-      * Set the terminus address to the target destination or node 
-      * on the remote broker.
-      * 
-      * The Solace Pubsub+ broker treats all un-prefixed termini
-      * addresses as queues, alternatively adding the 'queue://'
-      * prefix to the terminus address will send messages to a 
-      * queue as well.
-      * */
-     pn_terminus_set_address(pn_link_target(l), app->amqp_address);
-     pn_link_open(l);
-     break;
+     app->connection = c;
+     for (int i = 0; i < app->target_count; ++i) {
+       target_t *t = &app->targets[i];
+       char name[32] = "my_sender";
+       if (i > 0) {
+         snprintf(name, sizeof(name), "my_sender_%d", i);
+       }
+       pn_link_t* l = pn_sender(s, name);
+       /* 
+        * Set the terminus address to the target destination or node 
+        * on the remote broker.
+        * 
+        * The Solace Pubsub+ broker treats all un-prefixed termini
+        * addresses as queues, alternatively adding the 'queue://'
+        * prefix to the terminus address will send messages to a 
+        * queue as well.
+        * */
+       pn_terminus_set_address(pn_link_target(l), t->address);
+       if (app->presettled) {
+         pn_link_set_snd_settle_mode(l, PN_SND_SETTLED);
+       }
+       pn_link_set_context(l, t);
+       pn_link_open(l);
+       t->link = l;
      }
+     break;
    }
 
+   case PN_CONNECTION_REMOTE_OPEN:
+     app->total_open_ns += report_connection_open(event, app->connect_start, app->ssl);
+     app->open_time = clock_now_ns();
+     if (app->conflate_key) {
+       /* the application produces updates whether or not the broker keeps up */
+       app->generate_start = app->open_time;
+       pn_proactor_set_timeout(app->proactor, GENERATE_INTERVAL_MS);
+     }
+     break;
+
+   case PN_PROACTOR_TIMEOUT:
+     if (!app->connection) {
+       break;
+     }
+     generate_due(app);
+     if (app->pending.pending > 0) {
+       /* send from the connection's own context */
+       pn_connection_wake(app->connection);
+     }
+     if (app->generated < app->message_count) {
+       pn_proactor_set_timeout(app->proactor, GENERATE_INTERVAL_MS);
+     }
+     break;
+
+   case PN_CONNECTION_WAKE:
+     /* generated messages are waiting */
+     for (int i = 0; i < app->target_count; ++i) {
+       sched_wake(&app->sched, i);
+     }
+     sched_run(&app->sched);
+     break;
+
    case PN_LINK_FLOW: {
      /* The peer has given us some credit, now we can send messages */
-     pn_link_t *sender = pn_event_link(event);
-     while (pn_link_credit(sender) > 0 && app->sent < app->message_count) {
-       ++app->sent;
-       /* Use sent counter as unique delivery tag. */
-       pn_delivery(sender, pn_dtag((const char *)&app->sent, sizeof(app->sent)));
-       {
-       pn_bytes_t msgbuf = encode_message(app);
-       pn_link_send(sender, msgbuf.start, msgbuf.size);
-       }
-       pn_link_advance(sender);
+     target_t *t = (target_t*)pn_link_get_context(pn_event_link(event));
+     if (t) {
+       t->credit_time = app->latency_stages ? clock_now_ns() : 0;
+       sched_wake(&app->sched, t->index);
+       sched_run(&app->sched);
      }
      break;
    }
@@ -184,14 +610,26 @@ static bool handle(app_data_t* app, pn_event_t* event) {
    case PN_DELIVERY: {
      /* We received acknowledgement from the peer that a message was delivered. */
      pn_delivery_t* d = pn_event_delivery(event);
+     latency_trace_t* trace = (latency_trace_t*)pn_delivery_get_context(d);
+     if (trace) {
+       latency_trace_mark(trace, LATENCY_SEND_REMOTE_DISPOSITION);
+     }
      if (pn_delivery_remote_state(d) == PN_ACCEPTED) {
-       if (++app->acknowledged == app->message_count) {
-         printf("%d messages sent and acknowledged\n", app->acknowledged);
-         pn_connection_close(pn_event_connection(event));
-         /* Continue handling events till we receive TRANSPORT_CLOSED */
+       target_t* t = (target_t*)pn_link_get_context(pn_delivery_link(d));
+       pn_delivery_tag_t tag = pn_delivery_tag(d);
+       int sequence;
+       memcpy(&sequence, tag.start, sizeof(sequence));
+       latency_histogram_record(&t->latency, (clock_now_ns() - t->send_times[sequence]) / 1000);
+       pn_delivery_settle(d);
+       if (trace) {
+         latency_trace_mark(trace, LATENCY_SEND_SETTLE);
+         latency_stages_record(&app->stages, trace);
+         free(trace);
        }
+       message_done(app, t);
      } else {
        pn_disposition_t* disposition = pn_delivery_remote(d);
+       drop_trace(d);
        fprintf(stderr, "unexpected delivery state %d\n", (int)pn_delivery_remote_state(d));
        check_condition(event, pn_disposition_condition(disposition));
        pn_connection_close(pn_event_connection(event));
@@ -202,6 +640,10 @@ static bool handle(app_data_t* app, pn_event_t* event) {
 
    case PN_TRANSPORT_CLOSED:
     check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    drop_traces(app);
+    /* stop generating so the proactor goes inactive */
+    app->connection = NULL;
+    pn_proactor_cancel_timeout(app->proactor);
     break;
 
    case PN_CONNECTION_REMOTE_CLOSE:
@@ -228,35 +670,72 @@ static bool handle(app_data_t* app, pn_event_t* event) {
   return true;
 }
 
-void run(app_data_t *app) {
+/*
+ * Marks the messages sent in the last event batch as written, the proactor
+ * writes the transport output once the batch is handed back.
+ * */
+static void mark_written(app_data_t *app) {
+  if (app->unwritten) {
+    uint64_t now = clock_now_ns();
+    for (latency_trace_t *t = app->unwritten; t; t = t->next) {
+      t->at[LATENCY_SEND_TRANSPORT_WRITE] = now;
+    }
+    app->unwritten = NULL;
+  }
+}
+
+static void run(app_data_t *app) {
   /* Loop and handle events */
   do {
     pn_event_batch_t *events = pn_proactor_wait(app->proactor);
     pn_event_t *e;
     for (e = pn_event_batch_next(events); e; e = pn_event_batch_next(events)) {
       if (!handle(app, e)) {
+        pn_proactor_done(app->proactor, events);
         return;
       }
     }
     pn_proactor_done(app->proactor, events);
+    mark_written(app);
   } while(true);
 }
 
-void usage(void) {
+static void usage(void) {
     printf("Usage: send [options] \n");
     printf("\t-a      The host address [localhost]\n");
     printf("\t-p      The host port [5672]\n");
     printf("\t-c      # of messages to send [10]\n");
+    printf("\t-r      # of connections to make in sequence, each sends -c messages [1]\n");
     printf("\t-t      Target address [examples]\n");
+    printf("\t-T      Target address[,weight[,count[,priority]]] sharing the connection, repeat for several links [-t,1,-c,4]\n");
+    printf("\t-q      Bytes each link may send per turn per unit of weight, use with -T [4096]\n");
+    printf("\t-S      Strict priority, a target sends only while no higher priority target can, use with -T\n");
     printf("\t-i      AMQP Container name [send:<pid>]\n");
     printf("\t-u      Client authentication username []\n");
     printf("\t-P      Client authentication password []\n");
+    printf("\t-e      Message time to live in ms []\n");
+    printf("\t-z      Message body size in bytes, the sequence string padded, without -D [the sequence]\n");
+    printf("\t-d      Settlement, 'unsettled' waits for the broker to accept each message, 'presettled'\n");
+    printf("\t        sends them settled, at most once [unsettled]\n");
+    printf("\t-l      Stamp 1 in <n> messages, or one every <n>ms, for latency measurement []\n");
+    printf("\t-L      Report the per-stage latency of stamped messages, implies -l 1 without -l\n");
+    printf("\t-k      Generate messages keyed by this property and conflate them while waiting for credit []\n");
+    printf("\t-K      # of distinct keys to generate, use with -k or -H [100]\n");
+    printf("\t-H      Shard messages keyed by this property across the -T targets by consistent hashing []\n");
+    printf("\t-V      Virtual nodes per shard on the hash ring, scaled by the target weight, use with -H [100]\n");
+    printf("\t-g      Messages generated per second, 0 for all at once, use with -k [1000]\n");
+    printf("\t-D      Send snapshots as deltas against the previous one of the key or target, a keyframe every <n> messages []\n");
+    printf("\t-Z      Snapshot size in bytes, use with -D [4096]\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf(PROBE_USAGE);
+    printf("\t-Y      Answer the clock offset exchanges of consumers on other hosts at <address>, implies -N 1000 []\n");
     printf("\t-h      Displays this message\n");
     exit(0);
 
 }
 
-void parse_args(int argc, char **argv, app_data_t *app){
+static void parse_args(int argc, char **argv, app_data_t *app){
     char c;
     char con_id[PN_MAX_ADDR];
     if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
@@ -266,15 +745,27 @@ void parse_args(int argc, char **argv, app_data_t *app){
     /* initialize default values*/
     app->container_id = strdup(con_id); /* default to using argv[0] */
     app->host = "localhost";
-    app->port = "amqp";
+    app->port = NULL; /* amqp or amqps */
     app->amqp_address = "examples";
     app->message_count = 10;
+    app->connections = 1;
     app->username = NULL;
     app->password = NULL;
+    app->ssl = false;
+    app->ssl_ca_db = NULL;
+    app->probe_ms = 0;
+    app->clock_address = NULL;
+    app->conflate_key = NULL;
+    app->conflate_keys = 100;
+    app->generate_rate = 1000;
+    app->quantum = 4096;
+    app->shard_key = NULL;
+    app->shard_vnodes = 100;
+    app->snapshot_size = 4096;
 
     /* command line options */
     opterr = 0;
-    while((c = getopt(argc, argv, "i:a:c:t:p:P:u:h")) != -1) {
+    while((c = getopt(argc, argv, "i:a:c:r:t:T:q:Sp:P:u:e:z:d:l:Lk:K:H:V:g:D:Z:sC:Y:N:h")) != -1) {
         switch(c) {
         case 'h': usage(); break;
         case 'c': 
@@ -291,35 +782,228 @@ void parse_args(int argc, char **argv, app_data_t *app){
             app->container_id = strdup(con_id);
             break;
         case 't': app->amqp_address = optarg; break;
+        case 'T': {
+            if (app->target_count == MAX_TARGETS) {
+                fprintf(stderr, "At most %d targets are supported\n", MAX_TARGETS);
+                exit(1);
+            }
+            /* <address>[,<weight>[,<count>[,<priority>]]], the count defaults to -c */
+            target_t *t = &app->targets[app->target_count];
+            char *sep = strchr(optarg, ',');
+            t->index = app->target_count++;
+            t->address = optarg;
+            t->weight = 1;
+            t->priority = PN_DEFAULT_PRIORITY;
+            t->count = -1;
+            if (sep) {
+                *sep = '\0';
+                t->weight = atoi(sep + 1);
+                if (t->weight < 1) usage();
+                if ((sep = strchr(sep + 1, ','))) {
+                    t->count = atoi(sep + 1);
+                    if (t->count < 0) usage();
+                    if ((sep = strchr(sep + 1, ','))) {
+                        t->priority = atoi(sep + 1);
+                        if (t->priority < 0 || t->priority >= SCHED_PRIORITIES) usage();
+                    }
+                }
+            }
+            break;
+        }
+        case 'S': app->strict_priority = true; break;
+        case 'q':
+            app->quantum = strtoul(optarg, NULL, 10);
+            if (app->quantum == 0) usage();
+            break;
         case 'p': app->port = optarg; break;
         case 'P': app->password = optarg; break;
         case 'u': app->username = optarg; break;
+        case 'r':
+            app->connections = atoi(optarg);
+            if (app->connections < 1) usage();
+            break;
+        case 'e':
+            app->ttl_ms = strtoul(optarg, NULL, 10);
+            if (app->ttl_ms == 0) usage();
+            break;
+        case 'z': app->body_size = strtoul(optarg, NULL, 10); break;
+        case 'd':
+            if (strcmp(optarg, "unsettled") == 0) app->presettled = false;
+            else if (strcmp(optarg, "presettled") == 0) app->presettled = true;
+            else usage();
+            break;
+        case 'l':
+            if (latency_sampler_parse(&app->latency_sampler, optarg) < 0) usage();
+            app->latency = true;
+            break;
+        case 'L': app->latency = true; app->latency_stages = true; break;
+        case 'k':
+            if (strlen(optarg) >= CONFLATE_KEY_MAX) usage();
+            app->conflate_key = optarg;
+            break;
+        case 'K':
+            app->conflate_keys = atoi(optarg);
+            if (app->conflate_keys < 1) usage();
+            break;
+        case 'H':
+            if (strlen(optarg) >= CONFLATE_KEY_MAX) usage();
+            app->shard_key = optarg;
+            break;
+        case 'V':
+            app->shard_vnodes = atoi(optarg);
+            if (app->shard_vnodes < 1) usage();
+            break;
+        case 'g':
+            app->generate_rate = atoi(optarg);
+            if (app->generate_rate < 0) usage();
+            break;
+        case 'D':
+            app->delta_interval = atoi(optarg);
+            if (app->delta_interval < 1) usage();
+            break;
+        case 'Z':
+            app->snapshot_size = strtoul(optarg, NULL, 10) / SNAPSHOT_RECORD * SNAPSHOT_RECORD;
+            if (app->snapshot_size == 0) usage();
+            break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        case 'N':
+            if (probe_parse_interval(optarg, &app->probe_ms) < 0) usage();
+            break;
+        case 'Y': app->clock_address = optarg; break;
         default: usage(); break;
         }
     }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (app->target_count == 0) {
+        target_t *t = &app->targets[app->target_count++];
+        t->address = app->amqp_address;
+        t->weight = 1;
+        t->priority = PN_DEFAULT_PRIORITY;
+        t->count = -1;
+    }
+    if (app->presettled && app->latency_stages) {
+        fprintf(stderr, "The per-stage latency needs the acknowledgements, -L does not go with -d presettled\n");
+        exit(1);
+    }
+    if (app->conflate_key && (app->target_count > 1 || app->shard_key)) {
+        fprintf(stderr, "Conflation sends on a single target\n");
+        exit(1);
+    }
+    for (int i = 0; i < app->target_count; ++i) {
+        target_t *t = &app->targets[i];
+        if (t->count < 0) t->count = app->message_count;
+        app->total_count += t->count;
+    }
 
 }
 
-int main(int argc, char **argv) {
+int send_main(int argc, char **argv) {
     struct app_data_t app = {0};
     char addr[PN_MAX_ADDR];
   
     parse_args(argc, argv, &app);
+    latency_stages_init(&app.stages, true);
+    if (app.shard_key) {
+        route_messages(&app);
+    }
+    sched_init(&app.sched, app.quantum, app.strict_priority, target_ready, target_send, &app);
+    if (app.delta_interval) {
+        delta_init(&app.delta, app.delta_interval);
+        app.snapshot = (char*)malloc(app.snapshot_size);
+    }
+    for (int i = 0; i < app.target_count; ++i) {
+        target_t *t = &app.targets[i];
+        sched_add(&app.sched, t->weight, t->priority);
+        t->send_times = (uint64_t*)calloc(t->count > 0 ? t->count : 1, sizeof(uint64_t));
+    }
     
     app.proactor = pn_proactor();
     pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
-    /* Initial Sasl transport for authentication */
-    pn_transport_t *pnt = pn_transport();
-    pn_sasl_t *sasl = pn_sasl(pnt);
-    pn_sasl_set_allow_insecure_mechs(sasl, true);
-    
-    /* initial and start proton event proactor loop */
-    pn_proactor_connect2(app.proactor, NULL, pnt, addr);
-    run(&app);
+    if (app.ssl && !(app.ssl_domain = ssl_client_domain(app.ssl_ca_db))) {
+        exit(1);
+    }
+
+    if (app.clock_address && !app.probe_ms) {
+        app.probe_ms = 1000;
+    }
+    if (app.probe_ms) {
+        probe_config_t probe;
+        probe_config_init(&probe, app.host, app.port, app.username, app.password,
+                          app.container_id, app.ssl_domain, app.probe_ms);
+        if (app.clock_address) {
+            probe.clock_mode = PROBE_CLOCK_SERVE;
+            probe.clock_address = app.clock_address;
+        }
+        probe_start_sample(&app.probe, &probe);
+    }
+    for (int i = 0; i < app.connections && exit_code == 0; ++i) {
+        /* Initial Sasl transport for authentication */
+        pn_transport_t *pnt = pn_transport();
+        pn_sasl_t *sasl = pn_sasl(pnt);
+        pn_sasl_set_allow_insecure_mechs(sasl, true);
+        /* reconnects resume the SSL session cached in app.ssl_domain */
+        if (app.ssl && ssl_client_init(pnt, app.ssl_domain, app.host, app.port) < 0) {
+            exit_code = 1;
+            break;
+        }
+        app.sent = 0;
+        app.acknowledged = 0;
+        app.generated = 0;
+        app.fairness_taken = false;
+        sched_reset(&app.sched);
+        for (int t = 0; t < app.target_count; ++t) {
+            app.targets[t].sent = 0;
+            app.targets[t].acknowledged = 0;
+            app.targets[t].done_time = 0;
+        }
+        if (app.conflate_key) {
+            conflate_free(&app.pending);
+            conflate_init(&app.pending);
+        }
+        /* consumers may have missed messages while we were disconnected */
+        delta_request_keyframe(&app.delta, NULL);
+
+        /* initial and start proton event proactor loop */
+        app.connect_start = clock_now_ns();
+        pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+        run(&app);
+    }
+    if (app.latency_stages) {
+        latency_stages_report(stdout, &app.stages);
+    }
+    if (app.delta_interval) {
+        delta_report(stdout, "sent", &app.delta.stats);
+    }
+    if (app.connections > 1) {
+        printf("average connection open %.3f ms over %d connections\n",
+               app.total_open_ns / 1e6 / app.connections, app.connections);
+    }
 
     /* progam cleanup */
+    probe_stop(&app.probe);
+    if (app.probe_ms) probe_report(stdout, &app.probe);
     pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
     free(app.message_buffer.start);
+    if (app.conflate_key) conflate_free(&app.pending);
+    if (app.shard_key) hashring_free(&app.ring);
+    if (app.delta_interval) {
+        delta_free(&app.delta);
+        free(app.snapshot);
+    }
+    for (int i = 0; i < app.target_count; ++i) {
+        free(app.targets[i].send_times);
+        free(app.targets[i].sequences);
+    }
     str_free(app.container_id);
     return exit_code;
 }
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return send_main(argc, argv);
+}
+#endif
@@ -0,0 +1,487 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * sub_churn
+ *
+ * This Sample measures how fast durable subscriptions are set up and torn
+ * down, with both of the ways the other samples create them:
+ *
+ *   dsub      the 'dsub://' address prefix, as dte_solconsumer does
+ *   terminus  the 'topic://' address prefix with the terminus expiry
+ *             policy PN_EXPIRE_NEVER and durability PN_CONFIGURATION, as
+ *             dte_consumer does
+ *
+ * Each subscription goes through its whole life on one connection:
+ *
+ *   create    attach a receiver link, the broker creates the subscription
+ *   detach    detach the link without closing it, the subscription stays
+ *   reattach  attach the same link name again, as a restarted application
+ *             does, repeated -r times with a detach in between
+ *   delete    close the link, the broker deletes the subscription
+ *
+ * Up to -o subscriptions are in flight at once. The sample reports the
+ * latency percentiles of each step and the churn rate, the subscriptions
+ * taken through their whole life per second, for each method.
+ */
+
+#include <proton/connection.h>
+#include <proton/condition.h>
+#include <proton/link.h>
+#include <proton/proactor.h>
+#include <proton/session.h>
+#include <proton/terminus.h>
+#include <proton/transport.h>
+#include <proton/sasl.h>
+#include <proton/ssl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "util.h"
+
+#define AMQP_DURABLE_TOPIC_ENDPOINT_PREFIX "dsub://"
+#define AMQP_TOPIC_PREFIX "topic://"
+
+typedef enum {
+  METHOD_DSUB,
+  METHOD_TERMINUS,
+  METHODS
+} method_t;
+
+static const char *const method_names[METHODS] = { "dsub", "terminus" };
+
+/* Steps of a subscription's life, each has a latency histogram */
+typedef enum {
+  STEP_CREATE,
+  STEP_DETACH,
+  STEP_REATTACH,
+  STEP_DELETE,
+  STEPS
+} step_t;
+
+static const char *const step_names[STEPS] = { "create", "detach", "reattach", "delete" };
+
+/* One in flight subscription */
+typedef struct slot_t {
+  int subscription;         /* number of the subscription within the method */
+  step_t step;              /* step waiting for the broker */
+  int reattaches;           /* reattaches done */
+  pn_link_t *link;
+  uint64_t issued;          /* clock_now_ns() when the step was started */
+  bool idle;                /* no subscriptions left to start */
+} slot_t;
+
+typedef struct method_run_t {
+  latency_histogram_t steps[STEPS];   /* in us */
+  int started;
+  int deleted;
+  uint64_t start, end;
+} method_run_t;
+
+typedef struct app_data_t {
+  const char *host, *port;
+  const char *username, *password;
+  const char *topic;            /* subscription n subscribes to <topic>/<n> */
+  const char *subscription_name;
+  const char *container_id;
+  int subscription_count;       /* subscriptions per method */
+  int outstanding;              /* subscriptions in flight at once */
+  int reattach_count;           /* reattaches per subscription */
+  bool methods[METHODS];
+  bool ssl;
+  const char *ssl_ca_db;
+
+  pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  pn_session_t *session;
+  method_t method;          /* method being measured */
+  slot_t *slots;
+  method_run_t runs[METHODS];
+} app_data_t;
+
+static int exit_code = 0;
+
+#define str_free(strptr) free((void *)strptr)
+
+
+static void check_condition(pn_event_t *e, pn_condition_t *cond) {
+  if (pn_condition_is_set(cond)) {
+    fprintf(stderr, "%s: %s: %s\n", pn_event_type_name(pn_event_type(e)),
+            pn_condition_get_name(cond), pn_condition_get_description(cond));
+    pn_connection_close(pn_event_connection(e));
+    exit_code = 1;
+  }
+}
+
+static void record_step(app_data_t *app, slot_t *slot) {
+  uint64_t us = (clock_now_ns() - slot->issued) / 1000;
+  latency_histogram_record(&app->runs[app->method].steps[slot->step], us);
+}
+
+/* Attaches the slot's subscription link, creating or reattaching to the subscription */
+static bool subscription_attach(app_data_t *app, slot_t *slot) {
+  char name[PN_MAX_ADDR];
+  char topic[PN_MAX_ADDR];
+  char amqp_address[PN_MAX_ADDR];
+  const char *prefix = app->method == METHOD_DSUB ? AMQP_DURABLE_TOPIC_ENDPOINT_PREFIX : AMQP_TOPIC_PREFIX;
+
+  /* the subscription name is the name of the link */
+  snprintf(name, sizeof(name), "%s_%s_%d", app->subscription_name, method_names[app->method], slot->subscription);
+  snprintf(topic, sizeof(topic), "%s/%d", app->topic, slot->subscription);
+  if (amqp_destination_address(amqp_address, PN_MAX_ADDR, topic, strlen(topic), prefix, strlen(prefix)) < 0) {
+    fprintf(stderr, "failed to format amqp terminus address\n");
+    exit_code = 1;
+    return false;
+  }
+  slot->link = pn_receiver(app->session, name);
+  pn_link_set_context(slot->link, slot);
+  pn_terminus_set_address(pn_link_source(slot->link), amqp_address);
+  if (app->method == METHOD_TERMINUS) {
+    /* set terminus fields to indicate a durable subscription */
+    pn_terminus_set_expiry_policy(pn_link_source(slot->link), PN_EXPIRE_NEVER);
+    pn_terminus_set_durability(pn_link_source(slot->link), PN_CONFIGURATION);
+  }
+  slot->issued = clock_now_ns();
+  pn_link_open(slot->link);
+  return true;
+}
+
+static void method_report(app_data_t *app, method_t method) {
+  method_run_t *run = &app->runs[method];
+  double secs = (run->end - run->start) / 1e9;
+  char name[64];
+  printf("%s: %d subscriptions in %.3f s, churn %.0f subscriptions/s, %.0f attaches/s\n",
+         method_names[method], run->deleted, secs,
+         secs > 0 ? run->deleted / secs : 0.0,
+         secs > 0 ? run->deleted * (1.0 + app->reattach_count) / secs : 0.0);
+  for (int i = 0; i < STEPS; ++i) {
+    snprintf(name, sizeof(name), "%s %s", method_names[method], step_names[i]);
+    latency_histogram_report(stdout, name, "us", &app->runs[method].steps[i]);
+  }
+}
+
+/* Starts the next subscription of the method in every slot, returns false when the method is done */
+static bool method_start(app_data_t *app) {
+  method_run_t *run = &app->runs[app->method];
+  run->start = clock_now_ns();
+  for (int i = 0; i < app->outstanding; ++i) {
+    slot_t *slot = &app->slots[i];
+    memset(slot, 0, sizeof(*slot));
+    if (run->started < app->subscription_count) {
+      slot->subscription = run->started++;
+      slot->step = STEP_CREATE;
+      if (!subscription_attach(app, slot)) return false;
+    } else {
+      slot->idle = true;
+    }
+  }
+  return true;
+}
+
+/* Moves on to the next method once every slot is idle, closes the connection after the last */
+static void method_next(app_data_t *app, pn_connection_t *c) {
+  for (int i = 0; i < app->outstanding; ++i) {
+    if (!app->slots[i].idle) return;
+  }
+  app->runs[app->method].end = clock_now_ns();
+  method_report(app, app->method);
+  while (++app->method < METHODS && !app->methods[app->method]) {
+  }
+  if (app->method == METHODS) {
+    pn_session_close(app->session);
+    pn_connection_close(c);
+  } else if (!method_start(app)) {
+    pn_connection_close(c);
+  }
+}
+
+/* The slot's subscription is deleted, start the next one in the slot */
+static void slot_next(app_data_t *app, slot_t *slot, pn_connection_t *c) {
+  method_run_t *run = &app->runs[app->method];
+  ++run->deleted;
+  if (run->started < app->subscription_count) {
+    slot->subscription = run->started++;
+    slot->step = STEP_CREATE;
+    slot->reattaches = 0;
+    if (!subscription_attach(app, slot)) pn_connection_close(c);
+  } else {
+    slot->idle = true;
+    method_next(app, c);
+  }
+}
+
+/* Return true to continue, false to exit */
+static bool handle(app_data_t* app, pn_event_t* event) {
+  switch (pn_event_type(event)) {
+
+   case PN_CONNECTION_INIT: {
+     pn_connection_t* c = pn_event_connection(event);
+     /* Set authenticate creadentials if present */
+     if (app->username) {
+        pn_connection_set_user(c, app->username);
+        pn_connection_set_password(c, app->password);
+     }
+     pn_connection_set_container(c, app->container_id);
+     pn_connection_open(c);
+   } break;
+
+   case PN_CONNECTION_REMOTE_OPEN: {
+     report_connection_open(event, app->connect_start, app->ssl);
+     app->session = pn_session(pn_event_connection(event));
+     pn_session_open(app->session);
+     while (app->method < METHODS && !app->methods[app->method]) {
+       ++app->method;
+     }
+     if (!method_start(app)) {
+       pn_connection_close(pn_event_connection(event));
+     }
+   } break;
+
+   case PN_LINK_REMOTE_OPEN: {
+     /* The subscription is created or attached to, detach to keep it or close to delete it */
+     pn_link_t *l = pn_event_link(event);
+     slot_t *slot = (slot_t*)pn_link_get_context(l);
+     if (!pn_terminus_get_address(pn_link_remote_source(l))) {
+       /* the broker refused the subscription, its detach carries the reason */
+       break;
+     }
+     record_step(app, slot);
+     slot->issued = clock_now_ns();
+     if (slot->reattaches < app->reattach_count) {
+       slot->step = STEP_DETACH;
+       pn_link_detach(l);
+     } else {
+       slot->step = STEP_DELETE;
+       pn_link_close(l);
+     }
+   } break;
+
+   case PN_LINK_REMOTE_DETACH: {
+     /* The subscription stays, attach to it again */
+     pn_link_t *l = pn_event_link(event);
+     slot_t *slot = (slot_t*)pn_link_get_context(l);
+     check_condition(event, pn_link_remote_condition(l));
+     if (exit_code) break;
+     if (slot->step != STEP_DETACH) {
+       fprintf(stderr, "subscription %d detached by the broker\n", slot->subscription);
+       pn_connection_close(pn_event_connection(event));
+       exit_code = 1;
+       break;
+     }
+     record_step(app, slot);
+     pn_link_free(l);
+     ++slot->reattaches;
+     slot->step = STEP_REATTACH;
+     if (!subscription_attach(app, slot)) pn_connection_close(pn_event_connection(event));
+   } break;
+
+   case PN_LINK_REMOTE_CLOSE: {
+     /* The subscription is deleted */
+     pn_link_t *l = pn_event_link(event);
+     slot_t *slot = (slot_t*)pn_link_get_context(l);
+     check_condition(event, pn_link_remote_condition(l));
+     if (exit_code) break;
+     if (slot->step != STEP_DELETE) {
+       fprintf(stderr, "subscription %d closed by the broker\n", slot->subscription);
+       pn_connection_close(pn_event_connection(event));
+       exit_code = 1;
+       break;
+     }
+     record_step(app, slot);
+     pn_link_free(l);
+     slot_next(app, slot, pn_event_connection(event));
+   } break;
+
+   case PN_TRANSPORT_CLOSED:
+    check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    break;
+
+   case PN_CONNECTION_REMOTE_CLOSE:
+    check_condition(event, pn_connection_remote_condition(pn_event_connection(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_SESSION_REMOTE_CLOSE:
+    check_condition(event, pn_session_remote_condition(pn_event_session(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_PROACTOR_INACTIVE:
+    return false;
+    break;
+
+   default:
+    break;
+  }
+    return true;
+}
+
+static void run(app_data_t *app) {
+  /* Loop and handle events */
+  do {
+    pn_event_batch_t *events = pn_proactor_wait(app->proactor);
+    pn_event_t *e;
+    for (e = pn_event_batch_next(events); e; e = pn_event_batch_next(events)) {
+      if (!handle(app, e)) {
+        return;
+      }
+    }
+    pn_proactor_done(app->proactor, events);
+  } while(true);
+}
+
+static void usage() {
+    printf("Usage: sub_churn [options] \n");
+    printf("[Options]:\n");
+    printf("\t-a      The host address [localhost]\n");
+    printf("\t-p      The host port [5672]\n");
+    printf("\t-c      # of durable subscriptions to churn with each method [1000]\n");
+    printf("\t-o      # of subscriptions in flight at once [16]\n");
+    printf("\t-r      # of detach and reattach cycles per subscription before it is deleted [1]\n");
+    printf("\t-m      Method: dsub, terminus or both [both]\n");
+    printf("\t-t      Topic prefix, subscription <n> subscribes to <topic>/<n> [churn_topic]\n");
+    printf("\t-n      Subscription name prefix [churn_sub]\n");
+    printf("\t-i      Container name [sub_churn:<pid>]\n");
+    printf("\t-u      Client authentication username []\n");
+    printf("\t-P      Client authentication password []\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf("\t-h      Displays this message\n");
+    exit(0);
+
+}
+
+static void parse_args(int argc, char **argv, app_data_t *app) {
+    int c;
+    char con_id[PN_MAX_ADDR];
+    if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
+        fprintf(stderr, "Unable to format container id from source: %s", argv[0]);
+        exit(1);
+    }
+    /* initialize default values*/
+    app->container_id = strdup(con_id); /* default to using argv[0] */
+    app->host = "localhost";
+    app->port = NULL; /* amqp or amqps */
+    app->topic = "churn_topic";
+    app->subscription_name = "churn_sub";
+    app->subscription_count = 1000;
+    app->outstanding = 16;
+    app->reattach_count = 1;
+    app->methods[METHOD_DSUB] = app->methods[METHOD_TERMINUS] = true;
+
+    /* command line options */
+    opterr = 0;
+    while((c = getopt(argc, argv, "i:a:c:o:r:m:t:n:p:u:P:sC:h")) != -1) {
+        switch(c) {
+        case 'h': usage(); break;
+        case 'c':
+            app->subscription_count = atoi(optarg);
+            if (app->subscription_count < 1) usage();
+            break;
+        case 'o':
+            app->outstanding = atoi(optarg);
+            if (app->outstanding < 1) usage();
+            break;
+        case 'r':
+            app->reattach_count = atoi(optarg);
+            if (app->reattach_count < 0) usage();
+            break;
+        case 'm':
+            if (!strcmp(optarg, "dsub")) {
+                app->methods[METHOD_TERMINUS] = false;
+            } else if (!strcmp(optarg, "terminus")) {
+                app->methods[METHOD_DSUB] = false;
+            } else if (strcmp(optarg, "both")) {
+                usage();
+            }
+            break;
+        case 'a': app->host = optarg; break;
+        case 'i':
+            if (container_id(con_id, PN_MAX_ADDR, optarg, sizeof(optarg)) < 0) {
+                fprintf(stderr, "Unable to format container id from source: %s", optarg);
+                exit(1);
+            }
+            str_free(app->container_id);
+            app->container_id = strdup(con_id);
+            break;
+        case 't': app->topic = optarg; break;
+        case 'n': app->subscription_name = optarg; break;
+        case 'p': app->port = optarg; break;
+        case 'u': app->username = optarg; break;
+        case 'P': app->password = optarg; break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        default: usage(); break;
+        }
+    }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (app->outstanding > app->subscription_count) {
+        app->outstanding = app->subscription_count;
+    }
+
+}
+
+int sub_churn_main(int argc, char **argv) {
+    struct app_data_t app = {0};
+    char addr[PN_MAX_ADDR];
+
+    parse_args(argc, argv, &app);
+    app.slots = (slot_t*)calloc(app.outstanding, sizeof(slot_t));
+
+    /* Create the proactor and connect */
+    app.proactor = pn_proactor();
+    pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
+    fprintf(stdout, "Connecting to host: %s\n", addr);
+
+    /* Initialize Sasl transport */
+    pn_transport_t *pnt = pn_transport();
+    pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+        if (ssl_client_init(pnt, app.ssl_domain, app.host, app.port) < 0) {
+            exit(1);
+        }
+    }
+
+    /* initialize and start proton event proactor loop */
+    app.connect_start = clock_now_ns();
+    pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+    fprintf(stdout, "churning %d durable subscriptions per method, %d in flight, %d reattaches each\n",
+            app.subscription_count, app.outstanding, app.reattach_count);
+    run(&app);
+
+    /* program cleanup */
+    pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
+    free(app.slots);
+    str_free(app.container_id);
+    return exit_code;
+}
+
+#ifndef AMQP_PERF
+int main(int argc, char **argv) {
+    return sub_churn_main(argc, argv);
+}
+#endif
@@ -0,0 +1,499 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * telemetry
+ *
+ * This Sample demonstrates sending and receiving messages with a fixed
+ * schema, sensor readings, encoded and decoded by the compile time codec
+ * of schema.hpp instead of a pn_message_t and its pn_data_t trees.
+ *
+ * By default the sample sends readings to an AMQP address, with -R it
+ * receives and decodes them. With -B it connects to nothing and compares
+ * the time the codec and pn_message_t take to encode and decode the same
+ * readings.
+ */
+
+#include <proton/connection.h>
+#include <proton/condition.h>
+#include <proton/delivery.h>
+#include <proton/link.h>
+#include <proton/message.h>
+#include <proton/proactor.h>
+#include <proton/session.h>
+#include <proton/transport.h>
+#include <proton/sasl.h>
+#include <proton/ssl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include "util.h"
+}
+#include "schema.hpp"
+
+/* The schema of a reading: four application properties and a double body */
+static constexpr char SENSOR_KEY[] = "sensor";
+static constexpr char SEQUENCE_KEY[] = "sequence";
+static constexpr char TAKEN_KEY[] = "taken";
+static constexpr char STATUS_KEY[] = "status";
+
+typedef struct reading_t {
+  int64_t sensor;
+  uint64_t sequence;
+  schema::timestamp taken;
+  int32_t status;
+  double value;
+} reading_t;
+
+using reading_codec = schema::codec<reading_t,
+    schema::body<&reading_t::value>,
+    schema::field<SENSOR_KEY, &reading_t::sensor>,
+    schema::field<SEQUENCE_KEY, &reading_t::sequence>,
+    schema::field<TAKEN_KEY, &reading_t::taken>,
+    schema::field<STATUS_KEY, &reading_t::status>>;
+
+#define SENSORS 16
+
+typedef struct app_data_t {
+  const char *host, *port;
+  const char *username, *password;
+  const char *amqp_address;
+  const char *container_id;
+  int message_count;
+  bool ssl;
+  const char *ssl_ca_db;
+  bool receive;             /* receive readings instead of sending them */
+  bool bench;               /* compare the codec with pn_message_t offline */
+
+  pn_proactor_t *proactor;
+  pn_ssl_domain_t *ssl_domain;
+  uint64_t connect_start;   /* clock_now_ns() before connecting */
+  uint64_t open_time;       /* clock_now_ns() at PN_CONNECTION_REMOTE_OPEN */
+  int sent;
+  int acknowledged;
+  int received;
+  int undecodable;          /* received messages that are not readings */
+  double value_sum;
+  pn_rwbytes_t msgin;       /* Partially received message */
+} app_data_t;
+
+static const int BATCH = 1000; /* Batch size for unlimited receive */
+
+static int exit_code = 0;
+
+#define str_free(strptr) free((void *)strptr)
+
+
+static void check_condition(pn_event_t *e, pn_condition_t *cond) {
+  if (pn_condition_is_set(cond)) {
+    fprintf(stderr, "%s: %s: %s\n", pn_event_type_name(pn_event_type(e)),
+            pn_condition_get_name(cond), pn_condition_get_description(cond));
+    pn_connection_close(pn_event_connection(e));
+    exit_code = 1;
+  }
+}
+
+/* The n-th reading of the run */
+static reading_t make_reading(int n) {
+  reading_t r;
+  r.sensor = n % SENSORS;
+  r.sequence = (uint64_t)n;
+  r.taken.ms = (int64_t)clock_wall_ms();
+  r.status = 0;
+  r.value = 20.0 + (n % 100) / 10.0;
+  return r;
+}
+
+/* Encodes a reading the generic way, as encode_message() does */
+static size_t message_encode(pn_message_t* m, const reading_t& r, char* buf, size_t size) {
+  pn_data_t *properties = pn_message_properties(m);
+  pn_message_clear(m);
+  pn_message_set_durable(m, true);
+  pn_message_set_priority(m, 4);
+  pn_data_put_map(properties);
+  pn_data_enter(properties);
+  pn_data_put_string(properties, pn_bytes(strlen(SENSOR_KEY), SENSOR_KEY));
+  pn_data_put_long(properties, r.sensor);
+  pn_data_put_string(properties, pn_bytes(strlen(SEQUENCE_KEY), SEQUENCE_KEY));
+  pn_data_put_ulong(properties, r.sequence);
+  pn_data_put_string(properties, pn_bytes(strlen(TAKEN_KEY), TAKEN_KEY));
+  pn_data_put_timestamp(properties, r.taken.ms);
+  pn_data_put_string(properties, pn_bytes(strlen(STATUS_KEY), STATUS_KEY));
+  pn_data_put_int(properties, r.status);
+  pn_data_exit(properties);
+  pn_data_put_double(pn_message_body(m), r.value);
+  return pn_message_encode(m, buf, &size) == 0 ? size : 0;
+}
+
+/* Decodes a reading the generic way, walking the pn_data_t trees */
+static bool message_decode(pn_message_t* m, const char* bytes, size_t size, reading_t& r) {
+  pn_data_t *properties, *body;
+  pn_message_clear(m);
+  if (pn_message_decode(m, bytes, size) != 0) {
+    return false;
+  }
+  properties = pn_message_properties(m);
+  if (!data_map_find(properties, SENSOR_KEY)) return false;
+  r.sensor = pn_data_get_long(properties);
+  if (!data_map_find(properties, SEQUENCE_KEY)) return false;
+  r.sequence = pn_data_get_ulong(properties);
+  if (!data_map_find(properties, TAKEN_KEY)) return false;
+  r.taken.ms = pn_data_get_timestamp(properties);
+  if (!data_map_find(properties, STATUS_KEY)) return false;
+  r.status = pn_data_get_int(properties);
+  body = pn_message_body(m);
+  pn_data_rewind(body);
+  if (!pn_data_next(body)) return false;
+  r.value = pn_data_get_double(body);
+  return true;
+}
+
+/* Times encoding and decoding -c readings both ways */
+static void bench(app_data_t* app) {
+  int n = app->message_count ? app->message_count : 1000000;
+  pn_message_t *m = pn_message();
+  char buf[256];
+  double sum = 0;
+  int fallback = 0;
+  uint64_t start;
+  double codec_encode, codec_decode, message_encode_ns, message_decode_ns;
+
+  start = clock_now_ns();
+  for (int i = 0; i < n; ++i) {
+    reading_codec::encode(make_reading(i), buf, sizeof(buf));
+  }
+  codec_encode = (double)(clock_now_ns() - start) / n;
+  start = clock_now_ns();
+  for (int i = 0; i < n; ++i) {
+    reading_t r;
+    reading_codec::decode(buf, reading_codec::SIZE, r);
+    sum += r.value;
+  }
+  codec_decode = (double)(clock_now_ns() - start) / n;
+
+  size_t size = 0;
+  start = clock_now_ns();
+  for (int i = 0; i < n; ++i) {
+    size = message_encode(m, make_reading(i), buf, sizeof(buf));
+  }
+  message_encode_ns = (double)(clock_now_ns() - start) / n;
+  start = clock_now_ns();
+  for (int i = 0; i < n; ++i) {
+    reading_t r;
+    message_decode(m, buf, size, r);
+    sum += r.value;
+  }
+  message_decode_ns = (double)(clock_now_ns() - start) / n;
+
+  /* the codec reads what pn_message_t encodes, through the section scanner */
+  for (int i = 0; i < 100; ++i) {
+    reading_t r;
+    size = message_encode(m, make_reading(i), buf, sizeof(buf));
+    fallback += reading_codec::decode(buf, size, r) && r.sequence == (uint64_t)i;
+  }
+  pn_message_free(m);
+
+  printf("%d readings, %zu bytes with the codec, %zu bytes with pn_message_t\n", n, reading_codec::SIZE, size);
+  printf("codec:       encode %.1f ns, decode %.1f ns\n", codec_encode, codec_decode);
+  printf("pn_message:  encode %.1f ns, decode %.1f ns\n", message_encode_ns, message_decode_ns);
+  printf("codec decoded %d of 100 pn_message_t readings (checksum %g)\n", fallback, sum);
+}
+
+/* Sends readings while the link has credit */
+static void send_readings(app_data_t* app, pn_link_t* sender) {
+  char buf[reading_codec::SIZE];
+  while (pn_link_credit(sender) > 0 && app->sent < app->message_count) {
+    int sequence = app->sent++;
+    pn_delivery(sender, pn_dtag((const char *)&sequence, sizeof(sequence)));
+    reading_codec::encode(make_reading(sequence), buf, sizeof(buf));
+    pn_link_send(sender, buf, sizeof(buf));
+    pn_link_advance(sender);
+  }
+}
+
+/* Decodes a complete message and keeps the credit window open */
+static void receive_reading(app_data_t* app, pn_link_t* l, pn_delivery_t* d, pn_rwbytes_t data) {
+  reading_t r;
+  if (reading_codec::decode(data.start, data.size, r)) {
+    app->value_sum += r.value;
+  } else {
+    ++app->undecodable;
+  }
+  free(data.start);
+  pn_delivery_update(d, PN_ACCEPTED);
+  pn_delivery_settle(d);
+  ++app->received;
+  if (app->message_count == 0) {
+    if (pn_link_credit(l) < BATCH / 2) {
+      pn_link_flow(l, BATCH - pn_link_credit(l));
+    }
+  } else if (app->received >= app->message_count) {
+    pn_session_t *ssn = pn_link_session(l);
+    double secs = (clock_now_ns() - app->open_time) / 1e9;
+    printf("%d readings received in %.3f ms (%.0f msg/s), average value %.3f, %d not readings\n",
+           app->received, secs * 1e3, secs > 0 ? app->received / secs : 0.0,
+           app->value_sum / (app->received - app->undecodable > 0 ? app->received - app->undecodable : 1),
+           app->undecodable);
+    pn_link_close(l);
+    pn_session_close(ssn);
+    pn_connection_close(pn_session_connection(ssn));
+  }
+}
+
+/* Return true to continue, false to exit */
+static bool handle(app_data_t* app, pn_event_t* event) {
+  switch (pn_event_type(event)) {
+
+   case PN_CONNECTION_INIT: {
+     pn_connection_t* c = pn_event_connection(event);
+     /* Set authenticate creadentials if present */
+     if (app->username) {
+        pn_connection_set_user(c, app->username);
+        pn_connection_set_password(c, app->password);
+     }
+     pn_session_t* s = pn_session(c);
+     pn_connection_set_container(c, app->container_id);
+     pn_connection_open(c);
+     pn_session_open(s);
+     if (app->receive) {
+       pn_link_t* l = pn_receiver(s, "telemetry_receiver");
+       pn_terminus_set_address(pn_link_source(l), app->amqp_address);
+       pn_link_open(l);
+       /* cannot receive without granting credit: */
+       pn_link_flow(l, app->message_count ? app->message_count : BATCH);
+     } else {
+       pn_link_t* l = pn_sender(s, "telemetry_sender");
+       pn_terminus_set_address(pn_link_target(l), app->amqp_address);
+       pn_link_open(l);
+     }
+   } break;
+
+   case PN_CONNECTION_REMOTE_OPEN:
+     report_connection_open(event, app->connect_start, app->ssl);
+     app->open_time = clock_now_ns();
+     break;
+
+   case PN_LINK_FLOW:
+     /* The peer has given us some credit, now we can send messages */
+     if (!app->receive) {
+       send_readings(app, pn_event_link(event));
+     }
+     break;
+
+   case PN_DELIVERY: {
+     pn_delivery_t *d = pn_event_delivery(event);
+     if (!app->receive) {
+       /* We received acknowledgement from the peer that a message was delivered. */
+       if (pn_delivery_remote_state(d) == PN_ACCEPTED) {
+         pn_delivery_settle(d);
+         if (++app->acknowledged == app->message_count) {
+           double secs = (clock_now_ns() - app->open_time) / 1e9;
+           printf("%d readings sent and acknowledged in %.3f ms (%.0f msg/s)\n",
+                  app->acknowledged, secs * 1e3, secs > 0 ? app->acknowledged / secs : 0.0);
+           pn_connection_close(pn_event_connection(event));
+         }
+       } else {
+         fprintf(stderr, "unexpected delivery state %d\n", (int)pn_delivery_remote_state(d));
+         pn_connection_close(pn_event_connection(event));
+         exit_code = 1;
+       }
+     } else if (pn_delivery_readable(d)) {
+       pn_link_t *l = pn_delivery_link(d);
+       size_t size = pn_delivery_pending(d);
+       pn_rwbytes_t* m = &app->msgin; /* Append data to incoming message buffer */
+       ssize_t recv;
+       size_t oldsize = m->size;
+       m->size += size;
+       m->start = (char*)realloc(m->start, m->size);
+       recv = pn_link_recv(l, m->start + oldsize, m->size);
+       if (recv == PN_ABORTED) {
+         fprintf(stderr, "Message aborted\n");
+         m->size = 0;           /* Forget the data we accumulated */
+         pn_delivery_settle(d); /* Free the delivery so we can receive the next message */
+         pn_link_flow(l, 1);    /* Replace credit for aborted message */
+       } else if (recv < 0 && recv != PN_EOS) {        /* Unexpected error */
+         pn_condition_format(pn_link_condition(l), "broker", "PN_DELIVERY error: %s", pn_code((int)recv));
+         pn_link_close(l);               /* Unexpected error, close the link */
+       } else if (!pn_delivery_partial(d)) { /* Message is complete */
+         receive_reading(app, l, d, *m);
+         *m = pn_rwbytes_null;  /* Reset the buffer for the next message*/
+       }
+     }
+     break;
+   }
+
+   case PN_TRANSPORT_CLOSED:
+    check_condition(event, pn_transport_condition(pn_event_transport(event)));
+    break;
+
+   case PN_CONNECTION_REMOTE_CLOSE:
+    check_condition(event, pn_connection_remote_condition(pn_event_connection(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_SESSION_REMOTE_CLOSE:
+    check_condition(event, pn_session_remote_condition(pn_event_session(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_LINK_REMOTE_CLOSE:
+   case PN_LINK_REMOTE_DETACH:
+    check_condition(event, pn_link_remote_condition(pn_event_link(event)));
+    pn_connection_close(pn_event_connection(event));
+    break;
+
+   case PN_PROACTOR_INACTIVE:
+    return false;
+    break;
+
+   default:
+    break;
+  }
+    return true;
+}
+
+void run(app_data_t *app) {
+  /* Loop and handle events */
+  do {
+    pn_event_batch_t *events = pn_proactor_wait(app->proactor);
+    pn_event_t *e;
+    for (e = pn_event_batch_next(events); e; e = pn_event_batch_next(events)) {
+      if (!handle(app, e) || exit_code != 0) {
+        return;
+      }
+    }
+    pn_proactor_done(app->proactor, events);
+  } while(true);
+}
+
+void usage() {
+    printf("Usage: telemetry [options] \n");
+    printf("[Options]:\n");
+    printf("\t-a      The host address [localhost]\n");
+    printf("\t-p      The host port [5672]\n");
+    printf("\t-c      # of readings to send or receive, 0 receives forever [10]\n");
+    printf("\t-t      Target address [telemetry]\n");
+    printf("\t-R      Receive and decode readings instead of sending them\n");
+    printf("\t-B      Compare the codec with pn_message_t on -c readings offline, 0 for 1000000\n");
+    printf("\t-i      Container name [telemetry:<pid>]\n");
+    printf("\t-u      Client authentication username []\n");
+    printf("\t-P      Client authentication password []\n");
+    printf("\t-s      Use SSL, the default port becomes 5671\n");
+    printf("\t-C      Trusted CA database for SSL peer verification, implies -s []\n");
+    printf("\t-h      Displays this message\n");
+    exit(0);
+
+}
+
+void parse_args(int argc, char **argv, app_data_t *app) {
+    int c;
+    char con_id[PN_MAX_ADDR];
+    if (container_id(con_id, PN_MAX_ADDR, argv[0], sizeof(argv[0])) < 0){
+        fprintf(stderr, "Unable to format container id from source: %s", argv[0]);
+        exit(1);
+    }
+    /* initialize default values*/
+    app->container_id = strdup(con_id); /* default to using argv[0] */
+    app->host = "localhost";
+    app->port = NULL; /* amqp or amqps */
+    app->amqp_address = "telemetry";
+    app->message_count = 10;
+
+    /* command line options */
+    opterr = 0;
+    while((c = getopt(argc, argv, "i:a:c:t:RBp:u:P:sC:h")) != -1) {
+        switch(c) {
+        case 'h': usage(); break;
+        case 'c':
+            app->message_count = atoi(optarg);
+            if (app->message_count < 0) usage();
+            break;
+        case 'a': app->host = optarg; break;
+        case 'i':
+            if (container_id(con_id, PN_MAX_ADDR, optarg, sizeof(optarg)) < 0) {
+                fprintf(stderr, "Unable to format container id from source: %s", optarg);
+                exit(1);
+            }
+            str_free(app->container_id);
+            app->container_id = strdup(con_id);
+            break;
+        case 't': app->amqp_address = optarg; break;
+        case 'R': app->receive = true; break;
+        case 'B': app->bench = true; break;
+        case 'p': app->port = optarg; break;
+        case 'u': app->username = optarg; break;
+        case 'P': app->password = optarg; break;
+        case 's': app->ssl = true; break;
+        case 'C': app->ssl = true; app->ssl_ca_db = optarg; break;
+        default: usage(); break;
+        }
+    }
+    if (!app->port) {
+        app->port = app->ssl ? "amqps" : "amqp";
+    }
+    if (!app->receive && !app->bench && app->message_count == 0) {
+        fprintf(stderr, "Sending needs a # of readings\n");
+        exit(1);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    struct app_data_t app = {};
+    char addr[PN_MAX_ADDR];
+
+    parse_args(argc, argv, &app);
+    if (app.bench) {
+        bench(&app);
+        str_free(app.container_id);
+        return 0;
+    }
+
+    /* Create the proactor and connect */
+    app.proactor = pn_proactor();
+    pn_proactor_addr(addr, sizeof(addr), app.host, app.port);
+    fprintf(stdout, "Connecting to host: %s\n", addr);
+
+    /* Initialize Sasl transport */
+    pn_transport_t *pnt = pn_transport();
+    pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (app.ssl) {
+        app.ssl_domain = ssl_client_domain(app.ssl_ca_db);
+        if (ssl_client_init(pnt, app.ssl_domain, app.host, app.port) < 0) {
+            exit(1);
+        }
+    }
+
+    /* initialize and start proton event proactor loop */
+    app.connect_start = clock_now_ns();
+    pn_proactor_connect2(app.proactor, NULL, pnt, addr);
+    fprintf(stdout, "%s %d readings %s amqp address: %s\n", app.receive ? "waiting to receive" : "sending",
+            app.message_count, app.receive ? "from" : "to", app.amqp_address);
+    run(&app);
+
+    /* program cleanup */
+    free(app.msgin.start);
+    pn_proactor_free(app.proactor);
+    if (app.ssl_domain) pn_ssl_domain_free(app.ssl_domain);
+    str_free(app.container_id);
+    return exit_code;
+}
@@ -4,6 +4,11 @@
 #include <proton/codec.h>
 #include <proton/types.h>
 #include <proton/object.h>
+#include <proton/connection.h>
+#include <proton/message.h>
+#include <proton/proactor.h>
+#include <proton/ssl.h>
+#include <proton/transport.h>
 
 #include <string.h>
 #include <stdlib.h>
@@ -11,6 +16,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <time.h>
 
 /* 
  * Walks through a pn_data_t of type PN_MAP checking 
@@ -89,6 +95,61 @@ int get_data_map_string_property( pn_data_t* properties,
     return found; 
 }
 
+bool data_map_find(pn_data_t* map, const char* const key) {
+    size_t key_len = strlen(key);
+    pn_data_rewind(map);
+    if (!pn_data_next(map) || pn_data_type(map) != PN_MAP) {
+        return false;
+    }
+    size_t count = pn_data_get_map(map);
+    pn_data_enter(map);
+    for (size_t i = 0; i < count / 2; ++i) {
+        pn_data_next(map);
+        pn_type_t type = pn_data_type(map);
+        pn_bytes_t k = type == PN_STRING ? pn_data_get_string(map)
+                     : type == PN_SYMBOL ? pn_data_get_symbol(map) : pn_bytes_null;
+        pn_data_next(map);
+        if (k.size == key_len && memcmp(k.start, key, key_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool data_get_number(pn_data_t* data, double* value) {
+    switch (pn_data_type(data)) {
+    case PN_BYTE: *value = pn_data_get_byte(data); return true;
+    case PN_UBYTE: *value = pn_data_get_ubyte(data); return true;
+    case PN_SHORT: *value = pn_data_get_short(data); return true;
+    case PN_USHORT: *value = pn_data_get_ushort(data); return true;
+    case PN_INT: *value = pn_data_get_int(data); return true;
+    case PN_UINT: *value = pn_data_get_uint(data); return true;
+    case PN_LONG: *value = (double)pn_data_get_long(data); return true;
+    case PN_ULONG: *value = (double)pn_data_get_ulong(data); return true;
+    case PN_FLOAT: *value = pn_data_get_float(data); return true;
+    case PN_DOUBLE: *value = pn_data_get_double(data); return true;
+    case PN_TIMESTAMP: *value = (double)pn_data_get_timestamp(data); return true;
+    default: return false;
+    }
+}
+
+pn_data_t* message_properties_append(pn_message_t* message) {
+    pn_data_t* properties = pn_message_properties(message);
+    pn_data_rewind(properties);
+    if (!pn_data_next(properties)) {
+        pn_data_put_map(properties);
+        pn_data_enter(properties);
+        return properties;
+    }
+    if (pn_data_type(properties) != PN_MAP) {
+        return NULL;
+    }
+    /* move past the last entry */
+    pn_data_enter(properties);
+    while (pn_data_next(properties));
+    return properties;
+}
+
 /* 
  * Formats an amqp address to given 'dest' pointer with given 'address_prefix'.
  * The 'address_prefix' is only added if the base 'address' is not already present.
@@ -142,4 +203,72 @@ int container_id(char *dest, const size_t dest_len, char *source, const size_t s
     }
 }
 
+uint64_t clock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t clock_wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+uint64_t clock_wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+pn_ssl_domain_t* ssl_client_domain(const char *ca_db) {
+    pn_ssl_domain_t *domain = pn_ssl_domain(PN_SSL_MODE_CLIENT);
+    if (!domain) {
+        fprintf(stderr, "SSL is not available in this proton build\n");
+        return NULL;
+    }
+    if (ca_db) {
+        if (pn_ssl_domain_set_trusted_ca_db(domain, ca_db) != 0) {
+            fprintf(stderr, "Unable to load trusted CA database: %s\n", ca_db);
+            pn_ssl_domain_free(domain);
+            return NULL;
+        }
+        pn_ssl_domain_set_peer_authentication(domain, PN_SSL_VERIFY_PEER_NAME, NULL);
+    } else {
+        /* no CA given, encrypt only, eg. for self-signed test brokers */
+        pn_ssl_domain_set_peer_authentication(domain, PN_SSL_ANONYMOUS_PEER, NULL);
+    }
+    return domain;
+}
+
+int ssl_client_init(pn_transport_t *transport, pn_ssl_domain_t *domain,
+                    const char *host, const char *port) {
+    char session_id[PN_MAX_ADDR];
+    if (!transport || !domain) {
+        return -1;
+    }
+    if (snprintf(session_id, sizeof(session_id), "%s:%s", host, port) < 0) {
+        return -1;
+    }
+    pn_ssl_t *ssl = pn_ssl(transport);
+    if (!ssl || pn_ssl_init(ssl, domain, session_id) != 0) {
+        fprintf(stderr, "Unable to initialize SSL for %s\n", session_id);
+        return -1;
+    }
+    pn_ssl_set_peer_hostname(ssl, host);
+    return 0;
+}
 
+uint64_t report_connection_open(pn_event_t *event, uint64_t connect_start_ns, bool ssl) {
+    uint64_t elapsed = clock_now_ns() - connect_start_ns;
+    if (ssl) {
+        char protocol[64] = "unknown";
+        pn_ssl_t *s = pn_ssl(pn_event_transport(event));
+        pn_ssl_get_protocol_name(s, protocol, sizeof(protocol));
+        printf("connection open in %.3f ms (%s, session %s)\n", elapsed / 1e6, protocol,
+               pn_ssl_resume_status(s) == PN_SSL_RESUME_REUSED ? "resumed" : "new");
+    } else {
+        printf("connection open in %.3f ms\n", elapsed / 1e6);
+    }
+    return elapsed;
+}
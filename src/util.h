@@ -24,7 +24,13 @@
 
 
 #include <proton/codec.h>
+#include <proton/event.h>
+#include <proton/message.h>
+#include <proton/ssl.h>
+#include <proton/transport.h>
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 
@@ -44,6 +50,39 @@
  * */
 int get_data_map_string_property(pn_data_t* properties, const char* const key, char* value, const size_t value_size);
 
+/*
+ * Positions a pn_data_t of type PN_MAP at the value for a string or symbol key.
+ * Unlike get_data_map_string_property the data is left pointing at the value
+ * so it can be read with any pn_data_get_* function.
+ * parameters in:
+ *      map: the pointer to pn_data_t, the first node must be a map.
+ *      key: the search key string.
+ * returns:
+ *      true if the key was found, false on miss or if the data is not a map.
+ * */
+bool data_map_find(pn_data_t* map, const char* const key);
+
+/*
+ * Reads the current node of a pn_data_t as a double.
+ * parameter out:
+ *      value: the numeric value of any integer, floating point or timestamp node.
+ * returns:
+ *      true if the node is numeric, false otherwise.
+ * */
+bool data_get_number(pn_data_t* data, double* value);
+
+/*
+ * Prepares the application properties of a message for adding entries.
+ * The properties are created as an empty map if not set yet. Put the key
+ * and value of each new entry and call pn_data_exit() when done.
+ * parameters in:
+ *      message: the message to add application properties to.
+ * returns:
+ *      The properties positioned at the end of the map or NULL if the
+ *      existing properties are not a map.
+ * */
+pn_data_t* message_properties_append(pn_message_t* message);
+
 /*
  * Formats an AMQP terminus address with a destination type prefix.
  * The address_prefix is only added if the base address does not start
@@ -78,4 +117,70 @@ int amqp_destination_address(char* dest, const size_t dest_len,
 int container_id(char *dest, const size_t dest_len, 
                 char *source, const size_t source_len);
 
+/*
+ * Reads the monotonic clock.
+ *
+ * @returns: the current monotonic time in nanoseconds
+ * */
+uint64_t clock_now_ns(void);
+
+/*
+ * Reads the wall clock with microsecond resolution.
+ *
+ * @returns: microseconds since the epoch
+ * */
+uint64_t clock_wall_us(void);
+
+/*
+ * Reads the wall clock, comparable with AMQP message timestamps.
+ *
+ * @returns: milliseconds since the epoch
+ * */
+uint64_t clock_wall_ms(void);
+
+/*
+ * Creates a client SSL domain for AMQP connections.
+ *
+ * A sample should create one domain and keep it for the lifetime of the
+ * process. The SSL session cache lives with the domain, so every transport
+ * initialised from it with the same session id can resume the previous
+ * SSL session instead of running a full handshake.
+ *
+ * @param[in]: ca_db, path to the trusted CA database (PEM file or directory),
+ *             NULL accepts any peer certificate (anonymous peer)
+ *
+ * @returns: the new domain or NULL on error, free with pn_ssl_domain_free()
+ * */
+pn_ssl_domain_t* ssl_client_domain(const char *ca_db);
+
+/*
+ * Enables SSL on a client transport before it is handed to the proactor.
+ * The session id is formatted as '<host>:<port>' so reconnects to the
+ * same broker resume the cached SSL session.
+ *
+ * @param[in]: transport, the unconnected transport
+ * @param[in]: domain, domain from ssl_client_domain()
+ * @param[in]: host, the broker host, also used for peer name verification
+ * @param[in]: port, the broker port
+ *
+ * @returns: 0 on success or negative if error
+ * */
+int ssl_client_init(pn_transport_t *transport, pn_ssl_domain_t *domain,
+                    const char *host, const char *port);
+
+/*
+ * Prints the time taken to open a connection, measured from
+ * connect_start_ns (a clock_now_ns() reading taken before connecting)
+ * to the PN_CONNECTION_REMOTE_OPEN event. For SSL transports the
+ * negotiated protocol and whether the SSL session was resumed are
+ * printed as well.
+ *
+ * @param[in]: event, the PN_CONNECTION_REMOTE_OPEN event
+ * @param[in]: connect_start_ns, clock reading from before the connect
+ * @param[in]: ssl, true if SSL was enabled on the transport
+ *
+ * @returns: the elapsed open time in nanoseconds
+ * */
+uint64_t report_connection_open(pn_event_t *event, uint64_t connect_start_ns, bool ssl);
+
 #endif /* util.h */